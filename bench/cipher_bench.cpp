@@ -0,0 +1,161 @@
+// encrypt and decrypt throughput of shadowsocks::stream per method and
+// buffer size, over an in-memory next layer so no syscall is measured
+
+#include <benchmark/benchmark.h>
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+
+#include <shadowsocks/stream.h>
+
+#include <array>
+
+using namespace boost::asio;
+using namespace boost::system;
+
+namespace
+{
+
+constexpr std::array<const char*, 7> methods{
+	"ChaCha(20)", "Salsa20", "CTR(AES-256)",
+	"chacha20-ietf-poly1305", "aes-128-gcm", "aes-256-gcm",
+	"none"};
+
+// writes append to wire, reads consume it; completions are posted like a
+// socket's would be
+class memory_stream
+{
+public:
+	using executor_type = io_context::executor_type;
+	using lowest_layer_type = memory_stream;
+
+	memory_stream(io_context& ioc, std::vector<uint8_t>& wire) :
+		ioc_(ioc),
+		wire_(wire)
+	{}
+
+	executor_type get_executor() noexcept
+	{
+		return ioc_.get_executor();
+	}
+
+	lowest_layer_type& lowest_layer() noexcept
+	{
+		return *this;
+	}
+
+	std::size_t available(error_code& ec) const
+	{
+		ec = {};
+		return wire_.size() - read_;
+	}
+
+	template <typename ConstBufferSequence, typename Handler>
+	void async_write_some(const ConstBufferSequence& buffers, Handler&& handler)
+	{
+		std::size_t n = buffer_size(buffers);
+		std::size_t end = wire_.size();
+		wire_.resize(end + n);
+		buffer_copy(buffer(wire_.data() + end, n), buffers);
+		post(ioc_, boost::asio::detail::bind_handler(std::forward<Handler>(handler), error_code{}, n));
+	}
+
+	template <typename MutableBufferSequence, typename Handler>
+	void async_read_some(const MutableBufferSequence& buffers, Handler&& handler)
+	{
+		std::size_t n = buffer_copy(buffers, buffer(wire_.data() + read_, wire_.size() - read_));
+		read_ += n;
+		if (read_ == wire_.size())
+		{
+			wire_.clear();
+			read_ = 0;
+		}
+		post(ioc_, boost::asio::detail::bind_handler(std::forward<Handler>(handler), error_code{}, n));
+	}
+
+private:
+	io_context& ioc_;
+	std::vector<uint8_t>& wire_;
+	std::size_t read_ = 0;
+};
+
+struct fixture
+{
+	explicit fixture(const char* method) :
+		factory(method, std::vector<uint8_t>(shadowsocks::key_size(method), 0x5a), 8),
+		writer(memory_stream(ioc, wire), factory.create()),
+		reader(memory_stream(ioc, wire), factory.create())
+	{}
+
+	void write(const std::vector<uint8_t>& payload)
+	{
+		writer.async_write_some(buffer(payload), [](error_code, std::size_t) {});
+		ioc.poll();
+		ioc.restart();
+	}
+
+	void read(std::vector<uint8_t>& sink, std::size_t n)
+	{
+		for (std::size_t got = 0, last = 1; got < n && last != 0;)
+		{
+			reader.async_read_some(buffer(sink), [&](error_code, std::size_t bytes) { last = bytes; got += bytes; });
+			ioc.poll();
+			ioc.restart();
+		}
+	}
+
+	io_context ioc{1};
+	std::vector<uint8_t> wire;
+	shadowsocks::context_factory factory;
+	shadowsocks::stream<memory_stream> writer;
+	shadowsocks::stream<memory_stream> reader;
+};
+
+void stream_encrypt(benchmark::State& state)
+{
+	const char* method = methods[std::size_t(state.range(0))];
+	const auto size = std::size_t(state.range(1));
+	fixture f(method);
+	std::vector<uint8_t> payload(size, 0x42);
+	// the first write carries the iv or salt
+	f.write(payload);
+	for (auto _ : state)
+	{
+		f.wire.clear();
+		f.write(payload);
+	}
+	state.SetLabel(method);
+	state.SetBytesProcessed(int64_t(state.iterations()) * int64_t(size));
+}
+
+void stream_roundtrip(benchmark::State& state)
+{
+	const char* method = methods[std::size_t(state.range(0))];
+	const auto size = std::size_t(state.range(1));
+	fixture f(method);
+	std::vector<uint8_t> payload(size, 0x42);
+	std::vector<uint8_t> sink(size);
+	for (auto _ : state)
+	{
+		f.write(payload);
+		f.read(sink, size);
+	}
+	state.SetLabel(method);
+	state.SetBytesProcessed(int64_t(state.iterations()) * int64_t(size));
+}
+
+void method_and_size(benchmark::internal::Benchmark* b)
+{
+	for (std::size_t m = 0; m != methods.size(); ++m)
+	{
+		for (int64_t size : {1024, 16 * 1024, 64 * 1024})
+		{
+			b->Args({int64_t(m), size});
+		}
+	}
+}
+
+}
+
+BENCHMARK(stream_encrypt)->Apply(method_and_size);
+BENCHMARK(stream_roundtrip)->Apply(method_and_size);
@@ -0,0 +1,170 @@
+// heap allocations per relayed chunk: an encrypted writer, a socket_pair
+// relay decrypting onto a plain socket, and a reader on the far end, all on
+// one io_context. Run with --benchmark_counters_tabular=true.
+
+#include <benchmark/benchmark.h>
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+
+#include <shadowsocks/stream.h>
+#include <msocks/utility/handler_memory.hpp>
+#include <msocks/utility/socket_pair.hpp>
+#include <msocks/utility/tcp_socket.hpp>
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+using namespace boost::asio;
+using namespace boost::system;
+using namespace msocks;
+
+namespace
+{
+std::atomic<std::size_t> allocations{0};
+}
+
+void* operator new(std::size_t size)
+{
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	if (void* p = std::malloc(size))
+	{
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+namespace
+{
+
+const std::vector<uint8_t> key(32, 0x5a);
+
+shadowsocks::cipher_context make_context()
+{
+	return shadowsocks::cipher_context{"ChaCha(20)", key, 8};
+}
+
+std::pair<utility::tcp_socket, utility::tcp_socket> connected_pair(io_context& ioc)
+{
+	utility::tcp_acceptor acceptor(ioc, ip::tcp::endpoint(ip::address_v4::loopback(), 0));
+	utility::tcp_socket client(ioc);
+	client.connect(acceptor.local_endpoint());
+	utility::tcp_socket server(ioc);
+	acceptor.accept(server);
+	client.set_option(ip::tcp::no_delay(true));
+	server.set_option(ip::tcp::no_delay(true));
+	return {std::move(client), std::move(server)};
+}
+
+// wraps handlers in handler_memory when Custom, passes them through otherwise
+template <bool Custom>
+struct allocation_policy
+{
+	template <typename Handler>
+	static auto wrap(utility::handler_memory& memory, Handler&& handler)
+	{
+		if constexpr (Custom)
+		{
+			return utility::make_custom_alloc_handler(memory, std::forward<Handler>(handler));
+		}
+		else
+		{
+			(void)memory;
+			return std::forward<Handler>(handler);
+		}
+	}
+};
+
+template <bool Custom>
+class read_loop
+{
+public:
+	read_loop(utility::tcp_socket& socket, std::vector<uint8_t>& buf, utility::handler_memory& memory, std::size_t& remaining) :
+		socket_(socket), buf_(buf), memory_(memory), remaining_(remaining)
+	{}
+
+	void start()
+	{
+		socket_.async_read_some(buffer(buf_), allocation_policy<Custom>::wrap(memory_, std::move(*this)));
+	}
+
+	void operator()(error_code ec, std::size_t n)
+	{
+		remaining_ -= n;
+		if (!ec && remaining_ != 0)
+		{
+			start();
+		}
+	}
+
+private:
+	utility::tcp_socket& socket_;
+	std::vector<uint8_t>& buf_;
+	utility::handler_memory& memory_;
+	std::size_t& remaining_;
+};
+
+template <bool Custom>
+void relay_chunk(benchmark::State& state)
+{
+	const auto chunk = static_cast<std::size_t>(state.range(0));
+	io_context ioc(1);
+	auto [writer_socket, relay_in] = connected_pair(ioc);
+	auto [relay_out, reader] = connected_pair(ioc);
+	shadowsocks::stream<utility::tcp_socket> writer(std::move(writer_socket), make_context());
+	shadowsocks::stream<utility::tcp_socket> source(std::move(relay_in), make_context());
+
+	utility::buffer_slab& slab = use_service<utility::buffer_slab>(ioc);
+	utility::relay_buffer relay_buf(slab);
+	relay_buf.configure(chunk, chunk);
+	utility::handler_memory relay_memory, write_memory, read_memory;
+	utility::socket_pair(
+		source, relay_out,
+		relay_buf,
+		utility::no_limit{},
+		allocation_policy<Custom>::wrap(relay_memory, [](error_code) {}));
+
+	std::vector<uint8_t> payload(chunk, 0x42);
+	std::vector<uint8_t> sink(chunk);
+	auto round = [&]
+	{
+		std::size_t remaining = chunk;
+		writer.async_write_some(buffer(payload), allocation_policy<Custom>::wrap(write_memory, [](error_code, std::size_t) {}));
+		read_loop<Custom>(reader, sink, read_memory, remaining).start();
+		while (remaining != 0 && ioc.run_one() != 0)
+		{}
+	};
+	// the first round carries the iv and fills the slab
+	round();
+
+	std::size_t before = allocations.load(std::memory_order_relaxed);
+	for (auto _ : state)
+	{
+		round();
+	}
+	std::size_t total = allocations.load(std::memory_order_relaxed) - before;
+	state.counters["allocs_per_chunk"] = benchmark::Counter(double(total), benchmark::Counter::kAvgIterations);
+	state.SetBytesProcessed(int64_t(state.iterations()) * int64_t(chunk));
+
+	error_code ignored_ec;
+	writer.next_layer().close(ignored_ec);
+	reader.close(ignored_ec);
+	ioc.run_for(std::chrono::milliseconds(100));
+}
+
+}
+
+BENCHMARK_TEMPLATE(relay_chunk, false)->Arg(4 * 1024)->Arg(64 * 1024);
+BENCHMARK_TEMPLATE(relay_chunk, true)->Arg(4 * 1024)->Arg(64 * 1024);
+
@@ -0,0 +1,56 @@
+// cost of charging the rate limiter hierarchy, by itself and as the
+// before_read hook of a relay, when no delay is due
+
+#include <benchmark/benchmark.h>
+
+#include <boost/asio/io_context.hpp>
+
+#include <msocks/utility/rate_limiter.hpp>
+
+using namespace msocks;
+
+namespace
+{
+
+// rates far above what the loop charges, so acquire never asks for a wait
+constexpr std::size_t fast = std::size_t(1) << 50;
+
+std::unique_ptr<utility::rate_limiter> make_chain(std::size_t depth)
+{
+	std::shared_ptr<utility::rate_limiter> parent;
+	for (std::size_t i = 1; i < depth; ++i)
+	{
+		parent = std::make_shared<utility::rate_limiter>(fast, fast, parent);
+	}
+	return std::make_unique<utility::rate_limiter>(depth == 0 ? 0 : fast, fast, parent);
+}
+
+// range(0) classes: 0 is an unlimited session, 3 the session, user and
+// global classes of the server
+void limiter_acquire(benchmark::State& state)
+{
+	auto limiter = make_chain(std::size_t(state.range(0)));
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(limiter->acquire(16 * 1024));
+	}
+}
+
+void throttle_async_get(benchmark::State& state)
+{
+	io_context ioc(1);
+	auto limiter = make_chain(std::size_t(state.range(0)));
+	utility::throttle throttle(ioc, *limiter);
+	std::size_t calls = 0;
+	for (auto _ : state)
+	{
+		throttle.async_get(16 * 1024, [&calls] { ++calls; });
+		ioc.poll_one();
+	}
+	benchmark::DoNotOptimize(calls);
+}
+
+}
+
+BENCHMARK(limiter_acquire)->Arg(0)->Arg(1)->Arg(3);
+BENCHMARK(throttle_async_get)->Arg(0)->Arg(1)->Arg(3);
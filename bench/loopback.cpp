@@ -0,0 +1,303 @@
+// end to end over loopback: flows connect through client_endpoint and
+// server_endpoint to a sink in this process, then push their payload.
+// Reports throughput, connection setup latency (socks5 request until the
+// proxy's reply) and resident memory per established flow, which covers
+// both endpoints.
+//
+//   msocks_loopback [flows=100] [MiB per flow=16] [method=ChaCha(20)] [mux=0]
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/write.hpp>
+
+#include <msocks/endpoint/client_endpoint.hpp>
+#include <msocks/endpoint/server_endpoint.hpp>
+#include <msocks/session/pool.hpp>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+using namespace boost::asio;
+using namespace boost::system;
+
+namespace
+{
+
+using clock_type = std::chrono::steady_clock;
+
+constexpr uint16_t server_port = 18388;
+constexpr uint16_t client_port = 18389;
+constexpr uint16_t sink_port = 18390;
+constexpr std::size_t chunk = 64 * 1024;
+
+std::size_t resident_bytes()
+{
+	std::ifstream statm("/proc/self/statm");
+	std::size_t pages = 0, resident = 0;
+	statm >> pages >> resident;
+	return resident * std::size_t(sysconf(_SC_PAGESIZE));
+}
+
+struct run_state
+{
+	std::size_t flows = 0;
+	std::size_t bytes_per_flow = 0;
+	std::size_t established = 0;
+	std::size_t received = 0;
+	std::vector<double> setup_ms;
+	clock_type::time_point started;
+	clock_type::time_point finished;
+	std::size_t rss_before = 0;
+	std::size_t rss_established = 0;
+	std::function<void()> on_established;
+};
+
+// reads and drops everything the proxy forwards to it
+class sink : public std::enable_shared_from_this<sink>
+{
+public:
+	sink(ip::tcp::socket socket, run_state& state, io_context& ioc) :
+		socket_(std::move(socket)),
+		state_(state),
+		ioc_(ioc),
+		buf_(chunk)
+	{}
+
+	void read()
+	{
+		socket_.async_read_some(
+			buffer(buf_),
+			[this, p = shared_from_this()](error_code ec, std::size_t n)
+			{
+				if (ec)
+				{
+					return;
+				}
+				state_.received += n;
+				if (state_.received == state_.flows * state_.bytes_per_flow)
+				{
+					state_.finished = clock_type::now();
+					ioc_.stop();
+					return;
+				}
+				read();
+			});
+	}
+
+private:
+	ip::tcp::socket socket_;
+	run_state& state_;
+	io_context& ioc_;
+	std::vector<uint8_t> buf_;
+};
+
+void accept_sinks(ip::tcp::acceptor& acceptor, run_state& state, io_context& ioc)
+{
+	acceptor.async_accept(
+		[&acceptor, &state, &ioc](error_code ec, ip::tcp::socket socket)
+		{
+			if (ec)
+			{
+				return;
+			}
+			std::make_shared<sink>(std::move(socket), state, ioc)->read();
+			accept_sinks(acceptor, state, ioc);
+		});
+}
+
+// one socks5 CONNECT to the sink, then bytes_per_flow of payload
+class flow : public std::enable_shared_from_this<flow>
+{
+public:
+	flow(io_context& ioc, run_state& state) :
+		socket_(ioc),
+		state_(state),
+		payload_(chunk, 0x42)
+	{}
+
+	void start()
+	{
+		begin_ = clock_type::now();
+		socket_.async_connect(
+			ip::tcp::endpoint(ip::address_v4::loopback(), client_port),
+			[this, p = shared_from_this()](error_code ec)
+			{
+				if (ec)
+				{
+					fail(ec);
+					return;
+				}
+				socket_.set_option(ip::tcp::no_delay(true));
+				request_ = {
+					0x05, 0x01, 0x00,
+					0x05, 0x01, 0x00, 0x01, 127, 0, 0, 1, uint8_t(sink_port >> 8), uint8_t(sink_port)};
+				async_write(
+					socket_, buffer(request_),
+					[this, p](error_code ec, std::size_t)
+					{
+						if (ec)
+						{
+							fail(ec);
+							return;
+						}
+						// method selection and CONNECT reply
+						async_read(
+							socket_, buffer(reply_),
+							[this, p](error_code ec, std::size_t)
+							{
+								if (ec)
+								{
+									fail(ec);
+									return;
+								}
+								established();
+							});
+					});
+			});
+	}
+
+	void send()
+	{
+		if (sent_ == state_.bytes_per_flow)
+		{
+			return;
+		}
+		std::size_t n = std::min(chunk, state_.bytes_per_flow - sent_);
+		async_write(
+			socket_, buffer(payload_.data(), n),
+			[this, p = shared_from_this()](error_code ec, std::size_t n)
+			{
+				if (ec)
+				{
+					fail(ec);
+					return;
+				}
+				sent_ += n;
+				send();
+			});
+	}
+
+private:
+	void established()
+	{
+		state_.setup_ms.push_back(std::chrono::duration<double, std::milli>(clock_type::now() - begin_).count());
+		if (++state_.established == state_.flows)
+		{
+			state_.on_established();
+		}
+	}
+
+	void fail(const error_code& ec)
+	{
+		std::fprintf(stderr, "flow: %s\n", ec.message().c_str());
+		std::exit(1);
+	}
+
+	ip::tcp::socket socket_;
+	run_state& state_;
+	std::vector<uint8_t> payload_;
+	std::vector<uint8_t> request_;
+	std::array<uint8_t, 2 + 10> reply_{};
+	clock_type::time_point begin_;
+	std::size_t sent_ = 0;
+};
+
+double percentile(std::vector<double> values, double p)
+{
+	if (values.empty())
+	{
+		return 0;
+	}
+	std::sort(values.begin(), values.end());
+	return values[std::min(values.size() - 1, std::size_t(p * double(values.size())))];
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+	run_state state;
+	state.flows = argc > 1 ? std::stoul(argv[1]) : 100;
+	state.bytes_per_flow = (argc > 2 ? std::stoul(argv[2]) : 16) * 1024 * 1024;
+	std::string method = argc > 3 ? argv[3] : "ChaCha(20)";
+	std::size_t mux = argc > 4 ? std::stoul(argv[4]) : 0;
+	std::vector<uint8_t> key(shadowsocks::key_size(method), 0x5a);
+
+	io_context server_ioc(1);
+	msocks::server_endpoint_config server_config;
+	server_config.server_address = "127.0.0.1";
+	server_config.server_port = server_port;
+	server_config.key = key;
+	server_config.method = method;
+	server_config.iv_length = 8;
+	server_config.timeout = boost::posix_time::seconds(2);
+	msocks::pool<msocks::server_session> sessions(server_ioc, server_config.session_pool);
+	msocks::server_endpoint server(server_ioc, sessions, server_config);
+	server.start();
+
+	io_context client_ioc(1);
+	msocks::client_config client_config;
+	client_config.local_address = "127.0.0.1";
+	client_config.local_port = client_port;
+	client_config.remote_address = "127.0.0.1";
+	client_config.remote_port = server_port;
+	client_config.key = key;
+	client_config.method = method;
+	client_config.iv_length = 8;
+	client_config.timeout = boost::posix_time::seconds(2);
+	client_config.mux_connections = mux;
+	msocks::client_endpoint client(client_ioc, client_config);
+	client.start();
+
+	std::thread server_thread([&] { server_ioc.run(); });
+	std::thread client_thread([&] { client_ioc.run(); });
+
+	io_context ioc(1);
+	ip::tcp::acceptor acceptor(ioc, ip::tcp::endpoint(ip::address_v4::loopback(), sink_port));
+	accept_sinks(acceptor, state, ioc);
+	// the endpoints listen once their threads ran the accept coroutines
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+	std::vector<std::shared_ptr<flow>> flows;
+	state.on_established = [&]
+	{
+		state.rss_established = resident_bytes();
+		state.started = clock_type::now();
+		for (auto& f : flows)
+		{
+			f->send();
+		}
+	};
+	state.rss_before = resident_bytes();
+	for (std::size_t i = 0; i != state.flows; ++i)
+	{
+		flows.emplace_back(std::make_shared<flow>(ioc, state))->start();
+	}
+	ioc.run();
+
+	double seconds = std::chrono::duration<double>(state.finished - state.started).count();
+	double gbps = double(state.received) * 8 / seconds / 1e9;
+	double rss_per_flow = double(state.rss_established - std::min(state.rss_before, state.rss_established)) / double(state.flows);
+	std::printf("method %s, %zu flows%s\n", method.c_str(), state.flows, mux != 0 ? " over mux" : "");
+	std::printf("throughput %.3f Gbps (%zu bytes in %.3f s)\n", gbps, state.received, seconds);
+	std::printf("setup p50 %.3f ms, p99 %.3f ms\n", percentile(state.setup_ms, 0.5), percentile(state.setup_ms, 0.99));
+	std::printf("rss %.1f KiB per flow\n", rss_per_flow / 1024);
+
+	server_ioc.stop();
+	client_ioc.stop();
+	server_thread.join();
+	client_thread.join();
+	std::fflush(stdout);
+	// sessions still hold their sockets, nothing left worth tearing down
+	std::_Exit(0);
+}
@@ -0,0 +1,6 @@
+// every *_bench.cpp registers its benchmarks, they all run from here.
+// Run with --benchmark_filter=<regex> to pick some of them.
+
+#include <benchmark/benchmark.h>
+
+BENCHMARK_MAIN();
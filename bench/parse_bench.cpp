@@ -0,0 +1,56 @@
+// parsing the target address of a handshake in place, per address type
+
+#include <benchmark/benchmark.h>
+
+#include <msocks/utility/socks_address.hpp>
+
+#include <string>
+#include <vector>
+
+using namespace msocks;
+
+namespace
+{
+
+std::vector<uint8_t> header(uint8_t type)
+{
+	std::vector<uint8_t> h{type};
+	if (type == socks::addr_ipv4)
+	{
+		h.insert(h.end(), {127, 0, 0, 1});
+	}
+	else if (type == socks::addr_ipv6)
+	{
+		h.insert(h.end(), 16, 0);
+		h.back() = 1;
+	}
+	else
+	{
+		std::string host("www.example.com");
+		h.push_back(uint8_t(host.size()));
+		h.insert(h.end(), host.begin(), host.end());
+	}
+	h.insert(h.end(), {0x01, 0xbb});
+	// payload behind the header, as it arrives with early data
+	h.insert(h.end(), 512, 0x16);
+	return h;
+}
+
+void parse_address(benchmark::State& state)
+{
+	auto h = header(uint8_t(state.range(0)));
+	utility::socks_address target;
+	for (auto _ : state)
+	{
+		std::size_t size = h.size();
+		benchmark::DoNotOptimize(utility::parse_socks_address(h.data(), size, target));
+		benchmark::DoNotOptimize(size);
+	}
+}
+
+}
+
+BENCHMARK(parse_address)
+	->Arg(socks::addr_ipv4)
+	->Arg(socks::addr_ipv6)
+	->Arg(socks::addr_domain);
@@ -0,0 +1,52 @@
+// taking a server session from the pool and handing it back, against
+// constructing one from scratch every time
+
+#include <benchmark/benchmark.h>
+
+#include <boost/asio/io_context.hpp>
+
+#include <msocks/session/pool.hpp>
+#include <msocks/session/server_session.hpp>
+
+using namespace msocks;
+
+namespace
+{
+
+std::shared_ptr<const server_session_attribute> make_attribute()
+{
+	auto attribute = std::make_shared<server_session_attribute>();
+	attribute->method = "ChaCha(20)";
+	attribute->key.assign(32, 0x5a);
+	attribute->iv_length = 8;
+	attribute->cipher = std::make_shared<shadowsocks::context_factory>(attribute->method, attribute->key, attribute->iv_length);
+	return attribute;
+}
+
+void pool_take_recycle(benchmark::State& state)
+{
+	io_context ioc(1);
+	auto attribute = make_attribute();
+	pool<server_session> sessions(ioc);
+	for (auto _ : state)
+	{
+		auto session = sessions.take(std::ref(ioc), utility::tcp_socket(ioc), attribute);
+		benchmark::DoNotOptimize(session.get());
+	}
+}
+
+void session_construct(benchmark::State& state)
+{
+	io_context ioc(1);
+	auto attribute = make_attribute();
+	for (auto _ : state)
+	{
+		auto session = std::make_unique<server_session>(ioc, utility::tcp_socket(ioc), attribute);
+		benchmark::DoNotOptimize(session.get());
+	}
+}
+
+}
+
+BENCHMARK(pool_take_recycle);
+BENCHMARK(session_construct);
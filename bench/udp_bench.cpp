@@ -0,0 +1,66 @@
+// the per datagram work of the udp relays: sealing and opening a datagram
+// per method, and finding a peer's association among many
+
+#include <benchmark/benchmark.h>
+
+#include <shadowsocks/context.h>
+
+#include <msocks/utility/datagram_batch.hpp>
+#include <msocks/utility/nat_table.hpp>
+
+#include <array>
+#include <vector>
+
+using namespace boost::asio;
+
+namespace
+{
+
+constexpr std::array<const char*, 4> methods{"ChaCha(20)", "chacha20-ietf-poly1305", "aes-256-gcm", "none"};
+
+void packet_roundtrip(benchmark::State& state)
+{
+	std::string method = methods[state.range(0)];
+	std::vector<uint8_t> key(shadowsocks::key_size(method), 0x5a);
+	shadowsocks::context_factory factory(method, key, 8);
+	auto packet = factory.create_packet();
+	std::size_t n = std::size_t(state.range(1));
+	std::vector<uint8_t> slot(msocks::utility::datagram_batch::headroom + n + msocks::utility::datagram_batch::tailroom, 0x42);
+	for (auto _ : state)
+	{
+		std::size_t wire = packet.seal(slot.data(), n);
+		if (!packet.open(slot.data(), wire))
+		{
+			state.SkipWithError("open failed");
+			break;
+		}
+	}
+	state.SetLabel(method);
+	state.SetItemsProcessed(state.iterations());
+	state.SetBytesProcessed(int64_t(state.iterations()) * int64_t(n) * 2);
+}
+
+void nat_find(benchmark::State& state)
+{
+	msocks::utility::nat_table<std::size_t> table;
+	std::vector<ip::udp::endpoint> peers;
+	for (std::size_t i = 0; i != std::size_t(state.range(0)); ++i)
+	{
+		peers.emplace_back(ip::make_address_v4(uint32_t(0x0a000000 + i / 64)), uint16_t(40000 + i % 64));
+		table.insert(peers.back(), i);
+	}
+	std::size_t i = 0;
+	for (auto _ : state)
+	{
+		benchmark::DoNotOptimize(table.find(peers[i]));
+		i = i + 1 == peers.size() ? 0 : i + 1;
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+
+}
+
+BENCHMARK(packet_roundtrip)
+	->ArgsProduct({{0, 1, 2, 3}, {128, 1200}});
+
+BENCHMARK(nat_find)->Arg(16)->Arg(1024)->Arg(65536);
@@ -1,10 +1,29 @@
 #pragma once
 
+#include <boost/property_tree/ptree_fwd.hpp>
+
+#include <msocks/endpoint/client_endpoint.hpp>
+#include <msocks/endpoint/metrics_endpoint.hpp>
+#include <msocks/endpoint/server_endpoint.hpp>
+#include <msocks/utility/log.hpp>
+
+#include <iosfwd>
 #include <string>
+#include <vector>
 
 namespace msocks
 {
 
+// one in every rate sessions is traced, 0 for none; SIGUSR1 writes the
+// spans to file, the metrics listener serves them on GET /trace
+struct trace_config
+{
+  std::size_t rate = 0;
+  std::string file = "/tmp/msocks-trace.json";
+};
+
+// what the process runs with, see config/config.json. Keys left out get
+// the same defaults as the command line.
 struct config
 {
   enum Type
@@ -12,14 +31,28 @@ struct config
     Server = 0,
     Client = 1
   };
-  Type type;
-  std::string server;
-  unsigned short server_port;
-  std::string local;
-  unsigned short local_port;
-  std::string password;
-  std::string method;
-  std::size_t speed_limit;
+  Type type = Server;
+  // threads serving connections, resolved from 0 to one per core
+  std::size_t workers = 1;
+  // port 0 for no metrics listener
+  metrics_config metrics;
+  trace_config trace;
+  utility::log::log_config log;
+  server_endpoint_config server;
+  client_config client;
 };
 
-}
\ No newline at end of file
+// "type", "password", "method" and the endpoint's keys, throws
+// boost::property_tree::ptree_error on a missing or malformed value and
+// system_error on an unknown method
+config load_config(const boost::property_tree::ptree& tree);
+
+// reads json from in as it arrives, no need to hold the file
+config load_config(std::istream& in);
+
+config load_config(const std::string& path);
+
+// the key of password for method, as EVP_BytesToKey with MD5 derives it
+std::vector<uint8_t> password_key(const std::string& password, std::size_t key_size);
+
+}
@@ -5,62 +5,213 @@
 
 #include <boost/asio/spawn.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/post.hpp>
 #include <spdlog/spdlog.h>
 
+#include <algorithm>
+#include <list>
+#include <memory>
+
+#include <msocks/utility/admission.hpp>
+#include <msocks/utility/metrics.hpp>
+#include <msocks/utility/socket_option.hpp>
+#include <msocks/utility/tcp_socket.hpp>
+
 using namespace boost::asio;
 using namespace boost::system;
 
 namespace msocks
 {
 
+// how an endpoint listens on each of its addresses
+struct listen_config
+{
+	// connections the kernel queues per acceptor until they are accepted
+	int backlog = socket_base::max_listen_connections;
+	// set when several workers listen on the same endpoint
+	bool reuse_port = false;
+	// accept data on the SYN from up to this many pending connections,
+	// 0 leaves TCP_FASTOPEN off
+	int fast_open_queue = 0;
+	// acceptors per address and worker, more than one implies reuse_port
+	std::size_t acceptors = 1;
+	// connections accepted per wakeup of an accept loop
+	std::size_t accept_batch = 32;
+	// handshakes a worker runs at once, connections beyond are reset right
+	// after accept; 0 for no limit
+	std::size_t max_handshakes = 0;
+
+	// whether going from this to other needs new listening sockets
+	bool rebinds(const listen_config& other) const noexcept
+	{
+		return backlog != other.backlog || reuse_port != other.reuse_port ||
+			fast_open_queue != other.fast_open_queue || acceptors != other.acceptors;
+	}
+};
+
 class basic_endpoint : public noncopyable
 {
 protected:
 
 	explicit basic_endpoint(io_context& ioc) :
-		ioc_(ioc), acceptor_(ioc)
+		ioc_(ioc)
 	{}
 
+	// listens on ep with acceptors of its own, an endpoint may serve several
+	// addresses at once. create(socket, ticket) makes the session of an
+	// admitted connection, which gives the ticket back after its handshake.
+	// Throws if ep cannot be bound, with none of its acceptors left open.
 	template <typename SessionCreate>
-	void start_service(SessionCreate create, const ip::tcp::endpoint& ep)
+	void start_service(SessionCreate create, const ip::tcp::endpoint& ep, const listen_config& cfg = {})
+	{
+		std::list<utility::tcp_acceptor> bound;
+		for (std::size_t i = 0; i != std::max<std::size_t>(cfg.acceptors, 1); ++i)
+		{
+			bind(bound.emplace_back(ioc_), ep, cfg);
+		}
+		admission_.limit(cfg.max_handshakes);
+		accept_batch_ = cfg.accept_batch;
+		auto shared = std::make_shared<SessionCreate>(std::move(create));
+		for (auto& acceptor : bound)
+		{
+			spawn(
+				ioc_,
+				[shared, this, &acceptor, ep](yield_context yield)
+			{
+				do_async_accept(*shared, acceptor, ep, yield);
+			});
+		}
+		// the nodes move, the acceptors stay where the loops found them
+		acceptors_.splice(acceptors_.end(), bound);
+	}
+
+	// closes the acceptors, the accept loops end quietly and sessions they
+	// started keep running; start_service may listen anew right after
+	void stop_service()
+	{
+		close_service(std::move(acceptors_));
+		acceptors_.clear();
+	}
+
+	// sets the acceptors aside, they accept on until close_service(); a
+	// reload binds the new ones next to them
+	std::list<utility::tcp_acceptor> take_service()
+	{
+		auto acceptors = std::move(acceptors_);
+		acceptors_.clear();
+		return acceptors;
+	}
+
+	void close_service(std::list<utility::tcp_acceptor> acceptors)
 	{
-		spawn(
-			ioc_,
-			[create(std::move(create)), this, ep](yield_context yield)
+		if (acceptors.empty())
+		{
+			return;
+		}
+		for (auto& acceptor : acceptors)
 		{
-			do_async_accept(create, ep, yield);
-		});
+			error_code ignored;
+			acceptor.close(ignored);
+		}
+		// freed once the accept loops saw their acceptors closed
+		post(ioc_, [retired = std::make_shared<std::list<utility::tcp_acceptor>>(std::move(acceptors))] {});
 	}
 
 	io_context& ioc_;
-	ip::tcp::acceptor acceptor_;
+	// a list keeps the acceptors in place for the accept loops
+	std::list<utility::tcp_acceptor> acceptors_;
+	// shared by the endpoint's addresses
+	utility::admission admission_;
+	// read by the accept loops on every wakeup, a reload sets it in place
+	std::size_t accept_batch_ = 32;
 
 private:
 
+	void bind(utility::tcp_acceptor& acceptor, const ip::tcp::endpoint& ep, const listen_config& cfg)
+	{
+		acceptor.open(ep.protocol());
+		acceptor.set_option(socket_base::reuse_address(true));
+		if (cfg.reuse_port || cfg.acceptors > 1)
+		{
+#if defined(SO_REUSEPORT)
+			acceptor.set_option(utility::reuse_port(true));
+#else
+			spdlog::warn("SO_REUSEPORT is not supported on this platform");
+#endif
+		}
+		acceptor.bind(ep);
+		if (cfg.fast_open_queue > 0)
+		{
+#if defined(TCP_FASTOPEN)
+			error_code ec;
+			acceptor.set_option(utility::fast_open(cfg.fast_open_queue), ec);
+			if (ec)
+			{
+				spdlog::warn("TCP_FASTOPEN: {}", ec.message());
+			}
+#else
+			spdlog::warn("TCP_FASTOPEN is not supported on this platform");
+#endif
+		}
+		acceptor.listen(cfg.backlog);
+		// the batch below must not block, async_accept still waits
+		acceptor.non_blocking(true);
+	}
+
 	template <typename SessionCreate>
-	void do_async_accept(SessionCreate create, const ip::tcp::endpoint ep, yield_context yield)
+	void do_async_accept(SessionCreate& create, utility::tcp_acceptor& acceptor, const ip::tcp::endpoint ep, yield_context yield)
 	{
 		try
 		{
-			acceptor_.open(ep.protocol());
-			acceptor_.set_option(ip::tcp::socket::reuse_address(true));
-			acceptor_.bind(ep);
-			acceptor_.listen();
 			while (true)
 			{
-				ip::tcp::socket s(ioc_);
-				acceptor_.async_accept(s, yield);
-				auto session = create(std::move(s));
-				session->go();
+				utility::tcp_socket s(ioc_);
+				acceptor.async_accept(s, yield);
+				admit(create, std::move(s));
+				// whatever queued up meanwhile is taken without another trip
+				// through the reactor; errors are left to async_accept
+				for (std::size_t i = 1; i < accept_batch_; ++i)
+				{
+					utility::tcp_socket next(ioc_);
+					error_code ec;
+					acceptor.accept(next, ec);
+					if (ec)
+					{
+						break;
+					}
+					admit(create, std::move(next));
+				}
 			}
 		}
 		catch (system_error & e)
 		{
+			if (e.code() == error::operation_aborted)
+			{
+				return;
+			}
 			std::stringstream ss;
 			ss << ep;
 			spdlog::error("endpoint {}: error {}", ss.str(), e.what());
 		}
 	}
+
+	template <typename SessionCreate>
+	void admit(SessionCreate& create, utility::tcp_socket s)
+	{
+		utility::admission::ticket ticket;
+		if (!admission_.try_admit(ticket))
+		{
+			// a reset costs the client one round trip, a handshake timeout
+			// under a reconnect storm costs every client in the queue
+			error_code ignored;
+			s.set_option(socket_base::linger(true, 0), ignored);
+			s.close(ignored);
+			utility::metrics::add(utility::metrics::counter::handshakes_rejected);
+			return;
+		}
+		auto session = create(std::move(s), std::move(ticket));
+		session->go();
+	}
 };
 }
 
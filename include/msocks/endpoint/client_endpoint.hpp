@@ -4,6 +4,8 @@
 
 #pragma once
 #include <msocks/endpoint/basic_endpoint.hpp>
+#include <msocks/endpoint/udp_relay.hpp>
+#include <msocks/session/client_session.hpp>
 
 namespace msocks
 {
@@ -15,12 +17,45 @@ struct client_config
 	};
 	std::string local_address;
 	uint16_t local_port = 0;
+	// the server UDP is relayed to, and TCP too without upstreams
 	std::string remote_address;
 	uint16_t remote_port = 0;
+	struct upstream_config
+	{
+		std::string address;
+		uint16_t port = 0;
+	};
+	// servers TCP connections are spread over, probed every probe_interval,
+	// 0 for no probes: a probe is a bare connect the server logs as a
+	// failed handshake
+	std::vector<upstream_config> upstreams;
+	std::chrono::seconds probe_interval{0};
 	std::vector<uint8_t> key;
 	std::string method;
     size_t iv_length;
 	boost::posix_time::seconds timeout;
+	// backlog, acceptors and admission of the local port
+	listen_config listen;
+	// options of the sockets accepted from applications and of the ones
+	// connected to the server
+	utility::socket_profile inbound;
+	utility::socket_profile outbound;
+	// connect to the server with TCP_FASTOPEN_CONNECT, Linux only
+	bool fast_open = false;
+	// long lived connections streams are multiplexed over, 0 for a
+	// connection per stream
+	std::size_t mux_connections = 0;
+	// at most this many connections are opened ahead of demand, each
+	// closed unused after warm_ttl, which must stay below the server timeout
+	std::size_t warm_connections = 0;
+	std::chrono::milliseconds warm_ttl{1500};
+	// relay buffers grow from buffer_min up to buffer_max under bulk traffic
+	std::size_t buffer_min = utility::relay_buffer::default_min_size;
+	std::size_t buffer_max = utility::relay_buffer::default_max_size;
+	// answer socks5 UDP ASSOCIATE with a relay on the local port, an
+	// application's association closed after udp_timeout without traffic
+	bool udp = false;
+	std::chrono::seconds udp_timeout{60};
 };
 
 class client_endpoint final : public basic_endpoint
@@ -33,9 +68,38 @@ public:
 
 	void start();
 
+	// connections accepted from now on run with cfg, the running ones keep
+	// what they started with; listens anew if the local address changed.
+	// Call on the endpoint's thread, leaves everything as it was if cfg is
+	// bad.
+	void reload(client_config cfg);
+
 private:
-	client_config cfg_;
+	// the connections to the servers it holds are not opened yet, nor
+	// are the servers probed
+	std::shared_ptr<client_session_attribute> make_attribute(const client_config& cfg) const;
+
+	// relays udp on the local port, throws if it cannot be bound
+	std::unique_ptr<udp_client_relay> make_udp(
+		const client_config& cfg, const shadowsocks::context_factory& cipher, const ip::tcp::endpoint& listen);
 
+	// the reply to UDP ASSOCIATE, naming udp
+	static std::vector<uint8_t> udp_reply(const udp_client_relay& udp);
+
+	// stops udp, which lives on for its associations
+	void retire(std::unique_ptr<udp_client_relay> udp);
+
+	// a retired relay whose associations are all gone
+	void forget(const udp_client_relay* relay);
+
+	// throws if ep cannot be bound
+	void listen(const ip::tcp::endpoint& ep, const listen_config& cfg);
+
+	client_config cfg_;
+	std::shared_ptr<const client_session_attribute> attribute_;
+	std::unique_ptr<udp_client_relay> udp_;
+	// relays of earlier addresses, dropped once their associations are gone
+	std::vector<std::unique_ptr<udp_client_relay>> retired_;
 };
 
 }
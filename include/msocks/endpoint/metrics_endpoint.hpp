@@ -0,0 +1,32 @@
+#pragma once
+
+#include <msocks/endpoint/basic_endpoint.hpp>
+
+namespace msocks
+{
+
+struct metrics_config
+{
+	std::string address = "127.0.0.1";
+	uint16_t port = 0;
+};
+
+// answers GET /metrics with utility::metrics::scrape() and GET /trace with
+// utility::trace::dump(), one request per connection. Scrapes only read the
+// counters, the listener can run on an io_context of its own next to the
+// workers.
+class metrics_endpoint final : public basic_endpoint
+{
+public:
+	metrics_endpoint(io_context& ioc, metrics_config cfg) :
+		basic_endpoint(ioc),
+		cfg_(std::move(cfg))
+	{}
+
+	void start();
+
+private:
+	metrics_config cfg_;
+};
+
+}
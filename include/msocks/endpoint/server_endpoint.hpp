@@ -4,24 +4,84 @@
 #pragma once
 
 #include <msocks/endpoint/basic_endpoint.hpp>
+#include <msocks/endpoint/udp_relay.hpp>
 #include <msocks/session/pool.hpp>
 #include <msocks/session/server_session.hpp>
 #include <msocks/utility/rate_limiter.hpp>
+#include <msocks/utility/socket_profile.hpp>
 
 namespace msocks
 {
 
+struct server_user_config
+{
+	// labels the user's counters on /metrics, empty for none
+	std::string name;
+	std::vector<uint8_t> key;
+	// class the user's sessions charge, typically under a global one and
+	// shared between workers
+	std::shared_ptr<utility::rate_limiter> limiter;
+};
+
+struct server_port_config
+{
+	uint16_t port = 0;
+	// more than one only with an AEAD method, a connection's user is found
+	// by trial decryption of its first chunk. udp is relayed for ports
+	// with a single user only.
+	std::vector<server_user_config> users;
+};
+
 struct server_endpoint_config
 {
 	server_endpoint_config() : timeout(0) {};
 	std::string server_address;
 	uint16_t server_port = 0;
-	size_t speed_limit = 0;
+	// class every session charges after its own bucket, shared between
+	// workers so the limit holds for all of them together
+	std::shared_ptr<utility::rate_limiter> limiter;
+	// bytes per second and burst of each session, 0 rate for no limit
+	std::size_t session_speed_limit = 0;
+	std::size_t session_speed_burst = 0;
 	std::vector<uint8_t> key;
-	bool no_delay = true;
+	// ports on server_address with users of their own, all with method;
+	// server_port, key and limiter are a single one of them when empty
+	std::vector<server_port_config> ports;
+	// options of the sockets accepted from clients and of the ones
+	// connected to targets
+	utility::socket_profile inbound;
+	utility::socket_profile outbound;
+	// backlog, acceptors and admission of every port
+	listen_config listen;
+	// connect to targets with TCP Fast Open when the client sent payload
+	// along with the address header
+	bool fast_open_connect = false;
+	// splice() plaintext ("none" method) sessions and use MSG_ZEROCOPY for
+	// writes of at least zero_copy_threshold bytes, Linux only
+	bool zero_copy = false;
+	std::size_t zero_copy_threshold = 16 * 1024;
+	// relay reads and writes through a per-worker io_uring in builds with
+	// MSOCKS_IO_URING, epoll stays in charge where the kernel refuses it
+	bool io_uring = true;
 	std::string method;
+	// how long name lookups of the targets are cached, failures shorter
+	std::chrono::seconds dns_ttl = utility::dns_cache::default_ttl;
+	std::chrono::seconds dns_negative_ttl = utility::dns_cache::default_negative_ttl;
     size_t iv_length;
 	boost::posix_time::seconds timeout;
+	// relaying sessions that read nothing for idle_timeout are closed,
+	// half_close_timeout applies once one direction ended; 0 for no limit
+	std::chrono::seconds idle_timeout{300};
+	std::chrono::seconds half_close_timeout{30};
+	// relay buffers grow from buffer_min up to buffer_max under bulk traffic
+	std::size_t buffer_min = utility::relay_buffer::default_min_size;
+	std::size_t buffer_max = utility::relay_buffer::default_max_size;
+	// idle sessions kept for reuse by each worker's pool
+	pool_config session_pool;
+	// relay shadowsocks udp on the same port, a client's association
+	// closed after udp_timeout without traffic
+	bool udp = false;
+	std::chrono::seconds udp_timeout{60};
 };
 
 class server_endpoint final : public basic_endpoint
@@ -30,10 +90,46 @@ public:
 	server_endpoint(io_context& ioc, pool<server_session>& session_pool, server_endpoint_config cfg);
 
 	void start();
+
+	// sessions accepted from now on run with cfg, the running ones keep
+	// what they started with; listens anew if the addresses changed. Call
+	// on the endpoint's thread, leaves everything as it was if cfg is bad.
+	// The session pool's watermarks and the DNS cache are not reloaded.
+	void reload(server_endpoint_config cfg);
+
 private:
+	// what a port's accept loop reads, swapped in place by reloads
+	struct port_state
+	{
+		ip::tcp::endpoint endpoint;
+		std::shared_ptr<const server_session_attribute> attribute;
+		std::unique_ptr<udp_server_relay> udp;
+	};
+
+	using ports_type = std::vector<std::shared_ptr<port_state>>;
+
+	// the ports of cfg, server_port alone if cfg lists none
+	static std::vector<server_port_config> ports(const server_endpoint_config& cfg);
+
+	static std::shared_ptr<const server_session_attribute> make_attribute(const server_endpoint_config& cfg, const server_port_config& port);
+
+	// the state of every port of cfg, nothing listening yet
+	static ports_type make_ports(const server_endpoint_config& cfg);
+
+	// binds every port of ports, throws on the first that fails
+	void listen(const ports_type& ports, const server_endpoint_config& cfg);
+
+	// stops the udp relays of ports, which live on for their associations
+	void retire(const ports_type& ports);
+
+	// a retired relay whose associations are all gone
+	void forget(const udp_server_relay* relay);
+
 	pool<server_session>& session_pool_;
 	server_endpoint_config cfg_;
-	std::shared_ptr<utility::rate_limiter> limiter_;
+	ports_type ports_;
+	// relays of earlier addresses, dropped once their associations are gone
+	std::vector<std::unique_ptr<udp_server_relay>> retired_;
 };
 
 }
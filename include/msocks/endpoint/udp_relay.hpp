@@ -0,0 +1,161 @@
+#pragma once
+
+#include <boost/asio/ip/udp.hpp>
+#include <boost/asio/ip/v6_only.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <shadowsocks/context.h>
+
+#include <msocks/utility/datagram_batch.hpp>
+#include <msocks/utility/dns_cache.hpp>
+#include <msocks/utility/nat_table.hpp>
+#include <msocks/utility/tcp_socket.hpp>
+#include <msocks/utility/timing_wheel.hpp>
+
+#include <chrono>
+#include <functional>
+#include <memory>
+
+using namespace boost::asio;
+using namespace boost::system;
+
+namespace msocks
+{
+
+// a udp relay: peers send to one socket, and every peer gets an
+// association with a socket of its own for the other side, found through
+// a nat table keyed by the peer's address. Replies to the peer leave
+// through the shared socket. An association without traffic for timeout
+// is closed. Datagrams are read and sent in batches and rewritten where
+// they were received. One relay per worker thread.
+class basic_udp_relay : public boost::noncopyable
+{
+public:
+	virtual ~basic_udp_relay() = default;
+
+	// binds the peers' socket and starts relaying, throws if it cannot
+	void start(const ip::udp::endpoint& listen, bool reuse_port = false);
+
+	ip::udp::endpoint local_endpoint() const;
+
+	// datagrams read from now on are opened and sealed with cipher, for a
+	// reloaded config
+	void rekey(const shadowsocks::context_factory& cipher);
+
+	// closes the peers' socket; associations run out on their timeouts,
+	// the relay has to outlive them. drained is posted once nothing of the
+	// relay is pending anymore, the relay may be destroyed from then on.
+	void stop(std::function<void()> drained = {});
+
+protected:
+	// a handler of a derived relay is pending, it ends with settle()
+	void hold() noexcept
+	{
+		++pending_;
+	}
+
+	struct association : public std::enable_shared_from_this<association>, public boost::noncopyable
+	{
+		association(io_context& ioc, const ip::udp::endpoint& peer) :
+			socket(ioc),
+			peer(peer),
+			timeout(ioc, [this] { expire(); })
+		{}
+
+		// the pending read fails and hands the association back
+		void expire()
+		{
+			error_code ignored;
+			socket.close(ignored);
+		}
+
+		utility::udp_socket socket;
+		ip::udp::endpoint peer;
+		utility::timing_wheel::entry timeout;
+	};
+
+	basic_udp_relay(io_context& ioc, const shadowsocks::context_factory& cipher, std::chrono::seconds timeout);
+
+	// a datagram from a peer, one for the peer on its association
+	virtual void handle_peer(utility::datagram_batch::datagram& d) = 0;
+
+	virtual void handle_association(association& a, utility::datagram_batch::datagram& d) = 0;
+
+	// the association of peer, opened with protocol on first use;
+	// nullptr when no socket could be opened
+	association* associate(const ip::udp::endpoint& peer, const ip::udp& protocol);
+
+	// every handler of the relay ends with this, hold() went before the
+	// operation that runs it
+	void settle();
+
+	io_context& ioc_;
+	utility::udp_socket socket_;
+	utility::datagram_batch batch_;
+	shadowsocks::packet_context packet_;
+
+private:
+	using association_ptr = std::shared_ptr<association>;
+
+	// batches read in a row before other work gets a turn
+	static constexpr std::size_t max_rounds = 4;
+
+	void read_peers();
+
+	void read_association(association_ptr a);
+
+	void release(const association_ptr& a);
+
+	// reads and handles what socket has, would_block once it ran dry
+	template <typename Handle>
+	error_code drain(utility::udp_socket& socket, Handle handle);
+
+	std::chrono::seconds timeout_;
+	utility::nat_table<association_ptr> nat_;
+	// operations in flight whose handlers refer to the relay
+	std::size_t pending_ = 0;
+	bool stopped_ = false;
+	std::function<void()> drained_;
+};
+
+// the server side: peers are clients, whose datagrams carry the target's
+// address and are relayed to it; replies go back sealed with the address
+// they came from
+class udp_server_relay final : public basic_udp_relay
+{
+public:
+	udp_server_relay(io_context& ioc, const shadowsocks::context_factory& cipher, std::chrono::seconds timeout);
+
+private:
+	void handle_peer(utility::datagram_batch::datagram& d) override;
+
+	void handle_association(association& a, utility::datagram_batch::datagram& d) override;
+
+	// the target as the associations' sockets address it
+	ip::udp::endpoint outbound(const ip::address& address, uint16_t port) const;
+
+	// sends a datagram whose target's domain was looked up with ec
+	void send_resolved(association& a, const std::vector<uint8_t>& datagram, error_code ec, const utility::dns_cache::results_type& endpoints);
+
+	// associations send to both families from one dual stack socket if the
+	// host has ipv6
+	ip::udp protocol_;
+};
+
+// the client side: peers are local applications speaking socks5 udp, whose
+// datagrams are sealed and sent to the server, every application from a
+// socket of its own so the replies find their way back
+class udp_client_relay final : public basic_udp_relay
+{
+public:
+	udp_client_relay(io_context& ioc, const shadowsocks::context_factory& cipher, std::chrono::seconds timeout, const ip::udp::endpoint& server);
+
+private:
+	void handle_peer(utility::datagram_batch::datagram& d) override;
+
+	void handle_association(association& a, utility::datagram_batch::datagram& d) override;
+
+	ip::udp::endpoint server_;
+};
+
+}
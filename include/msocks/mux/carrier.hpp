@@ -0,0 +1,313 @@
+#pragma once
+
+#include <boost/asio/post.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/write.hpp>
+
+#include <msocks/mux/channel.hpp>
+
+#include <msocks/utility/log.hpp>
+#include <msocks/utility/metrics.hpp>
+#include <msocks/utility/socks_address.hpp>
+
+#include <cstring>
+#include <functional>
+#include <unordered_map>
+
+namespace msocks::mux
+{
+
+// one long lived encrypted connection carrying many streams. Frames of all
+// streams queue up in one buffer and leave with a single write while the
+// previous one is in flight; incoming frames are read header first and
+// handed to their stream. On the server side the peer opens the streams,
+// on the client side open() does, with odd ids.
+template <typename Stream>
+class basic_carrier final : public carrier, public std::enable_shared_from_this<basic_carrier<Stream>>
+{
+public:
+	// owner keeps stream alive; greeting goes out before any frame. A
+	// carrier that read no frame for idle_timeout is closed, 0 for never.
+	basic_carrier(io_context& ioc, Stream& stream, std::shared_ptr<void> owner, bool server,
+		stream_options options = {}, std::chrono::seconds idle_timeout = {}, const_buffer greeting = {}) :
+		ioc_(ioc),
+		stream_(stream),
+		owner_(std::move(owner)),
+		server_(server),
+		options_(options),
+		idle_(ioc, [this] { close(error::timed_out); }),
+		idle_timeout_(idle_timeout),
+		payload_in_(max_payload)
+	{
+		auto data = static_cast<const uint8_t*>(greeting.data());
+		out_.assign(data, data + greeting.size());
+	}
+
+	// stream is connected, frames may flow; received are bytes already read
+	// off stream that belong to the first frames
+	void start(const_buffer received = {})
+	{
+		auto data = static_cast<const uint8_t*>(received.data());
+		pending_.assign(data, data + received.size());
+		started_ = true;
+		// a peer gone without a FIN or RST would hold the carrier forever
+		idle_.schedule(idle_timeout_);
+		read_header();
+		flush();
+	}
+
+	// a new stream to the target in shadowsocks address format
+	std::shared_ptr<channel> open(utility::tcp_socket socket, const_buffer address)
+	{
+		uint32_t id = next_id_;
+		next_id_ += 2;
+		auto ch = std::make_shared<channel>(this->shared_from_this(), id, std::move(socket));
+		channels_.emplace(id, ch);
+		send_frame(frame_type::open, id, address);
+		return ch;
+	}
+
+	std::size_t size() const noexcept
+	{
+		return channels_.size();
+	}
+
+	bool alive() const noexcept
+	{
+		return !dead_;
+	}
+
+	void send_data(std::shared_ptr<channel> ch, const_buffer frame) override
+	{
+		if (dead_)
+		{
+			return;
+		}
+		// the server relays targets' bytes to the client, the client the other way round
+		utility::metrics::add(server_ ? utility::metrics::counter::bytes_sent : utility::metrics::counter::bytes_received, frame.size() - header_size);
+		auto data = static_cast<const uint8_t*>(frame.data());
+		out_.insert(out_.end(), data, data + frame.size());
+		sent_.emplace_back(std::move(ch));
+		flush();
+	}
+
+	void send_frame(frame_type type, uint32_t id, const_buffer payload) override
+	{
+		if (dead_)
+		{
+			return;
+		}
+		uint8_t header[header_size];
+		encode(header, frame_header{type, id, uint16_t(payload.size())});
+		auto data = static_cast<const uint8_t*>(payload.data());
+		out_.insert(out_.end(), header, header + header_size);
+		out_.insert(out_.end(), data, data + payload.size());
+		flush();
+	}
+
+	void remove(uint32_t id) override
+	{
+		channels_.erase(id);
+	}
+
+	// tears the carrier and all its streams down
+	void close(const error_code& ec)
+	{
+		if (dead_)
+		{
+			return;
+		}
+		dead_ = true;
+		idle_.cancel();
+		if (ec != error::operation_aborted && ec != error::eof)
+		{
+			MSOCKS_LOG(spdlog::level::info, "[mux] error: {}", ec.message());
+		}
+		auto channels = std::move(channels_);
+		channels_.clear();
+		for (auto& ch : channels)
+		{
+			ch.second->abort();
+		}
+		sent_.clear();
+		error_code ignored;
+		stream_.lowest_layer().close(ignored);
+	}
+
+private:
+	// fills out from the bytes left over by the handshake first
+	template <typename Handler>
+	void read_exactly(mutable_buffer out, Handler&& handler)
+	{
+		if (pending_begin_ == pending_.size())
+		{
+			async_read(stream_, out, std::forward<Handler>(handler));
+			return;
+		}
+		std::size_t n = std::min(out.size(), pending_.size() - pending_begin_);
+		std::memcpy(out.data(), pending_.data() + pending_begin_, n);
+		pending_begin_ += n;
+		if (pending_begin_ == pending_.size())
+		{
+			pending_.clear();
+			pending_.shrink_to_fit();
+			pending_begin_ = 0;
+		}
+		if (n == out.size())
+		{
+			post(ioc_, std::bind(std::forward<Handler>(handler), error_code{}, n));
+			return;
+		}
+		async_read(stream_, out + n, std::forward<Handler>(handler));
+	}
+
+	void read_header()
+	{
+		read_exactly(
+			buffer(header_in_),
+			utility::make_custom_alloc_handler(memory_read_, [this, p = this->shared_from_this()](error_code ec, std::size_t)
+			{
+				if (ec || dead_)
+				{
+					close(ec);
+					return;
+				}
+				idle_.touch();
+				current_ = decode(header_in_.data());
+				if (current_.length > max_payload)
+				{
+					close(error::message_size);
+					return;
+				}
+				read_payload();
+			}));
+	}
+
+	void read_payload()
+	{
+		read_exactly(
+			buffer(payload_in_.data(), current_.length),
+			utility::make_custom_alloc_handler(memory_read_, [this, p = this->shared_from_this()](error_code ec, std::size_t)
+			{
+				if (ec || dead_)
+				{
+					close(ec);
+					return;
+				}
+				dispatch();
+				read_header();
+			}));
+	}
+
+	void dispatch()
+	{
+		const uint8_t* payload = payload_in_.data();
+		if (current_.type == frame_type::open)
+		{
+			accept(payload);
+			return;
+		}
+		auto iter = channels_.find(current_.id);
+		if (iter == channels_.end())
+		{
+			// frames in flight for a stream that is gone already
+			return;
+		}
+		auto ch = iter->second;
+		switch (current_.type)
+		{
+			case frame_type::data:
+				utility::metrics::add(server_ ? utility::metrics::counter::bytes_received : utility::metrics::counter::bytes_sent, current_.length);
+				ch->on_data(payload, current_.length);
+				break;
+			case frame_type::window:
+				if (current_.length == 4)
+				{
+					ch->on_window(std::size_t(payload[0]) << 24 | payload[1] << 16 | payload[2] << 8 | payload[3]);
+				}
+				break;
+			case frame_type::close:
+				ch->on_close();
+				break;
+			case frame_type::reset:
+				ch->abort();
+				channels_.erase(current_.id);
+				break;
+			default:
+				break;
+		}
+	}
+
+	void accept(const uint8_t* payload)
+	{
+		utility::socks_address target;
+		std::size_t size = current_.length;
+		// only clients open streams, and with odd ids
+		if (!server_ || current_.id % 2 == 0 || channels_.count(current_.id) != 0 ||
+			utility::parse_socks_address(payload, size, target) != utility::parse_status::complete || size != current_.length)
+		{
+			send_frame(frame_type::reset, current_.id, {});
+			return;
+		}
+		auto ch = std::make_shared<channel>(this->shared_from_this(), current_.id, utility::tcp_socket(ioc_), options_);
+		channels_.emplace(current_.id, ch);
+		ch->connect(target);
+	}
+
+	void flush()
+	{
+		if (!started_ || writing_ || dead_ || out_.empty())
+		{
+			return;
+		}
+		writing_ = true;
+		std::swap(out_, out_writing_);
+		std::swap(sent_, sent_writing_);
+		async_write(
+			stream_, buffer(out_writing_),
+			utility::make_custom_alloc_handler(memory_write_, [this, p = this->shared_from_this()](error_code ec, std::size_t)
+			{
+				writing_ = false;
+				if (ec)
+				{
+					close(ec);
+					return;
+				}
+				out_writing_.clear();
+				for (auto& ch : sent_writing_)
+				{
+					ch->on_sent();
+				}
+				sent_writing_.clear();
+				flush();
+			}));
+	}
+
+	io_context& ioc_;
+	Stream& stream_;
+	std::shared_ptr<void> owner_;
+	const bool server_;
+	const stream_options options_;
+	utility::timing_wheel::entry idle_;
+	const std::chrono::seconds idle_timeout_;
+	std::unordered_map<uint32_t, std::shared_ptr<channel>> channels_;
+	uint32_t next_id_ = 1;
+	std::array<uint8_t, header_size> header_in_;
+	frame_header current_{};
+	std::vector<uint8_t> payload_in_;
+	// read along with the handshake, consumed before the stream is read
+	std::vector<uint8_t> pending_;
+	std::size_t pending_begin_ = 0;
+	// frames waiting for the next write, and those of the write in flight
+	std::vector<uint8_t> out_;
+	std::vector<uint8_t> out_writing_;
+	std::vector<std::shared_ptr<channel>> sent_;
+	std::vector<std::shared_ptr<channel>> sent_writing_;
+	bool started_ = false;
+	bool writing_ = false;
+	bool dead_ = false;
+	utility::handler_memory memory_read_;
+	utility::handler_memory memory_write_;
+};
+
+}
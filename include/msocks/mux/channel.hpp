@@ -0,0 +1,131 @@
+#pragma once
+
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <msocks/mux/frame.hpp>
+#include <msocks/utility/handler_memory.hpp>
+#include <msocks/utility/happy_eyeballs.hpp>
+#include <msocks/utility/socks_address.hpp>
+#include <msocks/utility/rate_limiter.hpp>
+#include <msocks/utility/socket_profile.hpp>
+#include <msocks/utility/tcp_socket.hpp>
+#include <msocks/utility/timing_wheel.hpp>
+
+#include <chrono>
+#include <memory>
+#include <optional>
+
+using namespace boost::asio;
+using namespace boost::system;
+
+namespace msocks::mux
+{
+
+class channel;
+
+// what a server applies to the streams its peers open
+struct stream_options
+{
+	// charged before every read and write when set
+	utility::rate_limiter* limiter = nullptr;
+	// a stream that relayed nothing for this long is reset, 0 for never
+	std::chrono::seconds idle_timeout{0};
+	// set on the connections to targets, outliving the carrier's streams
+	const utility::socket_profile* profile = nullptr;
+};
+
+// the shared connection streams send their frames through
+class carrier
+{
+public:
+	virtual ~carrier() = default;
+
+	// queues a data frame, header included; ch->on_sent() follows once it
+	// left, so every stream has one data frame in flight at most
+	virtual void send_data(std::shared_ptr<channel> ch, const_buffer frame) = 0;
+
+	virtual void send_frame(frame_type type, uint32_t id, const_buffer payload = {}) = 0;
+
+	// the stream is done in both directions
+	virtual void remove(uint32_t id) = 0;
+};
+
+// one stream of a carrier, relaying between a socket and the frames of its
+// id. Each direction owns a window of initial_window bytes, the receiver
+// hands credit back as it writes the bytes out, so a stalled socket only
+// stalls its own stream and never the carrier.
+class channel : public std::enable_shared_from_this<channel>, public boost::noncopyable
+{
+public:
+	channel(std::shared_ptr<carrier> owner, uint32_t id, utility::tcp_socket socket, const stream_options& options = {});
+
+	uint32_t id() const noexcept
+	{
+		return id_;
+	}
+
+	// relays the connected socket, early goes out in the first data frames
+	void start(const_buffer early = {});
+
+	// connects to target first, for streams the peer opened
+	void connect(const utility::socks_address& target);
+
+	void on_data(const uint8_t* data, std::size_t n);
+
+	void on_window(std::size_t credit);
+
+	void on_close();
+
+	// the carrier wrote the last data frame of this stream
+	void on_sent();
+
+	// the stream or the whole carrier is gone, nothing is sent anymore
+	void abort();
+
+private:
+	void read();
+
+	void handle_read(error_code ec, std::size_t n);
+
+	void send(std::size_t n);
+
+	void write();
+
+	void handle_write(error_code ec, std::size_t n);
+
+	void reset();
+
+	void finish();
+
+	std::shared_ptr<carrier> carrier_;
+	const uint32_t id_;
+	utility::tcp_socket socket_;
+	std::shared_ptr<utility::happy_eyeballs> connector_;
+	const utility::socket_profile* profile_;
+	std::optional<utility::throttle> throttle_up_;
+	std::optional<utility::throttle> throttle_down_;
+	std::optional<utility::timing_wheel::entry> idle_;
+	// header plus payload of the next data frame
+	std::vector<uint8_t> up_;
+	// bytes given to start() still to send
+	std::vector<uint8_t> early_;
+	std::size_t early_begin_ = 0;
+	// received bytes, and those being written to the socket
+	std::vector<uint8_t> down_;
+	std::vector<uint8_t> down_writing_;
+	std::size_t send_window_ = initial_window;
+	std::size_t recv_window_ = initial_window;
+	bool connected_ = false;
+	bool window_wanted_ = false;
+	bool writing_ = false;
+	// a close went out / came in
+	bool up_done_ = false;
+	bool down_done_ = false;
+	bool closed_ = false;
+	utility::handler_memory memory_up_;
+	utility::handler_memory memory_down_;
+};
+
+}
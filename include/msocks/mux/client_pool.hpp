@@ -0,0 +1,48 @@
+#pragma once
+
+#include <boost/noncopyable.hpp>
+
+#include <msocks/mux/carrier.hpp>
+#include <msocks/session/upstream_set.hpp>
+#include <msocks/utility/socket_profile.hpp>
+#include <shadowsocks/stream.h>
+
+#include <vector>
+
+namespace msocks::mux
+{
+
+// the client's carriers to one server. A stream goes to the least busy
+// carrier; while fewer than connections exist and every one of them carries
+// streams already, a new one is connected. Carriers that failed are dropped
+// on the next open.
+class client_pool : public boost::noncopyable
+{
+public:
+	client_pool(io_context& ioc, std::shared_ptr<upstream_set> upstreams,
+		std::shared_ptr<const shadowsocks::context_factory> cipher, std::size_t connections, bool fast_open,
+		utility::socket_profile profile = {});
+
+	// relays local to target, a socks address, early holds bytes the
+	// application sent already
+	void open(utility::tcp_socket local, const std::vector<uint8_t>& target, const_buffer early);
+
+private:
+	using carrier_type = basic_carrier<shadowsocks::stream<utility::tcp_socket>>;
+
+	std::shared_ptr<carrier_type> pick();
+
+	std::shared_ptr<carrier_type> connect();
+
+	io_context& ioc_;
+	// a new carrier connects to the server picked for it
+	const std::shared_ptr<upstream_set> upstreams_;
+	const std::shared_ptr<const shadowsocks::context_factory> cipher_;
+	const std::size_t connections_;
+	const bool fast_open_;
+	const utility::socket_profile profile_;
+	const std::vector<uint8_t> greeting_;
+	std::vector<std::shared_ptr<carrier_type>> carriers_;
+};
+
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <msocks/utility/socks_constants.hpp>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace msocks::mux
+{
+
+// every frame on a carrier is [type][stream id, 4 bytes][length, 2 bytes]
+// followed by length bytes of payload, integers in network order
+constexpr std::size_t header_size = 7;
+constexpr std::size_t max_payload = 16 * 1024;
+// bytes either side may send on a stream before the peer credits them back
+constexpr std::size_t initial_window = 256 * 1024;
+
+enum class frame_type : uint8_t
+{
+	// payload is the target in shadowsocks address format
+	open = 1,
+	data = 2,
+	// payload is the 4 byte credit returned by the receiver
+	window = 3,
+	// the sender is done sending, the other direction goes on
+	close = 4,
+	// the stream is gone in both directions
+	reset = 5
+};
+
+struct frame_header
+{
+	frame_type type;
+	uint32_t id;
+	uint16_t length;
+};
+
+inline void encode(uint8_t* out, const frame_header& h) noexcept
+{
+	out[0] = static_cast<uint8_t>(h.type);
+	out[1] = uint8_t(h.id >> 24);
+	out[2] = uint8_t(h.id >> 16);
+	out[3] = uint8_t(h.id >> 8);
+	out[4] = uint8_t(h.id);
+	out[5] = uint8_t(h.length >> 8);
+	out[6] = uint8_t(h.length);
+}
+
+inline frame_header decode(const uint8_t* in) noexcept
+{
+	return frame_header{
+		static_cast<frame_type>(in[0]),
+		uint32_t(in[1]) << 24 | uint32_t(in[2]) << 16 | uint32_t(in[3]) << 8 | in[4],
+		uint16_t(in[5] << 8 | in[6])};
+}
+
+// the domain a client asks the server to connect to when the connection
+// carries streams instead of a single target
+constexpr const char* marker_host = "mux.msocks.invalid";
+
+inline std::vector<uint8_t> marker_address()
+{
+	std::string host(marker_host);
+	std::vector<uint8_t> address{socks::addr_domain, uint8_t(host.size())};
+	address.insert(address.end(), host.begin(), host.end());
+	address.insert(address.end(), {0, 0});
+	return address;
+}
+
+
+}
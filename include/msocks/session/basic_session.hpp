@@ -6,9 +6,15 @@
 
 
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/io_context.hpp>
 #include <botan/stream_cipher.h>
 
 #include <shadowsocks/stream.h>
+#include <msocks/utility/admission.hpp>
+#include <msocks/utility/relay_buffer.hpp>
+#include <msocks/utility/session_id.hpp>
+#include <msocks/utility/handler_memory.hpp>
+#include <msocks/utility/tcp_socket.hpp>
 
 using namespace boost::asio;
 using namespace boost::system;
@@ -19,16 +25,27 @@ class basic_session : public noncopyable
 {
 public:
 
-	const std::string& uuid() const noexcept;
+	// tags log lines and traces, logged as {:x}
+	uint64_t id() const noexcept
+	{
+		return id_;
+	}
 
 protected:
 	basic_session(io_context& ioc);
 
 	io_context& ioc_;
-	std::string uuid_;
-	std::array<uint8_t,4096> buffer_local_;
-	std::array<uint8_t,4096> buffer_remote_;
-
+	// a pooled session takes a new one each time it is reused
+	uint64_t id_;
+	utility::relay_buffer buffer_local_;
+	utility::relay_buffer buffer_remote_;
+	// operations of each relay direction, named after the buffer they read into
+	utility::handler_memory memory_local_;
+	utility::handler_memory memory_remote_;
+	// held from accept until the session relays or ends
+	utility::admission::ticket handshake_;
+	// the session's phases are traced under this id, 0 if not sampled
+	uint64_t trace_ = 0;
 
 };
 
@@ -1,8 +1,10 @@
 #pragma once
 
-#include <boost/asio/spawn.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <msocks/session/basic_session.hpp>
+#include <msocks/session/upstream_set.hpp>
+#include <msocks/session/warm_pool.hpp>
+#include <msocks/utility/trace.hpp>
 #include <shadowsocks/stream.h>
 
 using namespace boost::system;
@@ -11,41 +13,118 @@ using namespace boost::asio;
 namespace msocks
 {
 
+namespace mux
+{
+class client_pool;
+}
+
 struct client_session_attribute
 {
 	client_session_attribute() : timeout(0) {};
-	std::string remote_address;
-	uint16_t remote_port = 0;
+	// the servers connections are spread over
+	std::shared_ptr<upstream_set> upstreams;
 	std::vector<uint8_t> key;
 	std::string method;
     size_t iv_length;
 	boost::posix_time::seconds timeout;
+	std::shared_ptr<const shadowsocks::context_factory> cipher;
+	bool fast_open = false;
+	// set on the connections to the server
+	utility::socket_profile outbound;
+	// carries the streams when set instead of a connection each
+	std::shared_ptr<mux::client_pool> mux;
+	// connections to the server made ahead of time, when set
+	std::shared_ptr<warm_pool> warm;
+	// reply to UDP ASSOCIATE naming the udp relay, empty without one
+	std::vector<uint8_t> udp_reply;
+	std::size_t buffer_min = utility::relay_buffer::default_min_size;
+	std::size_t buffer_max = utility::relay_buffer::default_max_size;
 };
 
 class client_session final : public basic_session, public std::enable_shared_from_this<client_session>
 {
 public:
-	client_session(io_context& ioc, ip::tcp::socket && local, const client_session_attribute& attribute) 
+	client_session(io_context& ioc, utility::tcp_socket && local, std::shared_ptr<const client_session_attribute> attribute, utility::admission::ticket handshake = {}) 
         : basic_session(ioc)
         , local_(std::move(local))
-        , remote_(ip::tcp::socket{ioc}, shadowsocks::cipher_context{attribute.method, attribute.key, attribute.iv_length})
-        , attribute_(attribute)
-	{}
+        , remote_(utility::tcp_socket{ioc}, attribute->cipher->create())
+        , attribute_(std::move(attribute))
+	{
+		handshake_ = std::move(handshake);
+		buffer_local_.configure(attribute_->buffer_min, attribute_->buffer_max);
+		buffer_remote_.configure(attribute_->buffer_min, attribute_->buffer_max);
+	}
 
 	void go();
 private:
 
-	void start(yield_context yield);
+	void start();
+
+	void handle_local_socks5(error_code ec, uint8_t command, const_buffer target_address, const_buffer rest);
+
+	// an association lasts as long as the connection that asked for it
+	void hold_association();
+
+	// connects to a server picked from the upstreams other than failed
+	void connect(std::size_t failed);
+
+	// connects to another server after ec unless nothing is left to
+	// try, true if it did
+	bool fail_over(const error_code& ec);
+
+	void handle_connect(error_code ec);
+
+	// the request of early bytes went out with ec on a fast open connect;
+	// waits for the server to accept or refuse it
+	void confirm_connect(error_code ec, std::size_t early);
+
+	void confirmed(const error_code& ec, std::size_t early);
+
+	// both directions start once the request is out
+	void relay();
+
+	// bytes the application sent along with its request, if any; ec is
+	// set when the local socket failed meanwhile
+	const_buffer read_early(error_code& ec);
+
+	// spans the wait for the server's first reply, sampled sessions only
+	void trace_first_byte();
+
+	void fwd_local_remote();
+	void fwd_remote_local();
+
+	// one relay direction ended with ec
+	void finish(const error_code& ec, bool local_remote);
+
+	utility::tcp_socket local_;
+
+	shadowsocks::stream<utility::tcp_socket> remote_;
+
+	std::vector<uint8_t> target_address_;
+
+	// bytes at the front of buffer_local_ read along with the request
+	std::size_t early_ = 0;
+
+	// relay directions still running
+	std::size_t relays_ = 0;
+
+	// servers a connection tries before it gives up
+	static constexpr std::size_t max_attempts = 3;
+
+	// the server connected to and the attempts made so far
+	std::size_t upstream_ = 0;
+	std::size_t attempts_ = 0;
+	upstream_set::clock::time_point connect_started_;
+	// a fast open connect whose outcome the request write reveals
+	bool confirming_ = false;
+	// remote_ came from the warm pool
+	bool warm_ = false;
 
-	void fwd_local_remote(yield_context yield);
-	void fwd_remote_local(yield_context yield);
+	// start of the current phase, for tracing
+	utility::trace::clock::time_point started_;
 
-    
-    ip::tcp::socket local_;
-    
-    shadowsocks::stream<ip::tcp::socket> remote_;
-    
-	const client_session_attribute& attribute_;
+	// kept for the session's lifetime, across reloads
+	std::shared_ptr<const client_session_attribute> attribute_;
 };
 
 }
@@ -1,11 +1,17 @@
 #pragma once
 
+#include <boost/asio/io_context.hpp>
 #include <boost/asio/steady_timer.hpp>
-#include <boost/asio/spawn.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/noncopyable.hpp>
 
 #include <msocks/utility/intrusive_list.hpp>
+#include <msocks/utility/metrics.hpp>
 
-#include <spdlog/spdlog.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
 
 using namespace boost::asio;
 using namespace boost::system;
@@ -19,6 +25,12 @@ void notify_reuse(Session& session, Args&& ... args)
 	session.notify_reuse(std::forward<Args>(args)...);
 }
 
+template <typename Session>
+void notify_recycle(Session& session)
+{
+	session.notify_recycle();
+}
+
 template <class Session, typename ... Args>
 std::add_pointer_t<Session> raw_ptr_factory(Args&& ... args)
 {
@@ -27,80 +39,221 @@ std::add_pointer_t<Session> raw_ptr_factory(Args&& ... args)
 }
 
 template <typename Session>
-class pool
+class pool;
+
+// the pool sessions go back to, cleared when the pool goes away before
+// them, e.g. before the io_context whose pending handlers still hold some
+template <typename Session>
+struct pool_link
+{
+	std::atomic<pool<Session>*> owner;
+};
+
+// intrusive reference count of a pooled session, the last reference hands
+// it back to the pool it was taken from instead of deleting it. Handlers
+// keep their session alive with self(), which costs no control block.
+template <typename Session>
+class pooled_object
 {
-	using pointer_type = typename utility::intrusive_list<Session>::pointer_type;
-	using deleter_type = std::function<void(pointer_type)>;
-	using unique_pointer_type = std::unique_ptr<Session, deleter_type>;
-	using shared_pointer_type = std::shared_ptr<Session>;
 public:
+	friend void intrusive_ptr_add_ref(Session* session) noexcept
+	{
+		session->refs_.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	friend void intrusive_ptr_release(Session* session) noexcept
+	{
+		if (session->refs_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		{
+			release(session);
+		}
+	}
+
+protected:
+	boost::intrusive_ptr<Session> self() noexcept
+	{
+		return boost::intrusive_ptr<Session>(static_cast<Session*>(this));
+	}
+
+private:
+	friend class pool<Session>;
+
+	static void release(Session* session) noexcept
+	{
+		auto owner = session->link_ ? session->link_->owner.load(std::memory_order_acquire) : nullptr;
+		if (owner == nullptr)
+		{
+			delete session;
+			return;
+		}
+		owner->recycle(session);
+	}
+
+	std::atomic<std::size_t> refs_{0};
+	std::shared_ptr<const pool_link<Session>> link_;
+	// link of the stack sessions released on other threads wait on
+	Session* overflow_next_ = nullptr;
+};
+
+struct pool_config
+{
+	// idle sessions beyond this are deleted right away when they come back
+	std::size_t high_watermark = 4096;
+	// idle sessions the periodic shrink always leaves alone
+	std::size_t low_watermark = 64;
+	// sessions that stayed idle for a whole interval are freed after it
+	std::chrono::seconds shrink_interval{30};
+};
+
+// sessions of one io_context, reset and reused instead of reallocated.
+// The free list belongs to the thread running the io_context and is used
+// LIFO, so the session taken next is the one with the warmest cache.
+// Sessions released on any other thread go onto a lock-free stack that the
+// owning thread drains whenever its free list runs dry.
+template <typename Session>
+class pool : public boost::noncopyable
+{
+	static_assert(std::is_base_of_v<pooled_object<Session>, Session>, "Session must be a pooled_object");
+public:
+	using pointer_type = boost::intrusive_ptr<Session>;
+
+	explicit pool(io_context& ioc, pool_config config = {}) :
+		ioc_(ioc),
+		config_(config),
+		timer_(ioc),
+		link_(std::make_shared<pool_link<Session>>())
+	{
+		link_->owner.store(this, std::memory_order_relaxed);
+		shrink();
+	}
 
-	explicit pool(io_context& ioc) : ioc_(ioc), timer_(ioc)
+	~pool()
 	{
-		timed_shrink_list();
+		// sessions still out are deleted when their last reference goes
+		link_->owner.store(nullptr, std::memory_order_release);
+		drain();
+		while (auto session = free_.release())
+		{
+			delete session;
+		}
 	}
 
 	template <typename ... Args>
-	shared_pointer_type take(Args&& ... args);
+	pointer_type take(Args&& ... args);
+
+	std::size_t idle() const noexcept
+	{
+		return free_.size();
+	}
 
 private:
-	io_context& ioc_;
-	steady_timer timer_;
-	std::size_t out_ = 0;
+	friend class pooled_object<Session>;
 
-	void timed_shrink_list();
+	void recycle(Session* session) noexcept;
 
-	void recycle(pointer_type session);
+	// the owning thread's part of recycle
+	void offer(Session* session) noexcept;
 
-	utility::intrusive_list<Session> session_list_;
+	void drain() noexcept;
 
-};
+	void shrink();
 
+	io_context& ioc_;
+	const pool_config config_;
+	steady_timer timer_;
+	utility::intrusive_list<Session> free_;
+	std::atomic<Session*> overflow_{nullptr};
+	const std::shared_ptr<pool_link<Session>> link_;
+	// the fewest idle sessions during the current shrink interval
+	std::size_t idle_min_ = 0;
+};
 
 template <typename Session>
 template <typename ... Args>
-typename pool<Session>::shared_pointer_type pool<Session>::take(Args&& ... args)
+typename pool<Session>::pointer_type pool<Session>::take(Args&& ... args)
 {
-	pointer_type session;
-	if (session_list_.empty())
+	if (free_.empty())
 	{
+		drain();
+	}
+	Session* session = free_.take();
+	if (session == nullptr)
+	{
+		utility::metrics::add(utility::metrics::counter::pool_misses);
 		session = raw_ptr_factory<Session>(std::forward<Args>(args)...);
+		session->link_ = link_;
 	}
 	else
 	{
-		session = session_list_.take();
+		utility::metrics::add(utility::metrics::counter::pool_hits);
+		idle_min_ = std::min(idle_min_, free_.size());
 		notify_reuse(*session, std::forward<Args>(args)...);
 	}
-	out_++;
-	return unique_pointer_type(session, [this](pointer_type session) { recycle(session); });
+	utility::metrics::add(utility::metrics::counter::sessions_active);
+	return pointer_type(session);
 }
 
 template <typename Session>
-void pool<Session>::recycle(pointer_type session)
+void pool<Session>::recycle(Session* session) noexcept
 {
-	if (session == nullptr)
+	if (ioc_.get_executor().running_in_this_thread())
+	{
+		offer(session);
 		return;
-	out_--;
-	session_list_.offer(session);
+	}
+	Session* head = overflow_.load(std::memory_order_relaxed);
+	do
+	{
+		session->overflow_next_ = head;
+	}
+	while (!overflow_.compare_exchange_weak(head, session, std::memory_order_release, std::memory_order_relaxed));
+}
+
+template <typename Session>
+void pool<Session>::offer(Session* session) noexcept
+{
+	utility::metrics::add(utility::metrics::counter::sessions_active, -1);
+	notify_recycle(*session);
+	if (free_.size() >= config_.high_watermark)
+	{
+		delete session;
+		return;
+	}
+	free_.offer(session);
 }
 
 template <typename Session>
-void pool<Session>::timed_shrink_list()
+void pool<Session>::drain() noexcept
 {
-	spawn(
-		ioc_,
-		[this](yield_context yield)
+	// the only consumer takes the whole stack at once, so there is no ABA
+	Session* session = overflow_.exchange(nullptr, std::memory_order_acquire);
+	while (session != nullptr)
+	{
+		Session* next = session->overflow_next_;
+		session->overflow_next_ = nullptr;
+		offer(session);
+		session = next;
+	}
+}
+
+template <typename Session>
+void pool<Session>::shrink()
+{
+	drain();
+	std::size_t excess = free_.size() > config_.low_watermark ? free_.size() - config_.low_watermark : 0;
+	// the least recently used sessions go first
+	for (std::size_t n = std::min(idle_min_, excess); n != 0; --n)
+	{
+		delete free_.release();
+	}
+	idle_min_ = free_.size();
+	timer_.expires_after(config_.shrink_interval);
+	timer_.async_wait(
+		[this](error_code ec)
 		{
-			while (true)
+			if (!ec)
 			{
-				timer_.expires_after(std::chrono::seconds(30));
-				error_code ec;
-				timer_.async_wait(yield[ec]);
-				while (session_list_.size() > out_ / 2)
-				{
-					pointer_type session = session_list_.release();
-					delete session;
-				}
+				shrink();
 			}
 		});
 }
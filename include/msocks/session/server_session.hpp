@@ -1,10 +1,20 @@
 #pragma once
 
-#include <boost/asio/spawn.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <functional>
 #include <msocks/utility/rate_limiter.hpp>
 #include <msocks/session/basic_session.hpp>
+#include <msocks/session/pool.hpp>
 #include <msocks/utility/intrusive_list_hook.hpp>
+#include <msocks/utility/zerocopy_socket.hpp>
+#include <msocks/utility/splice.hpp>
+#include <msocks/utility/happy_eyeballs.hpp>
+#include <msocks/utility/socks_address.hpp>
+#include <msocks/utility/socket_profile.hpp>
+#include <msocks/utility/metrics.hpp>
+#include <msocks/utility/timing_wheel.hpp>
+#include <shadowsocks/key_set.h>
 
 using namespace boost::asio;
 using namespace boost::system;
@@ -12,6 +22,14 @@ using namespace boost::system;
 namespace msocks
 {
 
+// a user of a port, with the class its sessions charge
+struct server_user
+{
+	std::shared_ptr<utility::rate_limiter> limiter;
+	// nullptr for a user without a name
+	utility::metrics::user_counters* counters = nullptr;
+};
+
 struct server_session_attribute
 {
 	server_session_attribute() : timeout(0) {};
@@ -19,45 +37,142 @@ struct server_session_attribute
 	std::string method;
     size_t iv_length;
 	boost::posix_time::seconds timeout;
-	std::size_t limit = 0;
+	// a relaying session that read nothing for idle_timeout is closed, once
+	// one direction ended the other one gets half_close_timeout instead;
+	// 0 for no limit
+	std::chrono::seconds idle_timeout{0};
+	std::chrono::seconds half_close_timeout{0};
+	// class the sessions' own buckets charge next, e.g. the user's
 	std::shared_ptr<utility::rate_limiter> limiter;
+	// bytes per second and burst of every single session, 0 rate for none
+	std::size_t session_limit = 0;
+	std::size_t session_burst = 0;
+	// built from method, key and iv_length once per endpoint
+	std::shared_ptr<const shadowsocks::context_factory> cipher;
+	// users of the port, may be empty; the session's one is known once the
+	// first chunk is open
+	std::vector<server_user> users;
+	// their keys if there are several, cipher is keyed with the first
+	std::shared_ptr<shadowsocks::key_set> keys;
+	// splice plaintext sessions and send large writes with MSG_ZEROCOPY
+	bool zero_copy = false;
+	std::size_t zero_copy_threshold = 0;
+	// relay through the worker's io_uring, builds with MSOCKS_IO_URING only
+	bool io_uring = false;
+	// payload that came with the header rides on the SYN to the target
+	bool fast_open_connect = false;
+	// set on the sockets connected to targets
+	utility::socket_profile outbound;
+	std::size_t buffer_min = utility::relay_buffer::default_min_size;
+	std::size_t buffer_max = utility::relay_buffer::default_max_size;
 };
 
 class server_session final : 
 	public basic_session, 
-	public std::enable_shared_from_this<server_session>,
+	public pooled_object<server_session>,
 	public utility::intrusive_list_hook<server_session>
 {
 public:
 
-	server_session(io_context& ioc, ip::tcp::socket local, const server_session_attribute& attribute) :
+	// a session keeps the attribute it started with, a reload only
+	// reaches the sessions taken after it
+	server_session(io_context& ioc, utility::tcp_socket local, std::shared_ptr<const server_session_attribute> attribute, utility::admission::ticket handshake = {}) :
 		basic_session(ioc)
-        , local_(std::move(local), shadowsocks::cipher_context{attribute.method, attribute.key, attribute.iv_length})
+        , local_(std::move(local), attribute->cipher->create())
         , remote_(ioc)
-        , attribute_(attribute)
-	{}
+        , timeout_(ioc, [this] { handle_timeout(); })
+        , limiter_(attribute->session_limit, attribute->session_burst, attribute->limiter)
+        , throttle_local_(ioc, limiter_)
+        , throttle_remote_(ioc, limiter_)
+        , attribute_(std::move(attribute))
+	{
+		handshake_ = std::move(handshake);
+		buffer_local_.configure(attribute_->buffer_min, attribute_->buffer_max);
+		buffer_remote_.configure(attribute_->buffer_min, attribute_->buffer_max);
+	}
 
 	void go();
 
-	void notify_reuse(const io_context& ioc, ip::tcp::socket local, const server_session_attribute& attribute);
+	void notify_reuse(const io_context& ioc, utility::tcp_socket local, std::shared_ptr<const server_session_attribute> attribute, utility::admission::ticket handshake = {});
+
+	// hands buffers and pipes back before the session idles in the pool
+	void notify_recycle();
 
 private:
+	// the target, the length of its header and the bytes read into buffer_local_
+	using handshake_handler = std::function<void(error_code, const utility::socks_address&, std::size_t, std::size_t)>;
+
+	void start();
+
+	void handle_handshake(error_code ec, const utility::socks_address& target);
+
+	// finds the client's user among the port's and charges it from now on
+	void identify();
+
+	void handle_resolve(error_code ec, utility::dns_cache::results_type endpoints);
+
+	void handle_connect(error_code ec);
+
+	void fwd_local_remote();
+
+	void fwd_remote_local();
+
+	// one relay direction ended with ec
+	void finish(const error_code& ec, bool local_remote);
+
+	void handle_timeout();
+
+	// ends both directions at once
+	void close();
+
+	void async_handshake(handshake_handler handler);
+
+	void stop(const error_code& ec);
+
+	bool splice() const noexcept;
+
+	shadowsocks::stream<utility::zerocopy_socket> local_;
+
+	utility::zerocopy_socket remote_;
+
+#if defined(MSOCKS_HAS_SPLICE)
+	utility::pipe_pair pipe_local_;
+
+	utility::pipe_pair pipe_remote_;
+#endif
+
+	// the handshake's and then the relay's idle timeout
+	utility::timing_wheel::entry timeout_;
+
+	std::shared_ptr<utility::happy_eyeballs> connector_;
+
+	// the handshake timed out
+	bool expired_ = false;
+
+	// the client's user, nullptr while unknown and for ports without users
+	const server_user* user_ = nullptr;
+
+	// relay directions still running
+	std::size_t relays_ = 0;
+
+	// start of the current handshake step, for the latency histograms
+	utility::metrics::clock::time_point started_;
 
-	void start(yield_context yield);
+	// the target sent something, for tracing the first byte
+	bool replied_ = false;
 
-	void fwd_local_remote(yield_context yield);
+	// payload read along with the address header, in buffer_local_
+	std::size_t early_begin_ = 0;
+	std::size_t early_end_ = 0;
 
-	void fwd_remote_local(yield_context yield);
+	// both directions share the session's bucket, each waits on its own timer
+	utility::rate_limiter limiter_;
 
-	async_result<yield_context, void(error_code, std::pair<std::string, std::string>)>::return_type async_handshake(yield_context yield);
+	utility::throttle throttle_local_;
 
-	void do_async_handshake(async_result<yield_context, void(error_code, std::pair<std::string, std::string>)>::completion_handler_type handler, yield_context yield);
+	utility::throttle throttle_remote_;
 
-    shadowsocks::stream<ip::tcp::socket> local_;
-    
-    ip::tcp::socket remote_;
-    
-	const server_session_attribute& attribute_;
+	std::shared_ptr<const server_session_attribute> attribute_;
 };
 
 }
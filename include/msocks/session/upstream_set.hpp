@@ -0,0 +1,103 @@
+#pragma once
+
+#include <boost/noncopyable.hpp>
+
+#include <msocks/utility/socket_profile.hpp>
+#include <msocks/utility/tcp_socket.hpp>
+
+#include <chrono>
+#include <limits>
+#include <memory>
+#include <random>
+#include <vector>
+
+using namespace boost::asio;
+using namespace boost::system;
+
+namespace msocks
+{
+
+// the servers a client spreads its connections over. Each one keeps a
+// smoothed connect latency and a streak of failures, fed by the client's
+// own connects and, with more than one server and a probe_interval, by a
+// probe connect every probe_interval. pick() draws two usable servers at random and takes the
+// one with the lower latency times connects in flight. A server that
+// failed sits out a backoff doubling with every failure, unless all of
+// them do. Lives on the thread of its io_context.
+class upstream_set : public boost::noncopyable, public std::enable_shared_from_this<upstream_set>
+{
+public:
+	using clock = std::chrono::steady_clock;
+
+	static constexpr std::size_t npos = std::numeric_limits<std::size_t>::max();
+
+	static constexpr std::chrono::seconds probe_timeout{3};
+
+	static constexpr std::chrono::seconds max_backoff{60};
+
+	upstream_set(io_context& ioc, std::vector<ip::tcp::endpoint> servers,
+		utility::socket_profile profile, clock::duration probe_interval);
+
+	void start();
+
+	// ends the probes, for a reloaded config
+	void stop();
+
+	// the server for the next connection, another one than except while
+	// there is a choice
+	std::size_t pick(std::size_t except = npos);
+
+	const ip::tcp::endpoint& endpoint(std::size_t index) const
+	{
+		return servers_[index].endpoint;
+	}
+
+	std::size_t size() const noexcept
+	{
+		return servers_.size();
+	}
+
+	// a connect to index starts, report() has to follow
+	void begin(std::size_t index) noexcept
+	{
+		servers_[index].pending++;
+	}
+
+	// a connect to index took latency and ended with ec; a zero latency
+	// is no sample, as for fast open connects that finish without a SYN,
+	// and clears no failures either
+	void report(std::size_t index, const error_code& ec, clock::duration latency);
+
+private:
+	struct server
+	{
+		ip::tcp::endpoint endpoint;
+		// microseconds, smoothed; 0 until a connect succeeded
+		double latency = 0;
+		std::size_t pending = 0;
+		unsigned failures = 0;
+		// when a failed server is tried again
+		clock::time_point retry;
+	};
+
+	bool usable(const server& s, clock::time_point now) const noexcept
+	{
+		return s.failures == 0 || s.retry <= now;
+	}
+
+	double score(const server& s) const noexcept;
+
+	void tick();
+
+	void probe(std::size_t index);
+
+	io_context& ioc_;
+	std::vector<server> servers_;
+	const utility::socket_profile profile_;
+	const clock::duration probe_interval_;
+	utility::steady_timer timer_;
+	std::minstd_rand random_;
+	bool stopped_ = false;
+};
+
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <boost/noncopyable.hpp>
+
+#include <msocks/session/upstream_set.hpp>
+#include <msocks/utility/socket_profile.hpp>
+#include <msocks/utility/tcp_socket.hpp>
+#include <shadowsocks/stream.h>
+
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <optional>
+
+using namespace boost::asio;
+using namespace boost::system;
+
+namespace msocks
+{
+
+// connections to the server opened ahead of demand, each with its cipher
+// context ready, so a client session skips the connect round trip. Nothing
+// is sent on them until they are taken, and they are closed after ttl, which
+// has to stay below the server's handshake timeout. The pool aims at the
+// number of sessions expected within one ttl, measured from how often
+// take() is called, and never holds more than max_size.
+class warm_pool : public boost::noncopyable, public std::enable_shared_from_this<warm_pool>
+{
+public:
+	using stream_type = shadowsocks::stream<utility::tcp_socket>;
+
+	warm_pool(io_context& ioc, std::shared_ptr<upstream_set> upstreams,
+		std::shared_ptr<const shadowsocks::context_factory> cipher,
+		std::size_t max_size, std::chrono::steady_clock::duration ttl, utility::socket_profile profile = {});
+
+	void start();
+
+	// closes what is ready and opens nothing more, for a reloaded config
+	void stop();
+
+	// a connected stream, if one is ready and still alive
+	std::optional<stream_type> take();
+
+private:
+	struct entry
+	{
+		stream_type stream;
+		std::chrono::steady_clock::time_point connected;
+	};
+
+	// false if the server closed or reset stream meanwhile
+	static bool alive(stream_type& stream);
+
+	void tick();
+
+	void expire();
+
+	void refill();
+
+	io_context& ioc_;
+	// each connection goes to the server picked when it is opened
+	const std::shared_ptr<upstream_set> upstreams_;
+	const std::shared_ptr<const shadowsocks::context_factory> cipher_;
+	const std::size_t max_size_;
+	const std::chrono::steady_clock::duration ttl_;
+	const utility::socket_profile profile_;
+	utility::steady_timer timer_;
+	std::deque<entry> ready_;
+	std::size_t connecting_ = 0;
+	std::size_t target_ = 0;
+	// sessions per second, smoothed over ticks
+	double rate_ = 0;
+	std::size_t taken_ = 0;
+	bool stopped_ = false;
+};
+
+}
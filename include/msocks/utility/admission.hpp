@@ -0,0 +1,108 @@
+#pragma once
+
+#include <boost/noncopyable.hpp>
+
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+namespace msocks::utility
+{
+
+// bounds the handshakes one worker runs at a time. An accepted connection
+// takes a ticket or is turned away; the session gives it back once it
+// relays or ends. Counts without atomics, tickets stay on the thread of the
+// endpoint that handed them out.
+class admission : public boost::noncopyable
+{
+	struct state
+	{
+		std::size_t limit;
+		std::size_t active = 0;
+	};
+
+public:
+	class ticket
+	{
+	public:
+		ticket() noexcept = default;
+
+		ticket(ticket&& other) noexcept :
+			state_(std::move(other.state_))
+		{}
+
+		ticket& operator=(ticket&& other) noexcept
+		{
+			if (this != &other)
+			{
+				reset();
+				state_ = std::move(other.state_);
+			}
+			return *this;
+		}
+
+		~ticket()
+		{
+			reset();
+		}
+
+		// the handshake is over, another connection may start one
+		void reset() noexcept
+		{
+			if (state_)
+			{
+				--state_->active;
+				state_.reset();
+			}
+		}
+
+	private:
+		friend class admission;
+
+		explicit ticket(std::shared_ptr<state> s) noexcept :
+			state_(std::move(s))
+		{
+			++state_->active;
+		}
+
+		// outlives the endpoint if a session does
+		std::shared_ptr<state> state_;
+	};
+
+	// 0 admits everyone and counts nothing
+	explicit admission(std::size_t limit = 0) :
+		state_(std::make_shared<state>(state{limit}))
+	{}
+
+	// tickets already out count against the new limit
+	void limit(std::size_t limit) noexcept
+	{
+		state_->limit = limit;
+	}
+
+	// false if limit handshakes are running already
+	bool try_admit(ticket& t)
+	{
+		if (state_->limit == 0)
+		{
+			t = ticket{};
+			return true;
+		}
+		if (state_->active >= state_->limit)
+		{
+			return false;
+		}
+		t = ticket(state_);
+		return true;
+	}
+
+	std::size_t active() const noexcept
+	{
+		return state_->active;
+	}
+
+private:
+	std::shared_ptr<state> state_;
+};
+
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <boost/asio/execution_context.hpp>
+
+#include <array>
+#include <cstdint>
+
+using namespace boost::asio;
+
+namespace msocks::utility
+{
+
+// per io_context cache of relay buffers in power of two size classes.
+// Sessions only hold a buffer while a read is ready, so a few blocks here
+// serve many mostly idle connections. Not thread safe, every worker thread
+// runs its own io_context and therefore gets its own slab.
+class buffer_slab : public execution_context::service
+{
+public:
+	static execution_context::id id;
+
+	static constexpr std::size_t smallest_class = 1024;
+	static constexpr std::size_t class_count = 11;
+	// upper bound of idle bytes kept per size class
+	static constexpr std::size_t cached_bytes = 8 * 1024 * 1024;
+
+	explicit buffer_slab(execution_context& ctx);
+
+	~buffer_slab() override;
+
+	// returns a block of at least size bytes, size becomes the block size
+	uint8_t* acquire(std::size_t& size);
+
+	void release(uint8_t* block, std::size_t size) noexcept;
+
+	std::size_t cached() const noexcept;
+
+private:
+	struct free_block
+	{
+		free_block* next;
+	};
+
+	void shutdown() override;
+
+	void clear() noexcept;
+
+	std::array<free_block*, class_count> free_{};
+	std::array<std::size_t, class_count> count_{};
+	bool shutdown_ = false;
+};
+
+}
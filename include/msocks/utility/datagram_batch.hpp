@@ -0,0 +1,85 @@
+#pragma once
+
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/ip/udp.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <msocks/utility/tcp_socket.hpp>
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/socket.h>
+#define MSOCKS_HAS_MMSG 1
+#endif
+
+using namespace boost::asio;
+using namespace boost::system;
+
+namespace msocks::utility
+{
+
+// datagrams in and out of udp sockets a batch per system call, with
+// recvmmsg and sendmmsg on Linux and a call per datagram elsewhere.
+// Received datagrams keep headroom in front and tailroom behind, so a
+// relay adds headers and tags where they landed and queues them for
+// sending without a copy. Queued datagrams go out with flush(), at the
+// latest before the next receive() overwrites them. One batch per worker.
+class datagram_batch : public boost::noncopyable
+{
+public:
+	static constexpr std::size_t capacity = 32;
+	// room for an iv or salt, in front of an address header
+	static constexpr std::size_t headroom = 64;
+	// anything longer, jumbo frames included, is dropped
+	static constexpr std::size_t max_datagram = 9216;
+	// room for an AEAD tag
+	static constexpr std::size_t tailroom = 32;
+
+	struct datagram
+	{
+		uint8_t* data;
+		std::size_t size;
+		ip::udp::endpoint peer;
+	};
+
+	datagram_batch();
+
+	// sends what is still queued, then reads up to capacity datagrams that
+	// are already there; would_block when there were none
+	std::size_t receive(udp_socket& socket, error_code& ec);
+
+	datagram& operator[](std::size_t i) noexcept
+	{
+		return received_[i];
+	}
+
+	// queues data for to, the bytes must stay put until flush()
+	void send(udp_socket& socket, const_buffer data, const ip::udp::endpoint& to);
+
+	// sends whatever is queued, what the socket has no room for is dropped
+	void flush() noexcept;
+
+private:
+	static constexpr std::size_t slot_size = headroom + max_datagram + tailroom;
+
+	std::vector<uint8_t> storage_;
+	std::array<datagram, capacity> received_;
+	udp_socket* queued_socket_ = nullptr;
+	std::size_t queued_ = 0;
+#if defined(MSOCKS_HAS_MMSG)
+	std::array<mmsghdr, capacity> rx_{};
+	std::array<iovec, capacity> rx_iov_{};
+	std::array<sockaddr_storage, capacity> rx_addr_{};
+	std::array<mmsghdr, capacity> tx_{};
+	std::array<iovec, capacity> tx_iov_{};
+	std::array<sockaddr_storage, capacity> tx_addr_{};
+#else
+	std::array<const_buffer, capacity> tx_data_;
+	std::array<ip::udp::endpoint, capacity> tx_to_;
+#endif
+};
+
+}
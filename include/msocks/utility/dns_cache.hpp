@@ -0,0 +1,71 @@
+#pragma once
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+
+#include <msocks/utility/socks_address.hpp>
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace boost::asio;
+using namespace boost::system;
+
+namespace msocks::utility
+{
+
+// per io_context cache of name lookups. Concurrent lookups of one name share
+// a single resolve, answers are kept for ttl and failures for negative_ttl,
+// so a burst of connections to the same host costs one trip through asio's
+// resolver thread. getaddrinfo does not report record TTLs, the cache uses
+// fixed ones. Address literals never reach the resolver. Not thread safe, every
+// worker thread runs its own io_context and gets its own cache.
+class dns_cache : public io_context::service
+{
+public:
+	static io_context::id id;
+
+	using results_type = std::shared_ptr<const std::vector<ip::tcp::endpoint>>;
+	using handler_type = std::function<void(error_code, results_type)>;
+
+	static constexpr std::chrono::seconds default_ttl{60};
+	static constexpr std::chrono::seconds default_negative_ttl{5};
+	static constexpr std::size_t max_entries = 4096;
+
+	explicit dns_cache(io_context& ioc);
+
+	void configure(std::chrono::steady_clock::duration ttl, std::chrono::steady_clock::duration negative_ttl) noexcept;
+
+	// endpoints of target, address families interleaved for happy_eyeballs;
+	// the domain is copied, handler never runs before this returns
+	void async_resolve(const socks_address& target, handler_type handler);
+
+private:
+	struct entry
+	{
+		error_code ec;
+		results_type results;
+		std::chrono::steady_clock::time_point expires;
+		// set while the lookup is in flight
+		std::vector<handler_type> waiters;
+		bool pending = false;
+	};
+
+	void shutdown() override;
+
+	void complete(const std::string& key, error_code ec, results_type results);
+
+	void evict();
+
+	io_context& ioc_;
+	ip::tcp::resolver resolver_;
+	std::chrono::steady_clock::duration ttl_ = default_ttl;
+	std::chrono::steady_clock::duration negative_ttl_ = default_negative_ttl;
+	std::unordered_map<std::string, entry> entries_;
+};
+
+}
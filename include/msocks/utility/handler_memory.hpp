@@ -0,0 +1,129 @@
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <boost/asio/detail/handler_cont_helpers.hpp>
+
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace msocks::utility
+{
+
+// storage for the one operation a relay direction has in flight at a time.
+// asio frees an operation before invoking its handler, so the next hop of
+// the same direction always finds the block free again; anything that does
+// not fit, or overlaps, falls back to the heap.
+class handler_memory : public boost::noncopyable
+{
+public:
+	static constexpr std::size_t block_size = 1024;
+
+	void* allocate(std::size_t size)
+	{
+		if (!in_use_ && size <= sizeof(storage_))
+		{
+			in_use_ = true;
+			return &storage_;
+		}
+		return ::operator new(size);
+	}
+
+	void deallocate(void* pointer) noexcept
+	{
+		if (pointer == &storage_)
+		{
+			in_use_ = false;
+			return;
+		}
+		::operator delete(pointer);
+	}
+
+private:
+	std::aligned_storage_t<block_size> storage_;
+	bool in_use_ = false;
+};
+
+template <typename T>
+class handler_allocator
+{
+public:
+	using value_type = T;
+
+	explicit handler_allocator(handler_memory& memory) noexcept :
+		memory_(memory)
+	{}
+
+	template <typename U>
+	handler_allocator(const handler_allocator<U>& other) noexcept :
+		memory_(other.memory_)
+	{}
+
+	T* allocate(std::size_t n) const
+	{
+		return static_cast<T *>(memory_.allocate(sizeof(T) * n));
+	}
+
+	void deallocate(T* pointer, std::size_t) const noexcept
+	{
+		memory_.deallocate(pointer);
+	}
+
+	bool operator==(const handler_allocator& other) const noexcept
+	{
+		return &memory_ == &other.memory_;
+	}
+
+	bool operator!=(const handler_allocator& other) const noexcept
+	{
+		return &memory_ != &other.memory_;
+	}
+
+private:
+	template <typename>
+	friend class handler_allocator;
+
+	handler_memory& memory_;
+};
+
+// a completion handler whose operations are allocated from handler_memory
+template <typename Handler>
+class custom_alloc_handler
+{
+public:
+	using allocator_type = handler_allocator<Handler>;
+
+	custom_alloc_handler(handler_memory& memory, Handler handler) :
+		memory_(memory),
+		handler_(std::move(handler))
+	{}
+
+	allocator_type get_allocator() const noexcept
+	{
+		return allocator_type(memory_);
+	}
+
+	template <typename ... Args>
+	void operator()(Args&& ... args)
+	{
+		handler_(std::forward<Args>(args)...);
+	}
+
+	// a wrapped composed operation keeps its hops on the fast path
+	friend bool asio_handler_is_continuation(custom_alloc_handler* this_handler)
+	{
+		return boost_asio_handler_cont_helpers::is_continuation(this_handler->handler_);
+	}
+
+private:
+	handler_memory& memory_;
+	Handler handler_;
+};
+
+template <typename Handler>
+custom_alloc_handler<std::decay_t<Handler>> make_custom_alloc_handler(handler_memory& memory, Handler&& handler)
+{
+	return custom_alloc_handler<std::decay_t<Handler>>(memory, std::forward<Handler>(handler));
+}
+
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <boost/noncopyable.hpp>
+
+#include <msocks/utility/dns_cache.hpp>
+#include <msocks/utility/socket_profile.hpp>
+#include <msocks/utility/tcp_socket.hpp>
+
+#include <deque>
+
+namespace msocks::utility
+{
+
+// connects to whichever of the endpoints answers first (RFC 8305). The
+// attempts start attempt_delay apart, or right away once every earlier one
+// failed, so an unreachable address family costs a short delay instead of
+// a whole connect timeout; the losers are closed. With fast_open a lone
+// endpoint is connected with TCP_FASTOPEN_CONNECT, the SYN then waits for
+// the first write and carries it; there is nothing to race in that case.
+// Every attempt's socket gets profile, which has to outlive the connect.
+class happy_eyeballs : public boost::noncopyable, public std::enable_shared_from_this<happy_eyeballs>
+{
+public:
+	using handler_type = std::function<void(error_code, utility::tcp_socket)>;
+
+	static constexpr std::chrono::milliseconds attempt_delay{250};
+
+	happy_eyeballs(io_context& ioc, dns_cache::results_type endpoints, handler_type handler, bool fast_open = false,
+		const socket_profile* profile = nullptr);
+
+	void start();
+
+	// gives up, handler sees operation_aborted unless it ran already
+	void cancel();
+
+private:
+	void attempt();
+
+	void handle_connect(std::size_t index, error_code ec);
+
+	void complete(error_code ec, utility::tcp_socket socket);
+
+	io_context& ioc_;
+	dns_cache::results_type endpoints_;
+	handler_type handler_;
+	steady_timer timer_;
+	std::deque<utility::tcp_socket> sockets_;
+	const bool fast_open_;
+	const socket_profile* const profile_;
+	std::size_t failed_ = 0;
+	bool done_ = false;
+};
+
+}
@@ -1,33 +1,41 @@
 #pragma once
 
 #include <boost/asio/ip/tcp.hpp>
+#if defined(MSOCKS_STACKFUL_RELAY)
 #include <boost/asio/spawn.hpp>
+#endif
+#include <functional>
+
+#include <msocks/utility/tcp_socket.hpp>
 
 using namespace boost::asio;
 using namespace boost::system;
 
-#if defined(_MSC_VER)
-#define MSOCKS_PACK(MSOCKS_STRUCT_DECLARE) __pragma(pack(push, 1)) MSOCKS_STRUCT_DECLARE __pragma( pack(pop) )
-#else
-#define MSOCKS_PACK(MSOCKS_STRUCT_DECLARE) MSOCKS_STRUCT_DECLARE __attribute__((packed))
-#endif
-
 namespace msocks::utility
 {
 
+// the command, the target in shadowsocks wire format and whatever the
+// application sent after its request, both pointing into scratch
+using local_socks5_handler = std::function<void(error_code, uint8_t, const_buffer, const_buffer)>;
+
 namespace detail
 {
+#if defined(MSOCKS_STACKFUL_RELAY)
 void do_local_socks5(
-	io_context& ioc,
-	ip::tcp::socket& local,
-	async_result<yield_context, void(error_code, std::vector<uint8_t>)>::completion_handler_type handler,
+	utility::tcp_socket& local,
+	mutable_buffer scratch,
+	const_buffer udp_reply,
+	local_socks5_handler handler,
 	yield_context yield);
+#endif
 }
 
-async_result<yield_context, void(error_code,std::vector<uint8_t>)>::return_type
-async_local_socks5(io_context& ioc, ip::tcp::socket& local, yield_context yield);
-
-
+// negotiates a socks5 CONNECT with the local client, reading as much as
+// arrives into scratch and parsing it there. scratch (at least 262 bytes,
+// the longest request) must stay alive until the handler runs. With a
+// udp_reply, the complete reply naming the udp relay, UDP ASSOCIATE is
+// accepted too; udp_reply must outlive the negotiation
+void async_local_socks5(utility::tcp_socket& local, mutable_buffer scratch, local_socks5_handler handler, const_buffer udp_reply = {});
 
 }
 
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <spdlog/spdlog.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace msocks::utility::log
+{
+
+// the process logs through spdlog's async logger: a call formats into a
+// queue slot and returns, one background thread writes, and a full queue
+// drops its oldest message instead of blocking the event loop
+struct log_config
+{
+	// spdlog level name: trace, debug, info, warn, error, critical or off
+	std::string level = "info";
+	// messages each MSOCKS_LOG site passes per second, 0 for no limit
+	std::size_t site_rate = 10;
+	// messages queued for the writer
+	std::size_t queue = 8192;
+};
+
+// throws std::invalid_argument for a name spdlog does not know
+spdlog::level::level_enum parse_level(const std::string& name);
+
+// replaces the default logger, call once before the workers start
+void setup(const log_config& cfg);
+
+// level and site rate of a reloaded config
+void configure(const log_config& cfg);
+
+// flushes what is queued and stops the writer
+void shutdown();
+
+inline std::atomic<std::size_t> site_rate{10};
+
+// one call site of MSOCKS_LOG, shared by all threads. It passes up to
+// site_rate messages per second and counts the rest, which the first
+// message of a later second reports.
+class site
+{
+public:
+	// whether to log now, suppressed holds what was dropped before
+	bool admit(std::size_t& suppressed) noexcept
+	{
+		const auto rate = site_rate.load(std::memory_order_relaxed);
+		suppressed = 0;
+		if (rate == 0)
+		{
+			return true;
+		}
+		const auto now = uint32_t(std::chrono::duration_cast<std::chrono::seconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count());
+		// the second and what passed in it change together, so no message
+		// counted in the new second is wiped by the one starting it
+		auto state = state_.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			if (uint32_t(state >> 32) != now)
+			{
+				if (state_.compare_exchange_weak(state, uint64_t(now) << 32 | 1, std::memory_order_relaxed))
+				{
+					suppressed = dropped_.exchange(0, std::memory_order_relaxed);
+					return true;
+				}
+				continue;
+			}
+			if ((state & 0xffffffff) >= rate)
+			{
+				break;
+			}
+			if (state_.compare_exchange_weak(state, state + 1, std::memory_order_relaxed))
+			{
+				return true;
+			}
+		}
+		dropped_.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+private:
+	// second in the upper half, messages passed in it in the lower
+	std::atomic<uint64_t> state_{0};
+	std::atomic<std::size_t> dropped_{0};
+};
+
+}
+
+// logs at spdlog level lvl unless the level is off or this site already
+// logged its share of the current second; arguments are not evaluated then
+#define MSOCKS_LOG(lvl, ...) \
+	do \
+	{ \
+		static ::msocks::utility::log::site msocks_log_site_; \
+		std::size_t msocks_log_suppressed_; \
+		if (::spdlog::default_logger_raw()->should_log(lvl) && msocks_log_site_.admit(msocks_log_suppressed_)) \
+		{ \
+			if (msocks_log_suppressed_ != 0) \
+			{ \
+				::spdlog::log(lvl, "{} similar messages suppressed", msocks_log_suppressed_); \
+			} \
+			::spdlog::log(lvl, __VA_ARGS__); \
+		} \
+	} \
+	while (false)
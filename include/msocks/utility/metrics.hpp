@@ -0,0 +1,142 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace msocks::utility::metrics
+{
+
+// process wide instrumentation. Every thread counts into a shard of its
+// own, padded to whole cache lines and written only by that thread, so
+// counting is a plain load and store; a scrape sums the shards of all
+// threads. Shards live as long as the process, the worker threads do too.
+
+enum class counter : std::size_t
+{
+	// plaintext read from clients and from targets
+	bytes_received,
+	bytes_sent,
+	sessions_active,
+	pool_hits,
+	pool_misses,
+	limiter_wait_ns,
+	cipher_ns,
+	cipher_bytes,
+	// datagrams through the udp relays
+	udp_received,
+	udp_sent,
+	udp_dropped,
+	// connections turned away by admission control
+	handshakes_rejected,
+	count
+};
+
+enum class histogram : std::size_t
+{
+	handshake,
+	resolve,
+	connect,
+	count
+};
+
+using clock = std::chrono::steady_clock;
+
+// upper bounds of the latency buckets in microseconds, +Inf follows
+constexpr std::array<int64_t, 15> bucket_bounds{
+	100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+	100000, 250000, 500000, 1000000, 2500000, 5000000};
+
+struct alignas(64) shard
+{
+	std::array<std::atomic<int64_t>, std::size_t(counter::count)> counters{};
+	std::array<std::array<std::atomic<int64_t>, bucket_bounds.size() + 1>, std::size_t(histogram::count)> buckets{};
+	std::array<std::atomic<int64_t>, std::size_t(histogram::count)> sum_ns{};
+};
+
+// the calling thread's shard, registered on first use
+shard& register_shard();
+
+inline thread_local shard* local_shard = nullptr;
+
+inline shard& local()
+{
+	if (local_shard == nullptr)
+	{
+		local_shard = &register_shard();
+	}
+	return *local_shard;
+}
+
+inline void bump(std::atomic<int64_t>& value, int64_t n) noexcept
+{
+	// no other thread writes this shard
+	value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+inline void add(counter c, int64_t n = 1)
+{
+	bump(local().counters[std::size_t(c)], n);
+}
+
+inline void observe(histogram h, clock::duration d)
+{
+	auto us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+	std::size_t bucket = 0;
+	while (bucket != bucket_bounds.size() && us > bucket_bounds[bucket])
+	{
+		++bucket;
+	}
+	auto& s = local();
+	bump(s.buckets[std::size_t(h)][bucket], 1);
+	bump(s.sum_ns[std::size_t(h)], std::chrono::duration_cast<std::chrono::nanoseconds>(d).count());
+}
+
+// charges the time until it goes out of scope and bytes to the cipher
+class cipher_timer
+{
+public:
+	explicit cipher_timer(std::size_t bytes) :
+		bytes_(bytes),
+		start_(clock::now())
+	{}
+
+	cipher_timer(const cipher_timer&) = delete;
+	cipher_timer& operator=(const cipher_timer&) = delete;
+
+	~cipher_timer()
+	{
+		auto& s = local();
+		bump(s.counters[std::size_t(counter::cipher_ns)],
+			std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start_).count());
+		bump(s.counters[std::size_t(counter::cipher_bytes)], int64_t(bytes_));
+	}
+
+private:
+	std::size_t bytes_;
+	clock::time_point start_;
+};
+
+// traffic of one user of a server with several. Unlike the shards these
+// are charged by every worker the user's sessions run on.
+struct alignas(64) user_counters
+{
+	std::atomic<int64_t> bytes_received{0};
+	std::atomic<int64_t> bytes_sent{0};
+	std::atomic<int64_t> sessions{0};
+};
+
+// the counters of name, the same ones on every call, so they survive reloads
+user_counters& user(const std::string& name);
+
+inline void add(std::atomic<int64_t>& value, int64_t n) noexcept
+{
+	value.fetch_add(n, std::memory_order_relaxed);
+}
+
+// all shards summed up in the Prometheus text format, users labeled
+std::string scrape();
+
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <boost/asio/ip/udp.hpp>
+
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+using namespace boost::asio;
+
+namespace msocks::utility
+{
+
+inline uint64_t hash_endpoint(const ip::udp::endpoint& ep) noexcept
+{
+	uint64_t h = ep.port();
+	auto address = ep.address();
+	if (address.is_v4())
+	{
+		h ^= uint64_t(address.to_v4().to_uint()) << 16;
+	}
+	else
+	{
+		auto bytes = address.to_v6().to_bytes();
+		uint64_t high, low;
+		std::memcpy(&high, bytes.data(), sizeof(high));
+		std::memcpy(&low, bytes.data() + sizeof(high), sizeof(low));
+		h ^= high * 0x9e3779b97f4a7c15ull ^ low;
+	}
+	// splitmix64's finalizer spreads ports and addresses over all bits
+	h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+	h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+	return h ^ (h >> 31);
+}
+
+// peers of a udp relay and what belongs to them, in open addressing with
+// linear probing. The hashes sit in an array of their own, so a lookup
+// walks a few adjacent words and touches the entries only on a match;
+// erasing shifts the following entries back instead of leaving
+// tombstones. Grows at half load. Not thread safe.
+template <typename Value>
+class nat_table
+{
+public:
+	explicit nat_table(std::size_t capacity = 64) :
+		hashes_(capacity),
+		entries_(capacity)
+	{}
+
+	std::size_t size() const noexcept
+	{
+		return size_;
+	}
+
+	Value* find(const ip::udp::endpoint& key) noexcept
+	{
+		uint64_t h = hash(key);
+		for (std::size_t i = h & mask(); hashes_[i] != 0; i = (i + 1) & mask())
+		{
+			if (hashes_[i] == h && entries_[i].first == key)
+			{
+				return &entries_[i].second;
+			}
+		}
+		return nullptr;
+	}
+
+	// key must not be in the table yet
+	Value& insert(const ip::udp::endpoint& key, Value value)
+	{
+		if (2 * (size_ + 1) > hashes_.size())
+		{
+			grow();
+		}
+		++size_;
+		return place(hash(key), key, std::move(value));
+	}
+
+	bool erase(const ip::udp::endpoint& key) noexcept
+	{
+		uint64_t h = hash(key);
+		std::size_t i = h & mask();
+		for (; hashes_[i] != 0; i = (i + 1) & mask())
+		{
+			if (hashes_[i] == h && entries_[i].first == key)
+			{
+				break;
+			}
+		}
+		if (hashes_[i] == 0)
+		{
+			return false;
+		}
+		--size_;
+		// entries after the hole that would not be found past it move up
+		for (std::size_t j = (i + 1) & mask(); hashes_[j] != 0; j = (j + 1) & mask())
+		{
+			std::size_t home = hashes_[j] & mask();
+			if (((j - home) & mask()) >= ((j - i) & mask()))
+			{
+				hashes_[i] = hashes_[j];
+				entries_[i] = std::move(entries_[j]);
+				i = j;
+			}
+		}
+		hashes_[i] = 0;
+		entries_[i] = {};
+		return true;
+	}
+
+private:
+	using entry = std::pair<ip::udp::endpoint, Value>;
+
+	std::size_t mask() const noexcept
+	{
+		return hashes_.size() - 1;
+	}
+
+	// 0 marks a free slot
+	static uint64_t hash(const ip::udp::endpoint& key) noexcept
+	{
+		uint64_t h = hash_endpoint(key);
+		return h == 0 ? 1 : h;
+	}
+
+	Value& place(uint64_t h, const ip::udp::endpoint& key, Value value)
+	{
+		std::size_t i = h & mask();
+		while (hashes_[i] != 0)
+		{
+			i = (i + 1) & mask();
+		}
+		hashes_[i] = h;
+		entries_[i] = entry(key, std::move(value));
+		return entries_[i].second;
+	}
+
+	void grow()
+	{
+		std::vector<uint64_t> hashes(hashes_.size() * 2);
+		std::vector<entry> entries(entries_.size() * 2);
+		hashes.swap(hashes_);
+		entries.swap(entries_);
+		for (std::size_t i = 0; i != hashes.size(); ++i)
+		{
+			if (hashes[i] != 0)
+			{
+				place(hashes[i], entries[i].first, std::move(entries[i].second));
+			}
+		}
+	}
+
+	std::vector<uint64_t> hashes_;
+	std::vector<entry> entries_;
+	std::size_t size_ = 0;
+};
+
+}
@@ -1,41 +1,166 @@
 #pragma once
 
-#include <boost/asio/deadline_timer.hpp>
-#include <boost/asio/spawn.hpp>
-#include <queue>
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/associated_allocator.hpp>
+#include <boost/asio/associated_executor.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <msocks/utility/metrics.hpp>
+#include <msocks/utility/tcp_socket.hpp>
+#include <msocks/utility/trace.hpp>
+
+#include <atomic>
+#include <chrono>
 #include <memory>
+
 using namespace boost::asio;
 using namespace boost::system;
 
 namespace msocks::utility
 {
 
-class rate_limiter : public noncopyable, public std::enable_shared_from_this<rate_limiter>
+// one class of a hierarchy of token buckets, typically global, then one per
+// user, then one per session. A bucket never queues: acquire() takes the
+// bytes right away, running into debt if need be, and reports how long the
+// caller has to wait until the debt of this class and all its parents is paid
+// off. Requests are served in the order they took their bytes, so a big one
+// only delays those behind it instead of starving itself. The state is a
+// single atomic, classes may be shared between worker threads.
+class rate_limiter : public boost::noncopyable
+{
+public:
+	using clock = std::chrono::steady_clock;
+
+	// rate in bytes per second, 0 does not limit this class; up to burst
+	// bytes pass without delay after the class sat idle
+	rate_limiter(std::size_t rate, std::size_t burst, std::shared_ptr<rate_limiter> parent = nullptr) noexcept;
+
+	// charges n bytes to this class and its parents
+	clock::duration acquire(std::size_t n) noexcept;
+
+	// forgets the debt, for a session starting over
+	void reset() noexcept;
+
+	// starts over with other limits, only while nobody charges the class
+	void reset(std::size_t rate, std::size_t burst, std::shared_ptr<rate_limiter> parent) noexcept;
+
+	std::size_t rate() const noexcept
+	{
+		return rate_;
+	}
+
+private:
+	clock::duration charge(std::size_t n) noexcept;
+
+	std::size_t rate_;
+	std::int64_t burst_ns_;
+	std::shared_ptr<rate_limiter> parent_;
+	// theoretical arrival time: when everything charged so far has passed
+	std::atomic<std::int64_t> tat_{0};
+};
+
+namespace detail
+{
+
+// completes a throttle wait, the relay's hook handler takes no arguments
+template <typename Handler>
+class throttle_handler
 {
+public:
+	explicit throttle_handler(Handler& handler) :
+		handler_(std::move(handler))
+	{}
+
+	void operator()(error_code)
+	{
+		handler_();
+	}
+
+	const Handler& handler() const noexcept
+	{
+		return handler_;
+	}
+
 private:
-	using storage_pair = std::pair<std::size_t, async_result<yield_context, void()>::completion_handler_type>;
-	using unique_pair = std::unique_ptr<storage_pair>;
+	Handler handler_;
+};
+
+}
+
+// before_read hook of one relay direction, waits out the delays of its
+// rate_limiter on a timer of its own
+class throttle : public boost::noncopyable
+{
 public:
-	rate_limiter(io_context& ioc, const std::size_t limit) :
-		ioc_(ioc), timer_(ioc), signal_(ioc), limit_(limit), no_limit_(limit == 0),
-		wait_queue_([](const unique_pair& l, const unique_pair& r) { return l->first >= r->first; })
+	throttle(io_context& ioc, rate_limiter& limiter) :
+		timer_(ioc),
+		limiter_(limiter)
 	{}
 
-	async_result<yield_context, void()>::return_type async_get(std::size_t n, yield_context yield);
+	// waits are traced as spans of session id, 0 for none
+	void trace(uint64_t id) noexcept
+	{
+		trace_ = id;
+	}
 
-	void start();
+	template <typename CompletionToken>
+	BOOST_ASIO_INITFN_RESULT_TYPE(CompletionToken, void())
+	async_get(std::size_t n, CompletionToken&& token)
+	{
+		async_completion<CompletionToken, void()> init(token);
+		using handler_type = typename async_completion<CompletionToken, void()>::completion_handler_type;
+		auto delay = limiter_.acquire(n);
+		if (delay == rate_limiter::clock::duration::zero())
+		{
+			// posting the handler itself keeps its allocator
+			post(timer_.get_executor(), std::move(init.completion_handler));
+		}
+		else
+		{
+			metrics::add(metrics::counter::limiter_wait_ns, std::chrono::duration_cast<std::chrono::nanoseconds>(delay).count());
+			if (trace_ != 0)
+			{
+				auto now = trace::clock::now();
+				trace::span(trace_, trace::phase::limiter_wait, now, now + delay);
+			}
+			timer_.expires_after(delay);
+			timer_.async_wait(detail::throttle_handler<handler_type>(init.completion_handler));
+		}
+		return init.result.get();
+	}
 
 private:
-	io_context& ioc_;
-	deadline_timer timer_;
-	deadline_timer signal_;
-	const std::size_t limit_;
-	bool no_limit_;
-	std::size_t available_ = 0;
-	std::priority_queue<
-		unique_pair,
-		std::vector<unique_pair>,
-		std::function<bool(const unique_pair& l, const unique_pair& r)>
-	> wait_queue_;
+	steady_timer timer_;
+	rate_limiter& limiter_;
+	uint64_t trace_ = 0;
+};
+
+}
+
+namespace boost::asio
+{
+
+template <typename Handler, typename Allocator>
+struct associated_allocator<msocks::utility::detail::throttle_handler<Handler>, Allocator>
+{
+	using type = typename associated_allocator<Handler, Allocator>::type;
+
+	static type get(const msocks::utility::detail::throttle_handler<Handler>& h, const Allocator& a = Allocator()) noexcept
+	{
+		return associated_allocator<Handler, Allocator>::get(h.handler(), a);
+	}
 };
+
+template <typename Handler, typename Executor>
+struct associated_executor<msocks::utility::detail::throttle_handler<Handler>, Executor>
+{
+	using type = typename associated_executor<Handler, Executor>::type;
+
+	static type get(const msocks::utility::detail::throttle_handler<Handler>& h, const Executor& ex = Executor()) noexcept
+	{
+		return associated_executor<Handler, Executor>::get(h.handler(), ex);
+	}
+};
+
 }
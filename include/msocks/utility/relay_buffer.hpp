@@ -0,0 +1,76 @@
+#pragma once
+
+#include <boost/asio/buffer.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <msocks/utility/buffer_slab.hpp>
+
+#include <chrono>
+
+using namespace boost::asio;
+
+namespace msocks::utility
+{
+
+// one direction's relay buffer. It starts at min_size and grows by
+// growth_factor after consecutive reads fill it, so bulk transfers amortize
+// syscalls and cipher calls, and drops back to min_size once the direction
+// sat idle for longer than idle_after, so quiet sessions stay cheap.
+// Memory is borrowed from the io_context's buffer_slab only while a read is
+// ready and handed back through release() once its bytes are written.
+class relay_buffer : public boost::noncopyable
+{
+public:
+	static constexpr std::size_t default_min_size = 4 * 1024;
+	static constexpr std::size_t default_max_size = 256 * 1024;
+	// the socks5 and shadowsocks handshakes use the buffer as scratch space
+	static constexpr std::size_t lowest_min_size = 1024;
+	static constexpr std::size_t growth_factor = 4;
+	static constexpr unsigned grow_after = 2;
+	static constexpr std::chrono::milliseconds idle_after{1000};
+
+	explicit relay_buffer(buffer_slab& slab) :
+		slab_(slab)
+	{}
+
+	~relay_buffer()
+	{
+		release();
+	}
+
+	void configure(std::size_t min_size, std::size_t max_size) noexcept;
+
+	// the whole buffer, ready for the next read
+	mutable_buffer prepare();
+
+	// records a read of n bytes, which stay valid until the next prepare()
+	void commit(std::size_t n) noexcept;
+
+	// gives the memory back to the slab while the direction waits for data
+	void release() noexcept;
+
+	uint8_t* data() noexcept
+	{
+		return data_;
+	}
+
+	std::size_t capacity() const noexcept
+	{
+		return size_;
+	}
+
+	// back to min_size for a recycled session
+	void reset() noexcept;
+
+private:
+	buffer_slab& slab_;
+	uint8_t* data_ = nullptr;
+	std::size_t size_ = 0;
+	std::size_t wanted_ = default_min_size;
+	std::size_t min_size_ = default_min_size;
+	std::size_t max_size_ = default_max_size;
+	unsigned full_reads_ = 0;
+	std::chrono::steady_clock::time_point released_;
+};
+
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+namespace msocks::utility
+{
+
+// ids of sessions without locks or random state: a tag of the thread in
+// the upper bits, the thread's own count below. They stay below 2^53 so
+// trace viewers read them exactly, and are formatted only when logged.
+constexpr unsigned session_id_count_bits = 40;
+
+inline std::atomic<uint64_t> session_id_tags{0};
+
+inline uint64_t next_session_id() noexcept
+{
+	static thread_local const uint64_t tag = session_id_tags.fetch_add(1, std::memory_order_relaxed) + 1;
+	static thread_local uint64_t count = 0;
+	return (tag << session_id_count_bits) | (++count & ((uint64_t(1) << session_id_count_bits) - 1));
+}
+
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <boost/asio/socket_base.hpp>
+#include <boost/asio/detail/socket_option.hpp>
+
+#if defined(__linux__)
+#include <netinet/tcp.h>
+#endif
+
+namespace msocks::utility
+{
+
+#if defined(SO_REUSEPORT)
+// lets every worker bind its own acceptor to the same endpoint,
+// the kernel then spreads incoming connections between them
+using reuse_port = boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+#endif
+
+#if defined(TCP_FASTOPEN)
+// queue length of pending fast open connections on a listener, whose
+// first segment then carries data along with the SYN
+using fast_open = boost::asio::detail::socket_option::integer<IPPROTO_TCP, TCP_FASTOPEN>;
+#endif
+
+#if defined(TCP_FASTOPEN_CONNECT)
+// lets connect() defer the SYN to the first write so it can carry data
+using fast_open_connect = boost::asio::detail::socket_option::boolean<IPPROTO_TCP, TCP_FASTOPEN_CONNECT>;
+#endif
+
+// the pending error of a socket, left by a connect that failed
+using socket_error = boost::asio::detail::socket_option::integer<SOL_SOCKET, SO_ERROR>;
+
+#if defined(TCP_QUICKACK)
+// acks right away instead of delaying them, until the kernel falls back
+using quick_ack = boost::asio::detail::socket_option::boolean<IPPROTO_TCP, TCP_QUICKACK>;
+#endif
+
+#if defined(TCP_NOTSENT_LOWAT)
+// a socket counts as writable while less than this much is left unsent
+using notsent_lowat = boost::asio::detail::socket_option::integer<IPPROTO_TCP, TCP_NOTSENT_LOWAT>;
+#endif
+
+#if defined(TCP_KEEPIDLE)
+// keepalive probes start after this many idle seconds, one every
+// keep_interval seconds, the connection dies after keep_count unanswered
+using keep_idle = boost::asio::detail::socket_option::integer<IPPROTO_TCP, TCP_KEEPIDLE>;
+using keep_interval = boost::asio::detail::socket_option::integer<IPPROTO_TCP, TCP_KEEPINTVL>;
+using keep_count = boost::asio::detail::socket_option::integer<IPPROTO_TCP, TCP_KEEPCNT>;
+#endif
+
+#if defined(IP_BIND_ADDRESS_NO_PORT)
+// bind() to a source address leaves the port to connect(), which can then
+// reuse it toward other destinations
+using bind_address_no_port = boost::asio::detail::socket_option::boolean<IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT>;
+#endif
+
+}
@@ -2,61 +2,240 @@
 
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/buffer.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/asio/post.hpp>
+#if defined(MSOCKS_STACKFUL_RELAY)
 #include <boost/asio/spawn.hpp>
-#include <boost/asio/streambuf.hpp>
+#endif
 #include <shadowsocks/stream.h>
+#include <msocks/utility/relay_buffer.hpp>
+#include <msocks/utility/transfer_all_at_once.hpp>
 
 using namespace boost::asio;
 using namespace boost::system;
 
 namespace msocks::utility
 {
-template <typename SourceStream, typename SinkStream, typename CompletionToken>
-async_result<yield_context, void(error_code)>::return_type
+
+// before_read hook for directions that are never throttled,
+// the relay skips the hook entirely instead of bouncing through it
+struct no_limit
+{
+};
+
+// whether a read of stream waits for its bytes in the kernel at no extra
+// cost, a relay then reads without waiting for readiness first and keeps
+// its buffer while idle; sources overload it
+template <typename Stream>
+bool read_waits(Stream&) noexcept
+{
+	return false;
+}
+
+template <typename Stream>
+bool read_waits(shadowsocks::stream<Stream>& stream) noexcept
+{
+	return read_waits(stream.next_layer());
+}
+
+namespace detail
+{
+
+// sources report readiness like a socket does, through available() and
+// async_wait(wait_read); the buffer is only taken once bytes are there
+template <typename SourceStream, typename SinkStream, typename BeforeRead, typename Handler>
+class socket_pair_op
+{
+public:
+	socket_pair_op(SourceStream& source, SinkStream& sink, relay_buffer& m_buf, BeforeRead& before_read, Handler& handler) :
+		source_(source),
+		sink_(sink),
+		m_buf_(m_buf),
+		before_read_(std::move(before_read)),
+		handler_(std::move(handler))
+	{}
+
+	// completion of async_wait
+	void operator()(error_code ec)
+	{
+		if (ec)
+		{
+			handler_(ec);
+			return;
+		}
+		read();
+	}
+
+	// completion of async_read_some / async_write
+	void operator()(error_code ec, std::size_t bytes_transferred)
+	{
+		if (ec)
+		{
+			handler_(ec);
+			return;
+		}
+		if (state_ == state::reading)
+		{
+			n_read_ = bytes_transferred;
+			m_buf_.commit(n_read_);
+			if constexpr (std::is_same_v<BeforeRead, no_limit>)
+			{
+				(*this)();
+			}
+			else
+			{
+				state_ = state::limiting;
+				BeforeRead hook(before_read_);
+				hook(n_read_, std::move(*this));
+			}
+			return;
+		}
+		wait();
+	}
+
+	// completion of before_read, the bytes just read may be written now
+	void operator()()
+	{
+		state_ = state::writing;
+		async_write(sink_, buffer(m_buf_.data(), n_read_), transfer_all_at_once(), std::move(*this));
+	}
+
+	void wait()
+	{
+		// asio's reactor is edge triggered and async_wait never tries the
+		// descriptor first, so bytes that are already queued must be read
+		// right away instead of waited for
+		error_code ec;
+		if (read_waits(source_) || source_.available(ec) != 0 || ec)
+		{
+			read();
+			return;
+		}
+		m_buf_.release();
+		state_ = state::waiting;
+		source_.async_wait(socket_base::wait_read, std::move(*this));
+	}
+
+	const Handler& handler() const noexcept
+	{
+		return handler_;
+	}
+
+private:
+	enum class state
+	{
+		waiting,
+		reading,
+		limiting,
+		writing
+	};
+
+	void read()
+	{
+		state_ = state::reading;
+		source_.async_read_some(m_buf_.prepare(), std::move(*this));
+	}
+
+	SourceStream& source_;
+	SinkStream& sink_;
+	relay_buffer& m_buf_;
+	BeforeRead before_read_;
+	Handler handler_;
+	state state_ = state::waiting;
+	std::size_t n_read_ = 0;
+};
+
+}
+
+// forwards everything read from source to sink until either side fails,
+// before_read(n, handler) runs between each read and the following write
+template <typename SourceStream, typename SinkStream, typename BeforeRead, typename CompletionToken>
+BOOST_ASIO_INITFN_RESULT_TYPE(CompletionToken, void(error_code))
 socket_pair(
 	SourceStream & source,
 	SinkStream & sink,
-	io_context& ioc,
-	mutable_buffer m_buf,
-    std::function<void(std::size_t, yield_context)> before_read,
+	relay_buffer & m_buf,
+	BeforeRead before_read,
 	CompletionToken&& token
 )
 {
-	using result_type = async_result<CompletionToken, void(error_code)>;
-	using handler_type = typename result_type::completion_handler_type;
-	handler_type handler(std::forward<CompletionToken>(token));
-	result_type result(handler);
+	async_completion<CompletionToken, void(error_code)> init(token);
+#if defined(MSOCKS_STACKFUL_RELAY)
 	spawn(
-		ioc,
+		sink.get_executor(),
 		[
 			&source,
 			&sink,
-			&ioc,
-			m_buf,
-            before_read(std::move(before_read)),
-			handler
+			&m_buf,
+			before_read(std::move(before_read)),
+			handler(std::move(init.completion_handler))
 		](yield_context yield) mutable
 	{
 		error_code ec;
 		while (true)
 		{
-			auto n_read = source.async_read_some(m_buf, yield[ec]);
+			if (!read_waits(source) && source.available(ec) == 0 && !ec)
+			{
+				m_buf.release();
+				source.async_wait(socket_base::wait_read, yield[ec]);
+				if (ec)
+				{
+					break;
+				}
+			}
+			auto n_read = source.async_read_some(m_buf.prepare(), yield[ec]);
 			if (ec)
 			{
 				break;
 			}
-			
-			before_read(n_read, yield);
-			async_write(sink, buffer(m_buf, n_read), yield[ec]);
-            
+			m_buf.commit(n_read);
+			if constexpr (!std::is_same_v<BeforeRead, no_limit>)
+			{
+				before_read(n_read, yield);
+			}
+			async_write(sink, buffer(m_buf.data(), n_read), transfer_all_at_once(), yield[ec]);
 			if (ec)
 			{
 				break;
 			}
 		}
-		post(ioc, std::bind(handler, ec));
+		post(sink.get_executor(), std::bind(handler, ec));
 	});
-	return result.get();
+#else
+	using handler_type = typename async_completion<CompletionToken, void(error_code)>::completion_handler_type;
+	detail::socket_pair_op<SourceStream, SinkStream, BeforeRead, handler_type>(
+		source, sink, m_buf, before_read, init.completion_handler).wait();
+#endif
+	return init.result.get();
+}
+
 }
 
+// operations of a relay run on the executor and allocator of the session's
+// completion handler
+namespace boost::asio
+{
+
+template <typename SourceStream, typename SinkStream, typename BeforeRead, typename Handler, typename Allocator>
+struct associated_allocator<msocks::utility::detail::socket_pair_op<SourceStream, SinkStream, BeforeRead, Handler>, Allocator>
+{
+	using type = typename associated_allocator<Handler, Allocator>::type;
+
+	static type get(const msocks::utility::detail::socket_pair_op<SourceStream, SinkStream, BeforeRead, Handler>& h, const Allocator& a = Allocator()) noexcept
+	{
+		return associated_allocator<Handler, Allocator>::get(h.handler(), a);
+	}
+};
+
+template <typename SourceStream, typename SinkStream, typename BeforeRead, typename Handler, typename Executor>
+struct associated_executor<msocks::utility::detail::socket_pair_op<SourceStream, SinkStream, BeforeRead, Handler>, Executor>
+{
+	using type = typename associated_executor<Handler, Executor>::type;
+
+	static type get(const msocks::utility::detail::socket_pair_op<SourceStream, SinkStream, BeforeRead, Handler>& h, const Executor& ex = Executor()) noexcept
+	{
+		return associated_executor<Handler, Executor>::get(h.handler(), ex);
+	}
+};
+
 }
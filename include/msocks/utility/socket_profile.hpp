@@ -0,0 +1,48 @@
+#pragma once
+
+#include <boost/asio/ip/address.hpp>
+#include <boost/system/error_code.hpp>
+
+#include <msocks/utility/tcp_socket.hpp>
+
+#include <chrono>
+#include <string>
+
+using namespace boost::system;
+
+namespace msocks::utility
+{
+
+// options an endpoint sets on the sockets of one direction, accepted ones
+// or the ones it connects with. Zero and empty leave the kernel's default.
+struct socket_profile
+{
+	bool no_delay = true;
+	// SO_SNDBUF and SO_RCVBUF in bytes; a size set turns the kernel's
+	// autotuning off for that buffer and caps it there
+	int send_buffer = 0;
+	int receive_buffer = 0;
+	// TCP_QUICKACK, the kernel may go back to delayed acks later on
+	bool quick_ack = false;
+	// TCP_NOTSENT_LOWAT, keeps less unsent data queued, a write waits instead
+	int notsent_lowat = 0;
+	// TCP_CONGESTION, e.g. "bbr", which has to be loaded on the host
+	std::string congestion;
+	// keepalive probes after keepalive_idle without traffic, 0 for none
+	std::chrono::seconds keepalive_idle{0};
+	std::chrono::seconds keepalive_interval{0};
+	int keepalive_count = 0;
+	// SO_BINDTODEVICE, needs CAP_NET_RAW
+	std::string interface;
+	// source address of connecting sockets of its family, bound with
+	// IP_BIND_ADDRESS_NO_PORT so ports are picked per destination;
+	// unspecified for none and for accepted sockets
+	ip::address source;
+};
+
+// sets the options of profile on an open socket, connecting ones before
+// their connect. Options the platform lacks are skipped; ec holds the
+// first that failed, the ones after it are still set.
+void apply(const socket_profile& profile, tcp_socket& socket, error_code& ec);
+
+}
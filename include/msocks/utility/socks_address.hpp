@@ -0,0 +1,117 @@
+#pragma once
+
+#include <boost/asio/ip/address.hpp>
+
+#include <msocks/utility/socks_constants.hpp>
+
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+namespace msocks::utility
+{
+
+// a target in the address format socks5 requests and shadowsocks headers
+// share: [type][ipv4 | ipv6 | length, domain][port], parsed where the bytes
+// were read, so nothing is formatted into strings on the way to connect()
+struct socks_address
+{
+	uint8_t type = 0;
+	// addr_ipv4 and addr_ipv6
+	boost::asio::ip::address address;
+	// addr_domain, points into the parsed bytes
+	std::string_view domain;
+	uint16_t port = 0;
+};
+
+enum class parse_status
+{
+	complete,
+	incomplete,
+	invalid
+};
+
+// parses the address at the start of data, on success size is the length
+// of the address and the rest of data is payload
+inline parse_status parse_socks_address(const uint8_t* data, std::size_t& size, socks_address& result)
+{
+	const std::size_t n = size;
+	if (n < 1)
+	{
+		return parse_status::incomplete;
+	}
+	std::size_t port_offset = 0;
+	result.type = data[0];
+	switch (data[0])
+	{
+		case socks::addr_ipv4:
+		{
+			boost::asio::ip::address_v4::bytes_type ipv4;
+			port_offset = 1 + ipv4.size();
+			if (n < port_offset + 2)
+			{
+				return parse_status::incomplete;
+			}
+			std::memcpy(ipv4.data(), data + 1, ipv4.size());
+			result.address = boost::asio::ip::make_address_v4(ipv4);
+			break;
+		}
+		case socks::addr_ipv6:
+		{
+			boost::asio::ip::address_v6::bytes_type ipv6;
+			port_offset = 1 + ipv6.size();
+			if (n < port_offset + 2)
+			{
+				return parse_status::incomplete;
+			}
+			std::memcpy(ipv6.data(), data + 1, ipv6.size());
+			result.address = boost::asio::ip::make_address_v6(ipv6);
+			break;
+		}
+		case socks::addr_domain:
+			if (n < 2)
+			{
+				return parse_status::incomplete;
+			}
+			port_offset = 2 + std::size_t(data[1]);
+			if (n < port_offset + 2)
+			{
+				return parse_status::incomplete;
+			}
+			result.domain = std::string_view(reinterpret_cast<const char*>(data + 2), data[1]);
+			break;
+		default:
+			return parse_status::invalid;
+	}
+	result.port = uint16_t(data[port_offset] << 8 | data[port_offset + 1]);
+	size = port_offset + 2;
+	return parse_status::complete;
+}
+
+// longest address write_socks_address produces, an ipv6 one
+constexpr std::size_t max_ip_address_size = 1 + 16 + 2;
+
+// writes address and port in the same format to out, returns the length
+inline std::size_t write_socks_address(uint8_t* out, const boost::asio::ip::address& address, uint16_t port)
+{
+	std::size_t n = 0;
+	if (address.is_v4())
+	{
+		auto bytes = address.to_v4().to_bytes();
+		out[n++] = socks::addr_ipv4;
+		std::memcpy(out + n, bytes.data(), bytes.size());
+		n += bytes.size();
+	}
+	else
+	{
+		auto bytes = address.to_v6().to_bytes();
+		out[n++] = socks::addr_ipv6;
+		std::memcpy(out + n, bytes.data(), bytes.size());
+		n += bytes.size();
+	}
+	out[n++] = uint8_t(port >> 8);
+	out[n++] = uint8_t(port);
+	return n;
+}
+
+}
@@ -15,6 +15,9 @@ enum errc_t
     cipher_algo_not_found,
     cipher_keylength_invalid,
     cipher_ivlength_invalid,
+    cipher_auth_failed,
+    cipher_chunk_invalid,
+    cipher_keys_unauthenticated,
     socks_error_size,
 };
 
@@ -39,6 +42,12 @@ const char * make_errc_string(errc_t code)
             return "cipher keylength invalid";
         case cipher_ivlength_invalid:
             return "cipher ivleng invalid";
+        case cipher_auth_failed:
+            return "cipher authentication failed";
+        case cipher_chunk_invalid:
+            return "cipher chunk invalid";
+        case cipher_keys_unauthenticated:
+            return "several keys on one port need an AEAD cipher";
 		default:
 			return "unknown";
 	}
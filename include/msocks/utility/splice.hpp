@@ -0,0 +1,221 @@
+#pragma once
+
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <msocks/utility/socket_pair.hpp>
+#include <msocks/utility/tcp_socket.hpp>
+
+#if defined(__linux__)
+#define MSOCKS_HAS_SPLICE 1
+#endif
+
+using namespace boost::asio;
+using namespace boost::system;
+
+namespace msocks::utility
+{
+
+#if defined(MSOCKS_HAS_SPLICE)
+
+// the kernel side buffer bytes are spliced through, opened lazily
+class pipe_pair : public boost::noncopyable
+{
+public:
+	pipe_pair() = default;
+
+	~pipe_pair();
+
+	void open(error_code& ec);
+
+	void close() noexcept;
+
+	bool is_open() const noexcept
+	{
+		return fds_[0] != -1;
+	}
+
+	int read_fd() const noexcept
+	{
+		return fds_[0];
+	}
+
+	int write_fd() const noexcept
+	{
+		return fds_[1];
+	}
+
+	std::size_t capacity() const noexcept
+	{
+		return capacity_;
+	}
+
+private:
+	int fds_[2] = {-1, -1};
+	std::size_t capacity_ = 0;
+};
+
+namespace detail
+{
+
+// moves up to len bytes between two descriptors, would_block and eof are
+// reported through ec the same way asio does
+std::size_t splice_some(int from, int to, std::size_t len, error_code& ec);
+
+template <typename BeforeRead, typename Handler>
+class splice_op
+{
+public:
+	splice_op(utility::tcp_socket& source, utility::tcp_socket& sink, pipe_pair& pipe, BeforeRead& before_read, Handler& handler) :
+		source_(source),
+		sink_(sink),
+		pipe_(pipe),
+		before_read_(std::move(before_read)),
+		handler_(std::move(handler))
+	{}
+
+	// completion of async_wait or of a post that yields to other sessions
+	void operator()(error_code ec)
+	{
+		if (ec)
+		{
+			handler_(ec);
+			return;
+		}
+		(*this)();
+	}
+
+	void operator()()
+	{
+		error_code ec;
+		for (std::size_t round = 0; round < max_rounds; round++)
+		{
+			if (in_pipe_ == 0)
+			{
+				std::size_t n = splice_some(source_.native_handle(), pipe_.write_fd(), pipe_.capacity(), ec);
+				if (ec == error::would_block)
+				{
+					source_.async_wait(socket_base::wait_read, std::move(*this));
+					return;
+				}
+				if (ec)
+				{
+					handler_(ec);
+					return;
+				}
+				in_pipe_ = n;
+				if constexpr (!std::is_same_v<BeforeRead, no_limit>)
+				{
+					BeforeRead hook(before_read_);
+					hook(n, std::move(*this));
+					return;
+				}
+			}
+			while (in_pipe_ != 0)
+			{
+				std::size_t n = splice_some(pipe_.read_fd(), sink_.native_handle(), in_pipe_, ec);
+				if (ec == error::would_block)
+				{
+					sink_.async_wait(socket_base::wait_write, std::move(*this));
+					return;
+				}
+				if (ec)
+				{
+					handler_(ec);
+					return;
+				}
+				in_pipe_ -= n;
+			}
+		}
+		// a busy flow must not keep the event loop to itself
+		post(sink_.get_executor(), std::move(*this));
+	}
+
+	const Handler& handler() const noexcept
+	{
+		return handler_;
+	}
+
+private:
+	static constexpr std::size_t max_rounds = 16;
+
+	utility::tcp_socket& source_;
+	utility::tcp_socket& sink_;
+	pipe_pair& pipe_;
+	BeforeRead before_read_;
+	Handler handler_;
+	std::size_t in_pipe_ = 0;
+};
+
+}
+
+// socket_pair for two plain tcp sockets, bytes go source -> pipe -> sink
+// inside the kernel and never touch a user space buffer
+template <typename BeforeRead, typename CompletionToken>
+BOOST_ASIO_INITFN_RESULT_TYPE(CompletionToken, void(error_code))
+splice_pair(
+	utility::tcp_socket& source,
+	utility::tcp_socket& sink,
+	pipe_pair& pipe,
+	BeforeRead before_read,
+	CompletionToken&& token)
+{
+	async_completion<CompletionToken, void(error_code)> init(token);
+	using handler_type = typename async_completion<CompletionToken, void(error_code)>::completion_handler_type;
+	error_code ec;
+	if (!pipe.is_open())
+	{
+		pipe.open(ec);
+	}
+	if (!ec)
+	{
+		source.non_blocking(true, ec);
+	}
+	if (!ec)
+	{
+		sink.non_blocking(true, ec);
+	}
+	if (ec)
+	{
+		post(sink.get_executor(), std::bind(std::move(init.completion_handler), ec));
+	}
+	else
+	{
+		detail::splice_op<BeforeRead, handler_type>(source, sink, pipe, before_read, init.completion_handler)();
+	}
+	return init.result.get();
+}
+
+#endif
+
+}
+
+#if defined(MSOCKS_HAS_SPLICE)
+namespace boost::asio
+{
+
+template <typename BeforeRead, typename Handler, typename Allocator>
+struct associated_allocator<msocks::utility::detail::splice_op<BeforeRead, Handler>, Allocator>
+{
+	using type = typename associated_allocator<Handler, Allocator>::type;
+
+	static type get(const msocks::utility::detail::splice_op<BeforeRead, Handler>& h, const Allocator& a = Allocator()) noexcept
+	{
+		return associated_allocator<Handler, Allocator>::get(h.handler(), a);
+	}
+};
+
+template <typename BeforeRead, typename Handler, typename Executor>
+struct associated_executor<msocks::utility::detail::splice_op<BeforeRead, Handler>, Executor>
+{
+	using type = typename associated_executor<Handler, Executor>::type;
+
+	static type get(const msocks::utility::detail::splice_op<BeforeRead, Handler>& h, const Executor& ex = Executor()) noexcept
+	{
+		return associated_executor<Handler, Executor>::get(h.handler(), ex);
+	}
+};
+
+}
+#endif
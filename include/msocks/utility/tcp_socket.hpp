@@ -0,0 +1,31 @@
+#pragma once
+
+#include <boost/version.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/ip/udp.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+using namespace boost::asio;
+
+namespace msocks::utility
+{
+
+// sessions name io_context's executor directly. From Boost 1.70 the default
+// ip::tcp::socket carries a type erased executor, any_io_executor since
+// 1.74, which routes every completion through a heap allocated function
+// object and makes the handlers' own allocator useless.
+#if BOOST_VERSION >= 107000
+using tcp_socket = basic_stream_socket<ip::tcp, io_context::executor_type>;
+using tcp_acceptor = basic_socket_acceptor<ip::tcp, io_context::executor_type>;
+using udp_socket = basic_datagram_socket<ip::udp, io_context::executor_type>;
+using steady_timer = basic_waitable_timer<
+	std::chrono::steady_clock, wait_traits<std::chrono::steady_clock>, io_context::executor_type>;
+#else
+using tcp_socket = ip::tcp::socket;
+using tcp_acceptor = ip::tcp::acceptor;
+using udp_socket = ip::udp::socket;
+using steady_timer = boost::asio::steady_timer;
+#endif
+
+}
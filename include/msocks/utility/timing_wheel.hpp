@@ -0,0 +1,126 @@
+#pragma once
+
+#include <boost/asio/io_context.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <msocks/utility/tcp_socket.hpp>
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+
+using namespace boost::asio;
+using namespace boost::system;
+
+namespace msocks::utility
+{
+
+// per io_context hashed timing wheel for the timeouts of many sessions.
+// One timer ticks once a resolution while anything is scheduled, entries
+// hash into the slot of their tick, so scheduling and cancelling cost two
+// pointer updates and a tick only visits the entries of one slot. Activity
+// is recorded lazily: touch() only stamps the current tick, an entry whose
+// slot comes up early is moved to the slot of its real deadline. Expiries
+// are never early and at most one resolution late. Not thread safe, every
+// worker thread runs its own io_context and gets its own wheel.
+class timing_wheel : public io_context::service
+{
+public:
+	static io_context::id id;
+
+	using clock = std::chrono::steady_clock;
+
+	static constexpr std::chrono::seconds resolution{1};
+	static constexpr std::size_t slot_count = 512;
+
+	// a timeout owned by whoever wants to be called back, usually a session
+	// member; it is cancelled when destroyed
+	class entry : public boost::noncopyable
+	{
+	public:
+		entry(io_context& ioc, std::function<void()> handler);
+
+		~entry();
+
+		// handler runs once timeout passed without a touch(), a pending
+		// expiry is replaced; a zero timeout only cancels
+		void schedule(std::chrono::seconds timeout);
+
+		// restarts the current timeout from now
+		void touch() noexcept
+		{
+			last_ = wheel_.now_;
+		}
+
+		void cancel() noexcept;
+
+		bool pending() const noexcept
+		{
+			return state_ != state::idle;
+		}
+
+	private:
+		friend class timing_wheel;
+
+		enum class state
+		{
+			idle,
+			scheduled,
+			expired
+		};
+
+		uint64_t deadline() const noexcept
+		{
+			// now_ is the tick that started last, one more keeps a whole
+			// timeout between the touch and the expiry
+			return last_ + timeout_ + 1;
+		}
+
+		timing_wheel& wheel_;
+		std::function<void()> handler_;
+		entry* next_ = nullptr;
+		entry* prev_ = nullptr;
+		state state_ = state::idle;
+		// in ticks
+		uint64_t timeout_ = 0;
+		uint64_t last_ = 0;
+		uint64_t due_ = 0;
+	};
+
+	explicit timing_wheel(io_context& ioc);
+
+	std::size_t size() const noexcept
+	{
+		return size_;
+	}
+
+private:
+	void shutdown() override;
+
+	entry*& head(entry& e) noexcept;
+
+	void link(entry& e, entry::state s) noexcept;
+
+	void unlink(entry& e) noexcept;
+
+	// ticks passed since the wheel was created
+	uint64_t elapsed() const noexcept;
+
+	void arm();
+
+	void advance();
+
+	void expire(uint64_t tick) noexcept;
+
+	steady_timer timer_;
+	clock::time_point origin_;
+	std::array<entry*, slot_count> slots_{};
+	// entries whose handler is about to run
+	entry* expired_ = nullptr;
+	uint64_t now_ = 0;
+	std::size_t size_ = 0;
+	bool ticking_ = false;
+};
+
+}
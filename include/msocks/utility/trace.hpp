@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace msocks::utility::trace
+{
+
+// where sampled sessions spend their time. One in every rate sessions is
+// traced under its session id, its phases stamped into a ring of the
+// thread running it, overwriting the oldest spans once full. Like the
+// metrics shards every ring is written by its own thread only and read by
+// dump().
+
+enum class phase : uint8_t
+{
+	// the client's SOCKS5 negotiation with the application
+	socks5,
+	// iv, target address and, for several users, the key lookup
+	handshake,
+	resolve,
+	connect,
+	// from connected until the first reply byte of the target or server
+	first_byte,
+	limiter_wait,
+	count
+};
+
+using clock = std::chrono::steady_clock;
+
+// spans each thread keeps
+constexpr std::size_t ring_size = 8192;
+
+inline std::atomic<std::size_t> rate{0};
+
+// traces one session out of every n from now on, 0 turns tracing off
+inline void sample_rate(std::size_t n) noexcept
+{
+	rate.store(n, std::memory_order_relaxed);
+}
+
+// whether a new session is traced, under its session id
+inline bool sample()
+{
+	const auto n = rate.load(std::memory_order_relaxed);
+	if (n == 0)
+	{
+		return false;
+	}
+	static thread_local std::size_t seen = 0;
+	return ++seen % n == 0;
+}
+
+// records p of session id from begin until end, nothing for id 0
+void span(uint64_t id, phase p, clock::time_point begin, clock::time_point end);
+
+inline void span(uint64_t id, phase p, clock::time_point begin)
+{
+	if (id != 0)
+	{
+		span(id, p, begin, clock::now());
+	}
+}
+
+// the spans of all threads as a Chrome trace (chrome://tracing, Perfetto),
+// a process per thread and a thread per session
+std::string dump();
+
+}
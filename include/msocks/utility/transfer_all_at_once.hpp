@@ -0,0 +1,20 @@
+#pragma once
+
+#include <boost/system/error_code.hpp>
+#include <cstddef>
+#include <limits>
+
+namespace msocks::utility
+{
+
+// completion condition that hands the whole buffer to one write_some instead
+// of asio's default 64 KiB slices, big relay buffers then cost one syscall
+struct transfer_all_at_once
+{
+	std::size_t operator()(const boost::system::error_code& ec, std::size_t) const noexcept
+	{
+		return ec ? 0 : std::numeric_limits<std::size_t>::max();
+	}
+};
+
+}
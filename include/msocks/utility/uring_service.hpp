@@ -0,0 +1,125 @@
+#pragma once
+
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/io_context.hpp>
+
+#if defined(MSOCKS_IO_URING) && defined(__linux__)
+#define MSOCKS_HAS_IO_URING 1
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+#include <cstdint>
+
+using namespace boost::asio;
+using namespace boost::system;
+
+namespace msocks::utility
+{
+
+#if defined(MSOCKS_HAS_IO_URING)
+
+// per io_context io_uring instance for the relays' socket operations.
+// Requests queued while handlers run are submitted together by one
+// io_uring_enter once they are done, and completions are announced through
+// an eventfd the io_context's reactor reads, so a busy worker pays a few
+// system calls per turn of its loop instead of one per read and write.
+// Sockets that do not use it stay on the reactor. Set up with raw system
+// calls, available() is false where the kernel refuses the ring or lacks
+// cancellation by descriptor (before 5.19), relays then stay on epoll.
+// Not thread safe, every worker thread runs its own io_context.
+class uring_service : public io_context::service
+{
+public:
+	static io_context::id id;
+
+	static constexpr unsigned entries = 4096;
+
+	// a request the kernel holds; complete runs once with the request's
+	// result, or with destroy set when the io_context goes away first
+	struct operation
+	{
+		using func_type = void (*)(operation*, int result, bool destroy);
+
+		explicit operation(func_type f) noexcept :
+			complete(f)
+		{}
+
+		func_type complete;
+		operation* next = nullptr;
+		operation* prev = nullptr;
+	};
+
+	explicit uring_service(io_context& ioc);
+
+	~uring_service() override;
+
+	bool available() const noexcept
+	{
+		return ring_fd_ >= 0;
+	}
+
+	void recv(int fd, mutable_buffer buffer, operation* op);
+
+	void send(int fd, const_buffer buffer, operation* op);
+
+	// msg must stay put until op completes
+	void sendmsg(int fd, const msghdr* msg, operation* op);
+
+	void poll(int fd, unsigned events, operation* op);
+
+	// everything pending on fd completes with ECANCELED; submitted right
+	// away, so fd may be closed next
+	void cancel(int fd);
+
+private:
+	void shutdown() override;
+
+	// the next free submission entry, nullptr if the ring is still full
+	// after a submit
+	io_uring_sqe* acquire();
+
+	void queue(io_uring_sqe* sqe, operation* op);
+
+	void submit();
+
+	// waits on the eventfd while the kernel holds requests
+	void arm();
+
+	void reap();
+
+	void teardown() noexcept;
+
+	io_context& ioc_;
+	posix::stream_descriptor event_;
+	uint64_t event_count_ = 0;
+	int ring_fd_ = -1;
+	void* ring_ = nullptr;
+	std::size_t ring_size_ = 0;
+	io_uring_sqe* sqes_ = nullptr;
+	std::size_t sqes_size_ = 0;
+	unsigned* sq_head_ = nullptr;
+	unsigned* sq_tail_ = nullptr;
+	unsigned sq_mask_ = 0;
+	unsigned sq_entries_ = 0;
+	unsigned* cq_head_ = nullptr;
+	unsigned* cq_tail_ = nullptr;
+	unsigned cq_mask_ = 0;
+	io_uring_cqe* cqes_ = nullptr;
+	// entries written but not submitted yet are [submitted_, tail_)
+	unsigned tail_ = 0;
+	unsigned submitted_ = 0;
+	// requests the kernel holds, for shutdown
+	operation* pending_ = nullptr;
+	std::size_t inflight_ = 0;
+	bool armed_ = false;
+	bool reaping_ = false;
+	bool submit_posted_ = false;
+};
+
+#endif
+
+}
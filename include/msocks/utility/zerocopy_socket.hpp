@@ -0,0 +1,387 @@
+#pragma once
+
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/buffer.hpp>
+
+#include <msocks/utility/tcp_socket.hpp>
+#include <msocks/utility/uring_service.hpp>
+
+#include <memory>
+
+#if defined(__linux__)
+#include <sys/socket.h>
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#define MSOCKS_HAS_ZEROCOPY 1
+#endif
+#endif
+
+using namespace boost::asio;
+using namespace boost::system;
+
+namespace msocks::utility
+{
+
+// tcp socket of the server's relays, whose large writes are sent with
+// MSG_ZEROCOPY once enabled. A zero-copy write only completes after the
+// kernel has released the pages, which for tcp means after the peer acked
+// them, so it pays off on short fat links and stays off by default.
+// With io_uring enabled reads, waits and the other writes go through the
+// io_context's uring_service instead of the reactor; closing or cancelling
+// through this class then also ends what the ring holds.
+class zerocopy_socket : public utility::tcp_socket
+{
+public:
+	explicit zerocopy_socket(io_context& ioc) :
+		utility::tcp_socket(ioc)
+	{}
+
+	zerocopy_socket(utility::tcp_socket&& socket) :
+		utility::tcp_socket(std::move(socket))
+	{}
+
+	zerocopy_socket(zerocopy_socket&& other) noexcept;
+
+	zerocopy_socket& operator=(zerocopy_socket&& other);
+
+	~zerocopy_socket();
+
+	// writes of at least threshold bytes skip the copy into the kernel,
+	// fails with operation_not_supported where SO_ZEROCOPY is missing
+	void enable_zerocopy(std::size_t threshold, error_code& ec);
+
+	// fails with operation_not_supported where the build has no
+	// MSOCKS_IO_URING or the kernel no usable io_uring
+	void enable_uring(error_code& ec);
+
+	template <typename ConstBufferSequence, typename WriteHandler>
+	BOOST_ASIO_INITFN_RESULT_TYPE(WriteHandler, void(error_code, std::size_t))
+	async_write_some(const ConstBufferSequence& buffers, WriteHandler&& handler);
+
+	template <typename MutableBufferSequence, typename ReadHandler>
+	BOOST_ASIO_INITFN_RESULT_TYPE(ReadHandler, void(error_code, std::size_t))
+	async_read_some(const MutableBufferSequence& buffers, ReadHandler&& handler);
+
+	template <typename WaitHandler>
+	BOOST_ASIO_INITFN_RESULT_TYPE(WaitHandler, void(error_code))
+	async_wait(socket_base::wait_type w, WaitHandler&& handler);
+
+	void cancel(error_code& ec);
+
+	void close(error_code& ec);
+
+	void close();
+
+	// reads go through the ring, which holds them until bytes arrive
+	bool on_uring() const noexcept
+	{
+#if defined(MSOCKS_HAS_IO_URING)
+		return uring_ != nullptr;
+#else
+		return false;
+#endif
+	}
+
+private:
+	template <typename ConstBufferSequence, typename Handler>
+	friend class zerocopy_write_op;
+
+#if defined(MSOCKS_HAS_IO_URING)
+	template <typename Handler, bool Wait>
+	friend class uring_op;
+#endif
+
+	// ends what the ring holds before the descriptor goes away
+	void cancel_uring() noexcept;
+
+	// sends what it can with MSG_ZEROCOPY, would_block when the socket is full
+	std::size_t send_zerocopy(const const_buffer* buffers, std::size_t count, error_code& ec);
+
+	// true once every zero-copy send issued so far has been released by the kernel
+	bool reap_completions(error_code& ec);
+
+	std::size_t threshold_ = 0;
+	uint32_t sent_ = 0;
+	uint32_t completed_ = 0;
+#if defined(MSOCKS_HAS_IO_URING)
+	uring_service* uring_ = nullptr;
+	// requests of this socket the ring holds
+	std::size_t uring_pending_ = 0;
+#endif
+};
+
+// a relay submits reads of a socket on the ring right away, asking for
+// readiness first would cost a FIONREAD and a poll of its own
+inline bool read_waits(zerocopy_socket& socket) noexcept
+{
+	return socket.on_uring();
+}
+
+#if defined(MSOCKS_HAS_IO_URING)
+// a read, write or wait of a zerocopy_socket the ring holds, allocated
+// with the handler's allocator and freed before the handler runs
+template <typename Handler, bool Wait>
+class uring_op : public uring_service::operation
+{
+public:
+	enum class kind
+	{
+		read,
+		write,
+		wait
+	};
+
+	template <typename H>
+	static void start(zerocopy_socket& socket, kind k, H&& handler, const const_buffer* buffers, std::size_t count, unsigned events = 0)
+	{
+		alloc_type allocator(get_associated_allocator(handler));
+		uring_op* op = alloc_traits::allocate(allocator, 1);
+		new (op) uring_op(socket, k, std::forward<H>(handler));
+		++socket.uring_pending_;
+		int fd = socket.native_handle();
+		switch (k)
+		{
+			case kind::read:
+				op->requested_ = count != 0 ? buffers[0].size() : 0;
+				socket.uring_->recv(fd, mutable_buffer(const_cast<void*>(count != 0 ? buffers[0].data() : nullptr), op->requested_), op);
+				break;
+			case kind::write:
+				if (count == 1)
+				{
+					socket.uring_->send(fd, buffers[0], op);
+					break;
+				}
+				for (std::size_t i = 0; i != count; ++i)
+				{
+					op->iov_[i].iov_base = const_cast<void*>(buffers[i].data());
+					op->iov_[i].iov_len = buffers[i].size();
+				}
+				op->msg_.msg_iov = op->iov_.data();
+				op->msg_.msg_iovlen = count;
+				socket.uring_->sendmsg(fd, &op->msg_, op);
+				break;
+			case kind::wait:
+				socket.uring_->poll(fd, events, op);
+				break;
+		}
+	}
+
+private:
+	using alloc_type = typename std::allocator_traits<associated_allocator_t<Handler>>::template rebind_alloc<uring_op>;
+	using alloc_traits = std::allocator_traits<alloc_type>;
+
+	template <typename H>
+	uring_op(zerocopy_socket& socket, kind k, H&& handler) :
+		uring_service::operation(&uring_op::do_complete),
+		socket_(socket),
+		kind_(k),
+		handler_(std::forward<H>(handler))
+	{}
+
+	static void do_complete(uring_service::operation* base, int result, bool destroy)
+	{
+		auto op = static_cast<uring_op*>(base);
+		--op->socket_.uring_pending_;
+		Handler handler(std::move(op->handler_));
+		kind k = op->kind_;
+		std::size_t requested = op->requested_;
+		alloc_type allocator(get_associated_allocator(handler));
+		op->~uring_op();
+		alloc_traits::deallocate(allocator, op, 1);
+		if (destroy)
+		{
+			return;
+		}
+		error_code ec;
+		if (result < 0)
+		{
+			ec = result == -ECANCELED ? error_code(error::operation_aborted) : error_code(-result, system_category());
+			result = 0;
+		}
+		else if (k == kind::read && result == 0 && requested != 0)
+		{
+			ec = error::eof;
+		}
+		if constexpr (Wait)
+		{
+			handler(ec);
+		}
+		else
+		{
+			handler(ec, std::size_t(result));
+		}
+	}
+
+	zerocopy_socket& socket_;
+	kind kind_;
+	Handler handler_;
+	std::size_t requested_ = 0;
+	std::array<iovec, 16> iov_{};
+	msghdr msg_{};
+};
+#endif
+
+template <typename ConstBufferSequence, typename Handler>
+class zerocopy_write_op
+{
+public:
+	zerocopy_write_op(zerocopy_socket& socket, const ConstBufferSequence& buffers, Handler& handler) :
+		socket_(socket),
+		buffers_(buffers),
+		handler_(std::move(handler))
+	{}
+
+	void operator()(error_code ec = {})
+	{
+		if (ec)
+		{
+			handler_(ec, bytes_transferred_);
+			return;
+		}
+		if (!sent_)
+		{
+			std::array<const_buffer, 16> sequence;
+			std::size_t count = 0;
+			for (auto iter = buffer_sequence_begin(buffers_); iter != buffer_sequence_end(buffers_) && count < sequence.size(); ++iter)
+			{
+				sequence[count++] = const_buffer(*iter);
+			}
+			bytes_transferred_ = socket_.send_zerocopy(sequence.data(), count, ec);
+			if (ec == error::would_block)
+			{
+				socket_.async_wait(socket_base::wait_write, std::move(*this));
+				return;
+			}
+			if (ec)
+			{
+				handler_(ec, 0);
+				return;
+			}
+			sent_ = true;
+		}
+		if (socket_.reap_completions(ec) || ec)
+		{
+			handler_(ec, bytes_transferred_);
+			return;
+		}
+		socket_.async_wait(socket_base::wait_error, std::move(*this));
+	}
+
+	const Handler& handler() const noexcept
+	{
+		return handler_;
+	}
+
+private:
+	zerocopy_socket& socket_;
+	ConstBufferSequence buffers_;
+	Handler handler_;
+	std::size_t bytes_transferred_ = 0;
+	bool sent_ = false;
+};
+
+template <typename ConstBufferSequence, typename WriteHandler>
+BOOST_ASIO_INITFN_RESULT_TYPE(WriteHandler, void(error_code, std::size_t))
+zerocopy_socket::async_write_some(const ConstBufferSequence& buffers, WriteHandler&& handler)
+{
+	if (threshold_ != 0 && buffer_size(buffers) >= threshold_)
+	{
+		async_completion<WriteHandler, void(error_code, std::size_t)> init(handler);
+		using handler_type = typename async_completion<WriteHandler, void(error_code, std::size_t)>::completion_handler_type;
+		zerocopy_write_op<ConstBufferSequence, handler_type>(*this, buffers, init.completion_handler)();
+		return init.result.get();
+	}
+#if defined(MSOCKS_HAS_IO_URING)
+	if (uring_ != nullptr)
+	{
+		async_completion<WriteHandler, void(error_code, std::size_t)> init(handler);
+		using handler_type = typename async_completion<WriteHandler, void(error_code, std::size_t)>::completion_handler_type;
+		std::array<const_buffer, 16> sequence;
+		std::size_t count = 0;
+		for (auto iter = buffer_sequence_begin(buffers); iter != buffer_sequence_end(buffers) && count < sequence.size(); ++iter)
+		{
+			if (const_buffer b(*iter); b.size() != 0)
+			{
+				sequence[count++] = b;
+			}
+		}
+		uring_op<handler_type, false>::start(*this, uring_op<handler_type, false>::kind::write, std::move(init.completion_handler), sequence.data(), count);
+		return init.result.get();
+	}
+#endif
+	return utility::tcp_socket::async_write_some(buffers, std::forward<WriteHandler>(handler));
+}
+
+template <typename MutableBufferSequence, typename ReadHandler>
+BOOST_ASIO_INITFN_RESULT_TYPE(ReadHandler, void(error_code, std::size_t))
+zerocopy_socket::async_read_some(const MutableBufferSequence& buffers, ReadHandler&& handler)
+{
+#if defined(MSOCKS_HAS_IO_URING)
+	if (uring_ != nullptr)
+	{
+		async_completion<ReadHandler, void(error_code, std::size_t)> init(handler);
+		using handler_type = typename async_completion<ReadHandler, void(error_code, std::size_t)>::completion_handler_type;
+		// like a reactor read_some, the first buffer with room takes it all
+		const_buffer first;
+		std::size_t count = 0;
+		for (auto iter = buffer_sequence_begin(buffers); iter != buffer_sequence_end(buffers); ++iter)
+		{
+			if (mutable_buffer b(*iter); b.size() != 0)
+			{
+				first = b;
+				count = 1;
+				break;
+			}
+		}
+		uring_op<handler_type, false>::start(*this, uring_op<handler_type, false>::kind::read, std::move(init.completion_handler), &first, count);
+		return init.result.get();
+	}
+#endif
+	return utility::tcp_socket::async_read_some(buffers, std::forward<ReadHandler>(handler));
+}
+
+template <typename WaitHandler>
+BOOST_ASIO_INITFN_RESULT_TYPE(WaitHandler, void(error_code))
+zerocopy_socket::async_wait(socket_base::wait_type w, WaitHandler&& handler)
+{
+#if defined(MSOCKS_HAS_IO_URING)
+	if (uring_ != nullptr)
+	{
+		async_completion<WaitHandler, void(error_code)> init(handler);
+		using handler_type = typename async_completion<WaitHandler, void(error_code)>::completion_handler_type;
+		unsigned events = w == socket_base::wait_read ? POLLIN : w == socket_base::wait_write ? POLLOUT : POLLERR | POLLPRI;
+		uring_op<handler_type, true>::start(*this, uring_op<handler_type, true>::kind::wait, std::move(init.completion_handler), nullptr, 0, events);
+		return init.result.get();
+	}
+#endif
+	return utility::tcp_socket::async_wait(w, std::forward<WaitHandler>(handler));
+}
+
+}
+
+// a zero-copy write inherits the allocator of the write that issued it
+namespace boost::asio
+{
+
+template <typename ConstBufferSequence, typename Handler, typename Allocator>
+struct associated_allocator<msocks::utility::zerocopy_write_op<ConstBufferSequence, Handler>, Allocator>
+{
+	using type = typename associated_allocator<Handler, Allocator>::type;
+
+	static type get(const msocks::utility::zerocopy_write_op<ConstBufferSequence, Handler>& h, const Allocator& a = Allocator()) noexcept
+	{
+		return associated_allocator<Handler, Allocator>::get(h.handler(), a);
+	}
+};
+
+template <typename ConstBufferSequence, typename Handler, typename Executor>
+struct associated_executor<msocks::utility::zerocopy_write_op<ConstBufferSequence, Handler>, Executor>
+{
+	using type = typename associated_executor<Handler, Executor>::type;
+
+	static type get(const msocks::utility::zerocopy_write_op<ConstBufferSequence, Handler>& h, const Executor& ex = Executor()) noexcept
+	{
+		return associated_executor<Handler, Executor>::get(h.handler(), ex);
+	}
+};
+
+}
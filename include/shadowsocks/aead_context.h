@@ -0,0 +1,402 @@
+#pragma once
+
+#include <boost/asio/buffer.hpp>
+#include <boost/system/error_code.hpp>
+
+#include <botan/aead.h>
+#include <botan/kdf.h>
+
+#include <shadowsocks/key_set.h>
+#include <shadowsocks/random_pool.h>
+
+#include <msocks/utility/metrics.hpp>
+#include <msocks/utility/socks_erorr.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace shadowsocks
+{
+
+// the shadowsocks AEAD framing: a salt, then chunks of
+// [sealed 2 byte length][tag][sealed payload][tag], every chunk under a
+// subkey of HKDF-SHA1(key, salt, "ss-subkey") and a counting nonce.
+// Reads open every complete chunk that arrived in one pass and keep the
+// plaintext here until the caller takes it; writes seal the whole buffer
+// sequence into one wire buffer so it leaves with a single write.
+class aead_context
+{
+    struct engine
+    {
+        std::unique_ptr<Botan::AEAD_Mode> mode_;
+        std::array<uint8_t, 12> nonce_{};
+        // unaligned end of a chunk plus its tag, reused between chunks
+        Botan::secure_vector<uint8_t> tail_;
+        bool keyed_ = false;
+    };
+
+public:
+    struct method
+    {
+        const char * name;
+        const char * algo_spec;
+        size_t key_size;
+    };
+
+    static constexpr size_t tag_size = 16;
+    static constexpr size_t max_payload = 0x3FFF;
+    static constexpr size_t chunk_overhead = 2 + 2 * tag_size;
+    // a read buffer of this many full chunks
+    static constexpr size_t read_chunks = 4;
+
+    static const method * find(const std::string & name) noexcept
+    {
+        static constexpr method methods[] = {
+            {"chacha20-ietf-poly1305", "ChaCha20Poly1305", 32},
+            {"aes-128-gcm", "AES-128/GCM", 16},
+            {"aes-192-gcm", "AES-192/GCM", 24},
+            {"aes-256-gcm", "AES-256/GCM", 32},
+        };
+        for(auto & m : methods)
+        {
+            if(name == m.name)
+            {
+                return &m;
+            }
+        }
+        return nullptr;
+    }
+
+    aead_context(const std::string & method_name, const std::vector<uint8_t> & key)
+        : aead_context(checked(method_name), key, Botan::KDF::create_or_throw("HKDF(SHA-1)"))
+    {
+    }
+
+    // kdf is shared by the sessions of one thread, it only runs const calls
+    aead_context(const method & m, const std::vector<uint8_t> & key, std::shared_ptr<const Botan::KDF> kdf)
+        : kdf_(std::move(kdf))
+    {
+        engine_[0].mode_ = Botan::AEAD_Mode::create(m.algo_spec, Botan::DECRYPTION);
+        engine_[1].mode_ = Botan::AEAD_Mode::create(m.algo_spec, Botan::ENCRYPTION);
+        if(!engine_[0].mode_ || !engine_[1].mode_)
+        {
+            throw boost::system::system_error(msocks::errc::cipher_algo_not_found, msocks::socks_category());
+        }
+        if(key.size() != m.key_size)
+        {
+            throw boost::system::system_error(msocks::errc::cipher_keylength_invalid, msocks::socks_category());
+        }
+        key_ = key;
+        salt_.resize(m.key_size);
+        random_pool::local().fill(salt_.data(), salt_.size());
+    }
+
+    // back to a fresh connection, the modes are rekeyed once the salts are known
+    void rekey()
+    {
+        for(auto & e : engine_)
+        {
+            e.nonce_.fill(0);
+            e.keyed_ = false;
+        }
+        plain_begin_ = plain_end_ = cipher_begin_ = cipher_end_ = 0;
+        payload_wanted_ = 0;
+        out_.clear();
+        identified_ = key_set::npos;
+        random_pool::local().fill(salt_.data(), salt_.size());
+    }
+
+    // the key of the connection is one of keys, found by trial on the
+    // first chunk; nullptr for the context's own key
+    void identify_by(key_set * keys) noexcept
+    {
+        keys_ = keys;
+    }
+
+    // index into the key_set of the key that opened the first chunk
+    size_t identified() const noexcept
+    {
+        return identified_;
+    }
+
+    // plaintext opened but not yet handed out
+    size_t pending() const noexcept
+    {
+        return plain_end_ - plain_begin_;
+    }
+
+    // room for the next read of ciphertext
+    boost::asio::mutable_buffer read_space()
+    {
+        if(in_.empty())
+        {
+            in_.resize(read_chunks * (max_payload + chunk_overhead));
+        }
+        if(pending() == 0 && cipher_begin_ != 0)
+        {
+            std::memmove(in_.data(), in_.data() + cipher_begin_, cipher_end_ - cipher_begin_);
+            cipher_end_ -= cipher_begin_;
+            cipher_begin_ = plain_begin_ = plain_end_ = 0;
+        }
+        return boost::asio::buffer(in_.data() + cipher_end_, in_.size() - cipher_end_);
+    }
+
+    // opens the chunks completed by n more bytes of ciphertext
+    void commit(size_t n, boost::system::error_code & ec)
+    {
+        msocks::utility::metrics::cipher_timer timer(n);
+        cipher_end_ += n;
+        auto & e = engine_[0];
+        if(!e.keyed_)
+        {
+            if(cipher_end_ - cipher_begin_ < salt_.size())
+            {
+                return;
+            }
+            if(!keys_)
+            {
+                derive(e, in_.data() + cipher_begin_);
+            }
+            else if(cipher_end_ - cipher_begin_ < salt_.size() + 2 + tag_size)
+            {
+                return;
+            }
+            else if(!identify(e, in_.data() + cipher_begin_))
+            {
+                ec = boost::system::error_code(msocks::errc::cipher_auth_failed, msocks::socks_category());
+                return;
+            }
+            cipher_begin_ += salt_.size();
+            plain_begin_ = plain_end_ = cipher_begin_;
+        }
+        for(;;)
+        {
+            size_t buffered = cipher_end_ - cipher_begin_;
+            uint8_t * chunk = in_.data() + cipher_begin_;
+            if(payload_wanted_ == 0)
+            {
+                if(buffered < 2 + tag_size)
+                {
+                    return;
+                }
+                if(!open_chunk(e, chunk, 2))
+                {
+                    ec = boost::system::error_code(msocks::errc::cipher_auth_failed, msocks::socks_category());
+                    return;
+                }
+                payload_wanted_ = size_t(chunk[0]) << 8 | chunk[1];
+                // the two high bits are reserved, a length using them is malformed
+                if(payload_wanted_ == 0 || payload_wanted_ > max_payload)
+                {
+                    ec = boost::system::error_code(msocks::errc::cipher_chunk_invalid, msocks::socks_category());
+                    return;
+                }
+                cipher_begin_ += 2 + tag_size;
+                continue;
+            }
+            if(buffered < payload_wanted_ + tag_size)
+            {
+                return;
+            }
+            if(!open_chunk(e, chunk, payload_wanted_))
+            {
+                ec = boost::system::error_code(msocks::errc::cipher_auth_failed, msocks::socks_category());
+                return;
+            }
+            // plaintext stays contiguous, headers and tags are squeezed out
+            std::memmove(in_.data() + plain_end_, chunk, payload_wanted_);
+            plain_end_ += payload_wanted_;
+            cipher_begin_ += payload_wanted_ + tag_size;
+            payload_wanted_ = 0;
+        }
+    }
+
+    template <typename MutableBufferSequence>
+    size_t take(const MutableBufferSequence & buffers)
+    {
+        size_t n = boost::asio::buffer_copy(buffers, boost::asio::buffer(in_.data() + plain_begin_, pending()));
+        plain_begin_ += n;
+        return n;
+    }
+
+    // seals everything in buffers, the result waits in wire()
+    template <typename ConstBufferSequence>
+    size_t seal(const ConstBufferSequence & buffers)
+    {
+        auto & e = engine_[1];
+        size_t total = boost::asio::buffer_size(buffers);
+        msocks::utility::metrics::cipher_timer timer(total);
+        size_t chunks = (total + max_payload - 1) / max_payload;
+        size_t wanted = (e.keyed_ ? 0 : salt_.size()) + total + chunks * chunk_overhead;
+        // one big write does not pin its buffer for the rest of the connection
+        if(out_.capacity() > std::max(wanted, read_chunks * (max_payload + chunk_overhead)))
+        {
+            std::vector<uint8_t>().swap(out_);
+        }
+        out_.clear();
+        out_.reserve(wanted);
+        if(!e.keyed_)
+        {
+            out_.insert(out_.end(), salt_.begin(), salt_.end());
+            derive(e, salt_.data());
+        }
+        auto iter = boost::asio::buffer_sequence_begin(buffers);
+        boost::asio::const_buffer current;
+        for(size_t left = total; left != 0;)
+        {
+            size_t len = std::min(left, max_payload);
+            size_t header = out_.size();
+            out_.resize(header + 2 + tag_size + len + tag_size);
+            uint8_t * chunk = out_.data() + header;
+            chunk[0] = uint8_t(len >> 8);
+            chunk[1] = uint8_t(len);
+            uint8_t * payload = chunk + 2 + tag_size;
+            for(size_t copied = 0; copied != len;)
+            {
+                while(current.size() == 0)
+                {
+                    current = boost::asio::const_buffer(*iter++);
+                }
+                size_t n = std::min(current.size(), len - copied);
+                std::memcpy(payload + copied, current.data(), n);
+                current += n;
+                copied += n;
+            }
+            seal_chunk(e, chunk, 2);
+            seal_chunk(e, payload, len);
+            left -= len;
+        }
+        return total;
+    }
+
+    boost::asio::const_buffer wire() const noexcept
+    {
+        return boost::asio::buffer(out_);
+    }
+
+private:
+    static const method & checked(const std::string & method_name)
+    {
+        auto m = find(method_name);
+        if(!m)
+        {
+            throw boost::system::system_error(msocks::errc::cipher_algo_not_found, msocks::socks_category());
+        }
+        return *m;
+    }
+
+    void derive(engine & e, const uint8_t * salt)
+    {
+        set_subkey(e, key_.data(), salt);
+        e.keyed_ = true;
+    }
+
+    void set_subkey(engine & e, const uint8_t * key, const uint8_t * salt)
+    {
+        static const uint8_t info[] = {'s', 's', '-', 's', 'u', 'b', 'k', 'e', 'y'};
+        auto subkey = kdf_->derive_key(key_.size(), key, key_.size(), salt, salt_.size(), info, sizeof(info));
+        e.mode_->set_key(subkey.data(), subkey.size());
+    }
+
+    // keys e with the first key of keys_ that opens the length block
+    // after salt, which stays sealed for commit to open again
+    bool identify(engine & e, const uint8_t * salt)
+    {
+        const uint8_t * block = salt + salt_.size();
+        identified_ = keys_->find(
+            [&](const uint8_t * key)
+            {
+                set_subkey(e, key, salt);
+                e.mode_->start(e.nonce_.data(), e.nonce_.size());
+                e.tail_.assign(block, block + 2 + tag_size);
+                try
+                {
+                    e.mode_->finish(e.tail_);
+                }
+                catch(const Botan::Exception &)
+                {
+                    return false;
+                }
+                return true;
+            });
+        if(identified_ == key_set::npos)
+        {
+            return false;
+        }
+        // the reply is sealed under the same key
+        std::copy(keys_->key(identified_), keys_->key(identified_) + key_.size(), key_.begin());
+        e.keyed_ = true;
+        return true;
+    }
+
+    static void increment(std::array<uint8_t, 12> & nonce) noexcept
+    {
+        for(auto & b : nonce)
+        {
+            if(++b != 0)
+            {
+                break;
+            }
+        }
+    }
+
+    // the aligned bulk goes through process() in place, only the
+    // remainder and the tag take the detour through tail_
+    static void seal_chunk(engine & e, uint8_t * data, size_t len)
+    {
+        e.mode_->start(e.nonce_.data(), e.nonce_.size());
+        size_t aligned = len - len % e.mode_->update_granularity();
+        if(aligned != 0)
+        {
+            e.mode_->process(data, aligned);
+        }
+        e.tail_.assign(data + aligned, data + len);
+        e.mode_->finish(e.tail_);
+        std::copy(e.tail_.begin(), e.tail_.end(), data + aligned);
+        increment(e.nonce_);
+    }
+
+    static bool open_chunk(engine & e, uint8_t * data, size_t len)
+    {
+        e.mode_->start(e.nonce_.data(), e.nonce_.size());
+        size_t aligned = len - len % e.mode_->update_granularity();
+        if(aligned != 0)
+        {
+            e.mode_->process(data, aligned);
+        }
+        e.tail_.assign(data + aligned, data + len + tag_size);
+        try
+        {
+            e.mode_->finish(e.tail_);
+        }
+        catch(const Botan::Exception &)
+        {
+            return false;
+        }
+        std::copy(e.tail_.begin(), e.tail_.end(), data + aligned);
+        increment(e.nonce_);
+        return true;
+    }
+
+    std::array<engine, 2> engine_;
+    std::shared_ptr<const Botan::KDF> kdf_;
+    std::vector<uint8_t> key_;
+    std::vector<uint8_t> salt_;
+    key_set * keys_ = nullptr;
+    size_t identified_ = key_set::npos;
+
+    // [plain_begin_, plain_end_) opened, [cipher_begin_, cipher_end_) sealed
+    std::vector<uint8_t> in_;
+    size_t plain_begin_ = 0;
+    size_t plain_end_ = 0;
+    size_t cipher_begin_ = 0;
+    size_t cipher_end_ = 0;
+    size_t payload_wanted_ = 0;
+
+    std::vector<uint8_t> out_;
+};
+
+}
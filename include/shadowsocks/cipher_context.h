@@ -1,26 +1,50 @@
 #pragma once
 
 #include <botan/stream_cipher.h>
-#include <botan/auto_rng.h>
+#include <botan/chacha.h>
+
+#include <shadowsocks/random_pool.h>
 
-#include <shadowsocks/cipher_context.h>
 #include  <msocks/utility/socks_erorr.hpp>
 
+#include <memory>
+#include <optional>
+#include <type_traits>
+
 namespace shadowsocks
 {
 
-class cipher_context
+// stream cipher state of both directions. Cipher is either the abstract
+// Botan::StreamCipher, looked up by name, or a concrete final cipher such as
+// Botan::ChaCha, held by value so its calls are not virtual and a keyed
+// prototype is copied instead of running create() and the key schedule.
+template <typename Cipher>
+class basic_cipher_context
 {
+    using holder = std::conditional_t<std::is_abstract_v<Cipher>, std::unique_ptr<Cipher>, std::optional<Cipher>>;
+
     struct engine
     {
-        std::unique_ptr<Botan::StreamCipher> cipher_;
+        holder cipher_;
         size_t iv_wanted_;
         std::vector<uint8_t> iv_;
     };
 
 public:
-    cipher_context(const std::string & algo_spec, const std::vector<uint8_t> & key, size_t iv_length)
+    // method name of the plaintext mode, bytes pass through untouched
+    static constexpr const char * plain_method = "none";
+
+    basic_cipher_context(const std::string & algo_spec, const std::vector<uint8_t> & key, size_t iv_length)
     {
+        static_assert(std::is_abstract_v<Cipher>, "concrete ciphers are built from a keyed prototype");
+        if(algo_spec == plain_method)
+        {
+            for(auto & i : engine_)
+            {
+                i.iv_wanted_ = 0;
+            }
+            return;
+        }
         for(auto & i : engine_)
         {
             i.cipher_ = Botan::StreamCipher::create(algo_spec);
@@ -28,13 +52,13 @@ public:
             {
                 throw boost::system::system_error(msocks::errc::cipher_algo_not_found, msocks::socks_category());
             }
-            
+
             if(!i.cipher_->valid_keylength(key.size()))
             {
                 throw boost::system::system_error(msocks::errc::cipher_keylength_invalid, msocks::socks_category());
             }
             i.cipher_->set_key(key);
-            
+
             if(!i.cipher_->valid_iv_length(iv_length))
             {
                 throw boost::system::system_error(msocks::errc::cipher_ivlength_invalid, msocks::socks_category());
@@ -42,10 +66,55 @@ public:
             i.iv_wanted_ = iv_length;
             i.iv_.resize(iv_length);
         }
-        Botan::AutoSeeded_RNG{}.randomize(engine_[1].iv_.data(), engine_[1].iv_.size());
+        random_pool::local().fill(engine_[1].iv_.data(), engine_[1].iv_.size());
+    }
+
+    // both directions start from prototype, which already carries the key
+    basic_cipher_context(const Cipher & prototype, const std::vector<uint8_t> & key, size_t iv_length)
+    {
+        for(auto & i : engine_)
+        {
+            if constexpr (std::is_abstract_v<Cipher>)
+            {
+                i.cipher_.reset(prototype.clone());
+            }
+            else
+            {
+                i.cipher_.emplace(prototype);
+            }
+            i.iv_.resize(iv_length);
+        }
+        rekey(prototype, key);
+    }
+
+    // back to a fresh connection without giving up the cipher objects
+    void rekey(const Cipher & prototype, const std::vector<uint8_t> & key)
+    {
+        for(auto & i : engine_)
+        {
+            if constexpr (std::is_abstract_v<Cipher>)
+            {
+                i.cipher_->set_key(key);
+            }
+            else
+            {
+                *i.cipher_ = prototype;
+            }
+            i.iv_wanted_ = i.iv_.size();
+        }
+        random_pool::local().fill(engine_[1].iv_.data(), engine_[1].iv_.size());
+    }
+
+    bool plain() const noexcept
+    {
+        return !engine_[0].cipher_;
     }
 
     std::array<engine, 2> engine_;
 };
 
+using cipher_context = basic_cipher_context<Botan::StreamCipher>;
+
+using chacha_context = basic_cipher_context<Botan::ChaCha>;
+
 }
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <shadowsocks/cipher_context.h>
+#include <shadowsocks/aead_context.h>
+#include <shadowsocks/packet_context.h>
+
+#include <variant>
+
+namespace shadowsocks
+{
+
+// the framing of a stream, stream cipher or AEAD depending on the method
+using context = std::variant<cipher_context, chacha_context, aead_context>;
+
+inline context make_context(const std::string & method, const std::vector<uint8_t> & key, size_t iv_length)
+{
+    if(aead_context::find(method))
+    {
+        return context{std::in_place_type<aead_context>, method, key};
+    }
+    return context{std::in_place_type<cipher_context>, method, key, iv_length};
+}
+
+// length of the key derived from the password for method
+inline size_t key_size(const std::string & method)
+{
+    if(auto m = aead_context::find(method))
+    {
+        return m->key_size;
+    }
+    return 32;
+}
+
+// resolves the method once and keeps a keyed prototype around, so a new
+// session costs a copy of the cipher state instead of a lookup by name and a
+// key schedule, and a recycled one rekeys its context in place. Checks
+// method, key and iv length up front, one factory per worker thread.
+class context_factory
+{
+public:
+    context_factory(const std::string & method, const std::vector<uint8_t> & key, size_t iv_length)
+        : key_(key)
+        , iv_length_(iv_length)
+        , aead_(aead_context::find(method))
+    {
+        if(aead_)
+        {
+            if(key_.size() != aead_->key_size)
+            {
+                throw boost::system::system_error(msocks::errc::cipher_keylength_invalid, msocks::socks_category());
+            }
+            if(!Botan::AEAD_Mode::create(aead_->algo_spec, Botan::ENCRYPTION))
+            {
+                throw boost::system::system_error(msocks::errc::cipher_algo_not_found, msocks::socks_category());
+            }
+            kdf_ = Botan::KDF::create_or_throw("HKDF(SHA-1)");
+            return;
+        }
+        if(method == cipher_context::plain_method)
+        {
+            return;
+        }
+        std::unique_ptr<Botan::StreamCipher> cipher;
+        if(auto rounds = chacha_rounds(method))
+        {
+            chacha_.emplace(rounds);
+        }
+        else
+        {
+            cipher = Botan::StreamCipher::create(method);
+            if(!cipher)
+            {
+                throw boost::system::system_error(msocks::errc::cipher_algo_not_found, msocks::socks_category());
+            }
+        }
+        Botan::StreamCipher & prototype = chacha_ ? static_cast<Botan::StreamCipher &>(*chacha_) : *cipher;
+        if(!prototype.valid_keylength(key_.size()))
+        {
+            throw boost::system::system_error(msocks::errc::cipher_keylength_invalid, msocks::socks_category());
+        }
+        if(!prototype.valid_iv_length(iv_length_))
+        {
+            throw boost::system::system_error(msocks::errc::cipher_ivlength_invalid, msocks::socks_category());
+        }
+        prototype.set_key(key_);
+        stream_ = std::move(cipher);
+    }
+
+    context create() const
+    {
+        if(aead_)
+        {
+            return context{std::in_place_type<aead_context>, *aead_, key_, kdf_};
+        }
+        if(chacha_)
+        {
+            return context{std::in_place_type<chacha_context>, *chacha_, key_, iv_length_};
+        }
+        if(stream_)
+        {
+            return context{std::in_place_type<cipher_context>, *stream_, key_, iv_length_};
+        }
+        return context{std::in_place_type<cipher_context>, cipher_context::plain_method, key_, iv_length_};
+    }
+
+    // the UDP framing of the same method and key, one per relay
+    packet_context create_packet() const
+    {
+        if(aead_)
+        {
+            return packet_context{*aead_, key_, kdf_};
+        }
+        std::unique_ptr<Botan::StreamCipher> cipher;
+        if(chacha_)
+        {
+            cipher.reset(chacha_->clone());
+        }
+        else if(stream_)
+        {
+            cipher.reset(stream_->clone());
+        }
+        else
+        {
+            return packet_context{};
+        }
+        cipher->set_key(key_);
+        return packet_context{std::move(cipher), iv_length_};
+    }
+
+    // prepares ctx of a finished connection for the next one
+    void reset(context & ctx) const
+    {
+        if(auto aead = std::get_if<aead_context>(&ctx); aead && aead_)
+        {
+            aead->rekey();
+        }
+        else if(auto chacha = std::get_if<chacha_context>(&ctx); chacha && chacha_)
+        {
+            chacha->rekey(*chacha_, key_);
+        }
+        else if(auto stream = std::get_if<cipher_context>(&ctx); stream && stream_ && !stream->plain())
+        {
+            stream->rekey(*stream_, key_);
+        }
+        else
+        {
+            ctx = create();
+        }
+    }
+
+private:
+    // rounds of a "ChaCha(n)" method, 0 for anything else
+    static size_t chacha_rounds(const std::string & method)
+    {
+        for(size_t rounds : {8, 12, 20})
+        {
+            if(method == "ChaCha(" + std::to_string(rounds) + ")")
+            {
+                return rounds;
+            }
+        }
+        return 0;
+    }
+
+    std::vector<uint8_t> key_;
+    size_t iv_length_;
+    const aead_context::method * aead_;
+    std::shared_ptr<const Botan::KDF> kdf_;
+    std::optional<Botan::ChaCha> chacha_;
+    std::unique_ptr<Botan::StreamCipher> stream_;
+};
+
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <boost/asio.hpp>
+
+#include <shadowsocks/aead_context.h>
+
+namespace shadowsocks
+{
+
+namespace detail
+{
+
+template <typename Stream, typename MutableBufferSequence, typename Handler>
+class aead_read_op
+{
+public:
+    aead_read_op(Stream & next_layer, aead_context & ctx, const MutableBufferSequence & buffers, Handler & h)
+        : next_layer_(next_layer)
+        , context_(ctx)
+        , buffers_(buffers)
+        , handler_(std::move(h))
+    {
+    }
+
+    void operator()(boost::system::error_code ec,
+        std::size_t bytes_transferred, int start = 0)
+    {
+        switch (start_ = start)
+        {
+        case 1:
+            if(context_.pending() != 0 || boost::asio::buffer_size(buffers_) == 0)
+            {
+                // plaintext of an earlier read is handed out without touching the socket
+                boost::asio::post(next_layer_.get_executor(),
+                    boost::asio::detail::bind_handler(std::move(*this), ec, 0));
+                return;
+            }
+            reading_ = true;
+            next_layer_.async_read_some(context_.read_space(), std::move(*this));
+            return;
+        default:
+            if(reading_)
+            {
+                reading_ = false;
+                if(!ec)
+                {
+                    context_.commit(bytes_transferred, ec);
+                }
+                if(ec)
+                {
+                    handler_(ec, 0);
+                    return;
+                }
+                if(context_.pending() == 0)
+                {
+                    reading_ = true;
+                    next_layer_.async_read_some(context_.read_space(), std::move(*this));
+                    return;
+                }
+            }
+            handler_(ec, context_.take(buffers_));
+            return;
+        }
+    }
+
+    const Handler & handler() const noexcept
+    {
+        return handler_;
+    }
+
+    friend bool asio_handler_is_continuation(aead_read_op * this_handler)
+    {
+        return this_handler->start_ == 0 ? true
+            : boost_asio_handler_cont_helpers::is_continuation(this_handler->handler_);
+    }
+
+private:
+    Stream & next_layer_;
+
+    aead_context & context_;
+
+    MutableBufferSequence buffers_;
+
+    Handler handler_;
+
+    int start_ = 0;
+
+    bool reading_ = false;
+};
+
+template <typename Stream, typename MutableBufferSequence, typename Handler>
+inline void async_read(Stream& next_layer, aead_context & ctx, const MutableBufferSequence & buffers, Handler& handler)
+{
+    aead_read_op<Stream, MutableBufferSequence, Handler>{next_layer, ctx, buffers, handler}(boost::system::error_code{}, 0, 1);
+}
+
+}
+}
+
+namespace boost
+{
+namespace asio
+{
+
+template <typename Stream, typename MutableBufferSequence, typename Handler, typename Allocator>
+struct associated_allocator<shadowsocks::detail::aead_read_op<Stream, MutableBufferSequence, Handler>, Allocator>
+{
+    typedef typename associated_allocator<Handler, Allocator>::type type;
+
+    static type get(const shadowsocks::detail::aead_read_op<Stream, MutableBufferSequence, Handler> & h,
+        const Allocator & a = Allocator()) BOOST_ASIO_NOEXCEPT
+    {
+        return associated_allocator<Handler, Allocator>::get(h.handler(), a);
+    }
+};
+
+template <typename Stream, typename MutableBufferSequence, typename Handler, typename Executor>
+struct associated_executor<shadowsocks::detail::aead_read_op<Stream, MutableBufferSequence, Handler>, Executor>
+{
+    typedef typename associated_executor<Handler, Executor>::type type;
+
+    static type get(const shadowsocks::detail::aead_read_op<Stream, MutableBufferSequence, Handler> & h,
+        const Executor & ex = Executor()) BOOST_ASIO_NOEXCEPT
+    {
+        return associated_executor<Handler, Executor>::get(h.handler(), ex);
+    }
+};
+
+}
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <boost/asio.hpp>
+
+#include <shadowsocks/aead_context.h>
+#include <shadowsocks/detail/write_op.h>
+
+namespace shadowsocks
+{
+namespace detail
+{
+
+template <typename Stream, typename ConstBufferSequence, typename Handler>
+class aead_write_op
+{
+public:
+    aead_write_op(Stream & next_layer, aead_context & ctx, const ConstBufferSequence & buffers, Handler & h)
+        : next_layer_(next_layer)
+        , context_(ctx)
+        , buffers_(buffers)
+        , handler_(std::move(h))
+    {
+    }
+
+    void operator()(boost::system::error_code ec,
+        std::size_t bytes_transferred, int start = 0)
+    {
+        switch (start_ = start)
+        {
+        case 1:
+            bytes_sealed_ = context_.seal(buffers_);
+            if(bytes_sealed_ == 0)
+            {
+                boost::asio::post(next_layer_.get_executor(),
+                    boost::asio::detail::bind_handler(std::move(*this), ec, 0));
+                return;
+            }
+            boost::asio::async_write(next_layer_, context_.wire(), transfer_all_at_once(), std::move(*this));
+            return;
+        default:
+            (void)bytes_transferred;
+            handler_(ec, ec ? 0 : bytes_sealed_);
+            return;
+        }
+    }
+
+    const Handler & handler() const noexcept
+    {
+        return handler_;
+    }
+
+    friend bool asio_handler_is_continuation(aead_write_op * this_handler)
+    {
+        return this_handler->start_ == 0 ? true
+            : boost_asio_handler_cont_helpers::is_continuation(this_handler->handler_);
+    }
+
+private:
+    Stream & next_layer_;
+
+    aead_context & context_;
+
+    ConstBufferSequence buffers_;
+
+    Handler handler_;
+
+    int start_ = 0;
+
+    std::size_t bytes_sealed_ = 0;
+};
+
+template <typename Stream, typename ConstBufferSequence, typename Handler>
+inline void async_write(Stream& next_layer, aead_context & ctx, const ConstBufferSequence & buffers, Handler& handler)
+{
+    aead_write_op<Stream, ConstBufferSequence, Handler>{next_layer, ctx, buffers, handler}(boost::system::error_code{}, 0, 1);
+}
+
+}
+}
+
+namespace boost
+{
+namespace asio
+{
+
+template <typename Stream, typename ConstBufferSequence, typename Handler, typename Allocator>
+struct associated_allocator<shadowsocks::detail::aead_write_op<Stream, ConstBufferSequence, Handler>, Allocator>
+{
+    typedef typename associated_allocator<Handler, Allocator>::type type;
+
+    static type get(const shadowsocks::detail::aead_write_op<Stream, ConstBufferSequence, Handler> & h,
+        const Allocator & a = Allocator()) BOOST_ASIO_NOEXCEPT
+    {
+        return associated_allocator<Handler, Allocator>::get(h.handler(), a);
+    }
+};
+
+template <typename Stream, typename ConstBufferSequence, typename Handler, typename Executor>
+struct associated_executor<shadowsocks::detail::aead_write_op<Stream, ConstBufferSequence, Handler>, Executor>
+{
+    typedef typename associated_executor<Handler, Executor>::type type;
+
+    static type get(const shadowsocks::detail::aead_write_op<Stream, ConstBufferSequence, Handler> & h,
+        const Executor & ex = Executor()) BOOST_ASIO_NOEXCEPT
+    {
+        return associated_executor<Handler, Executor>::get(h.handler(), ex);
+    }
+};
+
+}
+}
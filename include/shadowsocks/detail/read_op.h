@@ -3,6 +3,7 @@
 #include <boost/asio.hpp>
 
 #include <shadowsocks/cipher_context.h>
+#include <msocks/utility/metrics.hpp>
 
 namespace shadowsocks
 {
@@ -10,11 +11,11 @@ namespace shadowsocks
 namespace detail
 {
 
-template <typename Stream, typename MutableBufferSequence, typename Handler>
+template <typename Stream, typename Cipher, typename MutableBufferSequence, typename Handler>
 class read_op
 {
 public:
-    read_op(Stream & next_layer, cipher_context & ctx, const MutableBufferSequence & buffers, Handler & h)
+    read_op(Stream & next_layer, basic_cipher_context<Cipher> & ctx, const MutableBufferSequence & buffers, Handler & h)
         : next_layer_(next_layer)
         , context_(ctx)
         , buffers_(buffers)
@@ -27,7 +28,7 @@ public:
     {
         for(;;)
         {
-            switch (start)
+            switch (start_ = start)
             {
             case 1:
                 if(context_.engine_[0].iv_wanted_ != 0)
@@ -41,9 +42,15 @@ public:
                 start = 2;
                 continue;
             case 0:
+                if(context_.plain())
+                {
+                    handler_(ec, bytes_transferred);
+                    return;
+                }
                 if((context_.engine_[0].iv_wanted_ == 0) || ec)
                 {
                     size_t bytes = bytes_transferred;
+                    msocks::utility::metrics::cipher_timer timer(bytes);
                     for(auto iter = boost::asio::buffer_sequence_begin(buffers_); iter != boost::asio::buffer_sequence_end(buffers_); ++iter)
                     {
                         if(bytes == 0)
@@ -51,7 +58,9 @@ public:
                         boost::asio::mutable_buffer buffer(*iter);
                         if (buffer.size() != 0)
                         {
-                            context_.engine_[0].cipher_->cipher1(reinterpret_cast<uint8_t *>(buffer.data()), std::min(buffer.size(), bytes));
+                            // cipher() rather than cipher1(), which would dispatch virtually again
+                            auto data = reinterpret_cast<uint8_t *>(buffer.data());
+                            context_.engine_[0].cipher_->cipher(data, data, std::min(buffer.size(), bytes));
                             bytes -= std::min(buffer.size(), bytes);
                         }
                     }
@@ -70,104 +79,66 @@ public:
         }
     }
 
+    const Handler & handler() const noexcept
+    {
+        return handler_;
+    }
+
+    friend bool asio_handler_is_continuation(read_op * this_handler)
+    {
+        return this_handler->start_ == 0 ? true
+            : boost_asio_handler_cont_helpers::is_continuation(this_handler->handler_);
+    }
+
 private:
     Stream & next_layer_;
 
-    cipher_context & context_;
+    basic_cipher_context<Cipher> & context_;
 
     MutableBufferSequence buffers_;
 
     Handler handler_;
+
+    int start_ = 0;
 };
 
-template <typename Stream, typename MutableBufferSequence, typename Handler>
-inline void async_read(Stream& next_layer, cipher_context & ctx, const MutableBufferSequence & buffers, Handler& handler)
+template <typename Stream, typename Cipher, typename MutableBufferSequence, typename Handler>
+inline void async_read(Stream& next_layer, basic_cipher_context<Cipher> & ctx, const MutableBufferSequence & buffers, Handler& handler)
 {
-    read_op<Stream, MutableBufferSequence, Handler>{next_layer, ctx, buffers, handler}(boost::system::error_code{}, 0, 1);
+    read_op<Stream, Cipher, MutableBufferSequence, Handler>{next_layer, ctx, buffers, handler}(boost::system::error_code{}, 0, 1);
+}
+
+}
 }
 
-// add later
-//template <typename Stream, typename Operation, typename Handler>
-//inline void* asio_handler_allocate(std::size_t size,
-//    io_op<Stream, Operation, Handler>* this_handler)
-//{
-//  return boost_asio_handler_alloc_helpers::allocate(
-//      size, this_handler->handler_);
-//}
-//
-//template <typename Stream, typename Operation, typename Handler>
-//inline void asio_handler_deallocate(void* pointer, std::size_t size,
-//    io_op<Stream, Operation, Handler>* this_handler)
-//{
-//  boost_asio_handler_alloc_helpers::deallocate(
-//      pointer, size, this_handler->handler_);
-//}
-//
-//template <typename Stream, typename Operation, typename Handler>
-//inline bool asio_handler_is_continuation(
-//    io_op<Stream, Operation, Handler>* this_handler)
-//{
-//  return this_handler->start_ == 0 ? true
-//    : boost_asio_handler_cont_helpers::is_continuation(this_handler->handler_);
-//}
-//
-//template <typename Function, typename Stream,
-//    typename Operation, typename Handler>
-//inline void asio_handler_invoke(Function& function,
-//    io_op<Stream, Operation, Handler>* this_handler)
-//{
-//  boost_asio_handler_invoke_helpers::invoke(
-//      function, this_handler->handler_);
-//}
-//
-//template <typename Function, typename Stream,
-//    typename Operation, typename Handler>
-//inline void asio_handler_invoke(const Function& function,
-//    io_op<Stream, Operation, Handler>* this_handler)
-//{
-//  boost_asio_handler_invoke_helpers::invoke(
-//      function, this_handler->handler_);
-//}
-//
-//template <typename Stream, typename Operation, typename Handler>
-//inline void async_io(Stream& next_layer, stream_core& core,
-//    const Operation& op, Handler& handler)
-//{
-//  io_op<Stream, Operation, Handler>(
-//    next_layer, core, op, handler)(
-//      boost::system::error_code(), 0, 1);
-//}
-//
-//} // namespace detail
-//} // namespace ssl
-//
-//template <typename Stream, typename Operation,
-//    typename Handler, typename Allocator>
-//struct associated_allocator<
-//    ssl::detail::io_op<Stream, Operation, Handler>, Allocator>
-//{
-//  typedef typename associated_allocator<Handler, Allocator>::type type;
-//
-//  static type get(const ssl::detail::io_op<Stream, Operation, Handler>& h,
-//      const Allocator& a = Allocator()) BOOST_ASIO_NOEXCEPT
-//  {
-//    return associated_allocator<Handler, Allocator>::get(h.handler_, a);
-//  }
-//};
-//
-//template <typename Stream, typename Operation,
-//    typename Handler, typename Executor>
-//struct associated_executor<
-//    ssl::detail::io_op<Stream, Operation, Handler>, Executor>
-//{
-//  typedef typename associated_executor<Handler, Executor>::type type;
-//
-//  static type get(const ssl::detail::io_op<Stream, Operation, Handler>& h,
-//      const Executor& ex = Executor()) BOOST_ASIO_NOEXCEPT
-//  {
-//    return associated_executor<Handler, Executor>::get(h.handler_, ex);
-//  }
-//};
+namespace boost
+{
+namespace asio
+{
+
+template <typename Stream, typename Cipher, typename MutableBufferSequence, typename Handler, typename Allocator>
+struct associated_allocator<shadowsocks::detail::read_op<Stream, Cipher, MutableBufferSequence, Handler>, Allocator>
+{
+    typedef typename associated_allocator<Handler, Allocator>::type type;
+
+    static type get(const shadowsocks::detail::read_op<Stream, Cipher, MutableBufferSequence, Handler> & h,
+        const Allocator & a = Allocator()) BOOST_ASIO_NOEXCEPT
+    {
+        return associated_allocator<Handler, Allocator>::get(h.handler(), a);
+    }
+};
+
+template <typename Stream, typename Cipher, typename MutableBufferSequence, typename Handler, typename Executor>
+struct associated_executor<shadowsocks::detail::read_op<Stream, Cipher, MutableBufferSequence, Handler>, Executor>
+{
+    typedef typename associated_executor<Handler, Executor>::type type;
+
+    static type get(const shadowsocks::detail::read_op<Stream, Cipher, MutableBufferSequence, Handler> & h,
+        const Executor & ex = Executor()) BOOST_ASIO_NOEXCEPT
+    {
+        return associated_executor<Handler, Executor>::get(h.handler(), ex);
+    }
+};
 
 }
 }
@@ -1,18 +1,24 @@
 #pragma once
 
 #include <boost/asio.hpp>
+#include <array>
+#include <vector>
 #include <shadowsocks/cipher_context.h>
+#include <msocks/utility/metrics.hpp>
+#include <msocks/utility/transfer_all_at_once.hpp>
 
 namespace shadowsocks
 {
 namespace detail
 {
 
-template <typename Stream, typename ConstBufferSequence, typename Handler>
+using msocks::utility::transfer_all_at_once;
+
+template <typename Stream, typename Cipher, typename ConstBufferSequence, typename Handler>
 class write_op
 {
 public:
-    write_op(Stream & next_layer, cipher_context & ctx, const ConstBufferSequence & buffers, Handler & h)
+    write_op(Stream & next_layer, basic_cipher_context<Cipher> & ctx, const ConstBufferSequence & buffers, Handler & h)
         : next_layer_(next_layer)
         , context_(ctx)
         , buffers_(buffers)
@@ -23,61 +29,129 @@ public:
     void operator()(boost::system::error_code ec,
         std::size_t bytes_transferred, int start = 0)
     {
-        for(;;)
+        switch (start_ = start)
         {
-            switch (start)
+        case 1:
+            if(context_.engine_[1].iv_wanted_ != 0)
             {
-            case 1:
-                if(context_.engine_[1].iv_wanted_ != 0)
+                auto & e = context_.engine_[1];
+                e.iv_wanted_ = 0;
+                e.cipher_->set_iv(e.iv_.data(), e.iv_.size());
+                encrypt();
+                // the iv leaves in the same segment as the first payload
+                iv_size_ = e.iv_.size();
+                std::array<boost::asio::const_buffer, gather_limit> gathered;
+                gathered[0] = boost::asio::buffer(e.iv_);
+                std::size_t count = 1;
+                auto iter = boost::asio::buffer_sequence_begin(buffers_);
+                auto end = boost::asio::buffer_sequence_end(buffers_);
+                for(; iter != end && count != gather_limit; ++iter)
                 {
-                    boost::asio::async_write(next_layer_,
-                        boost::asio::buffer(context_.engine_[1].iv_),
-                        std::move(*this));
-                    return;
+                    gathered[count++] = boost::asio::const_buffer(*iter);
                 }
-                start = 2;
-                continue;
-            case 0:
-                if((context_.engine_[1].iv_wanted_ == 0) || ec)
+                if(iter == end)
                 {
-                    handler_(ec, bytes_transferred);
-                    return;
+                    boost::asio::async_write(next_layer_, gathered, transfer_all_at_once(), std::move(*this));
                 }
-
-                assert(bytes_transferred == context_.engine_[1].iv_wanted_);
-                context_.engine_[1].iv_wanted_ = 0;
-                context_.engine_[1].cipher_->set_iv(context_.engine_[1].iv_.data(),
-                        context_.engine_[1].iv_.size());
-            default:
-                for(auto iter = boost::asio::buffer_sequence_begin(buffers_); iter != boost::asio::buffer_sequence_end(buffers_); ++iter)
+                else
                 {
-                    boost::asio::const_buffer buffer(*iter);
-                    if (buffer.size() != 0)
-                    {
-                        context_.engine_[1].cipher_->cipher1(reinterpret_cast<uint8_t *>(const_cast<void *>((buffer.data()))), buffer.size());
-                    }
+                    std::vector<boost::asio::const_buffer> all(gathered.begin(), gathered.end());
+                    all.insert(all.end(), iter, end);
+                    boost::asio::async_write(next_layer_, all, transfer_all_at_once(), std::move(*this));
                 }
-                boost::asio::async_write(next_layer_, buffers_, std::move(*this));
                 return;
             }
+            encrypt();
+            boost::asio::async_write(next_layer_, buffers_, transfer_all_at_once(), std::move(*this));
+            return;
+        default:
+            handler_(ec, bytes_transferred > iv_size_ ? bytes_transferred - iv_size_ : 0);
+            return;
         }
     }
 
+    const Handler & handler() const noexcept
+    {
+        return handler_;
+    }
+
+    friend bool asio_handler_is_continuation(write_op * this_handler)
+    {
+        return this_handler->start_ == 0 ? true
+            : boost_asio_handler_cont_helpers::is_continuation(this_handler->handler_);
+    }
+
 private:
+    void encrypt()
+    {
+        if(context_.plain())
+        {
+            return;
+        }
+        msocks::utility::metrics::cipher_timer timer(boost::asio::buffer_size(buffers_));
+        for(auto iter = boost::asio::buffer_sequence_begin(buffers_); iter != boost::asio::buffer_sequence_end(buffers_); ++iter)
+        {
+            boost::asio::const_buffer buffer(*iter);
+            if (buffer.size() != 0)
+            {
+                auto data = reinterpret_cast<uint8_t *>(const_cast<void *>((buffer.data())));
+                context_.engine_[1].cipher_->cipher(data, data, buffer.size());
+            }
+        }
+    }
+
     Stream & next_layer_;
 
-    cipher_context & context_;
+    basic_cipher_context<Cipher> & context_;
+
+    static constexpr std::size_t gather_limit = 8;
 
     ConstBufferSequence buffers_;
 
     Handler handler_;
+
+    int start_ = 0;
+
+    std::size_t iv_size_ = 0;
 };
 
-template <typename Stream, typename ConstBufferSequence, typename Handler>
-inline void async_write(Stream& next_layer, cipher_context & ctx, const ConstBufferSequence & buffers, Handler& handler)
+template <typename Stream, typename Cipher, typename ConstBufferSequence, typename Handler>
+inline void async_write(Stream& next_layer, basic_cipher_context<Cipher> & ctx, const ConstBufferSequence & buffers, Handler& handler)
 {
-    write_op<Stream, ConstBufferSequence, Handler>{next_layer, ctx, buffers, handler}(boost::system::error_code{}, 0, 1);
+    write_op<Stream, Cipher, ConstBufferSequence, Handler>{next_layer, ctx, buffers, handler}(boost::system::error_code{}, 0, 1);
+}
+
 }
+}
+
+namespace boost
+{
+namespace asio
+{
+
+template <typename Stream, typename Cipher, typename ConstBufferSequence, typename Handler, typename Allocator>
+struct associated_allocator<shadowsocks::detail::write_op<Stream, Cipher, ConstBufferSequence, Handler>, Allocator>
+{
+    typedef typename associated_allocator<Handler, Allocator>::type type;
+
+    static type get(const shadowsocks::detail::write_op<Stream, Cipher, ConstBufferSequence, Handler> & h,
+        const Allocator & a = Allocator()) BOOST_ASIO_NOEXCEPT
+    {
+        return associated_allocator<Handler, Allocator>::get(h.handler(), a);
+    }
+};
+
+template <typename Stream, typename Cipher, typename ConstBufferSequence, typename Handler, typename Executor>
+struct associated_executor<shadowsocks::detail::write_op<Stream, Cipher, ConstBufferSequence, Handler>, Executor>
+{
+    typedef typename associated_executor<Handler, Executor>::type type;
+
+    static type get(const shadowsocks::detail::write_op<Stream, Cipher, ConstBufferSequence, Handler> & h,
+        const Executor & ex = Executor()) BOOST_ASIO_NOEXCEPT
+    {
+        return associated_executor<Handler, Executor>::get(h.handler(), ex);
+    }
+};
 
 }
 }
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <boost/system/system_error.hpp>
+
+#include <msocks/utility/socks_erorr.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace shadowsocks
+{
+
+// keys of the users sharing a port, back to back in one array so trying
+// them walks contiguous memory. A connection belongs to whoever's key opens
+// its first chunk; keys are tried most recently identified first, so a
+// user reconnecting a lot costs one try. Not thread safe, one per worker.
+class key_set
+{
+public:
+    static constexpr size_t npos = size_t(-1);
+
+    explicit key_set(size_t key_size)
+        : key_size_(key_size)
+    {
+    }
+
+    void add(const std::vector<uint8_t> & key)
+    {
+        if(key.size() != key_size_)
+        {
+            throw boost::system::system_error(msocks::errc::cipher_keylength_invalid, msocks::socks_category());
+        }
+        keys_.insert(keys_.end(), key.begin(), key.end());
+        order_.push_back(uint32_t(order_.size()));
+    }
+
+    size_t size() const noexcept
+    {
+        return order_.size();
+    }
+
+    size_t key_size() const noexcept
+    {
+        return key_size_;
+    }
+
+    const uint8_t * key(size_t i) const noexcept
+    {
+        return keys_.data() + i * key_size_;
+    }
+
+    // index of the first key opens accepts, npos if none does
+    template <typename Opens>
+    size_t find(Opens && opens)
+    {
+        for(size_t n = 0; n != order_.size(); ++n)
+        {
+            uint32_t i = order_[n];
+            if(opens(key(i)))
+            {
+                std::rotate(order_.begin(), order_.begin() + n, order_.begin() + n + 1);
+                return i;
+            }
+        }
+        return npos;
+    }
+
+private:
+    size_t key_size_;
+    std::vector<uint8_t> keys_;
+    // indices into keys_, most recently identified first
+    std::vector<uint32_t> order_;
+};
+
+}
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <botan/aead.h>
+#include <botan/kdf.h>
+#include <botan/stream_cipher.h>
+
+#include <shadowsocks/aead_context.h>
+#include <shadowsocks/random_pool.h>
+
+#include <msocks/utility/metrics.hpp>
+
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <vector>
+
+namespace shadowsocks
+{
+
+// the shadowsocks UDP framing, every datagram stands on its own:
+// [iv][encrypted address and payload] for stream ciphers and
+// [salt][sealed address and payload][tag] for AEAD, under a subkey derived
+// from the datagram's salt and a zero nonce. Works in place: the plaintext
+// sits prefix() bytes into the datagram, the tag follows it.
+class packet_context
+{
+public:
+    // plaintext, the "none" method
+    packet_context() = default;
+
+    // cipher is keyed and used for nothing else
+    packet_context(std::unique_ptr<Botan::StreamCipher> cipher, size_t iv_length)
+        : stream_(std::move(cipher))
+        , prefix_(iv_length)
+    {
+    }
+
+    packet_context(const aead_context::method & m, const std::vector<uint8_t> & key, std::shared_ptr<const Botan::KDF> kdf)
+        : seal_(Botan::AEAD_Mode::create(m.algo_spec, Botan::ENCRYPTION))
+        , open_(Botan::AEAD_Mode::create(m.algo_spec, Botan::DECRYPTION))
+        , kdf_(std::move(kdf))
+        , key_(key)
+        , prefix_(m.key_size)
+        , tag_(aead_context::tag_size)
+    {
+        if(!seal_ || !open_)
+        {
+            throw boost::system::system_error(msocks::errc::cipher_algo_not_found, msocks::socks_category());
+        }
+    }
+
+    // iv or salt in front of the plaintext
+    size_t prefix() const noexcept
+    {
+        return prefix_;
+    }
+
+    // bytes a datagram carries besides its plaintext
+    size_t overhead() const noexcept
+    {
+        return prefix_ + tag_;
+    }
+
+    // the n bytes at data + prefix() get their iv or salt in front and
+    // their tag behind, returns the size of the datagram
+    size_t seal(uint8_t * data, size_t n)
+    {
+        if(prefix_ == 0)
+        {
+            return n;
+        }
+        msocks::utility::metrics::cipher_timer timer(n);
+        random_pool::local().fill(data, prefix_);
+        uint8_t * plain = data + prefix_;
+        if(stream_)
+        {
+            stream_->set_iv(data, prefix_);
+            stream_->cipher(plain, plain, n);
+            return prefix_ + n;
+        }
+        derive(*seal_, data);
+        seal_->start(zero_nonce_.data(), zero_nonce_.size());
+        size_t aligned = n - n % seal_->update_granularity();
+        if(aligned != 0)
+        {
+            seal_->process(plain, aligned);
+        }
+        tail_.assign(plain + aligned, plain + n);
+        seal_->finish(tail_);
+        std::copy(tail_.begin(), tail_.end(), plain + aligned);
+        return prefix_ + n + tag_;
+    }
+
+    // opens the datagram of n bytes in place, the plaintext, n bytes
+    // afterwards, starts at data + prefix(). False when it is too short
+    // or was not sealed with our key
+    bool open(uint8_t * data, size_t & n)
+    {
+        if(prefix_ == 0)
+        {
+            return true;
+        }
+        if(n < overhead())
+        {
+            return false;
+        }
+        size_t len = n - overhead();
+        msocks::utility::metrics::cipher_timer timer(len);
+        uint8_t * plain = data + prefix_;
+        if(stream_)
+        {
+            stream_->set_iv(data, prefix_);
+            stream_->cipher(plain, plain, len);
+            n = len;
+            return true;
+        }
+        derive(*open_, data);
+        open_->start(zero_nonce_.data(), zero_nonce_.size());
+        size_t aligned = len - len % open_->update_granularity();
+        if(aligned != 0)
+        {
+            open_->process(plain, aligned);
+        }
+        tail_.assign(plain + aligned, plain + len + tag_);
+        try
+        {
+            open_->finish(tail_);
+        }
+        catch(const Botan::Exception &)
+        {
+            return false;
+        }
+        std::copy(tail_.begin(), tail_.end(), plain + aligned);
+        n = len;
+        return true;
+    }
+
+private:
+    void derive(Botan::AEAD_Mode & mode, const uint8_t * salt)
+    {
+        static const uint8_t info[] = {'s', 's', '-', 's', 'u', 'b', 'k', 'e', 'y'};
+        auto subkey = kdf_->derive_key(key_.size(), key_.data(), key_.size(), salt, prefix_, info, sizeof(info));
+        mode.set_key(subkey.data(), subkey.size());
+    }
+
+    std::unique_ptr<Botan::StreamCipher> stream_;
+    std::unique_ptr<Botan::AEAD_Mode> seal_;
+    std::unique_ptr<Botan::AEAD_Mode> open_;
+    std::shared_ptr<const Botan::KDF> kdf_;
+    std::vector<uint8_t> key_;
+    size_t prefix_ = 0;
+    size_t tag_ = 0;
+    std::array<uint8_t, 12> zero_nonce_{};
+    Botan::secure_vector<uint8_t> tail_;
+};
+
+}
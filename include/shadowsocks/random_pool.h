@@ -0,0 +1,89 @@
+#pragma once
+
+#include <boost/asio/post.hpp>
+
+#include <botan/auto_rng.h>
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+namespace shadowsocks
+{
+
+// per thread stock of random bytes for IVs and salts. The DRBG is seeded
+// once per thread and reseeds itself from the system every so many
+// requests, instead of a fresh AutoSeeded_RNG per connection pulling from
+// the OS. Bytes are generated in batches well ahead of use, each one is
+// handed out once.
+class random_pool
+{
+public:
+    static constexpr size_t capacity = 16 * 1024;
+    // below this much stock a refill is scheduled
+    static constexpr size_t low_watermark = capacity / 4;
+
+    static random_pool & local()
+    {
+        thread_local random_pool pool;
+        return pool;
+    }
+
+    void fill(uint8_t * out, size_t n)
+    {
+        if(n > capacity)
+        {
+            rng_.randomize(out, n);
+            return;
+        }
+        if(end_ - begin_ < n)
+        {
+            // the stock ran dry before a scheduled refill ran
+            refill();
+        }
+        std::memcpy(out, bytes_.data() + begin_, n);
+        // used bytes never stay behind in memory
+        std::memset(bytes_.data() + begin_, 0, n);
+        begin_ += n;
+    }
+
+    // tops the stock up later on ex once it runs low, so accepting
+    // connections never waits for the DRBG
+    template <typename Executor>
+    void schedule_refill(const Executor & ex)
+    {
+        if(refill_pending_ || end_ - begin_ >= low_watermark)
+        {
+            return;
+        }
+        refill_pending_ = true;
+        boost::asio::post(ex, [this]
+        {
+            refill_pending_ = false;
+            refill();
+        });
+    }
+
+    void refill()
+    {
+        std::memmove(bytes_.data(), bytes_.data() + begin_, end_ - begin_);
+        end_ -= begin_;
+        begin_ = 0;
+        rng_.randomize(bytes_.data() + end_, capacity - end_);
+        end_ = capacity;
+    }
+
+private:
+    random_pool()
+    {
+        refill();
+    }
+
+    Botan::AutoSeeded_RNG rng_;
+    std::array<uint8_t, capacity> bytes_;
+    size_t begin_ = 0;
+    size_t end_ = 0;
+    bool refill_pending_ = false;
+};
+
+}
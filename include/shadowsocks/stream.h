@@ -2,9 +2,11 @@
 
 #include <boost/asio.hpp>
 
-#include <shadowsocks/cipher_context.h>
+#include <shadowsocks/context.h>
 #include <shadowsocks/detail/read_op.h>
 #include <shadowsocks/detail/write_op.h>
+#include <shadowsocks/detail/aead_read_op.h>
+#include <shadowsocks/detail/aead_write_op.h>
 
 namespace shadowsocks
 {
@@ -13,8 +15,12 @@ template <typename Stream>
 class stream
 {
 public:
+    using executor_type = typename Stream::executor_type;
+
+    using lowest_layer_type = typename Stream::lowest_layer_type;
+
     template<typename Arg>
-    stream(Arg && arg, cipher_context && ctx)
+    stream(Arg && arg, context && ctx)
         : next_layer_(std::move(arg))
         , context_(std::move(ctx))
     {
@@ -38,6 +44,59 @@ public:
         return  next_layer_;
     }
 
+    shadowsocks::context & get_context() noexcept
+    {
+        return context_;
+    }
+
+    // bytes pass through untouched
+    bool plain() const noexcept
+    {
+        auto ctx = std::get_if<cipher_context>(&context_);
+        return ctx && ctx->plain();
+    }
+
+    lowest_layer_type & lowest_layer()
+    {
+        return next_layer_.lowest_layer();
+    }
+
+    executor_type get_executor() noexcept
+    {
+        return next_layer_.get_executor();
+    }
+
+    // bytes that can be read without blocking, AEAD plaintext already
+    // opened counts before the socket
+    std::size_t available(boost::system::error_code & ec)
+    {
+        auto aead = std::get_if<aead_context>(&context_);
+        if(aead && aead->pending() != 0)
+        {
+            ec = {};
+            return aead->pending();
+        }
+        return next_layer_.available(ec);
+    }
+
+    template <typename WaitHandler>
+    BOOST_ASIO_INITFN_RESULT_TYPE(WaitHandler, void (boost::system::error_code))
+    async_wait(boost::asio::socket_base::wait_type w, BOOST_ASIO_MOVE_ARG(WaitHandler) handler)
+    {
+        boost::asio::async_completion<WaitHandler, void (boost::system::error_code)> init(handler);
+        auto aead = std::get_if<aead_context>(&context_);
+        if(w == boost::asio::socket_base::wait_read && aead && aead->pending() != 0)
+        {
+            boost::asio::post(get_executor(),
+                boost::asio::detail::bind_handler(std::move(init.completion_handler), boost::system::error_code{}));
+        }
+        else
+        {
+            next_layer_.async_wait(w, std::move(init.completion_handler));
+        }
+        return init.result.get();
+    }
+
     template <typename ConstBufferSequence, typename WriteHandler>
     BOOST_ASIO_INITFN_RESULT_TYPE(WriteHandler,
         void (boost::system::error_code, std::size_t))
@@ -51,7 +110,10 @@ public:
       boost::asio::async_completion<WriteHandler,
         void (boost::system::error_code, std::size_t)> init(handler);
 
-      detail::async_write(next_layer_, context_, buffers, init.completion_handler);
+      std::visit([&](auto & ctx)
+          {
+              detail::async_write(next_layer_, ctx, buffers, init.completion_handler);
+          }, context_);
 
       return init.result.get();
     }
@@ -69,7 +131,10 @@ public:
       boost::asio::async_completion<ReadHandler,
         void (boost::system::error_code, std::size_t)> init(handler);
 
-      detail::async_read(next_layer_, context_, buffers, init.completion_handler);
+      std::visit([&](auto & ctx)
+          {
+              detail::async_read(next_layer_, ctx, buffers, init.completion_handler);
+          }, context_);
 
       return init.result.get();
     }
@@ -77,7 +142,7 @@ public:
 private:
     Stream next_layer_;
 
-    cipher_context context_;
+    shadowsocks::context context_;
 };
 
 }
@@ -0,0 +1,300 @@
+#include <msocks/config.hpp>
+
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include <botan/md5.h>
+
+#include <fstream>
+#include <set>
+#include <thread>
+
+namespace msocks
+{
+
+std::vector<uint8_t> password_key(const std::string& password, std::size_t key_size)
+{
+	std::vector<std::vector<uint8_t>> m;
+	std::vector<uint8_t> password1(password.begin(), password.end());
+	std::vector<uint8_t> data;
+	Botan::MD5 md5;
+	int i = 0;
+	while (m.size() * 16 < key_size)
+	{
+		if (i == 0)
+		{
+			data = password1;
+		}
+		else
+		{
+			data = m[i - 1];
+			std::copy(password1.begin(), password1.end(), std::back_inserter(data));
+		}
+		i++;
+		auto hash_result = md5.process(data.data(), data.size());
+		m.push_back(std::vector<uint8_t>(hash_result.begin(), hash_result.end()));
+	}
+	std::vector<uint8_t> key;
+	for (auto& mh : m)
+	{
+		std::copy(mh.begin(), mh.end(), std::back_inserter(key));
+	}
+	return std::vector<uint8_t>(key.begin(), key.begin() + key_size);
+}
+
+namespace
+{
+
+listen_config load_listen(const boost::property_tree::ptree& tree, const config& cfg)
+{
+	listen_config listen;
+	listen.backlog = tree.get<int>("backlog", listen.backlog);
+	// workers share the listening sockets' ports
+	listen.reuse_port = tree.get<bool>("reuse_port", false) || cfg.workers > 1;
+	listen.acceptors = tree.get<std::size_t>("acceptors", listen.acceptors);
+	listen.accept_batch = tree.get<std::size_t>("accept_batch", listen.accept_batch);
+	listen.max_handshakes = tree.get<std::size_t>("max_handshakes", listen.max_handshakes);
+	return listen;
+}
+
+// "inbound" and "outbound": {"no_delay": true, "send_buffer": 0,
+// "receive_buffer": 0, "quick_ack": false, "notsent_lowat": 0,
+// "congestion": "bbr", "keepalive": 0, "keepalive_interval": 0,
+// "keepalive_count": 0, "interface": "eth0"}, outbound also "source"
+utility::socket_profile load_profile(const boost::property_tree::ptree& tree, const char* name, bool outbound)
+{
+	utility::socket_profile profile;
+	auto child = tree.get_child_optional(name);
+	if (!child)
+	{
+		return profile;
+	}
+	profile.no_delay = child->get<bool>("no_delay", profile.no_delay);
+	profile.send_buffer = child->get<int>("send_buffer", 0);
+	profile.receive_buffer = child->get<int>("receive_buffer", 0);
+	profile.quick_ack = child->get<bool>("quick_ack", false);
+	profile.notsent_lowat = child->get<int>("notsent_lowat", 0);
+	profile.congestion = child->get<std::string>("congestion", "");
+	profile.keepalive_idle = std::chrono::seconds(child->get<long>("keepalive", 0));
+	profile.keepalive_interval = std::chrono::seconds(child->get<long>("keepalive_interval", 0));
+	profile.keepalive_count = child->get<int>("keepalive_count", 0);
+	profile.interface = child->get<std::string>("interface", "");
+	auto source = outbound ? child->get<std::string>("source", "") : std::string();
+	if (!source.empty())
+	{
+		profile.source = ip::make_address(source);
+	}
+	// an option the host refuses fails the load instead of every connection
+	io_context ioc;
+	utility::tcp_socket probe(ioc);
+	probe.open(profile.source.is_v6() ? ip::tcp::v6() : ip::tcp::v4());
+	error_code ec;
+	utility::apply(profile, probe, ec);
+	if (ec)
+	{
+		throw boost::property_tree::ptree_bad_data(std::string(name) + ": " + ec.message(), ec.value());
+	}
+	return profile;
+}
+
+// "ports": [{"port": 7000, "users": [{"name": "a", "password": "...",
+// "speed_limit": 512}, ...]}, ...], a user's speed_limit in KiB/s
+void load_ports(const boost::property_tree::ptree& tree, const std::shared_ptr<utility::rate_limiter>& global, server_endpoint_config& server)
+{
+	const auto key_size = shadowsocks::key_size(server.method);
+	std::set<uint16_t> seen;
+	for (auto& [ignored, p] : tree)
+	{
+		server_port_config port;
+		port.port = p.get<uint16_t>("port");
+		if (!seen.insert(port.port).second)
+		{
+			throw boost::property_tree::ptree_bad_data("port listed twice", port.port);
+		}
+		for (auto& [ignored, u] : p.get_child("users"))
+		{
+			server_user_config user;
+			user.name = u.get<std::string>("name", "");
+			user.key = password_key(u.get<std::string>("password"), key_size);
+			std::size_t limit = u.get<std::size_t>("speed_limit", 0) * 1024;
+			user.limiter = std::make_shared<utility::rate_limiter>(limit, limit / 10, global);
+			port.users.push_back(std::move(user));
+		}
+		if (port.users.empty())
+		{
+			throw boost::property_tree::ptree_bad_data("port without users", port.port);
+		}
+		if (port.users.size() > 1 && !shadowsocks::aead_context::find(server.method))
+		{
+			throw boost::system::system_error(errc::cipher_keys_unauthenticated, socks_category());
+		}
+		server.ports.push_back(std::move(port));
+	}
+	if (server.ports.empty())
+	{
+		throw boost::property_tree::ptree_bad_data("no ports", "");
+	}
+}
+
+void load_server(const boost::property_tree::ptree& tree, config& cfg)
+{
+	auto& server = cfg.server;
+	server.inbound = load_profile(tree, "inbound", false);
+	server.outbound = load_profile(tree, "outbound", true);
+	server.server_address = tree.get<std::string>("server");
+	// speed_limit holds for all users and workers together
+	std::size_t speed_limit = tree.get<std::size_t>("speed_limit", 0) * 1024;
+	auto global = std::make_shared<utility::rate_limiter>(speed_limit, speed_limit / 10);
+	if (auto ports = tree.get_child_optional("ports"))
+	{
+		load_ports(*ports, global, server);
+	}
+	else
+	{
+		server.server_port = tree.get<uint16_t>("server_port");
+		server.limiter = std::make_shared<utility::rate_limiter>(0, 0, global);
+	}
+	server.session_speed_limit = tree.get<std::size_t>("session_speed_limit", 0) * 1024;
+	server.session_speed_burst = server.session_speed_limit / 10;
+	server.listen = load_listen(tree, cfg);
+	server.listen.fast_open_queue = tree.get<int>("fast_open_queue", 256);
+	server.fast_open_connect = tree.get<bool>("fast_open", true);
+	server.zero_copy = tree.get<bool>("zero_copy", server.zero_copy);
+	server.zero_copy_threshold = tree.get<std::size_t>("zero_copy_threshold", server.zero_copy_threshold);
+	server.io_uring = tree.get<bool>("io_uring", server.io_uring);
+	server.idle_timeout = std::chrono::seconds(tree.get<long>("idle_timeout", server.idle_timeout.count()));
+	server.half_close_timeout = std::chrono::seconds(tree.get<long>("half_close_timeout", server.half_close_timeout.count()));
+	server.dns_ttl = std::chrono::seconds(tree.get<long>("dns_ttl", server.dns_ttl.count()));
+	server.buffer_min = tree.get<std::size_t>("buffer_min", server.buffer_min);
+	server.buffer_max = tree.get<std::size_t>("buffer_max", server.buffer_max);
+	server.udp = tree.get<bool>("udp", true);
+	server.udp_timeout = std::chrono::seconds(tree.get<long>("udp_timeout", server.udp_timeout.count()));
+	cfg.metrics.port = tree.get<uint16_t>("metrics_port", 0);
+}
+
+void load_client(const boost::property_tree::ptree& tree, config& cfg)
+{
+	auto& client = cfg.client;
+	client.local_address = tree.get<std::string>("local", "127.0.0.1");
+	client.local_port = tree.get<uint16_t>("local_port", 1081);
+	client.listen = load_listen(tree, cfg);
+	client.inbound = load_profile(tree, "inbound", false);
+	client.outbound = load_profile(tree, "outbound", true);
+	// "servers": [{"server": "...", "server_port": 8388}, ...] spreads TCP
+	// over all of them, UDP goes to the first
+	if (auto servers = tree.get_child_optional("servers"))
+	{
+		for (auto& [ignored, s] : *servers)
+		{
+			client.upstreams.push_back({s.get<std::string>("server"), s.get<uint16_t>("server_port")});
+		}
+		if (client.upstreams.empty())
+		{
+			throw boost::property_tree::ptree_bad_data("no servers", "");
+		}
+		client.remote_address = client.upstreams.front().address;
+		client.remote_port = client.upstreams.front().port;
+	}
+	else
+	{
+		client.remote_address = tree.get<std::string>("server");
+		client.remote_port = tree.get<uint16_t>("server_port");
+	}
+	client.probe_interval = std::chrono::seconds(tree.get<long>("probe_interval", client.probe_interval.count()));
+	if (client.probe_interval.count() < 0)
+	{
+		throw boost::property_tree::ptree_bad_data("probe_interval must not be negative", client.probe_interval.count());
+	}
+	client.fast_open = tree.get<bool>("fast_open", true);
+	client.mux_connections = tree.get<std::size_t>("mux", 0);
+	// well below the server's 2 s handshake timeout
+	client.warm_connections = tree.get<std::size_t>("warm_connections", 8);
+	client.warm_ttl = std::chrono::milliseconds(tree.get<long>("warm_ttl", 1500));
+	if (client.warm_ttl.count() <= 0)
+	{
+		throw boost::property_tree::ptree_bad_data("warm_ttl must be positive", client.warm_ttl.count());
+	}
+	// timeout is the server's handshake timeout too, a warm connection
+	// older than that is closed by the server already
+	if (client.mux_connections == 0 && client.warm_connections != 0 && client.warm_ttl >= std::chrono::seconds(client.timeout.total_seconds()))
+	{
+		throw boost::property_tree::ptree_bad_data("warm_ttl must be below the timeout", client.warm_ttl.count());
+	}
+	client.buffer_min = tree.get<std::size_t>("buffer_min", client.buffer_min);
+	client.buffer_max = tree.get<std::size_t>("buffer_max", client.buffer_max);
+	client.udp = tree.get<bool>("udp", true);
+	client.udp_timeout = std::chrono::seconds(tree.get<long>("udp_timeout", client.udp_timeout.count()));
+}
+
+}
+
+config load_config(const boost::property_tree::ptree& tree)
+{
+	config cfg;
+	auto type = tree.get<std::string>("type", "server");
+	if (type != "server" && type != "client")
+	{
+		throw boost::property_tree::ptree_bad_data("type is neither server nor client", type);
+	}
+	cfg.type = type == "server" ? config::Server : config::Client;
+	cfg.workers = tree.get<std::size_t>("workers", 1);
+	if (cfg.workers == 0)
+	{
+		cfg.workers = std::max(1u, std::thread::hardware_concurrency());
+	}
+	cfg.log.level = tree.get<std::string>("log_level", cfg.log.level);
+	utility::log::parse_level(cfg.log.level);
+	cfg.log.site_rate = tree.get<std::size_t>("log_rate", cfg.log.site_rate);
+	cfg.log.queue = tree.get<std::size_t>("log_queue", cfg.log.queue);
+	if (cfg.log.queue == 0)
+	{
+		throw boost::property_tree::ptree_bad_data("log_queue must hold a message", cfg.log.queue);
+	}
+	cfg.trace.rate = tree.get<std::size_t>("trace_rate", cfg.trace.rate);
+	cfg.trace.file = tree.get<std::string>("trace_file", cfg.trace.file);
+	auto method = tree.get<std::string>("method", "ChaCha(20)");
+	// a server with ports has passwords per user instead
+	const bool per_user = cfg.type == config::Server && tree.get_child_optional("ports");
+	auto key = password_key(per_user ? tree.get<std::string>("password", "") : tree.get<std::string>("password"),
+		shadowsocks::key_size(method));
+	auto iv_length = tree.get<std::size_t>("iv_length", 8);
+	auto timeout = boost::posix_time::seconds(tree.get<long>("timeout", 2));
+	// an unknown method fails here rather than on the workers
+	shadowsocks::context_factory(method, key, iv_length);
+	if (cfg.type == config::Server)
+	{
+		cfg.server.method = method;
+		cfg.server.key = key;
+		cfg.server.iv_length = iv_length;
+		cfg.server.timeout = timeout;
+		load_server(tree, cfg);
+	}
+	else
+	{
+		cfg.client.method = method;
+		cfg.client.key = key;
+		cfg.client.iv_length = iv_length;
+		cfg.client.timeout = timeout;
+		load_client(tree, cfg);
+	}
+	return cfg;
+}
+
+config load_config(std::istream& in)
+{
+	boost::property_tree::ptree tree;
+	boost::property_tree::read_json(in, tree);
+	return load_config(tree);
+}
+
+config load_config(const std::string& path)
+{
+	std::ifstream in(path);
+	if (!in)
+	{
+		throw boost::property_tree::json_parser_error("cannot open file", path, 0);
+	}
+	return load_config(in);
+}
+
+}
@@ -4,27 +4,218 @@
 
 #include <msocks/endpoint/client_endpoint.hpp>
 #include <msocks/session/client_session.hpp>
+#include <msocks/mux/client_pool.hpp>
+#include <msocks/utility/socks_address.hpp>
+#include <msocks/utility/socks_constants.hpp>
+#include <shadowsocks/random_pool.h>
+
+#include <algorithm>
 
 namespace msocks
 {
 
+std::shared_ptr<client_session_attribute> client_endpoint::make_attribute(const client_config& cfg) const
+{
+	std::vector<ip::tcp::endpoint> servers;
+	for (auto& upstream : cfg.upstreams)
+	{
+		servers.emplace_back(ip::make_address(upstream.address), upstream.port);
+	}
+	if (servers.empty())
+	{
+		servers.emplace_back(ip::make_address(cfg.remote_address), cfg.remote_port);
+	}
+	auto attribute = std::make_shared<client_session_attribute>();
+	attribute->key = cfg.key;
+	attribute->method = cfg.method;
+	attribute->timeout = cfg.timeout;
+	attribute->upstreams = std::make_shared<upstream_set>(ioc_, std::move(servers), cfg.outbound, cfg.probe_interval);
+	attribute->iv_length = cfg.iv_length;
+	attribute->cipher = std::make_shared<shadowsocks::context_factory>(cfg.method, cfg.key, cfg.iv_length);
+	attribute->buffer_min = cfg.buffer_min;
+	attribute->buffer_max = cfg.buffer_max;
+	attribute->fast_open = cfg.fast_open;
+	attribute->outbound = cfg.outbound;
+	if (cfg.mux_connections != 0)
+	{
+		attribute->mux = std::make_shared<mux::client_pool>(
+			ioc_, attribute->upstreams, attribute->cipher, cfg.mux_connections, cfg.fast_open, cfg.outbound);
+	}
+	else if (cfg.warm_connections != 0)
+	{
+		attribute->warm = std::make_shared<warm_pool>(
+			ioc_, attribute->upstreams, attribute->cipher, cfg.warm_connections, cfg.warm_ttl, cfg.outbound);
+	}
+	return attribute;
+}
+
+std::unique_ptr<udp_client_relay> client_endpoint::make_udp(
+	const client_config& cfg, const shadowsocks::context_factory& cipher, const ip::tcp::endpoint& listen)
+{
+	auto udp = std::make_unique<udp_client_relay>(
+		ioc_, cipher, cfg.udp_timeout,
+		ip::udp::endpoint(ip::make_address(cfg.remote_address), cfg.remote_port));
+	udp->start(ip::udp::endpoint(listen.address(), listen.port()));
+	return udp;
+}
+
+std::vector<uint8_t> client_endpoint::udp_reply(const udp_client_relay& udp)
+{
+	// every UDP ASSOCIATE gets the same reply, naming the relay
+	auto relay = udp.local_endpoint();
+	std::vector<uint8_t> reply{socks::socks5_version, 0x00, 0x00};
+	reply.resize(3 + utility::max_ip_address_size);
+	reply.resize(3 + utility::write_socks_address(reply.data() + 3, relay.address(), relay.port()));
+	return reply;
+}
+
+void client_endpoint::retire(std::unique_ptr<udp_client_relay> udp)
+{
+	if (udp)
+	{
+		udp->stop([this, relay = udp.get()] { forget(relay); });
+		retired_.push_back(std::move(udp));
+	}
+}
+
+void client_endpoint::forget(const udp_client_relay* relay)
+{
+	retired_.erase(
+		std::remove_if(retired_.begin(), retired_.end(), [relay](auto& r) { return r.get() == relay; }),
+		retired_.end());
+}
+
 void client_endpoint::start()
 {
-	const ip::tcp::endpoint listen(ip::make_address_v4(cfg_.local_address), cfg_.local_port);
-	static client_session_attribute attribute;
-	attribute.key = cfg_.key;
-	attribute.method = cfg_.method;
-	attribute.timeout = cfg_.timeout;
-	attribute.remote_address = cfg_.remote_address;
-	attribute.remote_port = cfg_.remote_port;
-    attribute.iv_length = cfg_.iv_length;
-	
+	const ip::tcp::endpoint ep(ip::make_address_v4(cfg_.local_address), cfg_.local_port);
+	auto attribute = make_attribute(cfg_);
+	if (cfg_.udp)
+	{
+		udp_ = make_udp(cfg_, *attribute->cipher, ep);
+		attribute->udp_reply = udp_reply(*udp_);
+	}
+	listen(ep, cfg_.listen);
+	attribute->upstreams->start();
+	if (attribute->warm)
+	{
+		attribute->warm->start();
+	}
+	attribute_ = std::move(attribute);
+}
+
+void client_endpoint::reload(client_config cfg)
+{
+	const ip::tcp::endpoint ep(ip::make_address_v4(cfg.local_address), cfg.local_port);
+	const ip::tcp::endpoint old_ep(ip::make_address_v4(cfg_.local_address), cfg_.local_port);
+	auto attribute = make_attribute(cfg);
+	const bool rebind = ep != old_ep || cfg.listen.rebinds(cfg_.listen);
+	// the udp relay is bound to both addresses
+	const bool restart_udp = rebind ||
+		cfg.remote_address != cfg_.remote_address ||
+		cfg.remote_port != cfg_.remote_port ||
+		cfg.udp != cfg_.udp ||
+		cfg.udp_timeout != cfg_.udp_timeout;
+	// the new sockets are bound next to the old ones, which are let go
+	// first only if that fails, and bound again if the new ones fail still
+	std::unique_ptr<udp_client_relay> udp;
+	auto old = rebind ? take_service() : std::list<utility::tcp_acceptor>{};
+	auto bind = [&]
+	{
+		if (restart_udp && cfg.udp)
+		{
+			udp = make_udp(cfg, *attribute->cipher, ep);
+		}
+		if (rebind)
+		{
+			listen(ep, cfg.listen);
+		}
+	};
+	auto unbind = [&]
+	{
+		if (rebind)
+		{
+			stop_service();
+		}
+		retire(std::move(udp));
+	};
+	try
+	{
+		bind();
+	}
+	catch (std::exception&)
+	{
+		unbind();
+		close_service(std::move(old));
+		if (restart_udp)
+		{
+			retire(std::move(udp_));
+		}
+		try
+		{
+			bind();
+		}
+		catch (std::exception&)
+		{
+			unbind();
+			if (restart_udp && cfg_.udp)
+			{
+				udp_ = make_udp(cfg_, *attribute_->cipher, old_ep);
+			}
+			if (rebind)
+			{
+				listen(old_ep, cfg_.listen);
+			}
+			throw;
+		}
+	}
+	close_service(std::move(old));
+	if (restart_udp)
+	{
+		retire(std::move(udp_));
+		udp_ = std::move(udp);
+		if (udp_)
+		{
+			attribute->udp_reply = udp_reply(*udp_);
+		}
+	}
+	else
+	{
+		if (udp_)
+		{
+			udp_->rekey(*attribute->cipher);
+		}
+		attribute->udp_reply = attribute_->udp_reply;
+	}
+	cfg_ = std::move(cfg);
+	// sessions still connecting keep the old set, unprobed
+	attribute_->upstreams->stop();
+	attribute->upstreams->start();
+	if (attribute_->warm)
+	{
+		attribute_->warm->stop();
+	}
+	if (attribute->warm)
+	{
+		attribute->warm->start();
+	}
+	attribute_ = std::move(attribute);
+	admission_.limit(cfg_.listen.max_handshakes);
+	accept_batch_ = cfg_.listen.accept_batch;
+}
+
+void client_endpoint::listen(const ip::tcp::endpoint& ep, const listen_config& cfg)
+{
 	start_service(
-		[this](ip::tcp::socket socket) -> std::shared_ptr<client_session>
+		[this](utility::tcp_socket socket, utility::admission::ticket handshake) -> std::shared_ptr<client_session>
 		{
-			return std::make_shared<client_session>(std::ref(ioc_), std::move(socket), std::ref(attribute));
+			error_code ec;
+			utility::apply(cfg_.inbound, socket, ec);
+			auto session = std::make_shared<client_session>(std::ref(ioc_), std::move(socket), attribute_, std::move(handshake));
+			shadowsocks::random_pool::local().schedule_refill(ioc_.get_executor());
+			return session;
 		},
-		listen
+		ep,
+		cfg
 	);
 }
 
@@ -0,0 +1,107 @@
+#include <boost/asio/read_until.hpp>
+#include <boost/asio/write.hpp>
+
+#include <msocks/endpoint/metrics_endpoint.hpp>
+#include <msocks/utility/metrics.hpp>
+#include <msocks/utility/trace.hpp>
+
+#include <spdlog/fmt/fmt.h>
+
+namespace msocks
+{
+
+namespace
+{
+
+class metrics_session : public std::enable_shared_from_this<metrics_session>
+{
+public:
+	// longest request head that is read before giving up
+	static constexpr std::size_t max_request = 4096;
+	// a client that has not sent its request by then is dropped
+	static constexpr std::chrono::seconds read_timeout{5};
+
+	explicit metrics_session(utility::tcp_socket socket) :
+		socket_(std::move(socket)),
+		timer_(socket_.get_executor())
+	{}
+
+	void go()
+	{
+		timer_.expires_after(read_timeout);
+		timer_.async_wait(
+			[this, p = shared_from_this()](error_code ec)
+			{
+				if (!ec)
+				{
+					error_code ignored;
+					socket_.close(ignored);
+				}
+			});
+		async_read_until(
+			socket_, dynamic_buffer(request_, max_request), "\r\n\r\n",
+			[this, p = shared_from_this()](error_code ec, std::size_t)
+			{
+				timer_.cancel();
+				if (ec)
+				{
+					return;
+				}
+				respond();
+			});
+	}
+
+private:
+	void respond()
+	{
+		std::string body;
+		const char* status = "200 OK";
+		const char* type = "text/plain; version=0.0.4";
+		if (request_.compare(0, 13, "GET /metrics ") == 0)
+		{
+			body = utility::metrics::scrape();
+		}
+		else if (request_.compare(0, 11, "GET /trace ") == 0)
+		{
+			body = utility::trace::dump();
+			type = "application/json";
+		}
+		else
+		{
+			status = "404 Not Found";
+		}
+		response_ = fmt::format(
+			"HTTP/1.1 {}\r\n"
+			"Content-Type: {}\r\n"
+			"Content-Length: {}\r\n"
+			"Connection: close\r\n\r\n{}",
+			status, type, body.size(), body);
+		async_write(
+			socket_, buffer(response_),
+			[this, p = shared_from_this()](error_code, std::size_t)
+			{
+				error_code ignored;
+				socket_.shutdown(socket_base::shutdown_both, ignored);
+			});
+	}
+
+	utility::tcp_socket socket_;
+	utility::steady_timer timer_;
+	std::string request_;
+	std::string response_;
+};
+
+}
+
+void metrics_endpoint::start()
+{
+	const ip::tcp::endpoint listen(ip::make_address(cfg_.address), cfg_.port);
+	start_service(
+		[](utility::tcp_socket socket, utility::admission::ticket)
+		{
+			return std::make_shared<metrics_session>(std::move(socket));
+		},
+		listen);
+}
+
+}
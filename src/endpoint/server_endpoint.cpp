@@ -3,6 +3,11 @@
 //
 
 #include <msocks/endpoint/server_endpoint.hpp>
+#include <msocks/utility/socks_erorr.hpp>
+#include <shadowsocks/random_pool.h>
+
+#include <algorithm>
+#include <set>
 
 namespace msocks
 {
@@ -10,28 +15,191 @@ namespace msocks
 server_endpoint::server_endpoint(io_context &ioc, pool<server_session> &session_pool, server_endpoint_config cfg) :
 	basic_endpoint(ioc),
 	session_pool_(session_pool),
-	cfg_(std::move(cfg)),
-	limiter_(new utility::rate_limiter(ioc_,cfg_.speed_limit * 1024))
+	cfg_(std::move(cfg))
 {}
 
+std::vector<server_port_config> server_endpoint::ports(const server_endpoint_config& cfg)
+{
+	if (!cfg.ports.empty())
+	{
+		return cfg.ports;
+	}
+	server_port_config port;
+	port.port = cfg.server_port;
+	port.users.push_back(server_user_config{"", cfg.key, cfg.limiter});
+	return {port};
+}
+
+std::shared_ptr<const server_session_attribute> server_endpoint::make_attribute(const server_endpoint_config& cfg, const server_port_config& port)
+{
+	if (port.users.empty())
+	{
+		throw system_error(errc::cipher_keylength_invalid, socks_category());
+	}
+	auto& first = port.users.front();
+	auto attribute = std::make_shared<server_session_attribute>();
+	attribute->timeout = cfg.timeout;
+	attribute->idle_timeout = cfg.idle_timeout;
+	attribute->half_close_timeout = cfg.half_close_timeout;
+	attribute->method = cfg.method;
+	attribute->key = first.key;
+	attribute->limiter = first.limiter;
+	attribute->session_limit = cfg.session_speed_limit;
+	attribute->session_burst = cfg.session_speed_burst;
+	attribute->iv_length = cfg.iv_length;
+	attribute->cipher = std::make_shared<shadowsocks::context_factory>(cfg.method, first.key, cfg.iv_length);
+	for (auto& user : port.users)
+	{
+		attribute->users.push_back(server_user{user.limiter, user.name.empty() ? nullptr : &utility::metrics::user(user.name)});
+	}
+	if (port.users.size() > 1)
+	{
+		// only an authenticated first chunk tells the users apart
+		if (!shadowsocks::aead_context::find(cfg.method))
+		{
+			throw system_error(errc::cipher_keys_unauthenticated, socks_category());
+		}
+		attribute->keys = std::make_shared<shadowsocks::key_set>(first.key.size());
+		for (auto& user : port.users)
+		{
+			attribute->keys->add(user.key);
+		}
+	}
+	attribute->zero_copy = cfg.zero_copy;
+	attribute->zero_copy_threshold = cfg.zero_copy_threshold;
+	attribute->io_uring = cfg.io_uring;
+	attribute->fast_open_connect = cfg.fast_open_connect;
+	attribute->outbound = cfg.outbound;
+	attribute->buffer_min = cfg.buffer_min;
+	attribute->buffer_max = cfg.buffer_max;
+	return attribute;
+}
+
+server_endpoint::ports_type server_endpoint::make_ports(const server_endpoint_config& cfg)
+{
+	const auto address = ip::make_address_v4(cfg.server_address);
+	ports_type result;
+	for (auto& port : ports(cfg))
+	{
+		auto state = std::make_shared<port_state>();
+		state->endpoint = ip::tcp::endpoint(address, port.port);
+		state->attribute = make_attribute(cfg, port);
+		result.push_back(std::move(state));
+	}
+	return result;
+}
+
 void server_endpoint::start()
 {
-	
-	const ip::tcp::endpoint listen(ip::make_address_v4(cfg_.server_address),cfg_.server_port);
-	static server_session_attribute attribute;
-	attribute.timeout = cfg_.timeout;
-	attribute.method = cfg_.method;
-	attribute.key = cfg_.key;
-	attribute.limit = cfg_.speed_limit;
-	attribute.limiter = limiter_;
-    attribute.iv_length = cfg_.iv_length;
-	start_service(
-		[this](ip::tcp::socket socket) -> std::shared_ptr<server_session>
+	ports_ = make_ports(cfg_);
+	use_service<utility::dns_cache>(ioc_).configure(cfg_.dns_ttl, cfg_.dns_negative_ttl);
+	listen(ports_, cfg_);
+}
+
+void server_endpoint::reload(server_endpoint_config cfg)
+{
+	auto ports = make_ports(cfg);
+	bool rebind = ports.size() != ports_.size() ||
+		cfg.listen.rebinds(cfg_.listen) ||
+		cfg.udp != cfg_.udp ||
+		cfg.udp_timeout != cfg_.udp_timeout;
+	for (std::size_t i = 0; !rebind && i != ports.size(); ++i)
+	{
+		rebind = ports[i]->endpoint != ports_[i]->endpoint ||
+			ports[i]->attribute->users.size() != ports_[i]->attribute->users.size();
+	}
+	if (!rebind)
+	{
+		cfg_ = std::move(cfg);
+		admission_.limit(cfg_.listen.max_handshakes);
+		accept_batch_ = cfg_.listen.accept_batch;
+		// the accept loops pick the new attributes up with their next session
+		for (std::size_t i = 0; i != ports.size(); ++i)
+		{
+			ports_[i]->attribute = std::move(ports[i]->attribute);
+			if (ports_[i]->udp)
+			{
+				ports_[i]->udp->rekey(*ports_[i]->attribute->cipher);
+			}
+		}
+		return;
+	}
+	// the new sockets are bound next to the old ones, which are let go
+	// first only if that fails, e.g. on a port without SO_REUSEPORT, and
+	// bound again if the new ones fail still
+	auto old = take_service();
+	try
+	{
+		listen(ports, cfg);
+	}
+	catch (std::exception&)
+	{
+		stop_service();
+		retire(ports);
+		close_service(std::move(old));
+		retire(ports_);
+		try
+		{
+			listen(ports, cfg);
+		}
+		catch (std::exception&)
+		{
+			stop_service();
+			retire(ports);
+			listen(ports_, cfg_);
+			throw;
+		}
+	}
+	close_service(std::move(old));
+	retire(ports_);
+	ports_ = std::move(ports);
+	cfg_ = std::move(cfg);
+}
+
+void server_endpoint::retire(const ports_type& ports)
+{
+	for (auto& port : ports)
+	{
+		if (port->udp)
 		{
-			socket.set_option(ip::tcp::no_delay(cfg_.no_delay));
-			return session_pool_.take(std::ref(ioc_),std::move(socket),std::ref(attribute));
-		},listen);
+			port->udp->stop([this, relay = port->udp.get()] { forget(relay); });
+			retired_.push_back(std::move(port->udp));
+		}
+	}
 }
 
+void server_endpoint::forget(const udp_server_relay* relay)
+{
+	retired_.erase(
+		std::remove_if(retired_.begin(), retired_.end(), [relay](auto& r) { return r.get() == relay; }),
+		retired_.end());
 }
 
+void server_endpoint::listen(const ports_type& ports, const server_endpoint_config& cfg)
+{
+	std::set<uint16_t> bound;
+	for (auto& port : ports)
+	{
+		if (!bound.insert(port->endpoint.port()).second)
+		{
+			spdlog::error("endpoint {}: port listed twice", port->endpoint.port());
+			continue;
+		}
+		if (cfg.udp && port->attribute->users.size() == 1)
+		{
+			port->udp = std::make_unique<udp_server_relay>(ioc_, *port->attribute->cipher, cfg.udp_timeout);
+			port->udp->start(ip::udp::endpoint(port->endpoint.address(), port->endpoint.port()), cfg.listen.reuse_port);
+		}
+		start_service(
+			[this, port](utility::tcp_socket socket, utility::admission::ticket handshake) -> pool<server_session>::pointer_type
+			{
+				error_code ec;
+				utility::apply(cfg_.inbound, socket, ec);
+				auto session = session_pool_.take(std::ref(ioc_),std::move(socket),port->attribute,std::move(handshake));
+				shadowsocks::random_pool::local().schedule_refill(ioc_.get_executor());
+				return session;
+			},port->endpoint, cfg.listen);
+	}
+}
+
+}
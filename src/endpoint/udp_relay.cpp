@@ -0,0 +1,386 @@
+#include <boost/asio/post.hpp>
+
+#include <msocks/endpoint/udp_relay.hpp>
+#include <msocks/utility/dns_cache.hpp>
+#include <msocks/utility/log.hpp>
+#include <msocks/utility/metrics.hpp>
+#include <msocks/utility/socket_option.hpp>
+#include <msocks/utility/socks_address.hpp>
+
+#include <cstring>
+#include <sstream>
+#include <vector>
+
+namespace msocks
+{
+
+basic_udp_relay::basic_udp_relay(io_context& ioc, const shadowsocks::context_factory& cipher, std::chrono::seconds timeout) :
+	ioc_(ioc),
+	socket_(ioc),
+	packet_(cipher.create_packet()),
+	timeout_(timeout)
+{}
+
+void basic_udp_relay::start(const ip::udp::endpoint& listen, bool reuse_port)
+{
+	try
+	{
+		socket_.open(listen.protocol());
+		socket_.set_option(socket_base::reuse_address(true));
+		if (reuse_port)
+		{
+#if defined(SO_REUSEPORT)
+			// the kernel keeps a peer on one worker, by its address
+			socket_.set_option(utility::reuse_port(true));
+#endif
+		}
+		socket_.bind(listen);
+		socket_.non_blocking(true);
+		read_peers();
+	}
+	catch (system_error& e)
+	{
+		std::stringstream ss;
+		ss << listen;
+		spdlog::error("udp relay {}: error {}", ss.str(), e.what());
+		// a reload falls back to the relay it meant to replace
+		throw;
+	}
+}
+
+ip::udp::endpoint basic_udp_relay::local_endpoint() const
+{
+	error_code ignored;
+	return socket_.local_endpoint(ignored);
+}
+
+void basic_udp_relay::rekey(const shadowsocks::context_factory& cipher)
+{
+	packet_ = cipher.create_packet();
+}
+
+void basic_udp_relay::stop(std::function<void()> drained)
+{
+	stopped_ = true;
+	drained_ = std::move(drained);
+	error_code ignored;
+	socket_.close(ignored);
+	hold();
+	post(ioc_, [this] { settle(); });
+}
+
+void basic_udp_relay::settle()
+{
+	if (--pending_ == 0 && stopped_ && drained_)
+	{
+		post(ioc_, std::exchange(drained_, nullptr));
+	}
+}
+
+template <typename Handle>
+error_code basic_udp_relay::drain(utility::udp_socket& socket, Handle handle)
+{
+	error_code ec;
+	for (std::size_t round = 0; round != max_rounds; ++round)
+	{
+		std::size_t n = batch_.receive(socket, ec);
+		if (ec)
+		{
+			return ec;
+		}
+		for (std::size_t i = 0; i != n; ++i)
+		{
+			handle(batch_[i]);
+		}
+	}
+	batch_.flush();
+	return ec;
+}
+
+void basic_udp_relay::read_peers()
+{
+	auto ec = drain(socket_, [this](utility::datagram_batch::datagram& d) { handle_peer(d); });
+	if (!ec)
+	{
+		// more is waiting, sessions on the same thread get a turn first
+		hold();
+		post(ioc_, [this]
+		{
+			read_peers();
+			settle();
+		});
+		return;
+	}
+	if (ec != error::would_block)
+	{
+		// ICMP errors of earlier sends surface here and end nothing
+		MSOCKS_LOG(spdlog::level::debug, "udp relay: {}", ec.message());
+	}
+	hold();
+	socket_.async_wait(
+		socket_base::wait_read,
+		[this](error_code ec)
+		{
+			if (!ec)
+			{
+				read_peers();
+			}
+			settle();
+		});
+}
+
+basic_udp_relay::association* basic_udp_relay::associate(const ip::udp::endpoint& peer, const ip::udp& protocol)
+{
+	if (auto found = nat_.find(peer))
+	{
+		(*found)->timeout.touch();
+		return found->get();
+	}
+	auto a = std::make_shared<association>(ioc_, peer);
+	error_code ec;
+	a->socket.open(protocol, ec);
+	if (!ec && protocol == ip::udp::v6())
+	{
+		a->socket.set_option(ip::v6_only(false), ec);
+	}
+	if (!ec)
+	{
+		a->socket.non_blocking(true, ec);
+	}
+	if (ec)
+	{
+		MSOCKS_LOG(spdlog::level::info, "udp relay: {}", ec.message());
+		utility::metrics::add(utility::metrics::counter::udp_dropped);
+		return nullptr;
+	}
+	a->timeout.schedule(timeout_);
+	nat_.insert(peer, a);
+	// nothing arrives before the first send, waiting right away is enough
+	hold();
+	a->socket.async_wait(
+		socket_base::wait_read,
+		[this, a](error_code ec)
+		{
+			if (ec)
+			{
+				release(a);
+			}
+			else
+			{
+				read_association(a);
+			}
+			settle();
+		});
+	return a.get();
+}
+
+void basic_udp_relay::read_association(association_ptr a)
+{
+	auto ec = drain(a->socket,
+		[this, &a](utility::datagram_batch::datagram& d)
+		{
+			a->timeout.touch();
+			handle_association(*a, d);
+		});
+	if (!ec)
+	{
+		hold();
+		post(ioc_, [this, a]
+		{
+			read_association(a);
+			settle();
+		});
+		return;
+	}
+	if (ec != error::would_block)
+	{
+		// closed by its timeout, or broken
+		release(a);
+		return;
+	}
+	hold();
+	a->socket.async_wait(
+		socket_base::wait_read,
+		[this, a](error_code ec)
+		{
+			if (ec)
+			{
+				release(a);
+			}
+			else
+			{
+				read_association(a);
+			}
+			settle();
+		});
+}
+
+void basic_udp_relay::release(const association_ptr& a)
+{
+	a->timeout.cancel();
+	error_code ignored;
+	a->socket.close(ignored);
+	// the peer may have a newer association by now
+	auto found = nat_.find(a->peer);
+	if (found && *found == a)
+	{
+		nat_.erase(a->peer);
+	}
+}
+
+namespace
+{
+
+ip::udp probe_protocol(io_context& ioc)
+{
+	utility::udp_socket probe(ioc);
+	error_code ec;
+	probe.open(ip::udp::v6(), ec);
+	if (!ec)
+	{
+		probe.set_option(ip::v6_only(false), ec);
+	}
+	return ec ? ip::udp::v4() : ip::udp::v6();
+}
+
+// the address as it goes into a header, v4 mapped ones as plain v4
+ip::address unmapped(const ip::address& address)
+{
+	if (address.is_v6() && address.to_v6().is_v4_mapped())
+	{
+		return ip::make_address_v4(ip::v4_mapped, address.to_v6());
+	}
+	return address;
+}
+
+}
+
+udp_server_relay::udp_server_relay(io_context& ioc, const shadowsocks::context_factory& cipher, std::chrono::seconds timeout) :
+	basic_udp_relay(ioc, cipher, timeout),
+	protocol_(probe_protocol(ioc))
+{}
+
+ip::udp::endpoint udp_server_relay::outbound(const ip::address& address, uint16_t port) const
+{
+	if (protocol_ == ip::udp::v6() && address.is_v4())
+	{
+		return ip::udp::endpoint(ip::make_address_v6(ip::v4_mapped, address.to_v4()), port);
+	}
+	return ip::udp::endpoint(address, port);
+}
+
+void udp_server_relay::handle_peer(utility::datagram_batch::datagram& d)
+{
+	std::size_t n = d.size;
+	if (!packet_.open(d.data, n))
+	{
+		utility::metrics::add(utility::metrics::counter::udp_dropped);
+		return;
+	}
+	const uint8_t* plain = d.data + packet_.prefix();
+	utility::socks_address target;
+	std::size_t header = n;
+	if (utility::parse_socks_address(plain, header, target) != utility::parse_status::complete ||
+		(target.type == socks::addr_ipv6 && protocol_ == ip::udp::v4()))
+	{
+		utility::metrics::add(utility::metrics::counter::udp_dropped);
+		return;
+	}
+	auto a = associate(d.peer, protocol_);
+	if (a == nullptr)
+	{
+		return;
+	}
+	const_buffer payload(plain + header, n - header);
+	if (target.type != socks::addr_domain)
+	{
+		batch_.send(a->socket, payload, outbound(target.address, target.port));
+		return;
+	}
+	// the datagram's slot is reused before the lookup completes
+	auto data = static_cast<const uint8_t*>(payload.data());
+	hold();
+	use_service<utility::dns_cache>(ioc_).async_resolve(
+		target,
+		[this, a = a->shared_from_this(), copy = std::vector<uint8_t>(data, data + payload.size())](error_code ec, utility::dns_cache::results_type endpoints)
+		{
+			send_resolved(*a, copy, ec, endpoints);
+			settle();
+		});
+}
+
+void udp_server_relay::send_resolved(association& a, const std::vector<uint8_t>& datagram, error_code ec, const utility::dns_cache::results_type& endpoints)
+{
+	if (!ec && a.socket.is_open())
+	{
+		for (auto& ep : *endpoints)
+		{
+			if (ep.address().is_v6() && protocol_ == ip::udp::v4())
+			{
+				continue;
+			}
+			a.socket.send_to(buffer(datagram), outbound(ep.address(), ep.port()), 0, ec);
+			utility::metrics::add(ec ? utility::metrics::counter::udp_dropped : utility::metrics::counter::udp_sent);
+			return;
+		}
+	}
+	utility::metrics::add(utility::metrics::counter::udp_dropped);
+}
+
+void udp_server_relay::handle_association(association& a, utility::datagram_batch::datagram& d)
+{
+	auto address = unmapped(d.peer.address());
+	std::size_t header = address.is_v4() ? 1 + 4 + 2 : utility::max_ip_address_size;
+	uint8_t* plain = d.data - header;
+	utility::write_socks_address(plain, address, d.peer.port());
+	uint8_t* wire = plain - packet_.prefix();
+	std::size_t n = packet_.seal(wire, header + d.size);
+	batch_.send(socket_, buffer(wire, n), a.peer);
+}
+
+udp_client_relay::udp_client_relay(io_context& ioc, const shadowsocks::context_factory& cipher, std::chrono::seconds timeout, const ip::udp::endpoint& server) :
+	basic_udp_relay(ioc, cipher, timeout),
+	server_(server)
+{}
+
+void udp_client_relay::handle_peer(utility::datagram_batch::datagram& d)
+{
+	// [reserved, 2][fragment][address][payload], fragments are not supported
+	if (d.size < 3 + 1 || d.data[0] != 0 || d.data[1] != 0 || d.data[2] != 0)
+	{
+		utility::metrics::add(utility::metrics::counter::udp_dropped);
+		return;
+	}
+	uint8_t* plain = d.data + 3;
+	std::size_t n = d.size - 3;
+	utility::socks_address target;
+	std::size_t header = n;
+	if (utility::parse_socks_address(plain, header, target) != utility::parse_status::complete)
+	{
+		utility::metrics::add(utility::metrics::counter::udp_dropped);
+		return;
+	}
+	auto a = associate(d.peer, server_.protocol());
+	if (a == nullptr)
+	{
+		return;
+	}
+	// the shadowsocks datagram is the socks5 one without its first 3 bytes
+	uint8_t* wire = plain - packet_.prefix();
+	batch_.send(a->socket, buffer(wire, packet_.seal(wire, n)), server_);
+}
+
+void udp_client_relay::handle_association(association& a, utility::datagram_batch::datagram& d)
+{
+	std::size_t n = d.size;
+	if (d.peer != server_ || !packet_.open(d.data, n))
+	{
+		utility::metrics::add(utility::metrics::counter::udp_dropped);
+		return;
+	}
+	uint8_t* reply = d.data + packet_.prefix() - 3;
+	std::memset(reply, 0, 3);
+	batch_.send(socket_, buffer(reply, 3 + n), a.peer);
+}
+
+}
@@ -1,91 +1,353 @@
 #include <spdlog/spdlog.h>
 
+#include <msocks/config.hpp>
 #include <msocks/endpoint/server_endpoint.hpp>
 #include <msocks/endpoint/client_endpoint.hpp>
+#include <msocks/endpoint/metrics_endpoint.hpp>
 #include <msocks/session/pool.hpp>
+#include <msocks/utility/log.hpp>
+#include <msocks/utility/trace.hpp>
+#include <shadowsocks/stream.h>
 #include <boost/asio/io_context.hpp>
+#include <boost/asio/signal_set.hpp>
+#include <boost/property_tree/ptree.hpp>
 
-#include <botan/sha2_32.h>
-#include <botan/md5.h>
+#include <atomic>
+#include <csignal>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <thread>
 
-void log_setup()
+// a server thread owns its io_context, session pool and acceptor,
+// nothing but the config is shared between threads
+class server_worker
 {
-	spdlog::set_pattern("[%l] %v");
-}
+public:
+	explicit server_worker(msocks::server_endpoint_config config) :
+		ioc_(1),
+		pool_(ioc_, config.session_pool),
+		server_(ioc_, pool_, std::move(config))
+	{}
 
-std::vector<uint8_t> evpBytesTokey(const std::string& password)
+	void run()
+	{
+		try
+		{
+			server_.start();
+			ioc_.run();
+		}
+		catch (boost::exception & e)
+		{
+			spdlog::error("{}",boost::diagnostic_information(e));
+		}
+		catch (std::exception & e)
+		{
+			spdlog::error("{}", e.what());
+		}
+	}
+
+	// from any thread, the endpoint takes it on its own
+	void reload(msocks::server_endpoint_config config)
+	{
+		post(ioc_, [this, config(std::move(config))]() mutable
+		{
+			try
+			{
+				server_.reload(std::move(config));
+			}
+			catch (std::exception & e)
+			{
+				spdlog::error("reload: {}", e.what());
+			}
+		});
+	}
+
+private:
+	io_context ioc_;
+	msocks::pool<msocks::server_session> pool_;
+	msocks::server_endpoint server_;
+};
+
+class client_worker
 {
-	std::vector<std::vector<uint8_t>> m;
-	std::vector<uint8_t> password1(password.begin(), password.end());
-	std::vector<uint8_t> data;
-	Botan::MD5 md5;
-	int i = 0;
-	while (m.size() < 32 + 8)
+public:
+	explicit client_worker(msocks::client_config config) :
+		client_(ioc_, std::move(config))
+	{}
+
+	void run()
 	{
-		if (i == 0)
+		try
 		{
-			data = password1;
+			client_.start();
+			ioc_.run();
 		}
-		else
+		catch (std::exception & e)
 		{
-			data = m[i - 1];
-			std::copy(password1.begin(), password1.end(), std::back_inserter(data));
+			spdlog::error("{}", e.what());
 		}
-		i++;
-		auto hash_result = md5.process(data.data(), data.size());
-		m.push_back(std::vector<uint8_t>(hash_result.begin(), hash_result.end()));
 	}
-	std::vector<uint8_t> key;
-	for (auto& mh : m)
+
+	void reload(msocks::client_config config)
+	{
+		post(ioc_, [this, config(std::move(config))]() mutable
+		{
+			try
+			{
+				client_.reload(std::move(config));
+			}
+			catch (std::exception & e)
+			{
+				spdlog::error("reload: {}", e.what());
+			}
+		});
+	}
+
+private:
+	io_context ioc_;
+	msocks::client_endpoint client_;
+};
+
+// scrapes get an io_context of their own, away from the relays
+class metrics_worker
+{
+public:
+	explicit metrics_worker(msocks::metrics_config config) :
+		ioc_(1),
+		config_(std::move(config))
+	{}
+
+	void run()
 	{
-		std::copy(mh.begin(), mh.end(), std::back_inserter(key));
+		try
+		{
+			msocks::metrics_endpoint endpoint(ioc_, config_);
+			endpoint.start();
+			ioc_.run();
+		}
+		catch (std::exception & e)
+		{
+			spdlog::error("{}", e.what());
+		}
 	}
-	return std::vector<uint8_t>(key.begin(), key.begin() + 32);
+
+	// from any thread, once the workers are gone
+	void stop()
+	{
+		ioc_.stop();
+	}
+
+private:
+	io_context ioc_;
+	msocks::metrics_config config_;
+};
+
+// the positional arguments of earlier versions, as a config
+msocks::config legacy_config(int argc, char* argv[])
+{
+	boost::property_tree::ptree tree;
+	bool server = !strcmp(argv[1], "s");
+	tree.put("type", server ? "server" : "client");
+	tree.put("server", argv[2]);
+	tree.put("server_port", argv[3]);
+	tree.put("password", argv[4]);
+	int method_arg = server ? 7 : 5;
+	if (argc > method_arg)
+	{
+		tree.put("method", argv[method_arg]);
+	}
+	if (server)
+	{
+		tree.put("speed_limit", argv[5]);
+		if (argc > 6)
+		{
+			tree.put("workers", argv[6]);
+		}
+		if (argc > 8)
+		{
+			tree.put("metrics_port", argv[8]);
+		}
+	}
+	else if (argc > 6)
+	{
+		tree.put("mux", argv[6]);
+	}
+	return msocks::load_config(tree);
+}
+
+// reloads path on every SIGHUP and hands the result to apply; a config
+// that fails to load leaves everything running as it was
+template <typename Apply>
+void watch_reload(signal_set& signals, const std::string& path, msocks::config::Type type, Apply apply)
+{
+	signals.async_wait(
+		[&signals, path, type, apply](error_code ec, int)
+		{
+			if (ec)
+			{
+				return;
+			}
+			try
+			{
+				auto config = msocks::load_config(path);
+				if (config.type != type)
+				{
+					spdlog::error("reload {}: the type does not change without a restart", path);
+				}
+				else
+				{
+					spdlog::info("reloading {}", path);
+					msocks::utility::trace::sample_rate(config.trace.rate);
+					msocks::utility::log::configure(config.log);
+					apply(std::move(config));
+				}
+			}
+			catch (std::exception & e)
+			{
+				spdlog::error("reload {}: {}", path, e.what());
+			}
+			watch_reload(signals, path, type, apply);
+		});
+}
+
+// writes the sampled sessions' spans to a file on every SIGUSR1
+void watch_trace(signal_set& signals, const std::string& file)
+{
+	signals.async_wait(
+		[&signals, file](error_code ec, int)
+		{
+			if (ec)
+			{
+				return;
+			}
+			std::ofstream out(file, std::ios::trunc);
+			out << msocks::utility::trace::dump();
+			if (!out)
+			{
+				spdlog::error("trace {}: write failed", file);
+			}
+			else
+			{
+				spdlog::info("trace written to {}", file);
+			}
+			watch_trace(signals, file);
+		});
 }
 
 int main(int argc, char* argv[])
 {
 	try
 	{
-		io_context ioc;
-		std::string password(argv[4]);
-		auto key = evpBytesTokey(password);
-		if (!strcmp(argv[1], "s"))
-		{
-			msocks::pool<msocks::server_session> pool(ioc);
-			msocks::server_endpoint_config config;
-			config.no_delay = true;
-			config.server_address = argv[2];
-			config.server_port = std::stoi(argv[3]);
-			config.key = key;
-			config.speed_limit = std::stoi(argv[5]);
-			config.method = "ChaCha(20)";
-            config.iv_length = 8;
-			config.timeout = boost::posix_time::seconds(2);
-			msocks::server_endpoint server(ioc, pool, std::move(config));
-			server.start();
-			ioc.run();
+		// msocks -c <config.json>, reloaded on SIGHUP
+		std::string path;
+		msocks::config config;
+		if (argc == 3 && !strcmp(argv[1], "-c"))
+		{
+			path = argv[2];
+			config = msocks::load_config(path);
+		}
+		else
+		{
+			config = legacy_config(argc, argv);
+		}
+		msocks::utility::log::setup(config.log);
+		io_context control(1);
+		signal_set signals(control);
+		if (!path.empty())
+		{
+			signals.add(SIGHUP);
+		}
+		msocks::utility::trace::sample_rate(config.trace.rate);
+		signal_set dumps(control, SIGUSR1);
+		watch_trace(dumps, config.trace.file);
+		// the signal waits keep control running, the last worker to
+		// return ends it, e.g. when every bind failed
+		std::atomic<std::size_t> running{0};
+		auto run = [&control, &running](auto& worker)
+		{
+			++running;
+			return [&control, &running, &worker]
+			{
+				worker.run();
+				if (--running == 0)
+				{
+					control.stop();
+				}
+			};
+		};
+		std::vector<std::thread> threads;
+		if (config.type == msocks::config::Server)
+		{
+			std::unique_ptr<metrics_worker> metrics;
+			if (config.metrics.port != 0)
+			{
+				metrics = std::make_unique<metrics_worker>(config.metrics);
+				threads.emplace_back(&metrics_worker::run, metrics.get());
+			}
+			std::vector<std::unique_ptr<server_worker>> workers;
+			for (std::size_t i = 0; i < config.workers; i++)
+			{
+				workers.push_back(std::make_unique<server_worker>(config.server));
+			}
+			for (auto& worker : workers)
+			{
+				threads.emplace_back(run(*worker));
+			}
+			if (!path.empty())
+			{
+				watch_reload(signals, path, config.type,
+					[&workers](msocks::config reloaded)
+					{
+						if (reloaded.workers != workers.size())
+						{
+							spdlog::warn("reload: the number of workers does not change without a restart");
+						}
+						// the workers' endpoints were bound with it
+						reloaded.server.listen.reuse_port = reloaded.server.listen.reuse_port || workers.size() > 1;
+						for (auto& worker : workers)
+						{
+							worker->reload(reloaded.server);
+						}
+					});
+			}
+			control.run();
+			if (metrics)
+			{
+				metrics->stop();
+			}
+			for (auto& t : threads)
+			{
+				t.join();
+			}
 		}
 		else
 		{
-			msocks::client_config config;
-			config.local_address = "127.0.0.1";
-			config.local_port = 1081;
-			config.key = key;
-			config.remote_address = argv[2];
-			config.remote_port = std::stoi(argv[3]);
-			config.method = "ChaCha(20)";
-            config.iv_length = 8;
-			config.timeout = boost::posix_time::seconds(2);
-			msocks::client_endpoint client(ioc, std::move(config));
-			client.start();
-			ioc.run();
+			client_worker client(std::move(config.client));
+			threads.emplace_back(run(client));
+			if (!path.empty())
+			{
+				watch_reload(signals, path, config.type,
+					[&client](msocks::config reloaded)
+					{
+						client.reload(std::move(reloaded.client));
+					});
+			}
+			control.run();
+			for (auto& t : threads)
+			{
+				t.join();
+			}
 		}
 	}
 	catch (boost::exception & e)
 	{
 		spdlog::error("{}",boost::diagnostic_information(e));
 	}
+	catch (std::exception & e)
+	{
+		spdlog::error("{}", e.what());
+	}
+	msocks::utility::log::shutdown();
 	system("pause");
 }
-
@@ -0,0 +1,303 @@
+#include <boost/asio/write.hpp>
+
+#include <msocks/mux/channel.hpp>
+
+#include <msocks/utility/log.hpp>
+
+#include <algorithm>
+#include <cstring>
+
+namespace msocks::mux
+{
+
+channel::channel(std::shared_ptr<carrier> owner, uint32_t id, utility::tcp_socket socket, const stream_options& options) :
+	carrier_(std::move(owner)),
+	id_(id),
+	socket_(std::move(socket)),
+	profile_(options.profile),
+	up_(header_size + max_payload)
+{
+	auto& ioc = socket_.get_executor().context();
+	if (options.limiter)
+	{
+		throttle_up_.emplace(ioc, *options.limiter);
+		throttle_down_.emplace(ioc, *options.limiter);
+	}
+	if (options.idle_timeout.count() != 0)
+	{
+		// the entry is a member, it is cancelled before this goes away
+		idle_.emplace(ioc, [this] { reset(); });
+		idle_->schedule(options.idle_timeout);
+	}
+}
+
+void channel::start(const_buffer early)
+{
+	connected_ = true;
+	error_code ignored;
+	socket_.set_option(ip::tcp::no_delay(true), ignored);
+	write();
+	auto data = static_cast<const uint8_t*>(early.data());
+	early_.assign(data, data + early.size());
+	read();
+}
+
+void channel::connect(const utility::socks_address& target)
+{
+	auto& ioc = socket_.get_executor().context();
+	use_service<utility::dns_cache>(ioc).async_resolve(
+		target,
+		[this, p = shared_from_this(), &ioc](error_code ec, utility::dns_cache::results_type endpoints)
+		{
+			if (closed_)
+			{
+				return;
+			}
+			if (ec)
+			{
+				MSOCKS_LOG(spdlog::level::info, "[mux {}] error: {}", id_, ec.message());
+				reset();
+				return;
+			}
+			connector_ = std::make_shared<utility::happy_eyeballs>(
+				ioc, std::move(endpoints),
+				[this, p](error_code ec, utility::tcp_socket socket)
+				{
+					connector_.reset();
+					if (closed_)
+					{
+						return;
+					}
+					if (ec)
+					{
+						MSOCKS_LOG(spdlog::level::info, "[mux {}] error: {}", id_, ec.message());
+						reset();
+						return;
+					}
+					socket_ = std::move(socket);
+					start();
+				},
+				false, profile_);
+			connector_->start();
+		});
+}
+
+void channel::read()
+{
+	if (closed_ || up_done_)
+	{
+		return;
+	}
+	if (send_window_ == 0)
+	{
+		window_wanted_ = true;
+		return;
+	}
+	if (early_begin_ != early_.size())
+	{
+		// early bytes leave before the socket is read, a frame at a time
+		std::size_t n = std::min({early_.size() - early_begin_, max_payload, send_window_});
+		std::memcpy(up_.data() + header_size, early_.data() + early_begin_, n);
+		early_begin_ += n;
+		if (early_begin_ == early_.size())
+		{
+			early_.clear();
+			early_.shrink_to_fit();
+			early_begin_ = 0;
+		}
+		send(n);
+		return;
+	}
+	socket_.async_read_some(
+		buffer(up_.data() + header_size, std::min(max_payload, send_window_)),
+		utility::make_custom_alloc_handler(memory_up_, [this, p = shared_from_this()](error_code ec, std::size_t n)
+		{
+			handle_read(ec, n);
+		}));
+}
+
+void channel::handle_read(error_code ec, std::size_t n)
+{
+	if (closed_)
+	{
+		return;
+	}
+	if (ec && ec != error::eof)
+	{
+		// the peer sees the socket fail rather than end
+		reset();
+		return;
+	}
+	if (ec)
+	{
+		// end of the socket's input, the peer's half carries on
+		up_done_ = true;
+		carrier_->send_frame(frame_type::close, id_);
+		finish();
+		return;
+	}
+	if (idle_)
+	{
+		idle_->touch();
+	}
+	if (throttle_up_)
+	{
+		throttle_up_->async_get(n, utility::make_custom_alloc_handler(memory_up_, [this, p = shared_from_this(), n]
+		{
+			send(n);
+		}));
+		return;
+	}
+	send(n);
+}
+
+void channel::send(std::size_t n)
+{
+	if (closed_)
+	{
+		return;
+	}
+	send_window_ -= n;
+	encode(up_.data(), frame_header{frame_type::data, id_, uint16_t(n)});
+	carrier_->send_data(shared_from_this(), buffer(up_.data(), header_size + n));
+}
+
+void channel::on_sent()
+{
+	read();
+}
+
+void channel::on_window(std::size_t credit)
+{
+	send_window_ += credit;
+	if (window_wanted_)
+	{
+		window_wanted_ = false;
+		read();
+	}
+}
+
+void channel::on_data(const uint8_t* data, std::size_t n)
+{
+	if (closed_ || down_done_)
+	{
+		return;
+	}
+	if (n > recv_window_)
+	{
+		MSOCKS_LOG(spdlog::level::info, "[mux {}] error: peer overran the window", id_);
+		reset();
+		return;
+	}
+	recv_window_ -= n;
+	if (idle_)
+	{
+		idle_->touch();
+	}
+	down_.insert(down_.end(), data, data + n);
+	write();
+}
+
+void channel::on_close()
+{
+	down_done_ = true;
+	write();
+}
+
+void channel::write()
+{
+	if (closed_ || !connected_ || writing_)
+	{
+		return;
+	}
+	if (down_.empty())
+	{
+		if (down_done_)
+		{
+			error_code ignored;
+			socket_.shutdown(socket_base::shutdown_send, ignored);
+			finish();
+		}
+		return;
+	}
+	writing_ = true;
+	std::swap(down_, down_writing_);
+	auto do_write = [this, p = shared_from_this()]
+	{
+		if (closed_)
+		{
+			return;
+		}
+		async_write(
+			socket_, buffer(down_writing_),
+			utility::make_custom_alloc_handler(memory_down_, [this, p](error_code ec, std::size_t n)
+			{
+				handle_write(ec, n);
+			}));
+	};
+	if (throttle_down_)
+	{
+		throttle_down_->async_get(down_writing_.size(), utility::make_custom_alloc_handler(memory_down_, std::move(do_write)));
+		return;
+	}
+	do_write();
+}
+
+void channel::handle_write(error_code ec, std::size_t n)
+{
+	writing_ = false;
+	if (closed_)
+	{
+		return;
+	}
+	if (ec)
+	{
+		reset();
+		return;
+	}
+	down_writing_.clear();
+	recv_window_ += n;
+	uint8_t credit[4] = {uint8_t(n >> 24), uint8_t(n >> 16), uint8_t(n >> 8), uint8_t(n)};
+	carrier_->send_frame(frame_type::window, id_, buffer(credit));
+	write();
+}
+
+void channel::reset()
+{
+	if (closed_)
+	{
+		return;
+	}
+	auto self = shared_from_this();
+	carrier_->send_frame(frame_type::reset, id_);
+	abort();
+	carrier_->remove(id_);
+}
+
+void channel::finish()
+{
+	if (closed_ || !up_done_ || !down_done_ || writing_ || !down_.empty())
+	{
+		return;
+	}
+	auto self = shared_from_this();
+	abort();
+	carrier_->remove(id_);
+}
+
+void channel::abort()
+{
+	closed_ = true;
+	if (idle_)
+	{
+		idle_->cancel();
+	}
+	error_code ignored;
+	socket_.close(ignored);
+	if (connector_)
+	{
+		connector_->cancel();
+	}
+}
+
+}
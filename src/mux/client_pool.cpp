@@ -0,0 +1,80 @@
+#include <msocks/mux/client_pool.hpp>
+#include <msocks/utility/socket_option.hpp>
+
+#include <algorithm>
+
+namespace msocks::mux
+{
+
+client_pool::client_pool(io_context& ioc, std::shared_ptr<upstream_set> upstreams,
+	std::shared_ptr<const shadowsocks::context_factory> cipher, std::size_t connections, bool fast_open,
+	utility::socket_profile profile) :
+	ioc_(ioc),
+	upstreams_(std::move(upstreams)),
+	cipher_(std::move(cipher)),
+	connections_(std::max<std::size_t>(connections, 1)),
+	fast_open_(fast_open),
+	profile_(std::move(profile)),
+	greeting_(marker_address())
+{}
+
+void client_pool::open(utility::tcp_socket local, const std::vector<uint8_t>& target, const_buffer early)
+{
+	auto ch = pick()->open(std::move(local), buffer(target));
+	ch->start(early);
+}
+
+std::shared_ptr<client_pool::carrier_type> client_pool::pick()
+{
+	carriers_.erase(
+		std::remove_if(carriers_.begin(), carriers_.end(), [](auto& c) { return !c->alive(); }),
+		carriers_.end());
+	auto least = std::min_element(
+		carriers_.begin(), carriers_.end(),
+		[](auto& l, auto& r) { return l->size() < r->size(); });
+	if (least == carriers_.end() || ((*least)->size() != 0 && carriers_.size() < connections_))
+	{
+		return connect();
+	}
+	return *least;
+}
+
+std::shared_ptr<client_pool::carrier_type> client_pool::connect()
+{
+	auto stream = std::make_shared<shadowsocks::stream<utility::tcp_socket>>(utility::tcp_socket(ioc_), cipher_->create());
+	auto c = std::make_shared<carrier_type>(ioc_, *stream, stream, false, stream_options{}, std::chrono::seconds{}, buffer(greeting_));
+	carriers_.push_back(c);
+	const auto index = upstreams_->pick();
+	const auto& server = upstreams_->endpoint(index);
+	error_code ec;
+	stream->next_layer().open(server.protocol(), ec);
+	if (ec)
+	{
+		c->close(ec);
+		return c;
+	}
+	utility::apply(profile_, stream->next_layer(), ec);
+#if defined(TCP_FASTOPEN_CONNECT)
+	if (fast_open_)
+	{
+		stream->next_layer().set_option(utility::fast_open_connect(true), ec);
+	}
+#endif
+	upstreams_->begin(index);
+	stream->next_layer().async_connect(
+		server,
+		[c, upstreams = upstreams_, index, fast_open = fast_open_, started = upstream_set::clock::now()](error_code ec)
+		{
+			// a fast open connect is done before the SYN left
+			upstreams->report(index, ec, fast_open ? upstream_set::clock::duration::zero() : upstream_set::clock::now() - started);
+			if (ec)
+			{
+				c->close(ec);
+				return;
+			}
+			c->start();
+		});
+	return c;
+}
+
+}
@@ -1,92 +1,355 @@
 #include <boost/asio/read.hpp>
 #include <boost/asio/write.hpp>
 
-#include <boost/endian/conversion.hpp>
 #include <botan/auto_rng.h>
 
 #include <msocks/session/client_session.hpp>
+#include <msocks/mux/client_pool.hpp>
 #include <msocks/utility/socket_pair.hpp>
 #include <msocks/utility/local_socks5.hpp>
+#include <msocks/utility/log.hpp>
+#include <msocks/utility/socket_option.hpp>
+#include <msocks/utility/socks_constants.hpp>
 
-#include <spdlog/spdlog.h>
+#include <cstring>
 
 namespace msocks
 {
 
-void client_session::start(yield_context yield)
+void client_session::start()
 {
-	try
+	trace_ = utility::trace::sample() ? id_ : 0;
+	if (trace_ != 0)
 	{
-		auto target_address = utility::async_local_socks5(ioc_, local_, yield);
+		started_ = utility::trace::clock::now();
+	}
+	utility::async_local_socks5(
+		local_,
+		buffer_local_.prepare(),
+		[this, p = shared_from_this()](error_code ec, uint8_t command, const_buffer target_address, const_buffer rest)
+		{
+			handle_local_socks5(ec, command, target_address, rest);
+		},
+		buffer(attribute_->udp_reply));
+}
 
-		ip::tcp::endpoint ep(ip::make_address(attribute_.remote_address), attribute_.remote_port);
-        remote_.next_layer().open(ep.protocol());
-		remote_.next_layer().async_connect(ep, yield);
-        async_write(remote_, buffer(target_address), yield);
-		spawn(
-			ioc_,
-			[this, p = shared_from_this()](yield_context yield)
+void client_session::handle_local_socks5(error_code ec, uint8_t command, const_buffer target_address, const_buffer rest)
+{
+	if (ec)
+	{
+		MSOCKS_LOG(spdlog::level::info, "[{:x}] error: {}", id_, ec.message());
+		return;
+	}
+	if (trace_ != 0)
+	{
+		auto now = utility::trace::clock::now();
+		utility::trace::span(trace_, utility::trace::phase::socks5, started_, now);
+		started_ = now;
+	}
+	if (command == socks::conn_udp)
+	{
+		handshake_.reset();
+		hold_association();
+		return;
+	}
+	auto address = static_cast<const uint8_t*>(target_address.data());
+	target_address_.assign(address, address + target_address.size());
+	// payload already read along with the request moves to the buffer front
+	std::memmove(buffer_local_.data(), rest.data(), rest.size());
+	early_ = rest.size();
+	if (attribute_->mux)
+	{
+		// the stream takes the socket over, this session is done
+		handshake_.reset();
+		error_code ec;
+		auto early = read_early(ec);
+		if (ec)
 		{
-			fwd_local_remote(yield);
-		});
-		spawn(
-			ioc_,
-			[this, p = shared_from_this()](yield_context yield)
+			MSOCKS_LOG(spdlog::level::info, "[{:x}] error: {}", id_, ec.message());
+			return;
+		}
+		attribute_->mux->open(std::move(local_), target_address_, early);
+		return;
+	}
+	if (attribute_->warm)
+	{
+		if (auto stream = attribute_->warm->take())
 		{
-			fwd_remote_local(yield);
-		});
+			remote_ = std::move(*stream);
+			warm_ = true;
+			handle_connect(error_code{});
+			return;
+		}
 	}
-	catch (system_error& e)
+	connect(upstream_set::npos);
+}
+
+void client_session::connect(std::size_t failed)
+{
+	auto& upstreams = *attribute_->upstreams;
+	upstream_ = upstreams.pick(failed);
+	const auto& ep = upstreams.endpoint(upstream_);
+	error_code ec;
+	if (attempts_ != 0 || warm_)
 	{
-		spdlog::info("[{}] error: {}", uuid(), e.what());
+		// the failed attempt may have sent the iv already
+		warm_ = false;
+		remote_ = shadowsocks::stream<utility::tcp_socket>(utility::tcp_socket(ioc_), attribute_->cipher->create());
 	}
+	confirming_ = false;
+	remote_.next_layer().open(ep.protocol(), ec);
+	if (!ec)
+	{
+		error_code ignored;
+		utility::apply(attribute_->outbound, remote_.next_layer(), ignored);
+	}
+	if (!ec && attribute_->fast_open)
+	{
+#if defined(TCP_FASTOPEN_CONNECT)
+		// the request header rides on the SYN once the server cookie is known
+		error_code failed;
+		remote_.next_layer().set_option(utility::fast_open_connect(true), failed);
+		confirming_ = !failed;
+#endif
+	}
+	if (ec)
+	{
+		MSOCKS_LOG(spdlog::level::info, "[{:x}] error: {}", id_, ec.message());
+		return;
+	}
+	upstreams.begin(upstream_);
+	connect_started_ = upstream_set::clock::now();
+	remote_.next_layer().async_connect(
+		ep,
+		[this, p = shared_from_this()](error_code ec)
+		{
+			// a fast open connect is done before the SYN left, it is
+			// reported once the server answered, see confirm_connect
+			if (ec || !confirming_)
+			{
+				confirming_ = false;
+				attribute_->upstreams->report(upstream_, ec, upstream_set::clock::now() - connect_started_);
+				if (fail_over(ec))
+				{
+					return;
+				}
+			}
+			handle_connect(ec);
+		});
 }
 
-void client_session::fwd_remote_local(yield_context yield)
+bool client_session::fail_over(const error_code& ec)
 {
-	try
+	if (!ec || ec == error::operation_aborted ||
+		++attempts_ >= std::min(attribute_->upstreams->size(), max_attempts))
 	{
-		error_code ec;
-		utility::socket_pair(
-			remote_, local_,
-			ioc_,
-			buffer(buffer_remote_),
-            [](std::size_t, yield_context) { return; },
-			yield[ec]);
+		return false;
+	}
+	MSOCKS_LOG(spdlog::level::info, "[{:x}] {}: {}, failing over", id_, attempts_, ec.message());
+	connect(upstream_);
+	return true;
+}
 
+void client_session::confirm_connect(error_code ec, std::size_t early)
+{
+	if (!ec)
+	{
+		// writable once the handshake is done, SO_ERROR tells how it went
+		remote_.next_layer().async_wait(
+			socket_base::wait_write,
+			[this, p = shared_from_this(), early](error_code ec)
+			{
+				if (!ec)
+				{
+					utility::socket_error error;
+					remote_.next_layer().get_option(error, ec);
+					if (!ec && error.value() != 0)
+					{
+						ec.assign(error.value(), system_category());
+					}
+				}
+				confirmed(ec, early);
+			});
+		return;
 	}
-	catch (system_error & ignored)
+	confirmed(ec, early);
+}
+
+void client_session::confirmed(const error_code& ec, std::size_t early)
+{
+	confirming_ = false;
+	attribute_->upstreams->report(upstream_, ec, upstream_set::clock::now() - connect_started_);
+	if (!ec)
 	{
+		relay();
+		return;
+	}
+	// the request is sent again, early bytes are still at the buffer front
+	early_ = early;
+	if (!fail_over(ec))
+	{
+		MSOCKS_LOG(spdlog::level::info, "[{:x}] error: {}", id_, ec.message());
 	}
 }
 
-void client_session::fwd_local_remote(yield_context yield)
+void client_session::handle_connect(error_code ec)
 {
-	try
+	handshake_.reset();
+	if (trace_ != 0)
 	{
-		error_code ec;
-		utility::socket_pair(
-			local_, remote_,
-			ioc_,
-			buffer(buffer_local_),
-            [](std::size_t, yield_context) { return; },
-			yield[ec]);
+		auto now = utility::trace::clock::now();
+		utility::trace::span(trace_, utility::trace::phase::connect, started_, now);
+		started_ = now;
+	}
+	if (ec)
+	{
+		MSOCKS_LOG(spdlog::level::info, "[{:x}] error: {}", id_, ec.message());
+		return;
+	}
+	// the cipher stream adds its iv to the same write
+	const auto early = read_early(ec);
+	if (ec)
+	{
+		if (confirming_)
+		{
+			// the connect is neither a success nor the server's failure
+			confirming_ = false;
+			attribute_->upstreams->report(upstream_, error::operation_aborted, upstream_set::clock::now() - connect_started_);
+		}
+		MSOCKS_LOG(spdlog::level::info, "[{:x}] local: {}", id_, ec.message());
+		return;
+	}
+	std::array<const_buffer, 2> request{buffer(target_address_), early};
+	async_write(
+		remote_,
+		request,
+		[this, p = shared_from_this(), early = early.size()](error_code ec, std::size_t)
+		{
+			if (confirming_)
+			{
+				confirm_connect(ec, early);
+				return;
+			}
+			if (ec && warm_ && ec != error::operation_aborted)
+			{
+				// a warm connection died after the check, a new one gets the request
+				MSOCKS_LOG(spdlog::level::info, "[{:x}] warm: {}, connecting", id_, ec.message());
+				early_ = early;
+				connect(upstream_set::npos);
+				return;
+			}
+			if (ec)
+			{
+				MSOCKS_LOG(spdlog::level::info, "[{:x}] error: {}", id_, ec.message());
+				return;
+			}
+			relay();
+		});
+}
 
+void client_session::relay()
+{
+	relays_ = 2;
+	if (trace_ != 0)
+	{
+		trace_first_byte();
 	}
-	catch (system_error & ignored)
+	fwd_local_remote();
+	fwd_remote_local();
+}
+
+void client_session::trace_first_byte()
+{
+	// waits next to the relay's read, which stays untouched by tracing
+	remote_.next_layer().async_wait(
+		socket_base::wait_read,
+		[this, p = shared_from_this()](error_code ec)
+		{
+			if (!ec)
+			{
+				utility::trace::span(trace_, utility::trace::phase::first_byte, started_);
+			}
+		});
+}
+
+const_buffer client_session::read_early(error_code& ec)
+{
+	// whatever the application sent already goes out with the request header
+	std::size_t early = early_;
+	early_ = 0;
+	if (local_.available(ec) != 0 && !ec)
 	{
+		early += local_.read_some(buffer_local_.prepare() + early, ec);
 	}
+	return buffer(buffer_local_.data(), early);
 }
 
-void client_session::go()
+void client_session::fwd_remote_local()
 {
-	spawn(
-		ioc_,
-		[this, p = shared_from_this()](yield_context yield)
+	utility::socket_pair(
+		remote_, local_,
+		buffer_remote_,
+		utility::no_limit{},
+		utility::make_custom_alloc_handler(memory_remote_, [this, p = shared_from_this()](error_code ec) { finish(ec, false); }));
+}
+
+void client_session::fwd_local_remote()
+{
+	utility::socket_pair(
+		local_, remote_,
+		buffer_local_,
+		utility::no_limit{},
+		utility::make_custom_alloc_handler(memory_local_, [this, p = shared_from_this()](error_code ec) { finish(ec, true); }));
+}
+
+void client_session::finish(const error_code& ec, bool local_remote)
+{
+	if (--relays_ == 0)
+	{
+		return;
+	}
+	error_code ignored;
+	if (ec == error::eof)
 	{
-		start(yield);
+		// passed on as a FIN, the other direction runs until its peer
+		// finishes too
+		if (local_remote)
+		{
+			remote_.next_layer().shutdown(socket_base::shutdown_send, ignored);
+		}
+		else
+		{
+			local_.shutdown(socket_base::shutdown_send, ignored);
+		}
+		return;
 	}
-	);
+	MSOCKS_LOG(spdlog::level::info, "[{:x}] error: {}", id_, ec.message());
+	local_.close(ignored);
+	remote_.next_layer().close(ignored);
+}
+
+void client_session::hold_association()
+{
+	local_.async_wait(
+		socket_base::wait_read,
+		[this, p = shared_from_this()](error_code ec)
+		{
+			if (!ec)
+			{
+				// the connection carries nothing else, whatever comes is dropped
+				std::array<uint8_t, 64> discard;
+				local_.read_some(buffer(discard), ec);
+			}
+			if (!ec)
+			{
+				hold_association();
+			}
+		});
+}
+
+void client_session::go()
+{
+	start();
 }
 
 }
@@ -1,204 +1,480 @@
 #include <boost/asio/read.hpp>
 #include <boost/asio/write.hpp>
-#include <boost/asio/deadline_timer.hpp>
-#include <boost/endian/conversion.hpp>
+#if defined(MSOCKS_STACKFUL_RELAY)
+#include <boost/asio/spawn.hpp>
+#endif
 
+#include <msocks/mux/carrier.hpp>
 #include <msocks/utility/socket_pair.hpp>
 #include <msocks/session/server_session.hpp>
 #include <msocks/utility/socks_constants.hpp>
 #include <msocks/utility/socks_erorr.hpp>
+#include <msocks/utility/socks_address.hpp>
+#include <msocks/utility/log.hpp>
+#include <msocks/utility/metrics.hpp>
+#include <msocks/utility/trace.hpp>
 
 #include <botan/auto_rng.h>
 
-#include <spdlog/spdlog.h>
-using namespace boost::endian;
-
 namespace msocks
 {
 
-void server_session::start(yield_context yield)
+namespace
+{
+
+#if !defined(MSOCKS_STACKFUL_RELAY)
+// reads into scratch until the shadowsocks address header is complete and
+// parses it where it landed; whatever followed the header stays in scratch
+template <typename Stream>
+class handshake_op
 {
-	try
+public:
+	using handler_type = std::function<void(error_code, const utility::socks_address&, std::size_t, std::size_t)>;
+
+	handshake_op(Stream& stream, mutable_buffer scratch, handler_type handler) :
+		stream_(stream),
+		scratch_(scratch),
+		handler_(std::move(handler))
+	{}
+
+	void operator()(error_code ec = {}, std::size_t bytes_transferred = 0)
 	{
-		deadline_timer timer(ioc_);
-		ip::tcp::resolver resolver(ioc_);
-		spawn(
-			ioc_, [this, p = shared_from_this(), &resolver, &timer](yield_context yield)
+		received_ += bytes_transferred;
+		if (!ec)
 		{
-			timer.expires_from_now(attribute_.timeout);
-			error_code ec;
-			timer.async_wait(yield[ec]);
-			if (ec != error::operation_aborted)
+			std::size_t size = received_;
+			switch (utility::parse_socks_address(static_cast<const uint8_t *>(scratch_.data()), size, target_))
 			{
-				local_.next_layer().cancel(ec);
-				resolver.cancel();
-				remote_.cancel(ec);
+				case utility::parse_status::complete:
+					handler_(ec, target_, size, received_);
+					return;
+				case utility::parse_status::incomplete:
+					if (received_ != scratch_.size())
+					{
+						stream_.async_read_some(scratch_ + received_, std::move(*this));
+						return;
+					}
+					[[fallthrough]];
+				case utility::parse_status::invalid:
+					ec = error_code(errc::address_not_supported, socks_category());
+					break;
 			}
-		});
-		auto [host, service] = async_handshake(yield);
-		auto result = resolver.async_resolve(host, service, yield);
-		remote_.async_connect(*result.begin(), yield);
-		timer.cancel();
-		spawn(
-			ioc_,
-			[this, p = shared_from_this()](yield_context yield)
-		{
-			fwd_local_remote(yield);
-		});
-		spawn(
-			ioc_,
-			[this, p = shared_from_this()](yield_context yield)
-		{
-			fwd_remote_local(yield);
-		});
-	}
-	catch (system_error& e)
-	{
-		if (e.code() != error::operation_aborted)
-		{
-			spdlog::info("[{}] error: {}", uuid_, e.what());
 		}
+		handler_(ec, target_, 0, 0);
 	}
+
+private:
+	Stream& stream_;
+	mutable_buffer scratch_;
+	handler_type handler_;
+	utility::socks_address target_;
+	std::size_t received_ = 0;
+};
+#endif
+
 }
 
-void server_session::fwd_local_remote(yield_context yield)
+void server_session::start()
 {
-	try
+	if (attribute_->zero_copy)
 	{
 		error_code ec;
-		utility::socket_pair(
-			local_, remote_,
-			ioc_,
-			buffer(buffer_local_),
-            [this](std::size_t n, yield_context yield)
-            {
-                attribute_.limiter->async_get(n, yield);
-            },
-			yield[ec]);
+		local_.next_layer().enable_zerocopy(attribute_->zero_copy_threshold, ec);
 	}
-	catch (system_error & ignored)
+	if (auto aead = std::get_if<shadowsocks::aead_context>(&local_.get_context()))
 	{
-
+		aead->identify_by(attribute_->keys.get());
 	}
+	expired_ = false;
+	user_ = nullptr;
+	relays_ = 0;
+	replied_ = false;
+	trace_ = utility::trace::sample() ? id_ : 0;
+	throttle_local_.trace(trace_);
+	throttle_remote_.trace(trace_);
+	started_ = utility::metrics::clock::now();
+	timeout_.schedule(std::chrono::seconds(attribute_->timeout.total_seconds()));
+	async_handshake(
+		[this, p = self()](error_code ec, const utility::socks_address& target, std::size_t header, std::size_t received)
+		{
+			early_begin_ = header;
+			early_end_ = received;
+			handle_handshake(ec, target);
+		});
 }
 
-void server_session::fwd_remote_local(yield_context yield)
+void server_session::handle_handshake(error_code ec, const utility::socks_address& target)
 {
-	try
+	if (ec)
 	{
-		error_code ec;
-		utility::socket_pair(
-			remote_, local_,
-			ioc_,
-			buffer(buffer_remote_),
-            [this](std::size_t n, yield_context yield)
-            {
-                attribute_.limiter->async_get(n, yield);
-            },
-            yield[ec]);
+		stop(ec);
+		return;
 	}
-	catch (system_error & ignored)
+	auto now = utility::metrics::clock::now();
+	utility::metrics::observe(utility::metrics::histogram::handshake, now - started_);
+	utility::trace::span(trace_, utility::trace::phase::handshake, started_, now);
+	started_ = now;
+	identify();
+	if (target.type == socks::addr_domain && target.domain == mux::marker_host)
 	{
+		// the connection carries streams, the carrier keeps this session
+		// and its cipher stream alive until it fails or idles, and bounds
+		// its streams' idle time too
+		timeout_.cancel();
+		handshake_.reset();
+		// the carrier only knows shared owners, this one holds the session
+		std::shared_ptr<void> owner(static_cast<void*>(this), [p = self()](void*) {});
+		std::make_shared<mux::basic_carrier<shadowsocks::stream<utility::zerocopy_socket>>>(
+			ioc_, local_, std::move(owner), true,
+			mux::stream_options{&limiter_, attribute_->idle_timeout, &attribute_->outbound}, attribute_->idle_timeout)->start(
+				buffer(buffer_local_.data() + early_begin_, early_end_ - early_begin_));
+		return;
 	}
+	use_service<utility::dns_cache>(ioc_).async_resolve(
+		target,
+		[this, p = self()](error_code ec, utility::dns_cache::results_type endpoints)
+		{
+			handle_resolve(ec, std::move(endpoints));
+		});
 }
 
-void server_session::do_async_handshake(
-	async_result<yield_context, void(error_code, std::pair<std::string, std::string>)>::completion_handler_type handler,
-	yield_context yield)
+void server_session::handle_resolve(error_code ec, utility::dns_cache::results_type endpoints)
 {
-	error_code ec;
-	std::pair<std::string, std::string> result;
-	try
+	auto now = utility::metrics::clock::now();
+	utility::metrics::observe(utility::metrics::histogram::resolve, now - started_);
+	utility::trace::span(trace_, utility::trace::phase::resolve, started_, now);
+	started_ = now;
+	if (!ec && expired_)
+	{
+		ec = error::timed_out;
+	}
+	if (ec)
 	{
-		uint8_t address_type = 0;
-		async_read(local_, buffer(&address_type, sizeof(address_type)), yield);
-		if (address_type == socks::addr_ipv4)
+		stop(ec);
+		return;
+	}
+	connector_ = std::make_shared<utility::happy_eyeballs>(
+		ioc_, std::move(endpoints),
+		[this, p = self()](error_code ec, utility::tcp_socket socket)
 		{
-			uint32_t ipv4;
-			uint16_t port;
-			std::array<mutable_buffer, 2> sequence
+			connector_.reset();
+			if (!ec)
 			{
-				buffer(&ipv4,sizeof(ipv4)),
-				buffer(&port,sizeof(port))
-			};
-			async_read(local_, sequence, transfer_all(), yield);
-			result.first = ip::make_address_v4(big_to_native(ipv4)).to_string();
-			result.second = std::to_string(big_to_native(port));
+				remote_ = utility::zerocopy_socket(std::move(socket));
+			}
+			handle_connect(ec);
+		},
+		// only a write can start a deferred SYN, and a target that speaks
+		// first would never see one
+		attribute_->fast_open_connect && early_end_ != early_begin_,
+		&attribute_->outbound);
+	connector_->start();
+}
+
+void server_session::handle_connect(error_code ec)
+{
+	// resolving and connecting count as handshake, that is where storms pile up
+	handshake_.reset();
+	if (ec)
+	{
+		stop(ec);
+		return;
+	}
+	auto now = utility::metrics::clock::now();
+	utility::metrics::observe(utility::metrics::histogram::connect, now - started_);
+	utility::trace::span(trace_, utility::trace::phase::connect, started_, now);
+	started_ = now;
+	relays_ = 2;
+	timeout_.schedule(attribute_->idle_timeout);
+	if (attribute_->zero_copy)
+	{
+		remote_.enable_zerocopy(attribute_->zero_copy_threshold, ec);
+	}
+	if (attribute_->io_uring && !splice())
+	{
+		// the handshake stayed on the reactor, only the relay moves over
+		remote_.enable_uring(ec);
+		if (!ec)
+		{
+			local_.next_layer().enable_uring(ec);
 		}
-		else if (address_type == socks::addr_ipv6)
+	}
+	fwd_remote_local();
+	if (early_end_ == early_begin_)
+	{
+		fwd_local_remote();
+		return;
+	}
+	// payload that came in along with the address header leaves right
+	// away; its bytes are charged to the limiter, whose debt then delays
+	// the next read of local_ instead of this write
+	std::size_t n = early_end_ - early_begin_;
+	utility::metrics::add(utility::metrics::counter::bytes_received, n);
+	if (user_ != nullptr && user_->counters != nullptr)
+	{
+		utility::metrics::add(user_->counters->bytes_received, int64_t(n));
+	}
+	limiter_.acquire(n);
+	async_write(
+		remote_, buffer(buffer_local_.data() + early_begin_, n),
+		[this, p = self()](error_code ec, std::size_t)
 		{
-			ip::address_v6::bytes_type ipv6;
-			uint16_t port;
-			std::array<mutable_buffer, 2> sequence
+			if (ec)
 			{
-				buffer(&ipv6,ipv6.size()),
-				buffer(&port,sizeof(port))
-			};
-			async_read(local_, sequence, transfer_all(), yield);
-			std::reverse(ipv6.begin(), ipv6.end());
-			result.first = ip::make_address_v6(ipv6).to_string();
-			result.second = std::to_string(big_to_native(port));
+				finish(ec, true);
+				return;
+			}
+			fwd_local_remote();
+		});
+}
+
+void server_session::finish(const error_code& ec, bool local_remote)
+{
+	if (--relays_ == 0)
+	{
+		// both directions are done, the session goes back to the pool
+		// once this handler lets go of it
+		timeout_.cancel();
+		return;
+	}
+	if (ec == error::eof)
+	{
+		// the peer finished sending, which is passed on as a FIN; the
+		// other direction may still carry a response
+		error_code ignored;
+		if (local_remote)
+		{
+			remote_.shutdown(socket_base::shutdown_send, ignored);
+		}
+		else
+		{
+			local_.next_layer().shutdown(socket_base::shutdown_send, ignored);
+		}
+		if (attribute_->half_close_timeout != std::chrono::seconds::zero())
+		{
+			timeout_.schedule(attribute_->half_close_timeout);
 		}
-		else if (address_type == socks::addr_domain)
+		return;
+	}
+	stop(ec);
+	close();
+}
+
+void server_session::handle_timeout()
+{
+	if (relays_ == 0)
+	{
+		expired_ = true;
+		error_code ignored;
+		local_.next_layer().cancel(ignored);
+		if (connector_)
 		{
-			uint8_t domain_length;
-			std::string domain;
-			uint16_t port;
+			connector_->cancel();
+		}
+		return;
+	}
+	stop(error::timed_out);
+	close();
+}
 
-			async_read(local_, buffer(&domain_length, sizeof(domain_length)), yield);
+void server_session::close()
+{
+	// pending operations fail and end their directions
+	error_code ignored;
+	local_.next_layer().close(ignored);
+	remote_.close(ignored);
+}
 
-			async_read(local_, dynamic_buffer(domain), transfer_exactly(domain_length), yield);
+void server_session::stop(const error_code& ec)
+{
+	timeout_.cancel();
+	if (ec != error::operation_aborted)
+	{
+		MSOCKS_LOG(spdlog::level::info, "[{:x}] error: {}", id_, ec.message());
+	}
+}
+
+void server_session::identify()
+{
+	if (attribute_->users.empty())
+	{
+		return;
+	}
+	std::size_t index = 0;
+	if (attribute_->keys)
+	{
+		// the handshake only completes once a key opened the first chunk
+		index = std::get<shadowsocks::aead_context>(local_.get_context()).identified();
+	}
+	user_ = &attribute_->users[index];
+	if (user_->limiter != attribute_->limiter)
+	{
+		// nothing charged the session's bucket yet
+		limiter_.reset(attribute_->session_limit, attribute_->session_burst, user_->limiter);
+	}
+	if (user_->counters != nullptr)
+	{
+		utility::metrics::add(user_->counters->sessions, 1);
+	}
+}
 
-			async_read(local_, buffer(&port, sizeof(port)), yield);
+bool server_session::splice() const noexcept
+{
+#if defined(MSOCKS_HAS_SPLICE)
+	return attribute_->zero_copy && local_.plain();
+#else
+	return false;
+#endif
+}
 
-			result.first = domain;
-			result.second = std::to_string(big_to_native(port));
-		}
-		else
+void server_session::fwd_local_remote()
+{
+	auto before_read = [this](std::size_t n, auto&& handler)
+	{
+		utility::metrics::add(utility::metrics::counter::bytes_received, n);
+		if (user_ != nullptr && user_->counters != nullptr)
 		{
-			throw system_error(errc::address_not_supported, socks_category());
+			utility::metrics::add(user_->counters->bytes_received, int64_t(n));
 		}
-	}
-	catch (system_error & e)
+		timeout_.touch();
+		throttle_local_.async_get(n, std::forward<decltype(handler)>(handler));
+	};
+#if defined(MSOCKS_HAS_SPLICE)
+	if (splice())
 	{
-		if (e.code() != error::operation_aborted)
-			ec = e.code();
+		utility::splice_pair(
+			local_.next_layer(), remote_,
+			pipe_local_,
+			before_read,
+			utility::make_custom_alloc_handler(memory_local_, [this, p = self()](error_code ec) { finish(ec, true); }));
+		return;
 	}
-	post(ioc_, std::bind(handler, ec, result));
+#endif
+	utility::socket_pair(
+		local_, remote_,
+		buffer_local_,
+		before_read,
+		utility::make_custom_alloc_handler(memory_local_, [this, p = self()](error_code ec) { finish(ec, true); }));
 }
 
-async_result<yield_context, void(error_code, std::pair<std::string, std::string>)>::return_type
-server_session::async_handshake(yield_context yield)
+void server_session::fwd_remote_local()
 {
-	async_result<yield_context, void(error_code, std::pair<std::string, std::string>)>::completion_handler_type handler(yield);
-	async_result<yield_context, void(error_code, std::pair<std::string, std::string>)> result(handler);
-	spawn(
-		ioc_,
-		[handler, this, p = shared_from_this()](yield_context yield)
+	auto before_read = [this](std::size_t n, auto&& handler)
 	{
-		do_async_handshake(handler, yield);
-	});
-	return result.get();
+		utility::metrics::add(utility::metrics::counter::bytes_sent, n);
+		if (user_ != nullptr && user_->counters != nullptr)
+		{
+			utility::metrics::add(user_->counters->bytes_sent, int64_t(n));
+		}
+		if (trace_ != 0 && !replied_)
+		{
+			replied_ = true;
+			utility::trace::span(trace_, utility::trace::phase::first_byte, started_);
+		}
+		timeout_.touch();
+		throttle_remote_.async_get(n, std::forward<decltype(handler)>(handler));
+	};
+#if defined(MSOCKS_HAS_SPLICE)
+	if (splice())
+	{
+		utility::splice_pair(
+			remote_, local_.next_layer(),
+			pipe_remote_,
+			before_read,
+			utility::make_custom_alloc_handler(memory_remote_, [this, p = self()](error_code ec) { finish(ec, false); }));
+		return;
+	}
+#endif
+	utility::socket_pair(
+		remote_, local_,
+		buffer_remote_,
+		before_read,
+		utility::make_custom_alloc_handler(memory_remote_, [this, p = self()](error_code ec) { finish(ec, false); }));
 }
 
-
-void server_session::go()
+#if defined(MSOCKS_STACKFUL_RELAY)
+void server_session::async_handshake(handshake_handler handler)
 {
 	spawn(
 		ioc_,
-		[this, p = shared_from_this()](yield_context yield)
+		[handler(std::move(handler)), this, p = self()](yield_context yield)
 	{
-		start(yield);
+		error_code ec;
+		utility::socks_address target;
+		auto scratch = buffer_local_.prepare();
+		std::size_t received = 0;
+		std::size_t size = 0;
+		for (;;)
+		{
+			size = received;
+			auto status = utility::parse_socks_address(static_cast<const uint8_t *>(scratch.data()), size, target);
+			if (status == utility::parse_status::complete)
+			{
+				break;
+			}
+			if (status == utility::parse_status::invalid || received == scratch.size())
+			{
+				ec = error_code(errc::address_not_supported, socks_category());
+				break;
+			}
+			received += local_.async_read_some(scratch + received, yield[ec]);
+			if (ec)
+			{
+				break;
+			}
+		}
+		handler(ec, target, size, received);
 	});
+}
+#else
+void server_session::async_handshake(handshake_handler handler)
+{
+	handshake_op<decltype(local_)>(local_, buffer_local_.prepare(), std::move(handler))();
+}
+#endif
 
+void server_session::go()
+{
+	start();
 }
+
 void
-server_session::notify_reuse(const io_context& ioc, ip::tcp::socket local, const server_session_attribute& attribute)
+server_session::notify_reuse(const io_context& ioc, utility::tcp_socket local, std::shared_ptr<const server_session_attribute> attribute, utility::admission::ticket handshake)
 {
 	(void)ioc;
-	(void)attribute;
-    local_ = shadowsocks::stream<ip::tcp::socket>{std::move(local), shadowsocks::cipher_context{attribute.method, attribute.key, attribute.iv_length}};
-	remote_ = ip::tcp::socket(ioc_);
+	id_ = utility::next_session_id();
+	handshake_ = std::move(handshake);
+	// everything else was reset in place when the session came back
+	local_.next_layer() = utility::zerocopy_socket(std::move(local));
+	if (attribute->cipher == attribute_->cipher)
+	{
+		attribute_->cipher->reset(local_.get_context());
+	}
+	else
+	{
+		// a reload may have changed method and key under the old context
+		local_.get_context() = attribute->cipher->create();
+	}
+	attribute_ = std::move(attribute);
+	limiter_.reset(attribute_->session_limit, attribute_->session_burst, attribute_->limiter);
+	buffer_local_.configure(attribute_->buffer_min, attribute_->buffer_max);
+	buffer_remote_.configure(attribute_->buffer_min, attribute_->buffer_max);
+}
+
+void server_session::notify_recycle()
+{
+	// both connections end here, not when the next client takes the session
+	timeout_.cancel();
+	handshake_.reset();
+	local_.next_layer() = utility::zerocopy_socket(ioc_);
+	remote_ = utility::zerocopy_socket(ioc_);
+	buffer_local_.reset();
+	buffer_remote_.reset();
+#if defined(MSOCKS_HAS_SPLICE)
+	// a torn down flow may have left bytes behind in the pipes
+	pipe_local_.close();
+	pipe_remote_.close();
+#endif
 }
 
 }
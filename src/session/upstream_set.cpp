@@ -0,0 +1,205 @@
+#include <msocks/session/upstream_set.hpp>
+
+#include <msocks/utility/log.hpp>
+
+#include <algorithm>
+
+namespace msocks
+{
+
+upstream_set::upstream_set(io_context& ioc, std::vector<ip::tcp::endpoint> servers,
+	utility::socket_profile profile, clock::duration probe_interval) :
+	ioc_(ioc),
+	profile_(std::move(profile)),
+	probe_interval_(probe_interval),
+	timer_(ioc),
+	random_(std::random_device{}())
+{
+	for (auto& ep : servers)
+	{
+		server s;
+		s.endpoint = ep;
+		servers_.push_back(s);
+	}
+}
+
+void upstream_set::start()
+{
+	// a single server is used whatever a probe says
+	if (servers_.size() > 1 && probe_interval_ != clock::duration::zero())
+	{
+		tick();
+	}
+}
+
+void upstream_set::stop()
+{
+	stopped_ = true;
+	timer_.cancel();
+}
+
+double upstream_set::score(const server& s) const noexcept
+{
+	// an unmeasured server looks as fast as the fastest so it gets tried
+	double latency = s.latency;
+	if (latency == 0)
+	{
+		latency = 1;
+		for (auto& other : servers_)
+		{
+			if (other.latency != 0 && (latency == 1 || other.latency < latency))
+			{
+				latency = other.latency;
+			}
+		}
+	}
+	return latency * double(s.pending + 1);
+}
+
+std::size_t upstream_set::pick(std::size_t except)
+{
+	if (servers_.size() == 1)
+	{
+		return 0;
+	}
+	const auto now = clock::now();
+	std::vector<std::size_t> candidates;
+	candidates.reserve(servers_.size());
+	for (std::size_t i = 0; i != servers_.size(); ++i)
+	{
+		if (i != except && usable(servers_[i], now))
+		{
+			candidates.push_back(i);
+		}
+	}
+	if (candidates.empty())
+	{
+		// everything failed lately, the one that comes back first is tried
+		std::size_t best = except == 0 ? 1 : 0;
+		for (std::size_t i = 0; i != servers_.size(); ++i)
+		{
+			if (i != except && servers_[i].retry < servers_[best].retry)
+			{
+				best = i;
+			}
+		}
+		return best;
+	}
+	if (candidates.size() == 1)
+	{
+		return candidates.front();
+	}
+	// two random choices, distinct
+	std::uniform_int_distribution<std::size_t> first(0, candidates.size() - 1);
+	std::uniform_int_distribution<std::size_t> second(0, candidates.size() - 2);
+	auto a = first(random_);
+	auto b = second(random_);
+	if (b >= a)
+	{
+		++b;
+	}
+	auto& l = servers_[candidates[a]];
+	auto& r = servers_[candidates[b]];
+	return score(l) <= score(r) ? candidates[a] : candidates[b];
+}
+
+void upstream_set::report(std::size_t index, const error_code& ec, clock::duration latency)
+{
+	auto& s = servers_[index];
+	if (s.pending != 0)
+	{
+		s.pending--;
+	}
+	if (ec == error::operation_aborted)
+	{
+		return;
+	}
+	if (ec)
+	{
+		s.failures++;
+		auto backoff = std::min<clock::duration>(
+			std::chrono::seconds(1) * (1u << std::min(s.failures - 1, 6u)), max_backoff);
+		s.retry = clock::now() + backoff;
+		return;
+	}
+	if (latency == clock::duration::zero())
+	{
+		// proves nothing, a failed server keeps its backoff
+		return;
+	}
+	s.failures = 0;
+	auto us = std::chrono::duration<double, std::micro>(latency).count();
+	s.latency = s.latency == 0 ? us : s.latency * 0.8 + us * 0.2;
+}
+
+void upstream_set::tick()
+{
+	for (std::size_t i = 0; i != servers_.size(); ++i)
+	{
+		probe(i);
+	}
+	timer_.expires_after(probe_interval_);
+	timer_.async_wait(
+		[this, p = shared_from_this()](error_code ec)
+		{
+			if (!ec && !stopped_)
+			{
+				tick();
+			}
+		});
+}
+
+void upstream_set::probe(std::size_t index)
+{
+	struct attempt
+	{
+		explicit attempt(io_context& ioc) :
+			socket(ioc),
+			timer(ioc)
+		{}
+
+		utility::tcp_socket socket;
+		utility::steady_timer timer;
+		clock::time_point started = clock::now();
+	};
+	auto a = std::make_shared<attempt>(ioc_);
+	error_code ec;
+	a->socket.open(endpoint(index).protocol(), ec);
+	if (!ec)
+	{
+		utility::apply(profile_, a->socket, ec);
+	}
+	if (ec)
+	{
+		MSOCKS_LOG(spdlog::level::warn, "upstream probe: {}", ec.message());
+		return;
+	}
+	begin(index);
+	a->timer.expires_after(probe_timeout);
+	a->timer.async_wait(
+		[a](error_code ec)
+		{
+			if (!ec)
+			{
+				error_code ignored;
+				a->socket.close(ignored);
+			}
+		});
+	a->socket.async_connect(
+		endpoint(index),
+		[this, p = shared_from_this(), a, index](error_code ec)
+		{
+			a->timer.cancel();
+			if (ec == error::operation_aborted)
+			{
+				// closed by the timer
+				ec = error::timed_out;
+			}
+			report(index, ec, clock::now() - a->started);
+			// the server sees a connection that closes without a request
+			error_code ignored;
+			a->socket.close(ignored);
+		});
+}
+
+}
@@ -0,0 +1,157 @@
+#include <msocks/session/warm_pool.hpp>
+
+#include <msocks/utility/log.hpp>
+
+#include <algorithm>
+#include <cmath>
+
+namespace msocks
+{
+
+warm_pool::warm_pool(io_context& ioc, std::shared_ptr<upstream_set> upstreams,
+	std::shared_ptr<const shadowsocks::context_factory> cipher,
+	std::size_t max_size, std::chrono::steady_clock::duration ttl, utility::socket_profile profile) :
+	ioc_(ioc),
+	upstreams_(std::move(upstreams)),
+	cipher_(std::move(cipher)),
+	max_size_(max_size),
+	ttl_(ttl),
+	profile_(std::move(profile)),
+	timer_(ioc)
+{}
+
+void warm_pool::start()
+{
+	tick();
+}
+
+void warm_pool::stop()
+{
+	stopped_ = true;
+	target_ = 0;
+	ready_.clear();
+	timer_.cancel();
+}
+
+bool warm_pool::alive(stream_type& stream)
+{
+	// the server sends nothing before the request, EOF, an error or any
+	// byte means the connection is gone
+	auto& socket = stream.next_layer();
+	error_code ec;
+	socket.non_blocking(true, ec);
+	uint8_t byte;
+	if (!ec)
+	{
+		socket.receive(buffer(&byte, 1), socket_base::message_peek, ec);
+	}
+	error_code ignored;
+	socket.non_blocking(false, ignored);
+	if (ec == error::would_block)
+	{
+		return true;
+	}
+	MSOCKS_LOG(spdlog::level::debug, "warm pool: dropped a dead connection: {}", ec ? ec.message() : "unexpected data");
+	return false;
+}
+
+std::optional<warm_pool::stream_type> warm_pool::take()
+{
+	taken_++;
+	expire();
+	// a server restart or a reset leaves dead ones behind
+	while (!ready_.empty() && !alive(ready_.front().stream))
+	{
+		ready_.pop_front();
+	}
+	if (ready_.empty())
+	{
+		if (!stopped_)
+		{
+			// demand outran the estimate, don't wait for the next tick
+			target_ = std::min(max_size_, std::max<std::size_t>(target_, 1));
+			refill();
+		}
+		return std::nullopt;
+	}
+	std::optional<stream_type> stream(std::move(ready_.front().stream));
+	ready_.pop_front();
+	refill();
+	return stream;
+}
+
+void warm_pool::tick()
+{
+	using seconds = std::chrono::duration<double>;
+	const double ttl = std::chrono::duration_cast<seconds>(ttl_).count();
+	const double period = ttl / 2;
+	rate_ = (rate_ + taken_ / period) / 2;
+	taken_ = 0;
+	// a rare session costs one round trip less than a connection that
+	// keeps expiring unused
+	target_ = std::min(max_size_, static_cast<std::size_t>(std::lround(rate_ * ttl)));
+	expire();
+	refill();
+	timer_.expires_after(std::chrono::duration_cast<std::chrono::steady_clock::duration>(seconds(period)));
+	timer_.async_wait(
+		[this, p = shared_from_this()](error_code ec)
+		{
+			if (!ec && !stopped_)
+			{
+				tick();
+			}
+		});
+}
+
+void warm_pool::expire()
+{
+	const auto deadline = std::chrono::steady_clock::now() - ttl_;
+	while (!ready_.empty() && ready_.front().connected < deadline)
+	{
+		ready_.pop_front();
+	}
+	// anything past the target goes, oldest first
+	while (ready_.size() > target_)
+	{
+		ready_.pop_front();
+	}
+}
+
+void warm_pool::refill()
+{
+	while (ready_.size() + connecting_ < target_)
+	{
+		auto stream = std::make_shared<stream_type>(utility::tcp_socket(ioc_), cipher_->create());
+		const auto index = upstreams_->pick();
+		const auto& server = upstreams_->endpoint(index);
+		error_code ec;
+		stream->next_layer().open(server.protocol(), ec);
+		if (ec)
+		{
+			MSOCKS_LOG(spdlog::level::warn, "warm pool: {}", ec.message());
+			return;
+		}
+		utility::apply(profile_, stream->next_layer(), ec);
+		connecting_++;
+		upstreams_->begin(index);
+		stream->next_layer().async_connect(
+			server,
+			[this, p = shared_from_this(), stream, index, started = upstream_set::clock::now()](error_code ec)
+			{
+				connecting_--;
+				upstreams_->report(index, ec, upstream_set::clock::now() - started);
+				if (ec)
+				{
+					// retried on the next tick, not right away
+					MSOCKS_LOG(spdlog::level::info, "warm pool: {}", ec.message());
+					return;
+				}
+				if (ready_.size() < target_)
+				{
+					ready_.push_back(entry{std::move(*stream), std::chrono::steady_clock::now()});
+				}
+			});
+	}
+}
+
+}
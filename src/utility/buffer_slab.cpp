@@ -0,0 +1,100 @@
+#include <msocks/utility/buffer_slab.hpp>
+
+namespace msocks::utility
+{
+
+namespace
+{
+
+std::size_t class_of(std::size_t size) noexcept
+{
+	std::size_t index = 0;
+	std::size_t block = buffer_slab::smallest_class;
+	while (block < size)
+	{
+		block <<= 1;
+		index++;
+	}
+	return index;
+}
+
+}
+
+execution_context::id buffer_slab::id;
+
+buffer_slab::buffer_slab(execution_context& ctx) :
+	execution_context::service(ctx)
+{}
+
+buffer_slab::~buffer_slab()
+{
+	clear();
+}
+
+uint8_t* buffer_slab::acquire(std::size_t& size)
+{
+	std::size_t index = class_of(size);
+	if (index >= class_count)
+	{
+		return new uint8_t[size];
+	}
+	size = smallest_class << index;
+	if (free_block* block = free_[index])
+	{
+		free_[index] = block->next;
+		count_[index]--;
+		return reinterpret_cast<uint8_t *>(block);
+	}
+	return new uint8_t[size];
+}
+
+void buffer_slab::release(uint8_t* block, std::size_t size) noexcept
+{
+	if (block == nullptr)
+	{
+		return;
+	}
+	std::size_t index = class_of(size);
+	if (shutdown_ || index >= class_count || (count_[index] + 1) * size > cached_bytes)
+	{
+		delete[] block;
+		return;
+	}
+	auto free = reinterpret_cast<free_block *>(block);
+	free->next = free_[index];
+	free_[index] = free;
+	count_[index]++;
+}
+
+std::size_t buffer_slab::cached() const noexcept
+{
+	std::size_t bytes = 0;
+	for (std::size_t i = 0; i < class_count; i++)
+	{
+		bytes += count_[i] * (smallest_class << i);
+	}
+	return bytes;
+}
+
+void buffer_slab::shutdown()
+{
+	// sessions released while the io_context tears down its handlers
+	// free their buffers directly from now on
+	shutdown_ = true;
+	clear();
+}
+
+void buffer_slab::clear() noexcept
+{
+	for (std::size_t i = 0; i < class_count; i++)
+	{
+		while (free_block* block = free_[i])
+		{
+			free_[i] = block->next;
+			delete[] reinterpret_cast<uint8_t *>(block);
+		}
+		count_[i] = 0;
+	}
+}
+
+}
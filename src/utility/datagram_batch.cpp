@@ -0,0 +1,158 @@
+#include <msocks/utility/datagram_batch.hpp>
+#include <msocks/utility/metrics.hpp>
+
+#include <cstring>
+
+namespace msocks::utility
+{
+
+datagram_batch::datagram_batch() :
+	storage_(capacity * slot_size)
+{
+	for (std::size_t i = 0; i != capacity; ++i)
+	{
+		received_[i].data = storage_.data() + i * slot_size + headroom;
+		received_[i].size = 0;
+#if defined(MSOCKS_HAS_MMSG)
+		rx_iov_[i].iov_base = received_[i].data;
+		rx_iov_[i].iov_len = max_datagram;
+		rx_[i].msg_hdr.msg_iov = &rx_iov_[i];
+		rx_[i].msg_hdr.msg_iovlen = 1;
+		rx_[i].msg_hdr.msg_name = &rx_addr_[i];
+		tx_[i].msg_hdr.msg_iov = &tx_iov_[i];
+		tx_[i].msg_hdr.msg_iovlen = 1;
+		tx_[i].msg_hdr.msg_name = &tx_addr_[i];
+#endif
+	}
+}
+
+#if defined(MSOCKS_HAS_MMSG)
+std::size_t datagram_batch::receive(udp_socket& socket, error_code& ec)
+{
+	flush();
+	for (auto& m : rx_)
+	{
+		m.msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+		m.msg_hdr.msg_flags = 0;
+	}
+	int n = ::recvmmsg(socket.native_handle(), rx_.data(), capacity, MSG_DONTWAIT, nullptr);
+	if (n < 0)
+	{
+		ec = error_code(errno == EAGAIN ? int(EWOULDBLOCK) : errno, system_category());
+		return 0;
+	}
+	ec = {};
+	std::size_t count = 0;
+	for (int i = 0; i != n; ++i)
+	{
+		auto& m = rx_[i];
+		if (m.msg_hdr.msg_flags & MSG_TRUNC)
+		{
+			metrics::add(metrics::counter::udp_dropped);
+			continue;
+		}
+		// truncated ones leave a gap, the slots' buffers move with them
+		auto& d = received_[count++];
+		std::swap(d.data, received_[i].data);
+		d.size = m.msg_len;
+		std::memcpy(d.peer.data(), &rx_addr_[i], m.msg_hdr.msg_namelen);
+		d.peer.resize(m.msg_hdr.msg_namelen);
+	}
+	for (std::size_t i = 0; i != capacity; ++i)
+	{
+		rx_iov_[i].iov_base = received_[i].data;
+	}
+	metrics::add(metrics::counter::udp_received, count);
+	return count;
+}
+
+void datagram_batch::send(udp_socket& socket, const_buffer data, const ip::udp::endpoint& to)
+{
+	if (queued_ == capacity || (queued_ != 0 && queued_socket_ != &socket))
+	{
+		flush();
+	}
+	queued_socket_ = &socket;
+	auto& m = tx_[queued_];
+	tx_iov_[queued_].iov_base = const_cast<void*>(data.data());
+	tx_iov_[queued_].iov_len = data.size();
+	std::memcpy(&tx_addr_[queued_], to.data(), to.size());
+	m.msg_hdr.msg_namelen = socklen_t(to.size());
+	++queued_;
+}
+
+void datagram_batch::flush() noexcept
+{
+	std::size_t sent = 0;
+	while (sent != queued_)
+	{
+		int n = ::sendmmsg(queued_socket_->native_handle(), tx_.data() + sent, unsigned(queued_ - sent), MSG_DONTWAIT);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			// a full socket buffer or an unreachable peer costs this datagram
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				metrics::add(metrics::counter::udp_dropped);
+				++sent;
+				continue;
+			}
+			metrics::add(metrics::counter::udp_dropped, int64_t(queued_ - sent));
+			break;
+		}
+		metrics::add(metrics::counter::udp_sent, n);
+		sent += std::size_t(n);
+	}
+	queued_ = 0;
+}
+#else
+std::size_t datagram_batch::receive(udp_socket& socket, error_code& ec)
+{
+	flush();
+	std::size_t count = 0;
+	while (count != capacity)
+	{
+		auto& d = received_[count];
+		d.size = socket.receive_from(buffer(d.data, max_datagram), d.peer, 0, ec);
+		if (ec)
+		{
+			break;
+		}
+		++count;
+	}
+	if (count != 0)
+	{
+		ec = {};
+	}
+	metrics::add(metrics::counter::udp_received, count);
+	return count;
+}
+
+void datagram_batch::send(udp_socket& socket, const_buffer data, const ip::udp::endpoint& to)
+{
+	if (queued_ == capacity || (queued_ != 0 && queued_socket_ != &socket))
+	{
+		flush();
+	}
+	queued_socket_ = &socket;
+	tx_data_[queued_] = data;
+	tx_to_[queued_] = to;
+	++queued_;
+}
+
+void datagram_batch::flush() noexcept
+{
+	for (std::size_t i = 0; i != queued_; ++i)
+	{
+		error_code ec;
+		queued_socket_->send_to(tx_data_[i], tx_to_[i], 0, ec);
+		metrics::add(ec ? metrics::counter::udp_dropped : metrics::counter::udp_sent);
+	}
+	queued_ = 0;
+}
+#endif
+
+}
@@ -0,0 +1,166 @@
+#include <boost/asio/post.hpp>
+
+#include <msocks/utility/dns_cache.hpp>
+
+#include <algorithm>
+
+namespace msocks::utility
+{
+
+namespace
+{
+
+// RFC 8305 ordering: the families take turns, starting with the first one
+// the resolver returned
+std::vector<ip::tcp::endpoint> interleave(const ip::tcp::resolver::results_type& results)
+{
+	std::vector<ip::tcp::endpoint> first, second;
+	for (auto& r : results)
+	{
+		auto ep = r.endpoint();
+		if (first.empty() || first.front().protocol() == ep.protocol())
+		{
+			first.push_back(ep);
+		}
+		else
+		{
+			second.push_back(ep);
+		}
+	}
+	std::vector<ip::tcp::endpoint> ordered;
+	ordered.reserve(first.size() + second.size());
+	for (std::size_t i = 0; i < std::max(first.size(), second.size()); i++)
+	{
+		if (i < first.size())
+		{
+			ordered.push_back(first[i]);
+		}
+		if (i < second.size())
+		{
+			ordered.push_back(second[i]);
+		}
+	}
+	return ordered;
+}
+
+}
+
+io_context::id dns_cache::id;
+
+dns_cache::dns_cache(io_context& ioc) :
+	io_context::service(ioc),
+	ioc_(ioc),
+	resolver_(ioc)
+{}
+
+void dns_cache::configure(std::chrono::steady_clock::duration ttl, std::chrono::steady_clock::duration negative_ttl) noexcept
+{
+	ttl_ = ttl;
+	negative_ttl_ = negative_ttl;
+}
+
+void dns_cache::async_resolve(const socks_address& target, handler_type handler)
+{
+	std::string host(target.domain);
+	error_code ec;
+	// domains that spell out an address are literals as well
+	auto address = target.type == socks::addr_domain ? ip::make_address(host, ec) : target.address;
+	if (!ec)
+	{
+		results_type results = std::make_shared<std::vector<ip::tcp::endpoint>>(1, ip::tcp::endpoint(address, target.port));
+		post(ioc_, std::bind(std::move(handler), error_code{}, std::move(results)));
+		return;
+	}
+	std::string service = std::to_string(target.port);
+	std::string key = host + ':' + service;
+	auto now = std::chrono::steady_clock::now();
+	auto iter = entries_.find(key);
+	if (iter != entries_.end())
+	{
+		auto& e = iter->second;
+		if (e.pending)
+		{
+			e.waiters.push_back(std::move(handler));
+			return;
+		}
+		if (e.expires > now)
+		{
+			post(ioc_, std::bind(std::move(handler), e.ec, e.results));
+			return;
+		}
+	}
+	else
+	{
+		evict();
+	}
+	auto& e = entries_[key];
+	e.pending = true;
+	e.waiters.push_back(std::move(handler));
+	resolver_.async_resolve(
+		host, service,
+		[this, key](error_code ec, ip::tcp::resolver::results_type results)
+		{
+			if (ec == error::operation_aborted)
+			{
+				return;
+			}
+			if (!ec && results.empty())
+			{
+				ec = error::host_not_found;
+			}
+			complete(key, ec, ec ? nullptr : std::make_shared<const std::vector<ip::tcp::endpoint>>(interleave(results)));
+		});
+}
+
+void dns_cache::complete(const std::string& key, error_code ec, results_type results)
+{
+	auto iter = entries_.find(key);
+	if (iter == entries_.end())
+	{
+		return;
+	}
+	auto& e = iter->second;
+	e.ec = ec;
+	e.results = results;
+	e.expires = std::chrono::steady_clock::now() + (ec ? negative_ttl_ : ttl_);
+	e.pending = false;
+	auto waiters = std::move(e.waiters);
+	e.waiters.clear();
+	for (auto& handler : waiters)
+	{
+		handler(ec, results);
+	}
+}
+
+void dns_cache::evict()
+{
+	if (entries_.size() < max_entries)
+	{
+		return;
+	}
+	auto now = std::chrono::steady_clock::now();
+	for (auto iter = entries_.begin(); iter != entries_.end();)
+	{
+		if (!iter->second.pending && iter->second.expires <= now)
+		{
+			iter = entries_.erase(iter);
+		}
+		else
+		{
+			++iter;
+		}
+	}
+	// still full of live answers, any one that is not in flight goes
+	for (auto iter = entries_.begin(); entries_.size() >= max_entries && iter != entries_.end();)
+	{
+		iter = iter->second.pending ? std::next(iter) : entries_.erase(iter);
+	}
+}
+
+void dns_cache::shutdown()
+{
+	// waiters hold on to their sessions
+	entries_.clear();
+}
+
+}
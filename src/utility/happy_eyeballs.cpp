@@ -0,0 +1,121 @@
+#include <msocks/utility/happy_eyeballs.hpp>
+#include <msocks/utility/socket_option.hpp>
+
+namespace msocks::utility
+{
+
+happy_eyeballs::happy_eyeballs(io_context& ioc, dns_cache::results_type endpoints, handler_type handler, bool fast_open,
+	const socket_profile* profile) :
+	ioc_(ioc),
+	endpoints_(std::move(endpoints)),
+	handler_(std::move(handler)),
+	timer_(ioc),
+	fast_open_(fast_open),
+	profile_(profile)
+{}
+
+void happy_eyeballs::start()
+{
+	if (endpoints_->empty())
+	{
+		post(ioc_, [this, p = shared_from_this()] { complete(error::host_not_found, utility::tcp_socket(ioc_)); });
+		return;
+	}
+	attempt();
+}
+
+void happy_eyeballs::attempt()
+{
+	std::size_t index = sockets_.size();
+	if (done_ || index == endpoints_->size())
+	{
+		return;
+	}
+	auto& endpoint = (*endpoints_)[index];
+	auto& socket = sockets_.emplace_back(ioc_);
+	error_code ec;
+	socket.open(endpoint.protocol(), ec);
+	if (ec)
+	{
+		post(ioc_, [this, p = shared_from_this(), index, ec] { handle_connect(index, ec); });
+		return;
+	}
+	if (profile_)
+	{
+		// the loader tried the profile, what fails here is left out
+		apply(*profile_, socket, ec);
+	}
+#if defined(TCP_FASTOPEN_CONNECT)
+	if (fast_open_ && endpoints_->size() == 1)
+	{
+		// a target without fast open support just sees a plain SYN
+		error_code ignored;
+		socket.set_option(utility::fast_open_connect(true), ignored);
+	}
+#endif
+	socket.async_connect(
+		endpoint,
+		[this, p = shared_from_this(), index](error_code ec)
+		{
+			handle_connect(index, ec);
+		});
+	if (sockets_.size() != endpoints_->size())
+	{
+		timer_.expires_after(attempt_delay);
+		timer_.async_wait(
+			[this, p = shared_from_this()](error_code ec)
+			{
+				if (!ec)
+				{
+					attempt();
+				}
+			});
+	}
+}
+
+void happy_eyeballs::handle_connect(std::size_t index, error_code ec)
+{
+	if (done_)
+	{
+		return;
+	}
+	if (!ec)
+	{
+		complete(ec, std::move(sockets_[index]));
+		return;
+	}
+	if (++failed_ == endpoints_->size())
+	{
+		complete(ec, utility::tcp_socket(ioc_));
+		return;
+	}
+	if (failed_ == sockets_.size())
+	{
+		// nothing left in flight, the next one need not wait for the timer
+		timer_.cancel();
+		attempt();
+	}
+}
+
+void happy_eyeballs::cancel()
+{
+	if (!done_)
+	{
+		complete(error::operation_aborted, utility::tcp_socket(ioc_));
+	}
+}
+
+void happy_eyeballs::complete(error_code ec, utility::tcp_socket socket)
+{
+	done_ = true;
+	timer_.cancel();
+	for (auto& s : sockets_)
+	{
+		error_code ignored;
+		s.close(ignored);
+	}
+	auto handler = std::move(handler_);
+	handler(ec, std::move(socket));
+}
+
+}
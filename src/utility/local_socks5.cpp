@@ -2,123 +2,229 @@
 // Created by maxtorm on 2019/4/14.
 //
 
-#include <boost/asio/spawn.hpp>
 #include <boost/asio/ip/tcp.hpp>
-#include <boost/asio/read.hpp>
 #include <boost/asio/write.hpp>
-#include <boost/endian/conversion.hpp>
 
+#include <msocks/utility/socks_address.hpp>
 #include <msocks/utility/socks_constants.hpp>
 #include <msocks/utility/socks_erorr.hpp>
 #include <msocks/utility/local_socks5.hpp>
-#include <spdlog/spdlog.h>
-using namespace boost::endian;
+
+#include <cstring>
 
 namespace msocks::utility
 {
-void detail::do_local_socks5(
-	io_context& strand,
-	ip::tcp::socket& local,
-	async_result<yield_context, void(error_code, std::vector<uint8_t>)>::completion_handler_type handler,
-	yield_context yield)
+namespace
 {
-	std::array<uint8_t, 256 + 2> temp{};
-	MSOCKS_PACK(
-		struct
-	{
-		uint8_t version;
-		uint8_t n_method;
-	})
-		auth_method {};
-	MSOCKS_PACK(
-		struct
+
+constexpr std::array<uint8_t, 2> auth_reply
+{
+	socks::socks5_version, socks::auth_no_auth
+};
+
+constexpr std::array<uint8_t, 10> reply
+{
+	socks::socks5_version, 0x00, 0x00, socks::addr_ipv4, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+// length of the method selection at the start of data, 0 while incomplete
+std::size_t greeting_length(const uint8_t* data, std::size_t n)
+{
+	return n >= 2 && n >= 2 + std::size_t(data[1]) ? 2 + std::size_t(data[1]) : 0;
+}
+
+// [version][cmd][reserved][address], on complete size is its length
+parse_status parse_request(const uint8_t* data, std::size_t& size, bool udp, error_code& ec)
+{
+	if (size < 3)
 	{
-		uint8_t version;
-		uint8_t method;
+		return parse_status::incomplete;
 	}
-	) auth_reply {
-		socks::socks5_version, socks::auth_no_auth
-	};
-
-	MSOCKS_PACK(
-		struct
+	if (data[1] != socks::conn_tcp && !(udp && data[1] == socks::conn_udp))
 	{
-		uint8_t version;
-		uint8_t cmd;
-		uint8_t reserve;
-		uint8_t addr_type;
-	})
-		request {};
-
-	MSOCKS_PACK(
-		struct
+		ec = error_code(errc::cmd_not_supported, socks_category());
+		return parse_status::invalid;
+	}
+	socks_address target;
+	std::size_t n = size - 3;
+	auto status = parse_socks_address(data + 3, n, target);
+	if (status == parse_status::invalid)
 	{
-		uint8_t version;
-		uint8_t rep;
-		uint8_t rsv;
-		uint8_t atyp;
-		uint32_t bnd_addr;
-		uint16_t bnd_port;
-	})
-		reply {
-		socks::socks5_version, 0x00, 0x00, socks::addr_ipv4, 0x00000000, 0x0000
-	};
+		ec = error_code(errc::address_not_supported, socks_category());
+	}
+	size = 3 + n;
+	return status;
+}
 
+}
+
+#if defined(MSOCKS_STACKFUL_RELAY)
+void detail::do_local_socks5(
+	utility::tcp_socket& local,
+	mutable_buffer scratch,
+	const_buffer udp_reply,
+	local_socks5_handler handler,
+	yield_context yield)
+{
+	auto data = static_cast<uint8_t *>(scratch.data());
+	std::size_t end = 0;
+	std::size_t size = 0;
 	error_code ec;
-	std::vector<uint8_t> result;
-	try
+	auto read_more = [&]
 	{
-		async_read(local, buffer(&auth_method, sizeof(auth_method)), yield);
-		async_read(local, buffer(temp, auth_method.n_method), yield);
-		async_write(local, buffer(&auth_reply, sizeof(auth_reply)), yield);
-		async_read(local, buffer(&request, sizeof(request)), yield);
-		switch (request.cmd)
+		if (end == scratch.size())
 		{
-			case socks::conn_tcp:
-				break;
-			case socks::conn_bind:
-			case socks::conn_udp:
-			default:
-				throw system_error(errc::cmd_not_supported, socks_category());
+			ec = error_code(errc::address_not_supported, socks_category());
+			return;
 		}
-		result.push_back(request.addr_type);
-		if (request.addr_type == socks::addr_ipv4)
+		end += local.async_read_some(scratch + end, yield[ec]);
+	};
+	while (!ec && (size = greeting_length(data, end)) == 0)
+	{
+		read_more();
+	}
+	if (!ec)
+	{
+		// a client that did not wait for the reply keeps its request
+		std::memmove(data, data + size, end - size);
+		end -= size;
+		async_write(local, buffer(auth_reply), yield[ec]);
+	}
+	while (!ec)
+	{
+		size = end;
+		auto status = parse_request(data, size, udp_reply.size() != 0, ec);
+		if (status == parse_status::complete)
 		{
-			async_read(local, buffer(temp, 32 / 8 + 2), yield);
-			std::copy(temp.begin(), temp.begin() + 32 / 8 + 2, std::back_inserter(result));
+			async_write(local, data[1] == socks::conn_udp ? udp_reply : buffer(reply), yield[ec]);
+			break;
 		}
-		else if (request.addr_type == socks::addr_ipv6)
+		if (status == parse_status::incomplete)
 		{
-			async_read(local, buffer(temp, 128 / 8 + 2), yield);
-			std::copy(temp.begin(), temp.begin() + 128 / 8 + 2, std::back_inserter(result));
+			read_more();
 		}
-		else if (request.addr_type == socks::addr_domain)
+	}
+	const_buffer address;
+	const_buffer rest;
+	uint8_t command = 0;
+	if (!ec)
+	{
+		command = data[1];
+		address = buffer(data + 3, size - 3);
+		rest = buffer(data + size, end - size);
+	}
+	post(local.get_executor(), std::bind(handler, ec, command, address, rest));
+}
+
+void async_local_socks5(utility::tcp_socket& local, mutable_buffer scratch, local_socks5_handler handler, const_buffer udp_reply)
+{
+	spawn(local.get_executor(), std::bind(&detail::do_local_socks5, std::ref(local), scratch, udp_reply, std::move(handler), std::placeholders::_1));
+}
+#else
+namespace
+{
+
+// reads whatever arrives into scratch and parses the greeting and the
+// request where they landed, without a read per field
+class local_socks5_op
+{
+public:
+	local_socks5_op(utility::tcp_socket& local, mutable_buffer scratch, const_buffer udp_reply, local_socks5_handler handler) :
+		local_(local),
+		scratch_(scratch),
+		udp_reply_(udp_reply),
+		handler_(std::move(handler))
+	{}
+
+	void operator()(error_code ec = {}, std::size_t bytes_transferred = 0)
+	{
+		if (ec)
 		{
-			uint8_t domain_length;
-			async_read(local, buffer(&domain_length, sizeof(domain_length)), yield);
-			result.push_back(domain_length);
-			async_read(local, buffer(temp, domain_length + 2), yield);
-			std::copy(temp.begin(), temp.begin() + domain_length + 2, std::back_inserter(result));
+			handler_(ec, 0, {}, {});
+			return;
 		}
-		else
+		auto data = static_cast<uint8_t *>(scratch_.data());
+		switch (state_)
 		{
-			throw system_error(errc::address_not_supported, socks_category());
+			case state::greeting:
+			{
+				end_ += bytes_transferred;
+				std::size_t size = greeting_length(data, end_);
+				if (size == 0)
+				{
+					read_more();
+					return;
+				}
+				// a client that did not wait for the reply keeps its request
+				std::memmove(data, data + size, end_ - size);
+				end_ -= size;
+				state_ = state::auth_reply;
+				async_write(local_, buffer(auth_reply), std::move(*this));
+				return;
+			}
+			case state::auth_reply:
+				state_ = state::request;
+				bytes_transferred = 0;
+				[[fallthrough]];
+			case state::request:
+			{
+				end_ += bytes_transferred;
+				size_ = end_;
+				switch (parse_request(data, size_, udp_reply_.size() != 0, ec))
+				{
+					case parse_status::complete:
+						state_ = state::reply;
+						async_write(local_, data[1] == socks::conn_udp ? udp_reply_ : buffer(reply), std::move(*this));
+						return;
+					case parse_status::incomplete:
+						read_more();
+						return;
+					case parse_status::invalid:
+						handler_(ec, 0, {}, {});
+						return;
+				}
+				return;
+			}
+			case state::reply:
+				handler_(ec, data[1], buffer(data + 3, size_ - 3), buffer(data + size_, end_ - size_));
+				return;
 		}
-		async_write(local, buffer(&reply, sizeof(reply)), yield);
 	}
-	catch (system_error& e)
+
+private:
+	enum class state
+	{
+		greeting,
+		auth_reply,
+		request,
+		reply
+	};
+
+	void read_more()
 	{
-		ec = e.code();
+		if (end_ == scratch_.size())
+		{
+			handler_(error_code(errc::address_not_supported, socks_category()), 0, {}, {});
+			return;
+		}
+		local_.async_read_some(scratch_ + end_, std::move(*this));
 	}
-	post(strand, std::bind(handler, ec, result));
+
+	utility::tcp_socket& local_;
+	mutable_buffer scratch_;
+	const_buffer udp_reply_;
+	local_socks5_handler handler_;
+	state state_ = state::greeting;
+	// bytes in scratch_, and the length of the request among them
+	std::size_t end_ = 0;
+	std::size_t size_ = 0;
+};
+
 }
 
-async_result<yield_context, void(error_code, std::vector<uint8_t>)>::return_type
-async_local_socks5(io_context& ioc, ip::tcp::socket& local, yield_context yield)
+void async_local_socks5(utility::tcp_socket& local, mutable_buffer scratch, local_socks5_handler handler, const_buffer udp_reply)
 {
-	async_result<yield_context, void(error_code, std::vector<uint8_t>)>::completion_handler_type handler(yield);
-	async_result<yield_context, void(error_code, std::vector<uint8_t>)> result(handler);
-	spawn(ioc, std::bind(&detail::do_local_socks5, std::ref(ioc), std::ref(local), handler, std::placeholders::_1));
-	return result.get();
+	local_socks5_op(local, scratch, udp_reply, std::move(handler))();
 }
+#endif
 }
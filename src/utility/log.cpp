@@ -0,0 +1,44 @@
+#include <msocks/utility/log.hpp>
+
+#include <spdlog/async.h>
+#include <spdlog/sinks/stdout_sinks.h>
+
+namespace msocks::utility::log
+{
+
+spdlog::level::level_enum parse_level(const std::string& name)
+{
+	auto lvl = spdlog::level::from_str(name);
+	// from_str takes anything it does not know for off
+	if (lvl == spdlog::level::off && name != "off")
+	{
+		throw std::invalid_argument("unknown log level " + name);
+	}
+	return lvl;
+}
+
+void setup(const log_config& cfg)
+{
+	auto lvl = parse_level(cfg.level);
+	spdlog::init_thread_pool(cfg.queue, 1);
+	auto logger = spdlog::create_async_nb<spdlog::sinks::stdout_sink_mt>("msocks");
+	logger->set_pattern("[%l] %v");
+	logger->set_level(lvl);
+	// errors are what an operator waits for, they leave the queue right away
+	logger->flush_on(spdlog::level::err);
+	spdlog::set_default_logger(std::move(logger));
+	site_rate.store(cfg.site_rate, std::memory_order_relaxed);
+}
+
+void configure(const log_config& cfg)
+{
+	spdlog::set_level(parse_level(cfg.level));
+	site_rate.store(cfg.site_rate, std::memory_order_relaxed);
+}
+
+void shutdown()
+{
+	spdlog::shutdown();
+}
+
+}
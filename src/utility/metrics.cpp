@@ -0,0 +1,182 @@
+#include <msocks/utility/metrics.hpp>
+
+#include <spdlog/fmt/fmt.h>
+
+#include <deque>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace msocks::utility::metrics
+{
+
+namespace
+{
+
+struct registry
+{
+	std::mutex mutex;
+	// a deque never moves the shards it holds
+	std::deque<shard> shards;
+	std::map<std::string, user_counters> users;
+};
+
+registry& instance()
+{
+	static registry r;
+	return r;
+}
+
+struct counter_info
+{
+	const char* name;
+	const char* type;
+	const char* help;
+	// nanosecond counters are exported in seconds
+	double scale;
+};
+
+constexpr std::array<counter_info, std::size_t(counter::count)> counter_infos{{
+	{"msocks_bytes_received_total", "counter", "Plaintext bytes read from clients.", 1},
+	{"msocks_bytes_sent_total", "counter", "Plaintext bytes read from targets and sent to clients.", 1},
+	{"msocks_sessions_active", "gauge", "Sessions taken from the pool and not yet returned.", 1},
+	{"msocks_pool_hits_total", "counter", "Sessions reused from the pool.", 1},
+	{"msocks_pool_misses_total", "counter", "Sessions the pool had to construct.", 1},
+	{"msocks_limiter_wait_seconds_total", "counter", "Time relays waited for rate limiters.", 1e-9},
+	{"msocks_cipher_seconds_total", "counter", "Time spent encrypting and decrypting.", 1e-9},
+	{"msocks_cipher_bytes_total", "counter", "Bytes encrypted and decrypted.", 1},
+	{"msocks_udp_received_total", "counter", "Datagrams the udp relay received.", 1},
+	{"msocks_udp_sent_total", "counter", "Datagrams the udp relay sent.", 1},
+	{"msocks_udp_dropped_total", "counter", "Datagrams dropped for size, full socket buffers or failed opens.", 1},
+	{"msocks_handshakes_rejected_total", "counter", "Connections reset on accept because too many handshakes ran.", 1},
+}};
+
+constexpr std::array<counter_info, std::size_t(histogram::count)> histogram_infos{{
+	{"msocks_handshake_seconds", "histogram", "From accept until the target address is known.", 1e-9},
+	{"msocks_resolve_seconds", "histogram", "Name lookups of targets, cache hits included.", 1e-9},
+	{"msocks_connect_seconds", "histogram", "Connects to targets over all attempts.", 1e-9},
+}};
+
+// a label value in the text format escapes backslash, quote and newline
+std::string label_value(const std::string& value)
+{
+	std::string escaped;
+	escaped.reserve(value.size());
+	for (char c : value)
+	{
+		switch (c)
+		{
+			case '\\':
+				escaped += "\\\\";
+				break;
+			case '"':
+				escaped += "\\\"";
+				break;
+			case '\n':
+				escaped += "\\n";
+				break;
+			default:
+				escaped += c;
+		}
+	}
+	return escaped;
+}
+
+}
+
+shard& register_shard()
+{
+	auto& r = instance();
+	std::lock_guard<std::mutex> lock(r.mutex);
+	return r.shards.emplace_back();
+}
+
+user_counters& user(const std::string& name)
+{
+	auto& r = instance();
+	std::lock_guard<std::mutex> lock(r.mutex);
+	return r.users[name];
+}
+
+std::string scrape()
+{
+	auto& r = instance();
+	std::array<int64_t, std::size_t(counter::count)> counters{};
+	std::array<std::array<int64_t, bucket_bounds.size() + 1>, std::size_t(histogram::count)> buckets{};
+	std::array<int64_t, std::size_t(histogram::count)> sums{};
+	std::vector<std::pair<std::string, std::array<int64_t, 3>>> users;
+	{
+		std::lock_guard<std::mutex> lock(r.mutex);
+		for (auto& [name, u] : r.users)
+		{
+			users.emplace_back(name, std::array<int64_t, 3>{
+				u.bytes_received.load(std::memory_order_relaxed),
+				u.bytes_sent.load(std::memory_order_relaxed),
+				u.sessions.load(std::memory_order_relaxed)});
+		}
+		for (auto& s : r.shards)
+		{
+			for (std::size_t i = 0; i != counters.size(); ++i)
+			{
+				counters[i] += s.counters[i].load(std::memory_order_relaxed);
+			}
+			for (std::size_t h = 0; h != buckets.size(); ++h)
+			{
+				for (std::size_t b = 0; b != buckets[h].size(); ++b)
+				{
+					buckets[h][b] += s.buckets[h][b].load(std::memory_order_relaxed);
+				}
+				sums[h] += s.sum_ns[h].load(std::memory_order_relaxed);
+			}
+		}
+	}
+	fmt::memory_buffer out;
+	for (std::size_t i = 0; i != counters.size(); ++i)
+	{
+		auto& info = counter_infos[i];
+		fmt::format_to(std::back_inserter(out), "# HELP {} {}\n# TYPE {} {}\n", info.name, info.help, info.name, info.type);
+		if (info.scale == 1)
+		{
+			fmt::format_to(std::back_inserter(out), "{} {}\n", info.name, counters[i]);
+		}
+		else
+		{
+			fmt::format_to(std::back_inserter(out), "{} {}\n", info.name, counters[i] * info.scale);
+		}
+	}
+	for (std::size_t h = 0; h != buckets.size(); ++h)
+	{
+		auto& info = histogram_infos[h];
+		fmt::format_to(std::back_inserter(out), "# HELP {} {}\n# TYPE {} {}\n", info.name, info.help, info.name, info.type);
+		int64_t cumulative = 0;
+		for (std::size_t b = 0; b != bucket_bounds.size(); ++b)
+		{
+			cumulative += buckets[h][b];
+			fmt::format_to(std::back_inserter(out), "{}_bucket{{le=\"{}\"}} {}\n", info.name, bucket_bounds[b] / 1e6, cumulative);
+		}
+		cumulative += buckets[h].back();
+		fmt::format_to(std::back_inserter(out), "{}_bucket{{le=\"+Inf\"}} {}\n", info.name, cumulative);
+		fmt::format_to(std::back_inserter(out), "{}_sum {}\n{}_count {}\n", info.name, sums[h] * info.scale, info.name, cumulative);
+	}
+	if (!users.empty())
+	{
+		static constexpr std::array<counter_info, 3> user_infos{{
+			{"msocks_user_bytes_received_total", "counter", "Plaintext bytes read from the user's clients.", 1},
+			{"msocks_user_bytes_sent_total", "counter", "Plaintext bytes sent to the user's clients.", 1},
+			{"msocks_user_sessions_total", "counter", "Sessions the user opened.", 1},
+		}};
+		for (std::size_t i = 0; i != user_infos.size(); ++i)
+		{
+			auto& info = user_infos[i];
+			fmt::format_to(std::back_inserter(out), "# HELP {} {}\n# TYPE {} {}\n", info.name, info.help, info.name, info.type);
+			for (auto& [name, values] : users)
+			{
+				fmt::format_to(std::back_inserter(out), "{}{{user=\"{}\"}} {}\n", info.name, label_value(name), values[i]);
+			}
+		}
+	}
+	return fmt::to_string(out);
+}
+
+}
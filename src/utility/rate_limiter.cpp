@@ -2,74 +2,75 @@
 // Created by maxtorm on 2019/4/14.
 //
 
-#include <boost/asio/post.hpp>
-
 #include <msocks/utility/rate_limiter.hpp>
 
+#include <algorithm>
+
 namespace msocks::utility
 {
 
-async_result<yield_context, void()>::return_type rate_limiter::async_get(std::size_t n, yield_context yield)
+namespace
 {
-	async_result<yield_context, void()>::completion_handler_type handler(yield);
-	async_result<yield_context, void()> result(handler);
-	if (no_limit_)
-	{
-		post(ioc_, std::bind(handler));
-		return result.get();
-	}
 
-	if (available_ >= n)
-	{
-		available_ -= n;
-		post(ioc_, std::bind(handler));
-		return result.get();
-	}
+constexpr std::int64_t ns_per_second = 1000 * 1000 * 1000;
 
-	if (wait_queue_.empty())
-	{
-		signal_.expires_from_now(boost::posix_time::pos_infin);
-	}
+std::int64_t transfer_time(std::size_t n, std::size_t rate) noexcept
+{
+	return rate == 0 ? 0 : static_cast<std::int64_t>(n) * ns_per_second / static_cast<std::int64_t>(rate);
+}
 
-	unique_pair pair(new storage_pair(n, handler));
-	wait_queue_.emplace(std::move(pair));
-	return result.get();
 }
 
+rate_limiter::rate_limiter(std::size_t rate, std::size_t burst, std::shared_ptr<rate_limiter> parent) noexcept :
+	rate_(rate),
+	burst_ns_(transfer_time(burst, rate)),
+	parent_(std::move(parent))
+{}
 
-void rate_limiter::start()
+rate_limiter::clock::duration rate_limiter::acquire(std::size_t n) noexcept
 {
-	if (no_limit_)
+	auto delay = charge(n);
+	for (auto parent = parent_.get(); parent; parent = parent->parent_.get())
 	{
-		return;
+		delay = std::max(delay, parent->charge(n));
 	}
+	return delay;
+}
 
-	spawn(
-		ioc_,
-		[this, p = shared_from_this()](yield_context yield)
+rate_limiter::clock::duration rate_limiter::charge(std::size_t n) noexcept
+{
+	if (rate_ == 0)
+	{
+		return clock::duration::zero();
+	}
+	const std::int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		clock::now().time_since_epoch()).count();
+	const std::int64_t cost = transfer_time(n, rate_);
+	std::int64_t tat = tat_.load(std::memory_order_relaxed);
+	std::int64_t next;
+	do
 	{
-		while (true)
-		{
-			if (wait_queue_.empty())
-			{
-				error_code ignored_ec;
-				signal_.async_wait(yield[ignored_ec]);
-			}
-			for (auto i = 0; i < 10; i++)
-			{
-				timer_.expires_from_now(boost::posix_time::milliseconds(100));
-				timer_.async_wait(yield);
-				available_ += limit_ / 10;
-				while (!wait_queue_.empty() && wait_queue_.top()->first <= available_)
-				{
-					auto handler = wait_queue_.top()->second;
-					available_ -= wait_queue_.top()->first;
-					wait_queue_.pop();
-					post(ioc_, std::bind(handler));
-				}
-			}
-		}
-	});
+		// an idle class does not bank more than its burst
+		next = std::max(tat, now) + cost;
+	}
+	while (!tat_.compare_exchange_weak(tat, next, std::memory_order_relaxed));
+	const std::int64_t wait = next - burst_ns_ - now;
+	return wait > 0
+		? std::chrono::duration_cast<clock::duration>(std::chrono::nanoseconds(wait))
+		: clock::duration::zero();
 }
 
-}
\ No newline at end of file
+void rate_limiter::reset() noexcept
+{
+	tat_.store(0, std::memory_order_relaxed);
+}
+
+void rate_limiter::reset(std::size_t rate, std::size_t burst, std::shared_ptr<rate_limiter> parent) noexcept
+{
+	rate_ = rate;
+	burst_ns_ = transfer_time(burst, rate);
+	parent_ = std::move(parent);
+	reset();
+}
+
+}
@@ -0,0 +1,67 @@
+#include <msocks/utility/relay_buffer.hpp>
+
+#include <algorithm>
+
+namespace msocks::utility
+{
+
+void relay_buffer::configure(std::size_t min_size, std::size_t max_size) noexcept
+{
+	min_size_ = std::max(min_size, lowest_min_size);
+	max_size_ = std::max(max_size, min_size_);
+	reset();
+}
+
+mutable_buffer relay_buffer::prepare()
+{
+	if (data_ != nullptr && size_ < wanted_)
+	{
+		release();
+	}
+	if (data_ == nullptr)
+	{
+		if (std::chrono::steady_clock::now() - released_ > idle_after)
+		{
+			full_reads_ = 0;
+			wanted_ = min_size_;
+		}
+		size_ = wanted_;
+		data_ = slab_.acquire(size_);
+	}
+	return buffer(data_, size_);
+}
+
+void relay_buffer::commit(std::size_t n) noexcept
+{
+	if (n < size_)
+	{
+		full_reads_ = 0;
+		return;
+	}
+	if (++full_reads_ >= grow_after && size_ < max_size_)
+	{
+		full_reads_ = 0;
+		wanted_ = std::min(size_ * growth_factor, max_size_);
+	}
+}
+
+void relay_buffer::release() noexcept
+{
+	if (data_ == nullptr)
+	{
+		return;
+	}
+	slab_.release(data_, size_);
+	data_ = nullptr;
+	size_ = 0;
+	released_ = std::chrono::steady_clock::now();
+}
+
+void relay_buffer::reset() noexcept
+{
+	release();
+	full_reads_ = 0;
+	wanted_ = min_size_;
+}
+
+}
@@ -0,0 +1,115 @@
+#include <msocks/utility/socket_profile.hpp>
+#include <msocks/utility/socket_option.hpp>
+
+#if defined(__linux__)
+#include <sys/socket.h>
+#endif
+
+namespace msocks::utility
+{
+
+namespace
+{
+
+// keeps the first failure, later options are still tried
+void keep(error_code& first, const error_code& ec)
+{
+	if (ec && !first)
+	{
+		first = ec;
+	}
+}
+
+#if defined(__linux__)
+// string valued options asio has no type for
+void set_string(tcp_socket& socket, int level, int name, const std::string& value, error_code& ec)
+{
+	if (::setsockopt(socket.native_handle(), level, name, value.data(), socklen_t(value.size())) != 0)
+	{
+		ec.assign(errno, system_category());
+	}
+}
+#endif
+
+}
+
+void apply(const socket_profile& profile, tcp_socket& socket, error_code& ec)
+{
+	ec = {};
+	error_code e;
+	socket.set_option(ip::tcp::no_delay(profile.no_delay), e);
+	keep(ec, e);
+	if (profile.send_buffer > 0)
+	{
+		socket.set_option(socket_base::send_buffer_size(profile.send_buffer), e);
+		keep(ec, e);
+	}
+	if (profile.receive_buffer > 0)
+	{
+		socket.set_option(socket_base::receive_buffer_size(profile.receive_buffer), e);
+		keep(ec, e);
+	}
+#if defined(TCP_QUICKACK)
+	if (profile.quick_ack)
+	{
+		socket.set_option(quick_ack(true), e);
+		keep(ec, e);
+	}
+#endif
+#if defined(TCP_NOTSENT_LOWAT)
+	if (profile.notsent_lowat > 0)
+	{
+		socket.set_option(notsent_lowat(profile.notsent_lowat), e);
+		keep(ec, e);
+	}
+#endif
+	if (profile.keepalive_idle.count() > 0)
+	{
+		socket.set_option(socket_base::keep_alive(true), e);
+		keep(ec, e);
+#if defined(TCP_KEEPIDLE)
+		socket.set_option(keep_idle(int(profile.keepalive_idle.count())), e);
+		keep(ec, e);
+		if (profile.keepalive_interval.count() > 0)
+		{
+			socket.set_option(keep_interval(int(profile.keepalive_interval.count())), e);
+			keep(ec, e);
+		}
+		if (profile.keepalive_count > 0)
+		{
+			socket.set_option(keep_count(profile.keepalive_count), e);
+			keep(ec, e);
+		}
+#endif
+	}
+#if defined(__linux__)
+	if (!profile.congestion.empty())
+	{
+		e = {};
+		set_string(socket, IPPROTO_TCP, TCP_CONGESTION, profile.congestion, e);
+		keep(ec, e);
+	}
+	if (!profile.interface.empty())
+	{
+		e = {};
+		set_string(socket, SOL_SOCKET, SO_BINDTODEVICE, profile.interface, e);
+		keep(ec, e);
+	}
+#endif
+	if (!profile.source.is_unspecified())
+	{
+		// a source of the other family is left to the kernel
+		auto local = socket.local_endpoint(e);
+		if (!e && local.address().is_v4() == profile.source.is_v4())
+		{
+#if defined(IP_BIND_ADDRESS_NO_PORT)
+			socket.set_option(bind_address_no_port(true), e);
+			keep(ec, e);
+#endif
+			socket.bind(ip::tcp::endpoint(profile.source, 0), e);
+		}
+		keep(ec, e);
+	}
+}
+
+}
@@ -0,0 +1,75 @@
+#include <msocks/utility/splice.hpp>
+
+#if defined(MSOCKS_HAS_SPLICE)
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace msocks::utility
+{
+
+namespace
+{
+constexpr int pipe_size = 64 * 1024;
+}
+
+pipe_pair::~pipe_pair()
+{
+	close();
+}
+
+void pipe_pair::open(error_code& ec)
+{
+	if (::pipe2(fds_, O_NONBLOCK | O_CLOEXEC) != 0)
+	{
+		fds_[0] = fds_[1] = -1;
+		ec.assign(errno, system_category());
+		return;
+	}
+	int size = ::fcntl(fds_[1], F_SETPIPE_SZ, pipe_size);
+	if (size <= 0)
+	{
+		size = ::fcntl(fds_[1], F_GETPIPE_SZ);
+	}
+	capacity_ = size > 0 ? std::size_t(size) : 4096;
+	ec = {};
+}
+
+void pipe_pair::close() noexcept
+{
+	for (auto& fd : fds_)
+	{
+		if (fd != -1)
+		{
+			::close(fd);
+			fd = -1;
+		}
+	}
+	capacity_ = 0;
+}
+
+std::size_t detail::splice_some(int from, int to, std::size_t len, error_code& ec)
+{
+	ssize_t n = ::splice(from, nullptr, to, nullptr, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (n < 0)
+	{
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+		{
+			ec = error::would_block;
+		}
+		else
+		{
+			ec.assign(errno, system_category());
+		}
+		return 0;
+	}
+	if (n == 0)
+	{
+		ec = error::eof;
+		return 0;
+	}
+	ec = {};
+	return std::size_t(n);
+}
+
+}
+#endif
@@ -0,0 +1,189 @@
+#include <msocks/utility/timing_wheel.hpp>
+
+namespace msocks::utility
+{
+
+io_context::id timing_wheel::id;
+
+timing_wheel::entry::entry(io_context& ioc, std::function<void()> handler) :
+	wheel_(use_service<timing_wheel>(ioc)),
+	handler_(std::move(handler))
+{}
+
+timing_wheel::entry::~entry()
+{
+	cancel();
+}
+
+void timing_wheel::entry::schedule(std::chrono::seconds timeout)
+{
+	cancel();
+	if (timeout == std::chrono::seconds::zero())
+	{
+		return;
+	}
+	if (!wheel_.ticking_)
+	{
+		// nothing was scheduled, the wheel stood still meanwhile
+		wheel_.now_ = wheel_.elapsed();
+	}
+	timeout_ = uint64_t((timeout + resolution - std::chrono::seconds(1)) / resolution);
+	last_ = wheel_.now_;
+	due_ = deadline();
+	wheel_.link(*this, state::scheduled);
+	wheel_.arm();
+}
+
+void timing_wheel::entry::cancel() noexcept
+{
+	if (state_ != state::idle)
+	{
+		wheel_.unlink(*this);
+	}
+}
+
+timing_wheel::timing_wheel(io_context& ioc) :
+	io_context::service(ioc),
+	timer_(ioc),
+	origin_(clock::now())
+{}
+
+void timing_wheel::shutdown()
+{
+	// entries outlive the wheel as session members, they must find
+	// themselves unlinked
+	for (auto& slot : slots_)
+	{
+		while (slot != nullptr)
+		{
+			unlink(*slot);
+		}
+	}
+	while (expired_ != nullptr)
+	{
+		unlink(*expired_);
+	}
+}
+
+timing_wheel::entry*& timing_wheel::head(entry& e) noexcept
+{
+	return e.state_ == entry::state::expired ? expired_ : slots_[e.due_ % slot_count];
+}
+
+void timing_wheel::link(entry& e, entry::state s) noexcept
+{
+	e.state_ = s;
+	entry*& h = head(e);
+	e.prev_ = nullptr;
+	e.next_ = h;
+	if (h != nullptr)
+	{
+		h->prev_ = &e;
+	}
+	h = &e;
+	if (s == entry::state::scheduled)
+	{
+		++size_;
+	}
+}
+
+void timing_wheel::unlink(entry& e) noexcept
+{
+	entry*& h = head(e);
+	if (e.prev_ != nullptr)
+	{
+		e.prev_->next_ = e.next_;
+	}
+	else
+	{
+		h = e.next_;
+	}
+	if (e.next_ != nullptr)
+	{
+		e.next_->prev_ = e.prev_;
+	}
+	if (e.state_ == entry::state::scheduled)
+	{
+		--size_;
+	}
+	e.state_ = entry::state::idle;
+	e.next_ = nullptr;
+	e.prev_ = nullptr;
+}
+
+uint64_t timing_wheel::elapsed() const noexcept
+{
+	return uint64_t((clock::now() - origin_) / resolution);
+}
+
+void timing_wheel::arm()
+{
+	if (ticking_)
+	{
+		return;
+	}
+	ticking_ = true;
+	timer_.expires_at(origin_ + resolution * int64_t(now_ + 1));
+	timer_.async_wait(
+		[this](error_code ec)
+		{
+			if (!ec)
+			{
+				advance();
+			}
+		});
+}
+
+void timing_wheel::advance()
+{
+	ticking_ = false;
+	uint64_t target = elapsed();
+	// a whole turn visits every slot, older ticks add nothing
+	if (target - now_ > slot_count)
+	{
+		now_ = target - slot_count;
+	}
+	while (now_ < target)
+	{
+		expire(++now_);
+	}
+	// handlers may cancel or reschedule each other, so they are taken one
+	// at a time
+	while (expired_ != nullptr)
+	{
+		entry& e = *expired_;
+		unlink(e);
+		e.handler_();
+	}
+	if (size_ != 0)
+	{
+		arm();
+	}
+}
+
+void timing_wheel::expire(uint64_t tick) noexcept
+{
+	entry* e = slots_[tick % slot_count];
+	while (e != nullptr)
+	{
+		entry* next = e->next_;
+		// the others are a turn or more away
+		if (e->due_ <= tick)
+		{
+			unlink(*e);
+			if (e->deadline() > tick)
+			{
+				// touched since it was linked, it moves to its real deadline
+				e->due_ = e->deadline();
+				link(*e, entry::state::scheduled);
+			}
+			else
+			{
+				link(*e, entry::state::expired);
+			}
+		}
+		e = next;
+	}
+}
+
+}
@@ -0,0 +1,155 @@
+#include <msocks/utility/trace.hpp>
+
+#include <spdlog/fmt/fmt.h>
+
+#include <array>
+#include <deque>
+#include <iterator>
+#include <mutex>
+#include <vector>
+
+namespace msocks::utility::trace
+{
+
+namespace
+{
+
+constexpr std::array<const char*, std::size_t(phase::count)> phase_names{{
+	"socks5", "handshake", "resolve", "connect", "first_byte", "limiter_wait",
+}};
+
+// fields are atomic so dump() may read a slot while it is overwritten,
+// which it then notices from seq, odd while a write is under way
+struct slot
+{
+	std::atomic<uint64_t> seq{0};
+	std::atomic<uint64_t> id{0};
+	std::atomic<int64_t> begin_ns{0};
+	std::atomic<int64_t> duration_ns{0};
+	std::atomic<uint8_t> phase{0};
+};
+
+struct ring
+{
+	explicit ring(std::size_t index) :
+		index(index)
+	{}
+
+	const std::size_t index;
+	// spans written so far, only the owning thread stores
+	std::atomic<uint64_t> head{0};
+	std::array<slot, ring_size> slots;
+};
+
+struct registry
+{
+	std::mutex mutex;
+	// a deque never moves the rings it holds
+	std::deque<ring> rings;
+};
+
+registry& instance()
+{
+	static registry r;
+	return r;
+}
+
+// allocated on the first sampled session of a thread only
+thread_local ring* local_ring = nullptr;
+
+ring& local()
+{
+	if (local_ring == nullptr)
+	{
+		auto& r = instance();
+		std::lock_guard<std::mutex> lock(r.mutex);
+		local_ring = &r.rings.emplace_back(r.rings.size());
+	}
+	return *local_ring;
+}
+
+int64_t nanoseconds(clock::duration d)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+}
+
+}
+
+void span(uint64_t id, phase p, clock::time_point begin, clock::time_point end)
+{
+	if (id == 0)
+	{
+		return;
+	}
+	auto& r = local();
+	auto head = r.head.load(std::memory_order_relaxed);
+	auto& s = r.slots[head % ring_size];
+	const auto seq = s.seq.load(std::memory_order_relaxed);
+	s.seq.store(seq + 1, std::memory_order_relaxed);
+	// keeps the field stores below from becoming visible before the odd seq
+	std::atomic_thread_fence(std::memory_order_release);
+	s.id.store(id, std::memory_order_relaxed);
+	s.begin_ns.store(nanoseconds(begin.time_since_epoch()), std::memory_order_relaxed);
+	s.duration_ns.store(nanoseconds(end - begin), std::memory_order_relaxed);
+	s.phase.store(uint8_t(p), std::memory_order_relaxed);
+	s.seq.store(seq + 2, std::memory_order_release);
+	r.head.store(head + 1, std::memory_order_release);
+}
+
+std::string dump()
+{
+	struct copy
+	{
+		uint64_t index;
+		bool torn;
+		uint64_t id;
+		int64_t begin_ns;
+		int64_t duration_ns;
+		uint8_t phase;
+	};
+	auto& r = instance();
+	fmt::memory_buffer out;
+	fmt::format_to(std::back_inserter(out), "{{\"traceEvents\":[");
+	bool first = true;
+	std::vector<copy> spans;
+	std::lock_guard<std::mutex> lock(r.mutex);
+	for (auto& ring : r.rings)
+	{
+		const auto head = ring.head.load(std::memory_order_acquire);
+		spans.clear();
+		for (auto i = head > ring_size ? head - ring_size : 0; i != head; ++i)
+		{
+			auto& s = ring.slots[i % ring_size];
+			const auto seq = s.seq.load(std::memory_order_acquire);
+			copy c{
+				i,
+				false,
+				s.id.load(std::memory_order_relaxed),
+				s.begin_ns.load(std::memory_order_relaxed),
+				s.duration_ns.load(std::memory_order_relaxed),
+				s.phase.load(std::memory_order_relaxed)};
+			std::atomic_thread_fence(std::memory_order_acquire);
+			c.torn = seq % 2 != 0 || s.seq.load(std::memory_order_relaxed) != seq;
+			spans.push_back(c);
+		}
+		// a slot the thread wrote again whole meanwhile reads consistent but
+		// holds a later span, head tells those apart
+		const auto now = ring.head.load(std::memory_order_relaxed);
+		const auto valid = now > ring_size ? now - ring_size : 0;
+		for (auto& s : spans)
+		{
+			if (s.torn || s.index < valid || s.phase >= phase_names.size())
+			{
+				continue;
+			}
+			fmt::format_to(std::back_inserter(out),
+				"{}{{\"name\":\"{}\",\"ph\":\"X\",\"pid\":{},\"tid\":{},\"ts\":{:.3f},\"dur\":{:.3f}}}",
+				first ? "" : ",", phase_names[s.phase], ring.index, s.id, s.begin_ns / 1e3, s.duration_ns / 1e3);
+			first = false;
+		}
+	}
+	fmt::format_to(std::back_inserter(out), "],\"displayTimeUnit\":\"ns\"}}\n");
+	return fmt::to_string(out);
+}
+
+}
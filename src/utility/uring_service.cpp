@@ -0,0 +1,381 @@
+#include <msocks/utility/uring_service.hpp>
+
+#if defined(MSOCKS_HAS_IO_URING)
+
+#include <boost/asio/post.hpp>
+
+#include <msocks/utility/log.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace msocks::utility
+{
+
+io_context::id uring_service::id;
+
+namespace
+{
+
+int io_uring_setup(unsigned entries, io_uring_params* p)
+{
+	return int(::syscall(__NR_io_uring_setup, entries, p));
+}
+
+int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return int(::syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+int io_uring_register(int fd, unsigned opcode, const void* arg, unsigned nr_args)
+{
+	return int(::syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+unsigned load_acquire(const unsigned* p) noexcept
+{
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+void store_release(unsigned* p, unsigned v) noexcept
+{
+	__atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+void prepare(io_uring_sqe* sqe, uint8_t opcode, int fd, const void* addr, uint32_t len) noexcept
+{
+	std::memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = reinterpret_cast<uint64_t>(addr);
+	sqe->len = len;
+}
+
+}
+
+uring_service::uring_service(io_context& ioc) :
+	io_context::service(ioc),
+	ioc_(ioc),
+	event_(ioc)
+{
+	io_uring_params p{};
+	p.flags = IORING_SETUP_CLAMP;
+	int fd = io_uring_setup(entries, &p);
+	if (fd < 0)
+	{
+		spdlog::info("io_uring unavailable: {}, relaying through the reactor", std::strerror(errno));
+		return;
+	}
+	ring_fd_ = fd;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+	{
+		spdlog::info("io_uring too old, relaying through the reactor");
+		teardown();
+		return;
+	}
+	ring_size_ = std::max<std::size_t>(p.sq_off.array + p.sq_entries * sizeof(unsigned), p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe));
+	ring_ = ::mmap(nullptr, ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+	void* sqes = ::mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring_ == MAP_FAILED || sqes == MAP_FAILED)
+	{
+		ring_ = ring_ == MAP_FAILED ? nullptr : ring_;
+		sqes_ = sqes == MAP_FAILED ? nullptr : static_cast<io_uring_sqe*>(sqes);
+		spdlog::info("io_uring unavailable: {}, relaying through the reactor", std::strerror(errno));
+		teardown();
+		return;
+	}
+	sqes_ = static_cast<io_uring_sqe*>(sqes);
+	auto base = static_cast<uint8_t*>(ring_);
+	sq_head_ = reinterpret_cast<unsigned*>(base + p.sq_off.head);
+	sq_tail_ = reinterpret_cast<unsigned*>(base + p.sq_off.tail);
+	sq_mask_ = *reinterpret_cast<unsigned*>(base + p.sq_off.ring_mask);
+	sq_entries_ = p.sq_entries;
+	cq_head_ = reinterpret_cast<unsigned*>(base + p.cq_off.head);
+	cq_tail_ = reinterpret_cast<unsigned*>(base + p.cq_off.tail);
+	cq_mask_ = *reinterpret_cast<unsigned*>(base + p.cq_off.ring_mask);
+	cqes_ = reinterpret_cast<io_uring_cqe*>(base + p.cq_off.cqes);
+	// submission entries are used in ring order
+	auto array = reinterpret_cast<unsigned*>(base + p.sq_off.array);
+	for (unsigned i = 0; i != sq_entries_; ++i)
+	{
+		array[i] = i;
+	}
+	tail_ = submitted_ = *sq_tail_;
+
+	// closing a socket does not end what the ring holds on it, only
+	// cancellation by descriptor does; a kernel without it rejects the
+	// flags, one that has it finds nothing to cancel
+	int event = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	io_uring_sqe* sqe = acquire();
+	prepare(sqe, IORING_OP_ASYNC_CANCEL, event, nullptr, 0);
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+	++tail_;
+	store_release(sq_tail_, tail_);
+	int probe = -EINVAL;
+	if (event >= 0 && io_uring_enter(ring_fd_, 1, 1, IORING_ENTER_GETEVENTS) == 1)
+	{
+		submitted_ = tail_;
+		unsigned head = *cq_head_;
+		if (head != load_acquire(cq_tail_))
+		{
+			probe = cqes_[head & cq_mask_].res;
+			store_release(cq_head_, head + 1);
+		}
+	}
+	if (probe == -EINVAL || event < 0 || io_uring_register(ring_fd_, IORING_REGISTER_EVENTFD, &event, 1) != 0)
+	{
+		spdlog::info("io_uring lacks cancellation by descriptor, relaying through the reactor");
+		if (event >= 0)
+		{
+			::close(event);
+		}
+		teardown();
+		return;
+	}
+	event_.assign(event);
+}
+
+uring_service::~uring_service()
+{
+	teardown();
+}
+
+void uring_service::teardown() noexcept
+{
+	if (sqes_ != nullptr)
+	{
+		::munmap(sqes_, sqes_size_);
+		sqes_ = nullptr;
+	}
+	if (ring_ != nullptr)
+	{
+		::munmap(ring_, ring_size_);
+		ring_ = nullptr;
+	}
+	if (ring_fd_ >= 0)
+	{
+		// the kernel cancels whatever is left
+		::close(ring_fd_);
+		ring_fd_ = -1;
+	}
+}
+
+void uring_service::shutdown()
+{
+	error_code ignored;
+	event_.close(ignored);
+	teardown();
+	// handlers of pending requests are destroyed, not invoked, and may own
+	// the sockets that find the ring gone
+	while (pending_ != nullptr)
+	{
+		operation* op = pending_;
+		pending_ = op->next;
+		op->complete(op, -ECANCELED, true);
+	}
+	inflight_ = 0;
+}
+
+io_uring_sqe* uring_service::acquire()
+{
+	if (tail_ - load_acquire(sq_head_) == sq_entries_)
+	{
+		submit();
+		if (tail_ - load_acquire(sq_head_) == sq_entries_)
+		{
+			return nullptr;
+		}
+	}
+	return &sqes_[tail_ & sq_mask_];
+}
+
+void uring_service::queue(io_uring_sqe* sqe, operation* op)
+{
+	if (sqe == nullptr)
+	{
+		MSOCKS_LOG(spdlog::level::warn, "io_uring submission queue full");
+		post(ioc_, [op] { op->complete(op, -ENOBUFS, false); });
+		return;
+	}
+	sqe->user_data = reinterpret_cast<uint64_t>(op);
+	++tail_;
+	store_release(sq_tail_, tail_);
+	op->prev = nullptr;
+	op->next = pending_;
+	if (pending_ != nullptr)
+	{
+		pending_->prev = op;
+	}
+	pending_ = op;
+	++inflight_;
+	// completions submit what they queued once all of them ran
+	if (!reaping_ && !submit_posted_)
+	{
+		submit_posted_ = true;
+		post(ioc_, [this] { submit_posted_ = false; submit(); arm(); });
+	}
+}
+
+void uring_service::recv(int fd, mutable_buffer buffer, operation* op)
+{
+	io_uring_sqe* sqe = acquire();
+	if (sqe != nullptr)
+	{
+		prepare(sqe, IORING_OP_RECV, fd, buffer.data(), uint32_t(buffer.size()));
+	}
+	queue(sqe, op);
+}
+
+void uring_service::send(int fd, const_buffer buffer, operation* op)
+{
+	io_uring_sqe* sqe = acquire();
+	if (sqe != nullptr)
+	{
+		prepare(sqe, IORING_OP_SEND, fd, buffer.data(), uint32_t(buffer.size()));
+		sqe->msg_flags = MSG_NOSIGNAL;
+	}
+	queue(sqe, op);
+}
+
+void uring_service::sendmsg(int fd, const msghdr* msg, operation* op)
+{
+	io_uring_sqe* sqe = acquire();
+	if (sqe != nullptr)
+	{
+		prepare(sqe, IORING_OP_SENDMSG, fd, msg, 1);
+		sqe->msg_flags = MSG_NOSIGNAL;
+	}
+	queue(sqe, op);
+}
+
+void uring_service::poll(int fd, unsigned events, operation* op)
+{
+	io_uring_sqe* sqe = acquire();
+	if (sqe != nullptr)
+	{
+		prepare(sqe, IORING_OP_POLL_ADD, fd, nullptr, 0);
+		sqe->poll32_events = events;
+	}
+	queue(sqe, op);
+}
+
+void uring_service::cancel(int fd)
+{
+	if (ring_fd_ < 0)
+	{
+		return;
+	}
+	io_uring_sqe* sqe = acquire();
+	if (sqe == nullptr)
+	{
+		return;
+	}
+	prepare(sqe, IORING_OP_ASYNC_CANCEL, fd, nullptr, 0);
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+	sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+	// a user_data of 0 belongs to no operation
+	sqe->user_data = 0;
+	++tail_;
+	store_release(sq_tail_, tail_);
+	submit();
+}
+
+void uring_service::submit()
+{
+	while (submitted_ != tail_ && ring_fd_ >= 0)
+	{
+		int n = io_uring_enter(ring_fd_, tail_ - submitted_, 0, 0);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			// EAGAIN or EBUSY: completions must be reaped first, which
+			// submits the rest
+			if (errno != EAGAIN && errno != EBUSY)
+			{
+				MSOCKS_LOG(spdlog::level::err, "io_uring_enter: {}", std::strerror(errno));
+			}
+			return;
+		}
+		submitted_ += unsigned(n);
+	}
+}
+
+void uring_service::arm()
+{
+	if (armed_ || inflight_ == 0 || !event_.is_open())
+	{
+		return;
+	}
+	armed_ = true;
+	// a read, unlike async_wait, tries the eventfd first and so never
+	// misses a completion that came in after the last reap
+	event_.async_read_some(
+		buffer(&event_count_, sizeof(event_count_)),
+		[this](error_code ec, std::size_t)
+		{
+			armed_ = false;
+			if (ec == error::operation_aborted)
+			{
+				return;
+			}
+			reap();
+			arm();
+		});
+}
+
+void uring_service::reap()
+{
+	reaping_ = true;
+	unsigned head = *cq_head_;
+	unsigned tail = load_acquire(cq_tail_);
+	while (head != tail)
+	{
+		for (; head != tail && ring_fd_ >= 0; ++head)
+		{
+			const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+			auto op = reinterpret_cast<operation*>(cqe.user_data);
+			int result = cqe.res;
+			store_release(cq_head_, head + 1);
+			if (op == nullptr)
+			{
+				continue;
+			}
+			if (op->prev != nullptr)
+			{
+				op->prev->next = op->next;
+			}
+			else
+			{
+				pending_ = op->next;
+			}
+			if (op->next != nullptr)
+			{
+				op->next->prev = op->prev;
+			}
+			--inflight_;
+			op->complete(op, result, false);
+		}
+		if (ring_fd_ < 0)
+		{
+			break;
+		}
+		tail = load_acquire(cq_tail_);
+	}
+	reaping_ = false;
+	submit();
+}
+
+}
+
+#endif
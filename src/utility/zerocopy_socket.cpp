@@ -0,0 +1,213 @@
+#include <msocks/utility/zerocopy_socket.hpp>
+
+#include <utility>
+
+#if defined(MSOCKS_HAS_ZEROCOPY)
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <sys/uio.h>
+#endif
+
+namespace msocks::utility
+{
+
+zerocopy_socket::zerocopy_socket(zerocopy_socket&& other) noexcept :
+	utility::tcp_socket(std::move(other)),
+	threshold_(other.threshold_),
+	sent_(other.sent_),
+	completed_(other.completed_)
+{
+#if defined(MSOCKS_HAS_IO_URING)
+	// pending requests point at other, moving is only for idle sockets
+	uring_ = std::exchange(other.uring_, nullptr);
+#endif
+}
+
+zerocopy_socket& zerocopy_socket::operator=(zerocopy_socket&& other)
+{
+	cancel_uring();
+	utility::tcp_socket::operator=(std::move(other));
+	threshold_ = other.threshold_;
+	sent_ = other.sent_;
+	completed_ = other.completed_;
+#if defined(MSOCKS_HAS_IO_URING)
+	uring_ = std::exchange(other.uring_, nullptr);
+#endif
+	return *this;
+}
+
+zerocopy_socket::~zerocopy_socket()
+{
+	cancel_uring();
+}
+
+void zerocopy_socket::cancel(error_code& ec)
+{
+	cancel_uring();
+	utility::tcp_socket::cancel(ec);
+}
+
+void zerocopy_socket::close(error_code& ec)
+{
+	cancel_uring();
+	utility::tcp_socket::close(ec);
+}
+
+void zerocopy_socket::close()
+{
+	cancel_uring();
+	utility::tcp_socket::close();
+}
+
+#if defined(MSOCKS_HAS_IO_URING)
+
+void zerocopy_socket::enable_uring(error_code& ec)
+{
+	auto& service = use_service<uring_service>(static_cast<io_context&>(get_executor().context()));
+	if (!service.available())
+	{
+		ec = error::operation_not_supported;
+		return;
+	}
+	ec = {};
+	uring_ = &service;
+}
+
+void zerocopy_socket::cancel_uring() noexcept
+{
+	if (uring_pending_ != 0 && is_open())
+	{
+		uring_->cancel(native_handle());
+	}
+}
+
+#else
+
+void zerocopy_socket::enable_uring(error_code& ec)
+{
+	ec = error::operation_not_supported;
+}
+
+void zerocopy_socket::cancel_uring() noexcept
+{
+}
+
+#endif
+
+#if defined(MSOCKS_HAS_ZEROCOPY)
+
+void zerocopy_socket::enable_zerocopy(std::size_t threshold, error_code& ec)
+{
+	int on = 1;
+	if (::setsockopt(native_handle(), SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) != 0)
+	{
+		ec.assign(errno, system_category());
+		return;
+	}
+	ec = {};
+	threshold_ = threshold;
+}
+
+std::size_t zerocopy_socket::send_zerocopy(const const_buffer* buffers, std::size_t count, error_code& ec)
+{
+	std::array<iovec, 16> iov;
+	for (std::size_t i = 0; i < count; i++)
+	{
+		iov[i].iov_base = const_cast<void *>(buffers[i].data());
+		iov[i].iov_len = buffers[i].size();
+	}
+	msghdr msg{};
+	msg.msg_iov = iov.data();
+	msg.msg_iovlen = count;
+	ssize_t n = ::sendmsg(native_handle(), &msg, MSG_ZEROCOPY | MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (n < 0)
+	{
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+		{
+			ec = error::would_block;
+		}
+		else if (errno == ENOBUFS)
+		{
+			// out of optmem for page pinning, send a copied write instead
+			n = ::sendmsg(native_handle(), &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+			if (n < 0)
+			{
+				ec = (errno == EAGAIN || errno == EWOULDBLOCK) ? error_code(error::would_block) : error_code(errno, system_category());
+				return 0;
+			}
+			ec = {};
+			return std::size_t(n);
+		}
+		else
+		{
+			ec.assign(errno, system_category());
+		}
+		return 0;
+	}
+	ec = {};
+	sent_++;
+	return std::size_t(n);
+}
+
+bool zerocopy_socket::reap_completions(error_code& ec)
+{
+	while (completed_ != sent_)
+	{
+		std::array<uint8_t, CMSG_SPACE(sizeof(sock_extended_err) + sizeof(sockaddr_in6))> control;
+		msghdr msg{};
+		msg.msg_control = control.data();
+		msg.msg_controllen = control.size();
+		if (::recvmsg(native_handle(), &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				ec.assign(errno, system_category());
+			}
+			return false;
+		}
+		for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != nullptr; cm = CMSG_NXTHDR(&msg, cm))
+		{
+			bool recverr = (cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+				(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR);
+			if (!recverr)
+			{
+				continue;
+			}
+			auto serr = reinterpret_cast<const sock_extended_err *>(CMSG_DATA(cm));
+			if (serr->ee_errno == 0 && serr->ee_origin == SO_EE_ORIGIN_ZEROCOPY)
+			{
+				// notifications carry the inclusive range [ee_info, ee_data] of sends
+				completed_ = serr->ee_data + 1;
+				if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				{
+					// the kernel copied anyway (e.g. loopback), stop paying for the notifications
+					threshold_ = 0;
+				}
+			}
+		}
+	}
+	return true;
+}
+
+#else
+
+void zerocopy_socket::enable_zerocopy(std::size_t, error_code& ec)
+{
+	ec = error::operation_not_supported;
+}
+
+std::size_t zerocopy_socket::send_zerocopy(const const_buffer*, std::size_t, error_code& ec)
+{
+	ec = error::operation_not_supported;
+	return 0;
+}
+
+bool zerocopy_socket::reap_completions(error_code& ec)
+{
+	ec = {};
+	return true;
+}
+
+#endif
+
+}